@@ -3,7 +3,9 @@
 #include "webserver/HTTP/http_connection.h"
 #include "webserver/webserver.h"
 #include "webserver/WS/ws_connection.h"
+#include "webserver/ktls.h"
 #include "core/openssl_encoders.h"
+#include "core/zeroout.h"
 
 #include <boost/bind.hpp>
 
@@ -20,13 +22,46 @@ namespace net
 		template<typename TSocket>
 		HTTPConnection<TSocket>::HTTPConnection(WebServer& webserver, std::shared_ptr<TSocket> sock, WebServerParams params,
 			std::unique_ptr<HTTPRequestHandler> bridge)
-		: Connection<TSocket>(sock, params), webserver_(webserver), bridge_(std::move(bridge)), strand_(sock->get_io_service())
+		: Connection<TSocket>(sock, params), webserver_(webserver), wheel_(webserver.timer_wheel()),
+		  metrics_(webserver.metrics()), recorder_(webserver.recorder()), bridge_(std::move(bridge)),
+		  strand_(sock->get_io_service()), access_log_(webserver.access_log()), capture_(webserver.capture())
 		{
+			metrics_.Gauge(MetricGauge::http_connections, 1);
+			
+			trace_ = recorder_.NewRequest();
+			trace_started_ = recorder_.Record(trace_, FlightEvent::accept);
+			capture_conn_ = capture_.NewConnection();
+			
+			if (access_log_.Enabled())
+			{
+				error_code ec;
+				auto remote = sock->lowest_layer().remote_endpoint(ec);
+				if (!ec)
+					access_.SetAddress(remote.address());
+				
+				access_.port = params.remote_port;
+				access_.tls = is_http ? 0 : 1;
+			}
+		}
+		
+		template<typename TSocket>
+		HTTPConnection<TSocket>::~HTTPConnection()
+		{
+			drop_pending();
+			metrics_.Gauge(MetricGauge::http_connections, -1);
 		}
 		
 		template<>
 		void HTTPConnection<TCPSocket>::Start()
 		{
+			arm_deadline(HTTPDeadline::header);
+			do_read();
+		}
+		
+		template<>
+		void HTTPConnection<MemSocket>::Start()
+		{
+			arm_deadline(HTTPDeadline::header);
 			do_read();
 		}
 		
@@ -39,12 +74,21 @@ namespace net
 			boost::asio::ip::tcp::no_delay option(true);
 			sock_->lowest_layer().set_option(option);
 			
+			arm_deadline(HTTPDeadline::handshake);
+			stage_started_ = metrics_.Now();
+			
 			sock_.get()->async_handshake(
 				boost::asio::ssl::stream_base::server,
 				strand_.wrap([this, self](boost::system::error_code ec)
 				{
 					if (!ec)
 					{
+						metrics_.Record(MetricStage::tls_handshake, stage_started_);
+						
+						if (params.ktls)
+							ktls_tx = ktls_enable_tx(*sock_.get());
+						
+						arm_deadline(HTTPDeadline::header);
 						do_read();
 					}
 				}
@@ -57,49 +101,27 @@ namespace net
 		void HTTPConnection<TSocket>::do_read()
 		{
 			auto self = this->shared_from_this();
+			
+			if (pending_begin_ != pending_end_)												/// next request is read already
+			{
+				strand_.post([this, self]()
+				{
+					size_t begin = pending_begin_, end = pending_end_;
+					pending_begin_ = pending_end_ = 0;
+					
+					on_read(begin, end);
+				});
+				return;
+			}
+			
+			recorder_.Record(trace_, FlightEvent::read_issued);
+			
 			sock_->async_read_some(boost::asio::buffer(buffer_),
 				strand_.wrap([this, self](boost::system::error_code ec, std::size_t bytes_transferred)
 				{
 					if (!ec)
 					{
-						request_ = HTTPRequest();
-						request_.is_http = is_http;
-						request_.origin = params.remote_ip;
-						
-						response_ = HTTPResponse();
-						
-						auto result = request_parser_.Parse(request_, buffer_.data(), buffer_.data() + bytes_transferred);
-						
-						if (result == HTTPParser::Result::good)
-						{
-							if (request_.isWSHandshake())
-							{
-								process_ws_handshake(request_.content);
-							}
-							else
-							{
-								try
-								{
-									bridge_->HandleRequest(request_, response_);
-								}
-								catch(std::exception& e)
-								{
-									IFLOG(P3, "HTTP request handling error, reason follows.", e.what());
-								}
-								
-								do_write();
-							}
-						}
-						else if (result == HTTPParser::Result::bad)
-						{
-							response_ = HTTPResponse::stock_reply(Schema::StatusCode::bad_request);
-							
-							do_write();
-						}
-						else
-						{
-							do_read();
-						}
+						on_read(0, bytes_transferred);
 					}
 					else if (ec != boost::asio::error::operation_aborted)
 					{
@@ -109,15 +131,142 @@ namespace net
 			));
 		}
 		
+		template<typename TSocket>
+		void HTTPConnection<TSocket>::on_read(size_t begin, size_t end)
+		{
+			size_t bytes = end - begin;
+			
+			if (request_started_ == Metrics::Clock::time_point())
+				request_started_ = metrics_.Now();
+			
+			if (access_log_.Enabled())
+			{
+				if (access_.bytes_in == 0)
+					access_started_ = std::chrono::steady_clock::now();
+				access_.bytes_in += bytes;
+			}
+			
+			if (!trace_read_)
+			{
+				uint64_t ns = recorder_.Record(trace_, FlightEvent::first_byte, bytes);
+				if (trace_started_ == 0)												/// keep-alive: from first byte
+					trace_started_ = ns;
+				
+				trace_read_ = true;
+			}
+			else
+			{
+				recorder_.Record(trace_, FlightEvent::read, bytes);
+			}
+			
+			request_ = HTTPRequest();
+			request_.is_http = is_http;
+			request_.origin = params.remote_ip;
+			
+			response_ = HTTPResponse();
+			
+			char* rest = nullptr;
+			auto result = request_parser_.Parse(request_, buffer_.data() + begin, buffer_.data() + end, &rest);
+			
+			if (result == HTTPParser::Result::good)
+			{
+				pending_begin_ = rest - buffer_.data();										/// pipelined requests
+				pending_end_ = end;
+				
+				arm_deadline(HTTPDeadline::none);
+				
+				metrics_.Record(MetricStage::http_read, request_started_);
+				metrics_.Count(MetricCounter::http_requests);
+				recorder_.Record(trace_, FlightEvent::parse_complete);
+				
+				if (request_.isWSHandshake())
+				{
+					process_ws_handshake(request_.content);
+				}
+				else if (!params.metrics_path.empty() && request_.uri.path() == params.metrics_path)
+				{
+					serve_metrics();
+					do_write();
+				}
+				else
+				{
+					if (capture_conn_)
+						capture_.Capture(capture_conn_, request_, !is_http);
+					
+					auto handle_started = metrics_.Now();
+					recorder_.Record(trace_, FlightEvent::handler_start);
+					
+					try
+					{
+						Watchdog::Scope watched(webserver_.watchdog(), "HTTP handler", &request_.uri, trace_,
+							nullptr);
+						bridge_->HandleRequest(request_, response_);
+					}
+					catch(std::exception& e)
+					{
+						IFLOG(P3, "HTTP request handling error, reason follows.", e.what());
+					}
+					
+					recorder_.Record(trace_, FlightEvent::handler_end);
+					metrics_.Record(MetricStage::http_handle, handle_started);
+					
+					if (access_log_.Enabled() && handle_started != Metrics::Clock::time_point())
+						access_.handler_us = static_cast<uint32_t>(std::chrono::duration_cast<
+							std::chrono::microseconds>(Metrics::Clock::now() - handle_started).count());
+					
+					do_write();
+				}
+			}
+			else if (result == HTTPParser::Result::bad)
+			{
+				arm_deadline(HTTPDeadline::none);
+				metrics_.Count(MetricCounter::http_bad_requests);
+				response_ = HTTPResponse::stock_reply(Schema::StatusCode::bad_request);
+				
+				do_write();
+			}
+			else
+			{
+				if (deadline_ == HTTPDeadline::idle)								/// first bytes of next request
+					arm_deadline(HTTPDeadline::header);
+				
+				if (deadline_ == HTTPDeadline::header && request_parser_.InBody())
+					arm_deadline(HTTPDeadline::body);
+				
+				do_read();
+			}
+		}
+		
 		template<typename TSocket>
 		void HTTPConnection<TSocket>::do_write()
 		{
 			auto self = this->shared_from_this();
-			boost::asio::async_write(*sock_.get(), response_.to_buffers(),
-				strand_.wrap([this, self](boost::system::error_code ec, std::size_t)
+			stage_started_ = metrics_.Now();
+			recorder_.Record(trace_, FlightEvent::write_start, static_cast<uint64_t>(response_.status));
+			
+			async_write_layer(*sock_.get(), ktls_tx, response_.to_buffers(),
+				strand_.wrap([this, self](boost::system::error_code ec, std::size_t bytes_transferred)
 				{
-					if (!ec)
+					log_access(bytes_transferred);
+					
+					metrics_.Record(MetricStage::http_write, stage_started_);
+					metrics_.Record(MetricStage::http_request, request_started_);
+					request_started_ = Metrics::Clock::time_point();
+					
+					if (recorder_.Finish(trace_, trace_started_))
+						recorder_.Dump(trace_, request_.method + " " + request_.uri.path());
+					
+					trace_ = recorder_.NewRequest();
+					trace_started_ = 0;
+					trace_read_ = false;
+					
+					if (!ec && close_after_write_)
+					{
+						stop();
+					}
+					else if (!ec)
 					{
+						arm_deadline(HTTPDeadline::idle);
 						do_read();
 					}
 					else if (ec != boost::asio::error::operation_aborted)
@@ -130,18 +279,53 @@ namespace net
 		
 		
 		
+		template<typename TSocket>
+		void HTTPConnection<TSocket>::serve_metrics()
+		{
+			response_.status = Schema::StatusCode::ok;
+			webserver_.metrics().Render(response_.content);
+			
+			response_.headers["Content-Type"] = "text/plain; version=0.0.4";
+			response_.headers["Content-Length"] = std::to_string(response_.content.size());
+		}
+		
+		template<typename TSocket>
+		void HTTPConnection<TSocket>::log_access(size_t bytes_out)
+		{
+			if (!access_log_.Enabled())
+				return;
+			
+			auto now = std::chrono::steady_clock::now();
+			
+			access_.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+			access_.duration_us = static_cast<uint32_t>(
+				std::chrono::duration_cast<std::chrono::microseconds>(now - access_started_).count());
+			access_.status = static_cast<uint16_t>(response_.status);
+			access_.bytes_out = bytes_out;
+			access_.SetMethod(request_.method);
+			access_.SetPath(request_.uri.path());
+			
+			access_log_.Log(access_);
+			
+			access_.bytes_in = 0;
+			access_.handler_us = 0;
+		}
+		
 		template<typename TSocket>
 		void HTTPConnection<TSocket>::process_ws_handshake(const std::string &content)
 		{
 			auto self = this->shared_from_this();
-		
+			
+			arm_deadline(HTTPDeadline::none);										/// socket goes to WSConnection
 			_cancel();
+			drop_pending();																/// client waits for 101 before framing
 			
 			_generate_ws_handshake_headers();
 			
 			auto buffers = response_.to_buffers();
 			
-			boost::asio::async_write(*sock_.get(), buffers,
+			async_write_layer(*sock_.get(), ktls_tx, buffers,
 				strand_.wrap(boost::bind(&HTTPConnection<TSocket>::_create_ws_connection, this, self)));
 		}
 		
@@ -161,6 +345,25 @@ namespace net
 			
 			if (request_.headers["sec-websocket-protocol"] == "chat, superchat")
 				response_.headers["Sec-WebSocket-Protocol"] = "chat";
+			
+			uint64_t last_seen = 0;
+			pauuid sid = request_.getCookie("SID").value;
+			
+			if (params.ws_replay_capacity != 0 && sid != pauuid() &&
+			    WS::parse_resume_offer(request_.headers["sec-websocket-protocol"], last_seen))
+			{
+				webserver_.ws_replay_.Attach(sid, last_seen, ws_resumption_);
+				
+				std::string answer = WS::resume_protocol(ws_resumption_.resumed ? last_seen : 0);
+				if (ws_resumption_.ring && (ws_resumption_.resumed ||
+				    WS::offers_protocol(request_.headers["sec-websocket-protocol"], answer)))	/// only what's offered
+					response_.headers["Sec-WebSocket-Protocol"] = answer;
+			}
+			
+			std::string extensions;
+			if (WS::negotiate_deflate(request_.headers["sec-websocket-extensions"], params.ws_deflate,
+			                          ws_deflate_agreed_, extensions))
+				response_.headers["Sec-WebSocket-Extensions"] = extensions;
 		}
 		
 		template<typename TSocket>
@@ -172,11 +375,18 @@ namespace net
 			
 			// after WSConnection "steals" 'sock_' socket of HTTPConnection, http connection is destroyed, because
 			// no 'shared_from_this' is used for connection prolongation
-			auto wsconn = std::make_shared<WS::WSConnection<TSocket>>(sock_, params, request_.uri, sid, id);
+			auto wsconn = std::make_shared<WS::WSConnection<TSocket>>(webserver_, sock_, params, request_.uri, sid, id,
+				ktls_tx, ws_deflate_agreed_);
+			
+			if (ws_resumption_.ring)													/// gap goes before any push
+				wsconn->Resume(std::move(ws_resumption_));
 			
 			std::weak_ptr<WS::WSConnection<TSocket>> wsconn_weak = wsconn;
 			webserver_.WSAddSession(id, wsconn_weak);
 			
+			if (params.ws_subscribe_by_path)
+				webserver_.WSSubscribe(request_.uri.path(), id);
+			
 			wsconn->Start();
 		}
 		
@@ -185,14 +395,97 @@ namespace net
 		template<typename TSocket>
 		void HTTPConnection<TSocket>::stop()
 		{
+			arm_deadline(HTTPDeadline::none);
+			
 			_cancel();
 			_shutdown();
 			_close();
+			
+			drop_pending();
+		}
+		
+		template<typename TSocket>
+		void HTTPConnection<TSocket>::drop_pending()
+		{
+			if (pending_begin_ != pending_end_)
+				zeroout(buffer_.data() + pending_begin_, pending_end_ - pending_begin_);	/// unparsed requests
+			
+			pending_begin_ = pending_end_ = 0;
+		}
+		
+		
+		
+		template<typename TSocket>
+		void HTTPConnection<TSocket>::arm_deadline(HTTPDeadline deadline)
+		{
+			if (deadline_timer_)
+				wheel_.Cancel(deadline_timer_);
+			
+			deadline_timer_ = 0;
+			deadline_ = deadline;
+			auto gen = ++deadline_gen_;
+			
+			uint timeout_sec = 0;
+			switch (deadline)
+			{
+				case HTTPDeadline::handshake:
+				case HTTPDeadline::header:
+					timeout_sec = params.http_header_timeout_sec;
+					break;
+				case HTTPDeadline::body:
+					timeout_sec = params.http_body_timeout_sec;
+					break;
+				case HTTPDeadline::idle:
+					timeout_sec = params.http_idle_timeout_sec;
+					break;
+				default:
+					break;
+			}
+			
+			if (timeout_sec == 0)
+				return;
+			
+			std::weak_ptr<HTTPConnection<TSocket>> weak = this->shared_from_this();	/// wheel doesn't prolong life
+			
+			deadline_timer_ = wheel_.Schedule(timeout_sec * 1000, [weak, deadline, gen]()
+			{
+				if (auto self = weak.lock())
+					self->strand_.post(boost::bind(&HTTPConnection<TSocket>::on_deadline, self.get(), self, deadline, gen));
+			});
+		}
+		
+		template<typename TSocket>
+		void HTTPConnection<TSocket>::on_deadline(std::shared_ptr<HTTPConnection<TSocket>> self, HTTPDeadline deadline,
+			uint64_t gen)
+		{
+			if (gen != deadline_gen_)													/// phase changed meanwhile
+				return;
+			
+			deadline_timer_ = 0;
+			webserver_.count_http_deadline(deadline);
+			
+			IFLOG(P4, "HTTP connection deadline expired. Deadline follows.", int(deadline));
+			
+			if (deadline == HTTPDeadline::idle || deadline == HTTPDeadline::handshake)
+			{
+				stop();
+				return;
+			}
+			
+			arm_deadline(HTTPDeadline::none);
+			_cancel();																	/// pending read ends with operation_aborted
+			
+			response_ = HTTPResponse::stock_reply(Schema::StatusCode::request_timeout);
+			response_.headers["Connection"] = "close";
+			close_after_write_ = true;
+			
+			do_write();
 		}
 		
 		
 		
 		template class HTTPConnection<TCPSocket>;
 		template class HTTPConnection<SSLSocket>;
+		template class HTTPConnection<MemSocket>;
 	}
 }
\ No newline at end of file
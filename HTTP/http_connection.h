@@ -9,6 +9,12 @@
 #include "webserver/HTTP/http_request.h"
 #include "webserver/HTTP/http_response.h"
 #include "webserver/WS/ws_connection.h"
+#include "webserver/timer_wheel.h"
+#include "webserver/metrics.h"
+#include "webserver/flight_recorder.h"
+#include "webserver/watchdog.h"
+#include "webserver/access_log.h"
+#include "webserver/traffic_capture.h"
 
 
 
@@ -20,6 +26,17 @@ namespace net
 	
 	namespace HTTP
 	{
+		// Deadline HTTPConnection is waiting for (see HTTPConnection::arm_deadline)
+		enum class HTTPDeadline { none, handshake, header, body, idle };
+		
+		// Counters of expired deadlines (see WebServer::GetHTTPDeadlineStats)
+		struct HTTPDeadlineStats
+		{
+			uint64_t header = 0;	// 408 sent: request line and headers (or TLS handshake) are too slow
+			uint64_t body = 0;		// 408 sent: body is too slow
+			uint64_t idle = 0;		// keep-alive connection closed silently
+		};
+		
 		//--------------------------------------------------------------------------------------------------------------
 		// HTTPConnection is a class that encapsulates single thread with boost::asio socket's read-write handlers.
 		// HTTPConnections run in parallel above different sockets but under single io_service queue which operates over
@@ -32,6 +49,9 @@ namespace net
 		// HTTPRequest class instance, an RFC-complying wrapper for HTTP attributes (headers, method, HTTP version etc.)
 		// In case HTTPRequest is websocket handshake by RFC, WSConnection is created. Otherwise, after successful
 		// parsing, HTTPRequest is passed to corresponding handler (with application level code) in webengine module.
+		// Bytes read past the request (pipelined requests) stay in buffer and are parsed by 'on_read' after response
+		// is written, before socket is read again. If connection stops or upgrades to WS instead, 'drop_pending'
+		// zeroouts them, as parser does with the bytes it consumed.
 		//
 		// Method 'do_write' uses "scatter-gather I/O" approach: divides HTTPResponse class instance info into separate
 		// buffers and writes them into socket.
@@ -40,11 +60,30 @@ namespace net
 		// completes and vice versa. Reads and writes are additionally separated via 'strand' boost::asio primitive,
 		// which is legacy element and can be removed with caution.
 		//
+		// Method 'serve_metrics' answers request to WebServerParams::metrics_path with Prometheus text, bypassing the
+		// bridge. Each connection stage (TLS handshake, read & parse, handling, write) is timed into WebServer's
+		// Metrics. Events of each request are also kept by WebServer's FlightRecorder ('trace_' is request's id there),
+		// whose timeline is dumped if request turns out slow. Method 'log_access' passes AccessRecord of each answered
+		// request to WebServer's AccessLog, if it's on. Requests to the bridge on connections sampled by WebServer's
+		// TrafficCapture ('capture_conn_' is non-zero) have their heads captured for replay.
+		//
 		// Methods 'process_ws_handshake', '_generate_ws_handshake_headers', '_create_ws_connection' serve the procedure
 		// of WSConnection creation and start-up.
 		//
 		// Method 'stop' initiates graceful shutdown of all socket operations and closure of boost::asio socket itself. It
-		// is only called when boost::asio read or write operation finishes with error, indicating any network error.
+		// is called when boost::asio read or write operation finishes with error, indicating any network error, or when
+		// deadline expires.
+		//
+		// Method 'arm_deadline' guards each phase of connection with its own deadline on WebServer's timer wheel, so
+		// slow (slowloris) or idle clients can't hold sockets forever:
+		// - 'header' (WebServerParams::http_header_timeout_sec) - from accept or from the first byte of the next
+		//   request till the end of headers; on expiry client gets 408 and connection is closed;
+		// - 'body' (http_body_timeout_sec) - from the end of headers till the end of body; 408 as well;
+		// - 'idle' (http_idle_timeout_sec) - keep-alive connection waits for the next request; closed silently;
+		// - 'handshake' - TLS handshake of HTTPS connection, limited by header timeout; closed silently.
+		// Deadlines are total, not per read, so trickling a byte at a time doesn't prolong them. No deadline runs while
+		// request is handled and response is written. Expiry ('on_deadline') is posted to 'strand_' and ignored if
+		// connection moved to another phase meanwhile ('deadline_gen_'). Expirations are counted by WebServer.
 		//
 		// HTTPConnection prolongs it's own life by passing shared_from_this to boost::asio read/write handlers. When
 		// the last shared_ptr is freed (shared_ptr's counter = 0), HTTPConnection is destroyed.
@@ -57,6 +96,7 @@ namespace net
 		{
 			using Connection<TSocket>::sock_;											// boost::asio socket, unique for this Connection
 			using Connection<TSocket>::params;
+			using Connection<TSocket>::ktls_tx;
 			using Connection<TSocket>::_cancel;
 			using Connection<TSocket>::_shutdown;
 			using Connection<TSocket>::_close;
@@ -64,21 +104,33 @@ namespace net
 		public:
 			HTTPConnection(WebServer& webserver, std::shared_ptr<TSocket> sock, WebServerParams params,
 				std::unique_ptr<HTTPRequestHandler> bridge);
+			~HTTPConnection();
 			
 			virtual void Start() override final;
 			
 		private:
 			void do_read();
+			void on_read(size_t begin, size_t end);
 			void do_write();
 			
+			void serve_metrics();
+			void log_access(size_t bytes_out);
+			
 			void process_ws_handshake(const std::string &content);
 			void _generate_ws_handshake_headers();
 			void _create_ws_connection(std::shared_ptr<HTTPConnection<TSocket>> self);
 			
-			void stop();																	// TODO: stop by timeout in case client does not reuse
+			void stop();
+			void drop_pending();															// zeroout unparsed bytes
+			
+			void arm_deadline(HTTPDeadline deadline);
+			void on_deadline(std::shared_ptr<HTTPConnection<TSocket>> self, HTTPDeadline deadline, uint64_t gen);
 			
 		private:
 			WebServer& webserver_;															// backlink for WSConnections management
+			TimerWheel& wheel_;
+			Metrics& metrics_;
+			FlightRecorder& recorder_;
 			std::unique_ptr<HTTPRequestHandler> bridge_;									// adapter class instance for REST requests handling
 			
 			HTTPRequest request_;															// wrapper of client's request
@@ -87,9 +139,33 @@ namespace net
 			
 			enum { max_buffer_length_ = 8192 };												// TODO: check buffer length handling
 			std::array<char, max_buffer_length_> buffer_;									// read-write buffer for socket
+			size_t pending_begin_ = 0;														// unparsed bytes of 'buffer_' -
+			size_t pending_end_ = 0;														// pipelined requests
 			Strand strand_;																	// TODO: legacy - remove, use logical sequencing
 			
-			static constexpr const bool is_http = std::is_same<TSocket, TCPSocket>::value;	// else is https
+			HTTPDeadline deadline_ = HTTPDeadline::none;									// all deadline_* are accessed in strand
+			TimerWheel::TimerId deadline_timer_ = 0;
+			uint64_t deadline_gen_ = 0;														// tells stale expirations
+			bool close_after_write_ = false;
+			
+			WS::WSResumption ws_resumption_;												// negotiated at WS handshake
+			WS::WSDeflateAgreement ws_deflate_agreed_;										// the same
+			
+			Metrics::Clock::time_point request_started_;									// first byte, zero - not yet
+			Metrics::Clock::time_point stage_started_;										// handshake or write
+			
+			uint64_t trace_ = 0;															// request id in FlightRecorder
+			uint64_t trace_started_ = 0;													// accept or first byte, ns
+			bool trace_read_ = false;														// first byte recorded
+			
+			AccessLog& access_log_;
+			AccessRecord access_;															// address is set once
+			std::chrono::steady_clock::time_point access_started_;							// first byte
+			
+			TrafficCapture& capture_;
+			uint64_t capture_conn_ = 0;														// 0 - not sampled
+			
+			static constexpr const bool is_http = !std::is_same<TSocket, SSLSocket>::value;	// else is https
 		};
 	}
 }
\ No newline at end of file
@@ -25,13 +25,17 @@ namespace net
 			data_ = Data();
 		}
 		
-		HTTPParser::Result HTTPParser::Parse(HTTPRequest& req, char* begin, char* end)
+		HTTPParser::Result HTTPParser::Parse(HTTPRequest& req, char* begin, char* end, char** rest)
 		{
 			void* target_memory_ptr = reinterpret_cast<void*>(begin);
-			size_t target_memory_sz = end - begin; // boost::asio buffer is a continuous memory chunk
 			
 			auto result = parse_impl(begin, end);
 			
+			char* parsed_end = (result == Result::good) ? begin : end; // pipelined requests are not zeroouted
+			size_t target_memory_sz = parsed_end - reinterpret_cast<char*>(target_memory_ptr);
+			if (rest)
+				*rest = parsed_end;
+			
 			if (result == Result::good) try {
 				fill_request(req);
 			} catch (std::out_of_range& e) { /// no 'Host' header
@@ -46,7 +50,7 @@ namespace net
 			return result;
 		}
 		
-		HTTPParser::Result HTTPParser::parse_impl(char* begin, char* end)
+		HTTPParser::Result HTTPParser::parse_impl(char*& begin, char* end)
 		{
 			using State = Schema::ParserState;
 			
@@ -303,7 +307,10 @@ namespace net
 								}
 							
 							if (data_.content_length == 0)					// no content
+							{
+								++begin;
 								return Result::good;
+							}
 						}
 						else
 						{
@@ -313,7 +320,10 @@ namespace net
 					case State::body:
 						data_.content.push_back(input);
 						if (data_.content.size() == data_.content_length) // full content
+						{
+							++begin;
 							return Result::good;
+						}
 						break;
 					default:
 						return Result::bad;
@@ -355,6 +365,7 @@ namespace net
 				req.content.assign(data_.content.begin(), data_.content.end());
 			
 			// HTTP message does not carry Uri in full form
+			req.target = data_.uri;
 			req.assembleUri(data_.uri);
 		};
 		
@@ -21,7 +21,9 @@ namespace net
 		// 3 or result code 'indeterminate' which means that byte array contained just a part of valid HTTP message
 		//
 		// Method 'Parse' returns result plus, possibly, fills HTTPRequest; 'begin' and 'end' are byte array boundaries.
+		// Bytes after a complete message (pipelined requests) are left intact, 'rest' points to the first of them.
 		// Method 'Reset' is called when parser gets solid result - 'good' or 'bad'.
+		// Method 'InBody' tells whether headers of incomplete message are over (see HTTPConnection deadlines).
 		//
 		// struct 'HTTPParser::Data' is an intermediate form to store parsed info.
 		//
@@ -56,10 +58,12 @@ namespace net
 			
 			void Reset();
 			
-			Result Parse(HTTPRequest& req, char* begin, char* end);
+			Result Parse(HTTPRequest& req, char* begin, char* end, char** rest = nullptr);
+			
+			bool InBody() const { return state_ == Schema::ParserState::body; }		// headers are parsed already
 			
 		private:
-			Result parse_impl(char* begin, char* end);
+			Result parse_impl(char*& begin, char* end);										// 'begin' - past parsed
 			void fill_request(HTTPRequest& req);
 			
 			static bool is_char(int c);
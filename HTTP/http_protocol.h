@@ -106,6 +106,7 @@ namespace net
 				unauthorized = 401,
 				forbidden = 403,
 				not_found = 404,
+				request_timeout = 408,
 				internal_server_error = 500,
 				not_implemented = 501,
 				bad_gateway = 502,
@@ -169,6 +170,8 @@ namespace net
 					"HTTP/1.0 403 Forbidden\r\n";
 				const std::string not_found =
 					"HTTP/1.0 404 Not Found\r\n";
+				const std::string request_timeout =
+					"HTTP/1.0 408 Request Timeout\r\n";
 				const std::string internal_server_error =
 					"HTTP/1.0 500 Internal Server Error\r\n";
 				const std::string not_implemented =
@@ -250,6 +253,11 @@ namespace net
 						"<head><title>Not Found</title></head>"
 						"<body><h1>404 Not Found</h1></body>"
 						"</html>";
+				const char request_timeout[] =
+						"<html>"
+						"<head><title>Request Timeout</title></head>"
+						"<body><h1>408 Request Timeout</h1></body>"
+						"</html>";
 				const char internal_server_error[] =
 						"<html>"
 						"<head><title>Internal Server Error</title></head>"
@@ -45,6 +45,7 @@ namespace net
 		
 			std::string content;
 			IPAddress origin;
+			std::string target;										// request-target as received
 			Uri uri;
 		};
 	}
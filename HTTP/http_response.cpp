@@ -63,6 +63,8 @@ namespace net
 					return boost::asio::buffer(forbidden);
 				case Schema::StatusCode::not_found:
 					return boost::asio::buffer(not_found);
+				case Schema::StatusCode::request_timeout:
+					return boost::asio::buffer(request_timeout);
 				case Schema::StatusCode::internal_server_error:
 					return boost::asio::buffer(internal_server_error);
 				case Schema::StatusCode::not_implemented:
@@ -118,6 +120,8 @@ namespace net
 					return forbidden;
 				case Schema::StatusCode::not_found:
 					return not_found;
+				case Schema::StatusCode::request_timeout:
+					return request_timeout;
 				case Schema::StatusCode::internal_server_error:
 					return internal_server_error;
 				case Schema::StatusCode::not_implemented:
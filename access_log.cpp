@@ -0,0 +1,221 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/access_log.h"
+#include "webserver/json_string.h"
+
+#include <ctime>
+
+
+
+namespace net
+{
+	namespace
+	{
+		template<size_t N>
+		void copy_truncated(char (&to)[N], const std::string& from)
+		{
+			size_t n = std::min(from.size(), N - 1);
+			std::memcpy(to, from.data(), n);
+			to[n] = 0;
+		}
+	}
+	
+	void AccessRecord::SetAddress(const boost::asio::ip::address& address)
+	{
+		if (address.is_v6())
+		{
+			auto bytes = address.to_v6().to_bytes();
+			std::memcpy(ip, bytes.data(), bytes.size());
+			ip_v6 = 1;
+		}
+		else
+		{
+			auto bytes = address.to_v4().to_bytes();
+			std::memcpy(ip, bytes.data(), bytes.size());
+			ip_v6 = 0;
+		}
+	}
+	
+	void AccessRecord::SetMethod(const std::string& s)
+	{
+		copy_truncated(method, s);
+	}
+	
+	void AccessRecord::SetPath(const std::string& s)
+	{
+		copy_truncated(path, s);
+	}
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// SPSC ring: owner thread advances 'head', writer thread advances 'tail'; capacity is a power of two.
+	//------------------------------------------------------------------------------------------------------------------
+	struct AccessLog::Ring
+	{
+		explicit Ring(size_t capacity)
+			: records(new AccessRecord[capacity]), mask(capacity - 1), head(0), tail(0), seen(0)
+		{
+		}
+		
+		std::unique_ptr<AccessRecord[]> records;
+		const size_t mask;
+		std::atomic<uint64_t> head;
+		std::atomic<uint64_t> tail;
+		uint64_t seen;																/// owner only, for sampling
+	};
+	
+	AccessLog::AccessLog(const std::string& path, size_t ring_capacity, uint flush_ms, uint sample_every)
+		: path_(path), ring_capacity_(std::max<size_t>(ring_capacity, 4)), flush_ms_(std::max(flush_ms, 1u)),
+		  sample_every_(std::max(sample_every, 1u)), written_(0), dropped_(0), sampled_out_(0)
+	{
+	}
+	
+	AccessLog::~AccessLog()
+	{
+		Stop();
+	}
+	
+	void AccessLog::Start()
+	{
+		if (!Enabled() || writer_.Running())
+			return;
+		
+		file_ = std::fopen(path_.c_str(), "ab");
+		if (!file_)
+		{
+			IFLOG(P2, "AccessLog can't open file, access log is off. Path follows.", path_);
+			return;
+		}
+		
+		writer_.Start([this] { drain(); return false; }, flush_ms_);
+	}
+	
+	void AccessLog::Stop()
+	{
+		if (!writer_.Running())
+			return;
+		
+		writer_.Stop();																	/// drains rings
+		
+		std::fclose(file_);
+		file_ = nullptr;
+	}
+	
+	void AccessLog::Log(const AccessRecord& record)
+	{
+		if (!writer_.Running())
+			return;
+		
+		Ring& r = ring();
+		uint64_t head = r.head.load(std::memory_order_relaxed);
+		uint64_t used = head - r.tail.load(std::memory_order_acquire);
+		
+		if (used > r.mask)																/// full
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		
+		if (used >= (r.mask + 1) / 4 * 3 && r.seen++ % sample_every_ != 0)				/// filling up - sample
+		{
+			sampled_out_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		
+		r.records[head & r.mask] = record;
+		r.head.store(head + 1, std::memory_order_release);
+	}
+	
+	size_t AccessLog::drain()
+	{
+		buffer_.clear();
+		size_t n = 0;
+		
+		for (auto r : rings_.All())
+		{
+			uint64_t tail = r->tail.load(std::memory_order_relaxed);
+			uint64_t head = r->head.load(std::memory_order_acquire);
+			
+			for (; tail != head; ++tail, ++n)
+				Format(r->records[tail & r->mask], buffer_);
+			
+			r->tail.store(tail, std::memory_order_release);
+		}
+		
+		uint64_t dropped = dropped_, sampled_out = sampled_out_;
+		if (dropped != reported_dropped_ || sampled_out != reported_sampled_out_)
+		{
+			buffer_ += "{\"dropped\":" + std::to_string(dropped - reported_dropped_) +
+			           ",\"sampled_out\":" + std::to_string(sampled_out - reported_sampled_out_) + "}\n";
+			
+			reported_dropped_ = dropped;
+			reported_sampled_out_ = sampled_out;
+		}
+		
+		if (!buffer_.empty())
+		{
+			if (std::fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size())
+				IFLOG(P2, "AccessLog write failed. Path follows.", path_);
+			
+			std::fflush(file_);
+		}
+		
+		written_ += n;
+		return n;
+	}
+	
+	void AccessLog::Format(const AccessRecord& record, std::string& out)
+	{
+		char time[32];
+		std::time_t seconds = static_cast<std::time_t>(record.time_ms / 1000);
+		std::tm tm = {};
+#if defined(_WIN32)
+		gmtime_s(&tm, &seconds);
+#else
+		gmtime_r(&seconds, &tm);
+#endif
+		size_t len = std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+		std::snprintf(time + len, sizeof(time) - len, ".%03uZ", static_cast<uint>(record.time_ms % 1000));
+		
+		std::string ip;
+		if (record.ip_v6)
+		{
+			boost::asio::ip::address_v6::bytes_type bytes;
+			std::memcpy(bytes.data(), record.ip, bytes.size());
+			ip = boost::asio::ip::address_v6(bytes).to_string();
+		}
+		else
+		{
+			boost::asio::ip::address_v4::bytes_type bytes;
+			std::memcpy(bytes.data(), record.ip, bytes.size());
+			ip = boost::asio::ip::address_v4(bytes).to_string();
+		}
+		
+		out += "{\"time\":\"";
+		out += time;
+		out += "\",\"ip\":\"" + ip + "\",\"port\":" + std::to_string(record.port);
+		out += ",\"tls\":";
+		out += record.tls ? "true" : "false";
+		out += ",\"method\":";
+		AppendJsonString(out, record.method);
+		out += ",\"path\":";
+		AppendJsonString(out, record.path);
+		out += ",\"status\":" + std::to_string(record.status);
+		out += ",\"bytes_in\":" + std::to_string(record.bytes_in);
+		out += ",\"bytes_out\":" + std::to_string(record.bytes_out);
+		out += ",\"duration_us\":" + std::to_string(record.duration_us);
+		out += ",\"handler_us\":" + std::to_string(record.handler_us);
+		out += "}\n";
+	}
+	
+	AccessLog::Ring& AccessLog::ring()
+	{
+		return rings_.Get([this](size_t)
+		{
+			size_t capacity = 1;
+			while (capacity < ring_capacity_)
+				capacity <<= 1;
+			
+			return std::unique_ptr<Ring>(new Ring(capacity));
+		});
+	}
+}
@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/thread_slots.h"
+#include "webserver/worker_thread.h"
+
+#include <cstdio>
+
+
+
+namespace net
+{
+	// Fixed-size binary record of one HTTP request; strings are truncated, not allocated
+	struct AccessRecord
+	{
+		uint64_t time_ms = 0;														// wall clock at completion, Unix ms
+		uint32_t duration_us = 0;													// first byte - response written
+		uint32_t handler_us = 0;													// in HTTPRequestHandler, 0 - metrics off
+		uint64_t bytes_in = 0;
+		uint64_t bytes_out = 0;
+		uint16_t status = 0;
+		uint16_t port = 0;															// remote
+		uint8_t ip_v6 = 0;
+		uint8_t ip[16] = {};														// remote, network order
+		uint8_t tls = 0;
+		char method[8] = {};
+		char path[192] = {};
+		
+		void SetAddress(const boost::asio::ip::address& address);
+		void SetMethod(const std::string& s);
+		void SetPath(const std::string& s);
+	};
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// AccessLog writes a JSON line per HTTP request to file 'path' without I/O threads ever formatting, allocating or
+	// waiting for disk: HTTPConnection fills AccessRecord and 'Log' copies it into a single-producer single-consumer
+	// ring of the calling thread ('ring_capacity' records, allocated on first use). A writer thread wakes each
+	// 'flush_ms', drains all rings, formats the batch into one buffer and appends it with one write.
+	//
+	// Under overload records are shed, never waited for: a ring filled over 3/4 keeps 1 record of 'sample_every',
+	// a full one drops them. Numbers of shed records are written to the log as {"dropped":..,"sampled_out":..} lines,
+	// so gaps are visible.
+	//
+	// Empty 'path' disables the log: 'Log' costs a branch, no thread is started.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API AccessLog
+	{
+		DECLARE_NONCOPYABLE(AccessLog);
+		
+		struct Ring;
+	
+	public:
+		AccessLog(const std::string& path, size_t ring_capacity, uint flush_ms = 100, uint sample_every = 8);
+		~AccessLog();
+		
+		bool Enabled() const { return !path_.empty(); }
+		
+		void Start();
+		void Stop();																// drains rings, closes file
+		
+		void Log(const AccessRecord& record);										// from I/O threads
+		
+		uint64_t Written() const { return written_; }
+		uint64_t Dropped() const { return dropped_; }
+		uint64_t SampledOut() const { return sampled_out_; }
+		
+		static void Format(const AccessRecord& record, std::string& out);			// appends JSON line
+	
+	private:
+		size_t drain();
+		Ring& ring();
+	
+	private:
+		const std::string path_;
+		const size_t ring_capacity_;
+		const uint flush_ms_;
+		const uint sample_every_;
+		
+		ThreadSlots<Ring> rings_;
+		
+		std::FILE* file_ = nullptr;
+		std::string buffer_;														// writer thread only
+		uint64_t reported_dropped_ = 0;
+		uint64_t reported_sampled_out_ = 0;
+		
+		std::atomic<uint64_t> written_;
+		std::atomic<uint64_t> dropped_;
+		std::atomic<uint64_t> sampled_out_;
+		
+		WorkerThread writer_;
+	};
+}
@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// BoundedQueue is a lock-free bounded FIFO queue over a ring of cells (D. Vyukov's MPMC algorithm). Any number of
+	// producers and consumers may call 'TryPush' / 'TryPop' concurrently; none of them ever blocks or allocates.
+	//
+	// Each cell carries a sequence number, which tells whether cell is free for the producer of given lap or filled
+	// for the consumer of given lap. Positions of producers and consumers are claimed with CAS and are kept on
+	// separate cache lines.
+	//
+	// Method 'TryPush' returns false if queue is full, 'TryPop' returns false if queue is empty.
+	// Method 'Ready' tells whether the head element is completely pushed, i.e. 'TryPop' would succeed.
+	// Method 'Size' is approximate when queue is used concurrently.
+	// Capacity is rounded up to a power of two.
+	//------------------------------------------------------------------------------------------------------------------
+	template<typename T>
+	class BoundedQueue
+	{
+		DECLARE_NONCOPYABLE(BoundedQueue);
+		
+		struct Cell
+		{
+			std::atomic<size_t> seq;
+			T value;
+		};
+	
+	public:
+		explicit BoundedQueue(size_t capacity)
+		{
+			size_t n = 2;
+			while (n < capacity)
+				n <<= 1;
+			
+			cells_.reset(new Cell[n]);
+			mask_ = n - 1;
+			
+			for (size_t i = 0; i < n; ++i)
+				cells_[i].seq.store(i, std::memory_order_relaxed);
+			
+			enqueue_pos_.store(0, std::memory_order_relaxed);
+			dequeue_pos_.store(0, std::memory_order_relaxed);
+		}
+		
+		template<typename TArg>
+		bool TryPush(TArg&& v)
+		{
+			Cell* cell;
+			size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+			
+			for (;;)
+			{
+				cell = &cells_[pos & mask_];
+				size_t seq = cell->seq.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+				
+				if (diff == 0)
+				{
+					if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)													/// full
+					return false;
+				else
+					pos = enqueue_pos_.load(std::memory_order_relaxed);
+			}
+			
+			cell->value = std::forward<TArg>(v);
+			cell->seq.store(pos + 1, std::memory_order_release);
+			
+			return true;
+		}
+		
+		bool TryPop(T& v)
+		{
+			Cell* cell;
+			size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+			
+			for (;;)
+			{
+				cell = &cells_[pos & mask_];
+				size_t seq = cell->seq.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+				
+				if (diff == 0)
+				{
+					if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)													/// empty
+					return false;
+				else
+					pos = dequeue_pos_.load(std::memory_order_relaxed);
+			}
+			
+			v = std::move(cell->value);
+			cell->value = T();														/// release resources held by cell
+			cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+			
+			return true;
+		}
+		
+		size_t Size() const
+		{
+			size_t enq = enqueue_pos_.load(std::memory_order_relaxed);
+			size_t deq = dequeue_pos_.load(std::memory_order_relaxed);
+			
+			return (enq > deq ? enq - deq : 0);
+		}
+		
+		bool Ready() const
+		{
+			size_t pos = dequeue_pos_.load(std::memory_order_seq_cst);
+			
+			return cells_[pos & mask_].seq.load(std::memory_order_seq_cst) == pos + 1;
+		}
+		
+		size_t Capacity() const { return mask_ + 1; }
+	
+	private:
+		std::unique_ptr<Cell[]> cells_;
+		size_t mask_;
+		
+		char pad_0_[64];															// producers and consumers positions
+		std::atomic<size_t> enqueue_pos_;											// live on different cache lines
+		char pad_1_[64];
+		std::atomic<size_t> dequeue_pos_;
+		char pad_2_[64];
+	};
+}
@@ -28,6 +28,17 @@ namespace net
 			IFLOG(P2, "Exception happened while socket cancel", ec);
 	}
 	
+	template<>
+	void Connection<MemSocket>::_cancel()
+	{
+		error_code ec;
+		
+		sock_->cancel(ec);
+		
+		if (ec)
+			IFLOG(P2, "Exception happened while socket cancel", ec);
+	}
+	
 	template<>
 	void Connection<TCPSocket>::_shutdown()
 	{
@@ -50,6 +61,17 @@ namespace net
 			IFLOG(P2, "Exception happened while socket shutdown", ec);
 	}
 	
+	template<>
+	void Connection<MemSocket>::_shutdown()
+	{
+		error_code ec;
+		
+		sock_->shutdown(sock_->shutdown_both, ec);
+		
+		if (ec)
+			IFLOG(P2, "Exception happened while socket shutdown", ec);
+	}
+	
 	template<>
 	void Connection<TCPSocket>::_close()
 	{
@@ -71,10 +93,22 @@ namespace net
 		if (ec)
 			IFLOG(P2, "Exception happened while socket close", ec);
 	}
+	template<>
+	void Connection<MemSocket>::_close()
+	{
+		error_code ec;
+		
+		sock_->close(ec);
+		
+		if (ec)
+			IFLOG(P2, "Exception happened while socket close", ec);
+	}
 	
 	
 	
 	template class Connection<SSLSocket>;
 	
 	template class Connection<TCPSocket>;
+	
+	template class Connection<MemSocket>;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "webserver/stdhdr.h"
 
 #include "webserver/webserver_params.h"
+#include "webserver/mem_socket.h"
 
 
 
@@ -11,15 +12,18 @@ namespace net
 {
 	//------------------------------------------------------------------------------------------------------------------
 	// Base class for HTTP(S) & WS(S) connections. Stores basic web connection management info - boost::asio socket and
-	// params of connection.
+	// params of connection. TSocket is TCPSocket, SSLSocket or in-memory MemSocket (see WebServer::Accept).
+	//
+	// Field 'ktls_tx' is state of this socket, not a setting: it's set by HTTPConnection after TLS handshake, if kernel
+	// took over encryption of writes (see ktls.h), and is passed on to WSConnection with the socket.
 	//
 	// Methods _cancel, _shutdown and _close are used in combination for boost::asio sockets' correct closure.
 	template<typename TSocket>
 	class Connection
 	{
 	public:
-		Connection(std::shared_ptr<TSocket> sock, WebServerParams p)
-			: params(std::move(p)), sock_(std::move(sock))
+		Connection(std::shared_ptr<TSocket> sock, WebServerParams p, bool ktls_tx = false)
+			: params(std::move(p)), ktls_tx(ktls_tx), sock_(std::move(sock))
 		{}
 		
 		virtual ~Connection() = default;
@@ -33,6 +37,7 @@ namespace net
 	
 	public:
 		WebServerParams params;
+		bool ktls_tx;															// writes go to TCP layer, kernel encrypts
 	
 	protected:
 		std::shared_ptr<TSocket> sock_;
@@ -0,0 +1,235 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/flight_recorder.h"
+
+#include <algorithm>
+#include <chrono>
+
+
+
+namespace net
+{
+	namespace
+	{
+		const char* event_names[] =
+		{
+			"accept", "read_issued", "first_byte", "read", "parse_complete", "handler_start", "handler_end",
+			"write_start", "write_complete"
+		};
+		
+		static_assert(sizeof(event_names) / sizeof(*event_names) == static_cast<size_t>(FlightEvent::count_), "names");
+		
+	}
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// Writer claims slot 'n' (claimed_ = n + 1, release fence), fills it, publishes it (head_ = n + 1). Reader copies
+	// slots below head_, then after acquire fence reads claimed_: copied slot 'j' is intact if j + capacity >= claimed_,
+	// i.e. no writer has claimed it for a newer event yet.
+	//------------------------------------------------------------------------------------------------------------------
+	struct FlightRecorder::Ring
+	{
+		struct Slot
+		{
+			std::atomic<uint64_t> request;
+			std::atomic<uint64_t> ns;
+			std::atomic<uint64_t> event_arg;											// event | arg << 8
+		};
+		
+		Ring(size_t capacity, uint64_t index)
+			: slots(new Slot[capacity]()), capacity(capacity), index(index), requests(0), claimed(0), head(0)
+		{
+		}
+		
+		std::unique_ptr<Slot[]> slots;
+		const size_t capacity;
+		const uint64_t index;
+		uint64_t requests;															/// writer only
+		std::atomic<uint64_t> claimed;
+		std::atomic<uint64_t> head;
+	};
+	
+	FlightRecorder::FlightRecorder(size_t events_per_thread, uint slow_ms)
+		: events_per_thread_(events_per_thread), slow_ns_(uint64_t(slow_ms) * 1000000), dumped_(0), skipped_(0)
+	{
+	}
+	
+	FlightRecorder::~FlightRecorder()
+	{
+		Stop();
+	}
+	
+	void FlightRecorder::Start()
+	{
+		if (!Enabled() || slow_ns_ == 0)
+			return;
+		
+		dumper_.Start([this] { dump_queued(); return false; }, 1000);
+	}
+	
+	void FlightRecorder::Stop()
+	{
+		dumper_.Stop();
+		dump_queued();																	/// queued while it was stopping
+	}
+	
+	void FlightRecorder::OnSlow(Handler handler)
+	{
+		on_slow_ = std::move(handler);
+	}
+	
+	uint64_t FlightRecorder::NewRequest()
+	{
+		if (!Enabled())
+			return 0;
+		
+		auto& r = ring();
+		return (r.index << 40) | ++r.requests;
+	}
+	
+	uint64_t FlightRecorder::Record(uint64_t request, FlightEvent event, uint64_t arg)
+	{
+		if (!Enabled())
+			return 0;
+		
+		auto& r = ring();
+		uint64_t ns = now_ns();
+		uint64_t n = r.head.load(std::memory_order_relaxed);
+		
+		r.claimed.store(n + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		
+		auto& slot = r.slots[n % r.capacity];
+		slot.request.store(request, std::memory_order_relaxed);
+		slot.ns.store(ns, std::memory_order_relaxed);
+		slot.event_arg.store(static_cast<uint64_t>(event) | (arg << 8), std::memory_order_relaxed);
+		
+		r.head.store(n + 1, std::memory_order_release);
+		
+		return ns;
+	}
+	
+	bool FlightRecorder::Finish(uint64_t request, uint64_t started_ns)
+	{
+		uint64_t ns = Record(request, FlightEvent::write_complete);
+		
+		return slow_ns_ != 0 && started_ns != 0 && ns - started_ns >= slow_ns_;
+	}
+	
+	void FlightRecorder::Dump(uint64_t request, const std::string& what)
+	{
+		{
+			boost::lock_guard<ptl::mutex> lck(queued_mx_);
+			
+			if (dumper_.Running())
+			{
+				if (queued_.size() >= max_queued_dumps_)								/// dumper lags, don't pile up
+				{
+					++skipped_;
+					return;
+				}
+				
+				queued_.emplace_back(request, what);
+				dumper_.Wake();
+				return;
+			}
+		}
+		
+		dump(request, what);															/// not started
+	}
+	
+	void FlightRecorder::dump_queued()
+	{
+		std::deque<std::pair<uint64_t, std::string>> batch;
+		
+		{
+			boost::lock_guard<ptl::mutex> lck(queued_mx_);
+			batch.swap(queued_);
+		}
+		
+		for (auto& d : batch)
+			dump(d.first, d.second);
+	}
+	
+	void FlightRecorder::dump(uint64_t request, const std::string& what)
+	{
+		std::string timeline = what + "\n" + Timeline(request);
+		++dumped_;
+		
+		if (on_slow_)
+			on_slow_(request, timeline);
+		else
+			IFLOG(P3, "Slow request, its timeline follows.", timeline);
+	}
+	
+	std::string FlightRecorder::Timeline(uint64_t request) const
+	{
+		struct Event
+		{
+			uint64_t ns;
+			uint64_t event_arg;
+			uint64_t seq;																/// slot number in ring
+			uint64_t thread;
+		};
+		
+		std::vector<Event> events;
+		
+		for (auto r : rings_.All())
+		{
+			uint64_t head = r->head.load(std::memory_order_acquire);
+			uint64_t from = head > r->capacity ? head - r->capacity : 0;
+			size_t copied = events.size();
+			
+			for (uint64_t j = from; j < head; ++j)
+			{
+				auto& slot = r->slots[j % r->capacity];
+				if (slot.request.load(std::memory_order_relaxed) != request)
+					continue;
+				
+				Event e;
+				e.ns = slot.ns.load(std::memory_order_relaxed);
+				e.event_arg = slot.event_arg.load(std::memory_order_relaxed);
+				e.seq = j;
+				e.thread = r->index;
+				events.push_back(e);
+			}
+			
+			std::atomic_thread_fence(std::memory_order_acquire);
+			uint64_t claimed = r->claimed.load(std::memory_order_relaxed);
+			
+			auto overwritten = std::remove_if(events.begin() + copied, events.end(),
+				[&](const Event& e) { return e.seq + r->capacity < claimed; });
+			events.erase(overwritten, events.end());
+		}
+		
+		std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.ns < b.ns; });
+		
+		std::ostringstream ss;
+		for (auto& e : events)
+		{
+			auto event = static_cast<size_t>(e.event_arg & 0xff);
+			uint64_t arg = e.event_arg >> 8;
+			
+			ss << "  +" << (e.ns - events.front().ns) / 1000 << " us\t" << event_names[std::min(event,
+				static_cast<size_t>(FlightEvent::count_) - 1)];
+			if (arg != 0)
+				ss << " (" << arg << ")";
+			ss << "\tthread " << e.thread << "\n";
+		}
+		
+		return ss.str();
+	}
+	
+	uint64_t FlightRecorder::now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	
+	FlightRecorder::Ring& FlightRecorder::ring()
+	{
+		return rings_.Get([this](size_t index)
+		{
+			return std::unique_ptr<Ring>(new Ring(events_per_thread_, index + 1));
+		});
+	}
+}
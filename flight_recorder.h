@@ -0,0 +1,103 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/thread_slots.h"
+#include "webserver/worker_thread.h"
+#include "templates/mutex.h"
+
+#include <deque>
+
+
+
+namespace net
+{
+	// Events of request timeline recorded by FlightRecorder
+	enum class FlightEvent : uint8_t
+	{
+		accept,				// connection accepted (first request of connection only)
+		read_issued,		// async_read_some issued
+		first_byte,			// first bytes of request read, arg - bytes
+		read,				// more bytes of request read, arg - bytes
+		parse_complete,		// request parsed
+		handler_start,		// HTTPRequestHandler::HandleRequest called
+		handler_end,		// ... returned
+		write_start,		// response write started, arg - status
+		write_complete,		// ... completed
+		count_
+	};
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// FlightRecorder keeps last events of requests, so that timeline of a slow one can be dumped after the fact: was
+	// it waiting for bytes (read_issued - first_byte), parsing, in the bridge (handler_start - handler_end) or in the
+	// socket (write_start - write_complete).
+	//
+	// Each thread writes into a ring of its own ('events_per_thread' slots, allocated on first use), so recording
+	// is lock-free and uncontended: a clock read and a few relaxed stores. Old events are overwritten silently.
+	// Request ids are unique across threads (ring index in high bits), as request of a connection may move between
+	// I/O threads.
+	//
+	// Method 'Finish' records write_complete and tells whether the request took 'slow_ms' or longer; then method
+	// 'Dump' collects its events from all rings and hands the timeline to 'OnSlow' handler (logged with P3 if none).
+	// After 'Start' dumps are made by a thread of recorder: 'Dump' only queues request's id, so an I/O thread never
+	// scans rings or waits for the handler. Up to 'max_queued_dumps_' wait there, more slow requests are skipped and
+	// counted (see 'Skipped'); the longer a dump waits, the more of its events may be pushed out of rings.
+	// Rings are read while written: a reader drops the slots a writer may be overwriting (see Ring), so a dump may
+	// miss events pushed out by newer ones, but never shows torn ones.
+	//
+	// 'events_per_thread' 0 disables the recorder: ids are 0 and nothing is recorded.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API FlightRecorder
+	{
+		DECLARE_NONCOPYABLE(FlightRecorder);
+		
+		struct Ring;
+	
+	public:
+		using Handler = std::function<void(uint64_t request, const std::string& timeline)>;
+	
+	public:
+		FlightRecorder(size_t events_per_thread, uint slow_ms);
+		~FlightRecorder();
+		
+		bool Enabled() const { return events_per_thread_ != 0; }
+		
+		void OnSlow(Handler handler);												// before first 'Dump'
+		
+		void Start();																// dumps are made by own thread
+		void Stop();																// makes queued dumps
+		
+		uint64_t NewRequest();
+		uint64_t Record(uint64_t request, FlightEvent event, uint64_t arg = 0);		// returns timestamp, ns
+		bool Finish(uint64_t request, uint64_t started_ns);							// true - slow, call 'Dump'
+		
+		void Dump(uint64_t request, const std::string& what);
+		std::string Timeline(uint64_t request) const;
+		size_t Dumped() const { return dumped_; }
+		size_t Skipped() const { return skipped_; }
+	
+	private:
+		static uint64_t now_ns();
+		Ring& ring();
+		
+		void dump_queued();
+		void dump(uint64_t request, const std::string& what);
+	
+	private:
+		const size_t events_per_thread_;
+		const uint64_t slow_ns_;
+		
+		Handler on_slow_;
+		std::atomic<size_t> dumped_;
+		std::atomic<size_t> skipped_;
+		
+		ThreadSlots<Ring> rings_;
+		
+		enum { max_queued_dumps_ = 64 };
+		std::deque<std::pair<uint64_t, std::string>> queued_;						// request & what
+		ptl::mutex queued_mx_;
+		
+		WorkerThread dumper_;
+	};
+}
@@ -0,0 +1,49 @@
+﻿#pragma once
+
+#include "webserver/stdhdr.h"
+
+#include <cstring>
+
+
+
+namespace net
+{
+	// Appends 's' as JSON string: quotes, backslashes and control characters are escaped, other bytes (UTF-8 as well)
+	// are copied as is
+	inline void AppendJsonString(std::string& out, const char* s, size_t size)
+	{
+		static const char hex[] = "0123456789abcdef";
+		
+		out += '"';
+		for (size_t i = 0; i < size; ++i)
+		{
+			auto c = static_cast<unsigned char>(s[i]);
+			if (c == '"' || c == '\\')
+			{
+				out += '\\';
+				out += s[i];
+			}
+			else if (c < 0x20)
+			{
+				out += "\\u00";
+				out += hex[c >> 4];
+				out += hex[c & 0xf];
+			}
+			else
+			{
+				out += s[i];
+			}
+		}
+		out += '"';
+	}
+	
+	inline void AppendJsonString(std::string& out, const std::string& s)
+	{
+		AppendJsonString(out, s.data(), s.size());
+	}
+	
+	inline void AppendJsonString(std::string& out, const char* s)
+	{
+		AppendJsonString(out, s, std::strlen(s));
+	}
+}
@@ -0,0 +1,152 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/ktls.h"
+#include "openssl/ssl.h"
+#include "openssl/evp.h"
+#include "openssl/kdf.h"
+
+#if defined(__linux__)
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <sys/socket.h>
+#endif
+
+#if defined(__linux__) && !defined(TCP_ULP)
+#define TCP_ULP 31
+#endif
+
+#if defined(__linux__) && !defined(SOL_TLS)
+#define SOL_TLS 282
+#endif
+
+
+
+namespace net
+{
+#if defined(__linux__) && defined(TLS_TX) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+	namespace
+	{
+		// TLS 1.2 key block (RFC 5246, 6.3) for AEAD ciphers has no MAC keys:
+		// client_write_key | server_write_key | client_write_IV (4B) | server_write_IV (4B)
+		bool derive_key_block(SSL* ssl, const EVP_MD* md, unsigned char* out, size_t out_len)
+		{
+			unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+			unsigned char client_random[SSL3_RANDOM_SIZE];
+			unsigned char server_random[SSL3_RANDOM_SIZE];
+			
+			size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+			if (master_len == 0 ||
+			    SSL_get_client_random(ssl, client_random, sizeof(client_random)) != sizeof(client_random) ||
+			    SSL_get_server_random(ssl, server_random, sizeof(server_random)) != sizeof(server_random))
+				return false;
+			
+			std::unique_ptr<EVP_PKEY_CTX, void(*)(EVP_PKEY_CTX*)> pctx(EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr),
+			                                                            EVP_PKEY_CTX_free);
+			static const unsigned char label[] = "key expansion";
+			
+			bool ok = pctx &&
+			          EVP_PKEY_derive_init(pctx.get()) > 0 &&
+			          EVP_PKEY_CTX_set_tls1_prf_md(pctx.get(), md) > 0 &&
+			          EVP_PKEY_CTX_set1_tls1_prf_secret(pctx.get(), master, static_cast<int>(master_len)) > 0 &&
+			          EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), label, sizeof(label) - 1) > 0 &&
+			          EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), server_random, sizeof(server_random)) > 0 &&
+			          EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), client_random, sizeof(client_random)) > 0 &&
+			          EVP_PKEY_derive(pctx.get(), out, &out_len) > 0;
+			
+			OPENSSL_cleanse(master, sizeof(master));
+			
+			return ok;
+		}
+		
+		template<typename TCryptoInfo>
+		bool install_tx(int fd, uint16_t cipher_type, const unsigned char* key, const unsigned char* salt)
+		{
+			// Server's only record encrypted by OpenSSL under new keys is its Finished message (sequence number 0),
+			// NewSessionTicket goes before ChangeCipherSpec. So first application record has sequence number 1.
+			// Explicit nonce of GCM record is taken equal to its sequence number, as OpenSSL does.
+			unsigned char seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+			
+			TCryptoInfo ci;
+			std::memset(&ci, 0, sizeof(ci));
+			ci.info.version = TLS_1_2_VERSION;
+			ci.info.cipher_type = cipher_type;
+			std::memcpy(ci.key, key, sizeof(ci.key));
+			std::memcpy(ci.salt, salt, sizeof(ci.salt));
+			std::memcpy(ci.iv, seq, sizeof(ci.iv));
+			std::memcpy(ci.rec_seq, seq, sizeof(ci.rec_seq));
+			
+			bool ok = (setsockopt(fd, SOL_TLS, TLS_TX, &ci, sizeof(ci)) == 0);
+			
+			OPENSSL_cleanse(&ci, sizeof(ci));
+			
+			return ok;
+		}
+	}
+	
+	bool ktls_enable_tx(SSLSocket& sock)
+	{
+		SSL* ssl = sock.native_handle();
+		
+		if (SSL_version(ssl) != TLS1_2_VERSION)
+			return false;
+		
+		const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+		if (!cipher)
+			return false;
+		
+		int cipher_nid = SSL_CIPHER_get_cipher_nid(cipher);
+		size_t key_len;
+		
+		if (cipher_nid == NID_aes_128_gcm)
+			key_len = 16;
+		else if (cipher_nid == NID_aes_256_gcm)
+			key_len = 32;
+		else
+			return false;															/// only AES-GCM suites of setup_ssl
+		
+		const size_t salt_len = 4;
+		unsigned char key_block[2 * 32 + 2 * 4];
+		
+		if (!derive_key_block(ssl, SSL_CIPHER_get_handshake_digest(cipher), key_block, 2 * key_len + 2 * salt_len))
+		{
+			IFLOG(P5, "INFO: kTLS - TLS key block derivation failed. Falling back to OpenSSL write path.");
+			return false;
+		}
+		
+		const unsigned char* server_key = key_block + key_len;
+		const unsigned char* server_salt = key_block + 2 * key_len + salt_len;
+		
+		int fd = sock.lowest_layer().native_handle();
+		bool ok = false;
+		
+		if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0)
+		{
+			ok = (key_len == 16)
+				? install_tx<tls12_crypto_info_aes_gcm_128>(fd, TLS_CIPHER_AES_GCM_128, server_key, server_salt)
+				: install_tx<tls12_crypto_info_aes_gcm_256>(fd, TLS_CIPHER_AES_GCM_256, server_key, server_salt);
+		}
+		
+		OPENSSL_cleanse(key_block, sizeof(key_block));
+		
+		if (ok)
+		{
+			// OpenSSL still writes records of its own (alert on a broken read, for one) into the BIO pair, which asio
+			// flushes to the socket. Encrypted with its stale write state, they'd break the kernel's record stream, so
+			// they're discarded: peer sees the connection closed without alert. Reads keep the pair: SSL holds a
+			// reference to it per direction, 'SSL_set0_wbio' releases the write one.
+			SSL_set0_wbio(ssl, BIO_new(BIO_s_null()));
+		}
+		else
+		{
+			IFLOG(P5, "INFO: kTLS - kernel refused TLS offload (no 'tls' module?). Falling back to OpenSSL write path.", errno);
+		}
+		
+		return ok;
+	}
+#else
+	bool ktls_enable_tx(SSLSocket&)
+	{
+		return false;																/// no kTLS on this platform
+	}
+#endif
+}
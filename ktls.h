@@ -0,0 +1,51 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+#include "webserver/mem_socket.h"
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// Kernel TLS (kTLS) offload of the transmit direction for HTTPS & WSS connections. Opt-in, Linux only.
+	//
+	// Function 'ktls_enable_tx' is called once, right after successful TLS handshake. It derives TLS 1.2 AES-GCM write
+	// key of the server from OpenSSL session, installs "tls" upper layer protocol on the TCP socket and passes the key
+	// to the kernel. Since then every plaintext byte written into underlying TCPSocket is framed and encrypted by the
+	// kernel, so that write path of SSLSocket is treated like TCPSocket one (no user-space encryption, no extra copy).
+	// Reads are still decrypted by OpenSSL inside boost::asio::ssl::stream. OpenSSL can't write anymore: records it
+	// would send by itself (alerts on read errors) are discarded, renegotiation is off (see WebServer::setup_ssl), and
+	// connection is closed without close_notify, as before.
+	//
+	// Whether the socket is offloaded is kept per connection in Connection::ktls_tx.
+	//
+	// Function returns false and leaves socket untouched, if platform is not Linux, kernel lacks 'tls' module, cipher is
+	// not AES-GCM or OpenSSL is older than 1.1.1. Caller then falls back to usual user-space encryption.
+	//
+	// Functions 'async_write_layer' choose the layer of socket which actual write goes through.
+	//------------------------------------------------------------------------------------------------------------------
+	bool ktls_enable_tx(SSLSocket& sock);
+	
+	template<typename TBuffers, typename THandler>
+	void async_write_layer(TCPSocket& sock, bool /* ktls_tx */, const TBuffers& buffers, THandler handler)
+	{
+		async_write(sock, buffers, std::move(handler));
+	}
+	
+	template<typename TBuffers, typename THandler>
+	void async_write_layer(MemSocket& sock, bool /* ktls_tx */, const TBuffers& buffers, THandler handler)
+	{
+		async_write(sock, buffers, std::move(handler));
+	}
+	
+	template<typename TBuffers, typename THandler>
+	void async_write_layer(SSLSocket& sock, bool ktls_tx, const TBuffers& buffers, THandler handler)
+	{
+		if (ktls_tx)
+			async_write(sock.next_layer(), buffers, std::move(handler));	// kernel encrypts
+		else
+			async_write(sock, buffers, std::move(handler));					// OpenSSL encrypts
+	}
+}
@@ -0,0 +1,298 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/mem_socket.h"
+
+
+
+namespace net
+{
+	namespace
+	{
+		using MemChannel = MemSocket::MemChannel;
+		
+		// Copies from 'ch.data' into 'buffers', at most 'limit' bytes (0 - no limit); 'ch.mx' is held by caller
+		size_t take(MemChannel& ch, const std::vector<boost::asio::mutable_buffer>& buffers, size_t limit)
+		{
+			size_t n = 0;
+			
+			for (auto& b : buffers)
+			{
+				size_t avail = ch.data.size() - ch.head;
+				size_t room = boost::asio::buffer_size(b);
+				
+				if (limit)
+					room = std::min(room, limit - n);
+				
+				size_t k = std::min(avail, room);
+				std::memcpy(boost::asio::buffer_cast<char*>(b), ch.data.data() + ch.head, k);
+				ch.head += k;
+				n += k;
+				
+				if (k < boost::asio::buffer_size(b) || (limit && n == limit))
+					break;
+			}
+			
+			if (ch.head == ch.data.size())											/// all read - reuse storage
+			{
+				ch.data.clear();
+				ch.head = 0;
+			}
+			
+			return n;
+		}
+		
+		// Completes pending asynchronous read of 'ch' if there is something to read (or eof) and no delay is due
+		void complete_read(const std::shared_ptr<MemChannel>& ch)
+		{
+			MemSocket::ReadHandler handler;
+			error_code ec;
+			size_t n = 0;
+			
+			{
+				boost::lock_guard<ptl::mutex> lck(ch->mx);
+				
+				if (!ch->read_handler || ch->read_delayed)
+					return;
+				
+				size_t requested = boost::asio::buffer_size(ch->read_buffers);
+				
+				if (requested != 0)
+				{
+					if (ch->head != ch->data.size())
+						n = take(*ch, ch->read_buffers, ch->read_limit);
+					else if (ch->eof)
+						ec = boost::asio::error::eof;
+					else
+						return;															/// wait for writer
+				}
+				
+				handler.swap(ch->read_handler);
+				ch->read_buffers.clear();
+			}
+			
+			ch->service.post([handler, ec, n]() { handler(ec, n); });
+		}
+	}
+	
+	MemSocket::MemSocket(IOService& service)
+		: service_(service), in_(std::make_shared<MemChannel>(service)), open_(true)
+	{}
+	
+	MemSocket::~MemSocket()
+	{
+		error_code ec;
+		close(ec);
+	}
+	
+	void MemSocket::Connect(MemSocket& a, MemSocket& b)
+	{
+		a.out_ = b.in_;
+		b.out_ = a.in_;
+	}
+	
+	void MemSocket::SetScript(MemScript script)
+	{
+		boost::lock_guard<ptl::mutex> lck(in_->mx);
+		
+		in_->script = std::move(script);
+		in_->reads = 0;
+	}
+	
+	NetEndpoint MemSocket::remote_endpoint() const
+	{
+		return NetEndpoint(boost::asio::ip::address_v4::loopback(), 0);
+	}
+	
+	NetEndpoint MemSocket::remote_endpoint(error_code& ec) const
+	{
+		ec = open_ ? error_code() : error_code(boost::asio::error::not_connected);
+		
+		return remote_endpoint();
+	}
+	
+	bool MemSocket::is_open() const
+	{
+		return open_;
+	}
+	
+	void MemSocket::cancel(error_code& ec)
+	{
+		ec = error_code();
+		
+		ReadHandler handler;
+		{
+			boost::lock_guard<ptl::mutex> lck(in_->mx);
+			
+			handler.swap(in_->read_handler);
+			in_->read_buffers.clear();
+			
+			if (in_->read_delayed)
+			{
+				error_code ignored;
+				in_->timer.cancel(ignored);
+				in_->read_delayed = false;
+			}
+		}
+		
+		if (handler)
+			service_.post([handler]() { handler(boost::asio::error::operation_aborted, 0); });
+	}
+	
+	void MemSocket::shutdown(shutdown_type what, error_code& ec)
+	{
+		ec = error_code();
+		
+		if (what != shutdown_send)													/// peer's writes fail
+		{
+			boost::lock_guard<ptl::mutex> lck(in_->mx);
+			in_->reader_closed = true;
+		}
+		
+		if (what != shutdown_receive && out_)										/// peer reads eof
+		{
+			{
+				boost::lock_guard<ptl::mutex> lck(out_->mx);
+				out_->eof = true;
+			}
+			
+			out_->readable.notify_all();
+			complete_read(out_);
+		}
+	}
+	
+	void MemSocket::close(error_code& ec)
+	{
+		if (!open_.exchange(false))
+		{
+			ec = error_code();
+			return;
+		}
+		
+		cancel(ec);
+		shutdown(shutdown_both, ec);
+		
+		in_->readable.notify_all();													/// synchronous read fails
+	}
+	
+	void MemSocket::start_read(std::vector<boost::asio::mutable_buffer> buffers, ReadHandler handler)
+	{
+		uint delay_us = 0;
+		
+		{
+			boost::lock_guard<ptl::mutex> lck(in_->mx);
+			
+			auto& script = in_->script;
+			size_t i = in_->reads++;
+			
+			in_->read_buffers = std::move(buffers);
+			in_->read_handler = std::move(handler);
+			in_->read_limit = script.read_sizes.empty() ? 0 : script.read_sizes[i % script.read_sizes.size()];
+			
+			if (!open_)
+			{
+				auto h = std::move(in_->read_handler);
+				in_->read_handler = nullptr;
+				service_.post([h]() { h(boost::asio::error::bad_descriptor, 0); });
+				return;
+			}
+			
+			if (!script.read_delays_us.empty())
+				delay_us = script.read_delays_us[i % script.read_delays_us.size()];
+			
+			if (delay_us)
+			{
+				std::weak_ptr<MemChannel> wch = in_;
+				
+				in_->read_delayed = true;
+				in_->timer.expires_from_now(boost::posix_time::microseconds(delay_us));
+				in_->timer.async_wait([wch](const error_code& ec)
+				{
+					auto ch = wch.lock();
+					if (ec || !ch)
+						return;
+					
+					{
+						boost::lock_guard<ptl::mutex> lck(ch->mx);
+						ch->read_delayed = false;
+					}
+					
+					complete_read(ch);
+				});
+			}
+		}
+		
+		complete_read(in_);
+	}
+	
+	size_t MemSocket::read(std::vector<boost::asio::mutable_buffer> buffers, error_code& ec)
+	{
+		ec = error_code();
+		
+		if (boost::asio::buffer_size(buffers) == 0)
+			return 0;
+		
+		std::unique_lock<ptl::mutex> lck(in_->mx);
+		
+		auto& script = in_->script;
+		size_t i = in_->reads++;
+		size_t limit = script.read_sizes.empty() ? 0 : script.read_sizes[i % script.read_sizes.size()];
+		uint delay_us = script.read_delays_us.empty() ? 0 : script.read_delays_us[i % script.read_delays_us.size()];
+		
+		if (delay_us)
+		{
+			lck.unlock();
+			std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+			lck.lock();
+		}
+		
+		in_->readable.wait(lck, [this] { return in_->head != in_->data.size() || in_->eof || !open_; });
+		
+		if (!open_)
+		{
+			ec = boost::asio::error::bad_descriptor;
+			return 0;
+		}
+		
+		if (in_->head == in_->data.size())
+		{
+			ec = boost::asio::error::eof;
+			return 0;
+		}
+		
+		return take(*in_, buffers, limit);
+	}
+	
+	size_t MemSocket::write(std::vector<boost::asio::const_buffer> buffers, error_code& ec)
+	{
+		ec = error_code();
+		
+		if (!open_ || !out_)
+		{
+			ec = open_ ? boost::asio::error::not_connected : boost::asio::error::bad_descriptor;
+			return 0;
+		}
+		
+		size_t n = 0;
+		{
+			boost::lock_guard<ptl::mutex> lck(out_->mx);
+			
+			if (out_->reader_closed || out_->eof)
+			{
+				ec = boost::asio::error::broken_pipe;
+				return 0;
+			}
+			
+			for (auto& b : buffers)
+			{
+				size_t k = boost::asio::buffer_size(b);
+				out_->data.append(boost::asio::buffer_cast<const char*>(b), k);
+				n += k;
+			}
+		}
+		
+		out_->readable.notify_all();
+		complete_read(out_);
+		
+		return n;
+	}
+}
@@ -0,0 +1,164 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "templates/mutex.h"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/version.hpp>
+
+#include <condition_variable>
+
+
+
+namespace net
+{
+	// Script of reads from MemSocket: i-th read returns at most read_sizes[i] bytes and completes not earlier than
+	// read_delays_us[i] after it's issued; both lists are cycled, empty list or 0 - no limit / no delay
+	struct MemScript
+	{
+		std::vector<size_t> read_sizes;
+		std::vector<uint> read_delays_us;
+	};
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// MemSocket is an in-memory duplex stream, a third TSocket of Connection<TSocket> templates beside TCPSocket and
+	// SSLSocket. It satisfies boost::asio AsyncReadStream, AsyncWriteStream, SyncReadStream and SyncWriteStream, and
+	// has socket's 'lowest_layer', 'cancel', 'shutdown' and 'close', so HTTPConnection and WSConnection run over it
+	// unchanged (see WebServer::Accept). No syscalls are made, so the whole stack can be benchmarked and tested
+	// deterministically - with a single thread running io_service, the order of completions is fixed.
+	//
+	// Method 'Connect' links two sockets: bytes written to one are read from the other. Each direction is a MemChannel
+	// owned by the reading side; writes append to it and complete at once (buffer is unbounded), reads take what's
+	// there, limited by reader's MemScript (see 'SetScript'). So partial reads at every offset are easy to reproduce.
+	//
+	// Completion handlers are never called inline: they're posted to socket's io_service, as with real sockets.
+	// Synchronous 'read_some' and 'write_some' block the calling thread only; they're meant for a client on a thread
+	// of its own, talking to a server that runs on io_service.
+	//
+	// Closing or shutting down sending side gives peer's reads 'eof' after the remaining bytes; writing to a closed
+	// peer gives 'broken_pipe'. Method 'cancel' completes pending read with 'operation_aborted'.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API MemSocket
+	{
+		DECLARE_NONCOPYABLE(MemSocket);
+	
+	public:
+		using lowest_layer_type = MemSocket;
+		using ReadHandler = std::function<void(const error_code&, size_t)>;
+		
+		enum shutdown_type { shutdown_receive, shutdown_send, shutdown_both };
+	
+	public:
+		explicit MemSocket(IOService& service);
+		~MemSocket();
+		
+		static void Connect(MemSocket& a, MemSocket& b);
+		
+		void SetScript(MemScript script);										// before reads
+		
+		IOService& get_io_service() { return service_; }
+#if BOOST_VERSION >= 106600
+		using executor_type = IOService::executor_type;							// composed operations of newer boost
+		executor_type get_executor() { return service_.get_executor(); }
+#endif
+		MemSocket& lowest_layer() { return *this; }
+		
+		template<typename TOption>
+		void set_option(const TOption&) {}										// no Nagle here
+		
+		NetEndpoint remote_endpoint() const;
+		NetEndpoint remote_endpoint(error_code& ec) const;
+		
+		bool is_open() const;
+		void cancel(error_code& ec);
+		void shutdown(shutdown_type what, error_code& ec);
+		void close(error_code& ec);
+		
+		template<typename TBuffers, typename THandler>
+		void async_read_some(const TBuffers& buffers, THandler handler)
+		{
+			start_read(std::vector<boost::asio::mutable_buffer>(buffers.begin(), buffers.end()), std::move(handler));
+		}
+		
+		template<typename TBuffers, typename THandler>
+		void async_write_some(const TBuffers& buffers, THandler handler)
+		{
+			error_code ec;
+			size_t n = write(std::vector<boost::asio::const_buffer>(buffers.begin(), buffers.end()), ec);
+			
+			service_.post([handler, ec, n]() mutable { handler(ec, n); });
+		}
+		
+		template<typename TBuffers>
+		size_t read_some(const TBuffers& buffers, error_code& ec)
+		{
+			return read(std::vector<boost::asio::mutable_buffer>(buffers.begin(), buffers.end()), ec);
+		}
+		
+		template<typename TBuffers>
+		size_t read_some(const TBuffers& buffers)
+		{
+			error_code ec;
+			size_t n = read_some(buffers, ec);
+			if (ec)
+				throw system_error(ec);
+			
+			return n;
+		}
+		
+		template<typename TBuffers>
+		size_t write_some(const TBuffers& buffers, error_code& ec)
+		{
+			return write(std::vector<boost::asio::const_buffer>(buffers.begin(), buffers.end()), ec);
+		}
+		
+		template<typename TBuffers>
+		size_t write_some(const TBuffers& buffers)
+		{
+			error_code ec;
+			size_t n = write_some(buffers, ec);
+			if (ec)
+				throw system_error(ec);
+			
+			return n;
+		}
+	
+	public:
+		// One direction of the stream, owned by the reading side
+		struct MemChannel
+		{
+			explicit MemChannel(IOService& service) : service(service), timer(service) {}
+			
+			IOService& service;													// of the reader
+			ptl::mutex mx;
+			std::condition_variable_any readable;								// for synchronous reads
+			
+			std::string data;
+			size_t head = 0;													// first unread byte of 'data'
+			bool eof = false;													// writer is done
+			bool reader_closed = false;											// writes fail
+			
+			MemScript script;
+			size_t reads = 0;													// issued, index into 'script'
+			
+			std::vector<boost::asio::mutable_buffer> read_buffers;				// pending asynchronous read
+			ReadHandler read_handler;
+			size_t read_limit = 0;												// 0 - no limit
+			bool read_delayed = false;											// waits for 'timer'
+			boost::asio::deadline_timer timer;
+		};
+	
+	private:
+		void start_read(std::vector<boost::asio::mutable_buffer> buffers, ReadHandler handler);
+		size_t read(std::vector<boost::asio::mutable_buffer> buffers, error_code& ec);
+		size_t write(std::vector<boost::asio::const_buffer> buffers, error_code& ec);
+	
+	private:
+		IOService& service_;
+		std::shared_ptr<MemChannel> in_;										// peer writes here
+		std::shared_ptr<MemChannel> out_;										// peer's 'in_', nullptr - not connected
+		std::atomic<bool> open_;
+	};
+}
@@ -0,0 +1,248 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/metrics.h"
+
+#include <iomanip>
+#include <thread>
+
+
+
+namespace net
+{
+	namespace
+	{
+		const char* stage_names[] =
+		{
+			"tls_handshake", "http_read", "http_handle", "http_write", "http_request", "ws_queue", "ws_write", "io_stall"
+		};
+		
+		const char* counter_names[] =
+		{
+			"webserver_http_requests_total",
+			"webserver_http_bad_requests_total",
+			"webserver_http_timeouts_header_total",
+			"webserver_http_timeouts_body_total",
+			"webserver_http_timeouts_idle_total",
+			"webserver_ws_frames_out_total",
+			"webserver_ws_messages_in_total",
+			"webserver_io_stalls_total"
+		};
+		
+		const char* gauge_names[] =
+		{
+			"webserver_http_connections",
+			"webserver_ws_connections"
+		};
+		
+		static_assert(sizeof(stage_names) / sizeof(*stage_names) == static_cast<size_t>(MetricStage::count_), "names");
+		static_assert(sizeof(counter_names) / sizeof(*counter_names) == static_cast<size_t>(MetricCounter::count_), "names");
+		static_assert(sizeof(gauge_names) / sizeof(*gauge_names) == static_cast<size_t>(MetricGauge::count_), "names");
+		
+		const size_t prometheus_buckets = 25;										// le = 1 us ... 2^24 us (~16.8 s)
+	}
+	
+	Metrics::Metrics(bool enabled)
+		: enabled_(enabled),
+		  shards_count_(enabled ? std::max<size_t>(min_shards_, std::thread::hardware_concurrency()) : 1),
+		  shards_(new Shard[shards_count_]())
+	{
+	}
+	
+	void Metrics::Record(MetricStage stage, Clock::time_point started)
+	{
+		if (started == Clock::time_point())											/// disabled or not started
+			return;
+		
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count();
+		Record(stage, static_cast<uint64_t>(std::max<long long>(us, 0)));
+	}
+	
+	void Metrics::Record(MetricStage stage, uint64_t us)
+	{
+		if (!enabled_)
+			return;
+		
+		auto& s = shard();
+		auto i = static_cast<size_t>(stage);
+		
+		s.buckets[i][bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+		s.sum_us[i].fetch_add(us, std::memory_order_relaxed);
+	}
+	
+	void Metrics::Count(MetricCounter counter, uint64_t n)
+	{
+		if (enabled_)
+			shard().counters[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+	}
+	
+	void Metrics::Gauge(MetricGauge gauge, int64_t delta)
+	{
+		if (enabled_)
+			shard().gauges[static_cast<size_t>(gauge)].fetch_add(delta, std::memory_order_relaxed);
+	}
+	
+	uint64_t Metrics::Total(MetricStage stage) const
+	{
+		Buckets buckets;
+		uint64_t sum_us;
+		merge(stage, buckets, sum_us);
+		
+		uint64_t total = 0;
+		for (auto n : buckets)
+			total += n;
+		
+		return total;
+	}
+	
+	uint64_t Metrics::Quantile(MetricStage stage, double q) const
+	{
+		Buckets buckets;
+		uint64_t sum_us;
+		merge(stage, buckets, sum_us);
+		
+		uint64_t total = 0;
+		for (auto n : buckets)
+			total += n;
+		
+		if (total == 0)
+			return 0;
+		
+		auto rank = static_cast<uint64_t>(std::ceil(std::min(std::max(q, 0.0), 1.0) * total));
+		rank = std::max<uint64_t>(rank, 1);
+		
+		uint64_t seen = 0;
+		for (size_t b = 0; b < buckets.size(); ++b)
+		{
+			seen += buckets[b];
+			if (seen >= rank)
+				return bucket_ceil(b);
+		}
+		
+		return bucket_ceil(buckets.size() - 1);
+	}
+	
+	uint64_t Metrics::Value(MetricCounter counter) const
+	{
+		uint64_t value = 0;
+		for (size_t i = 0; i < shards_count_; ++i)
+			value += shards_[i].counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+		
+		return value;
+	}
+	
+	int64_t Metrics::Value(MetricGauge gauge) const
+	{
+		int64_t value = 0;
+		for (size_t i = 0; i < shards_count_; ++i)
+			value += shards_[i].gauges[static_cast<size_t>(gauge)].load(std::memory_order_relaxed);
+		
+		return value;
+	}
+	
+	void Metrics::Render(std::string& out) const
+	{
+		std::ostringstream ss;
+		ss << std::setprecision(9);
+		
+		ss << "# HELP webserver_stage_seconds Latency of HTTP and WS connection stages.\n";
+		ss << "# TYPE webserver_stage_seconds histogram\n";
+		
+		for (size_t stage = 0; stage < static_cast<size_t>(MetricStage::count_); ++stage)
+		{
+			Buckets buckets;
+			uint64_t sum_us;
+			merge(static_cast<MetricStage>(stage), buckets, sum_us);
+			
+			uint64_t cumulative = 0;
+			size_t b = 0;
+			
+			for (size_t k = 0; k < prometheus_buckets; ++k)							/// values below 2^k us
+			{
+				uint64_t bound = uint64_t(1) << k;
+				
+				for (; b < buckets.size() && bucket_ceil(b) < bound; ++b)
+					cumulative += buckets[b];
+				
+				ss << "webserver_stage_seconds_bucket{stage=\"" << stage_names[stage] << "\",le=\"" << bound / 1e6
+				   << "\"} " << cumulative << "\n";
+			}
+			
+			for (; b < buckets.size(); ++b)
+				cumulative += buckets[b];
+			
+			ss << "webserver_stage_seconds_bucket{stage=\"" << stage_names[stage] << "\",le=\"+Inf\"} " << cumulative << "\n";
+			ss << "webserver_stage_seconds_sum{stage=\"" << stage_names[stage] << "\"} " << sum_us / 1e6 << "\n";
+			ss << "webserver_stage_seconds_count{stage=\"" << stage_names[stage] << "\"} " << cumulative << "\n";
+		}
+		
+		for (size_t counter = 0; counter < static_cast<size_t>(MetricCounter::count_); ++counter)
+		{
+			ss << "# TYPE " << counter_names[counter] << " counter\n";
+			ss << counter_names[counter] << " " << Value(static_cast<MetricCounter>(counter)) << "\n";
+		}
+		
+		for (size_t gauge = 0; gauge < static_cast<size_t>(MetricGauge::count_); ++gauge)
+		{
+			ss << "# TYPE " << gauge_names[gauge] << " gauge\n";
+			ss << gauge_names[gauge] << " " << Value(static_cast<MetricGauge>(gauge)) << "\n";
+		}
+		
+		out = ss.str();
+	}
+	
+	size_t Metrics::bucket_of(uint64_t us)
+	{
+		if (us < sub_buckets_)
+			return static_cast<size_t>(us);
+		
+		size_t e = 0;																/// floor(log2(us)), >= 3
+		uint64_t v = us;
+		for (size_t shift = 32; shift != 0; shift >>= 1)
+		{
+			if (v >> shift)
+			{
+				v >>= shift;
+				e += shift;
+			}
+		}
+		
+		size_t sub = static_cast<size_t>(us >> (e - 3)) & (sub_buckets_ - 1);
+		
+		return std::min<size_t>(sub_buckets_ + (e - 3) * sub_buckets_ + sub, buckets_ - 1);
+	}
+	
+	uint64_t Metrics::bucket_ceil(size_t bucket)
+	{
+		if (bucket < sub_buckets_)
+			return bucket;
+		
+		size_t e = (bucket - sub_buckets_) / sub_buckets_ + 3;
+		size_t sub = (bucket - sub_buckets_) % sub_buckets_;
+		
+		return ((sub_buckets_ + sub + 1) << (e - 3)) - 1;
+	}
+	
+	void Metrics::merge(MetricStage stage, Buckets& buckets, uint64_t& sum_us) const
+	{
+		auto i = static_cast<size_t>(stage);
+		
+		buckets.fill(0);
+		sum_us = 0;
+		
+		for (size_t s = 0; s < shards_count_; ++s)
+		{
+			for (size_t b = 0; b < buckets_; ++b)
+				buckets[b] += shards_[s].buckets[i][b].load(std::memory_order_relaxed);
+			
+			sum_us += shards_[s].sum_us[i].load(std::memory_order_relaxed);
+		}
+	}
+	
+	Metrics::Shard& Metrics::shard()
+	{
+		static std::atomic<size_t> next_thread(0);
+		static thread_local size_t index = next_thread++;
+		
+		return shards_[index % shards_count_];
+	}
+}
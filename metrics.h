@@ -0,0 +1,117 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include <chrono>
+
+
+
+namespace net
+{
+	// Stages timed by Metrics; each one gets its own latency histogram
+	enum class MetricStage
+	{
+		tls_handshake,		// HTTPS connection start - TLS handshake done
+		http_read,			// first byte of request - request parsed
+		http_handle,		// HTTPRequestHandler::HandleRequest
+		http_write,			// response write started - completed
+		http_request,		// first byte of request - response written
+		ws_queue,			// WS frame queued - taken into a batch by writer
+		ws_write,			// WS batch write started - completed
+		io_stall,			// handler that stalled I/O thread (see Watchdog) entered - returned
+		count_
+	};
+	
+	enum class MetricCounter
+	{
+		http_requests,
+		http_bad_requests,
+		http_timeouts_header,
+		http_timeouts_body,
+		http_timeouts_idle,
+		ws_frames_out,
+		ws_messages_in,
+		io_stalls,
+		count_
+	};
+	
+	enum class MetricGauge
+	{
+		http_connections,
+		ws_connections,
+		count_
+	};
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// Metrics is a low-overhead instrumentation surface of WebServer: latency histograms of connection stages
+	// (MetricStage), event counters (MetricCounter) and gauges of open connections (MetricGauge). WebServer serves
+	// them in Prometheus text format at WebServerParams::metrics_path (see 'Render'). Both are off by default. The path
+	// is served without authentication on WebServer's own ports and takes precedence over application's route with
+	// the same path, so it should be set only where those ports are not public.
+	//
+	// Each thread is bound to one of 'shards_count_' shards by its sequence number (a thread_local index), updates
+	// there are relaxed atomic increments. There are as many shards as hardware threads (at least 16), so I/O threads
+	// of a pool sized by hardware don't share cache lines and pay an uncontended add per update; threads beyond that
+	// number share shards round robin and contend on them. Readers merge shards on read; a snapshot is not atomic as a
+	// whole, which is fine for monitoring. Disabled metrics keep a single shard.
+	//
+	// Histograms are HDR-style log-linear over whole microseconds: values below 8 us have a bucket each, every next
+	// power of two is split into 8 buckets, so relative error is below 12.5% from 1 us up to ~12 days. Method
+	// 'Render' exports them with Prometheus buckets at powers of two microseconds; method 'Quantile' reads them
+	// at full precision.
+	//
+	// Method 'Now' returns zero time point if metrics are disabled (WebServerParams::metrics), and 'Record' ignores
+	// zero starts, so disabled metrics cost a branch per stage and no clock reads.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API Metrics
+	{
+		DECLARE_NONCOPYABLE(Metrics);
+	
+	public:
+		using Clock = std::chrono::steady_clock;
+	
+	public:
+		explicit Metrics(bool enabled = true);
+		
+		bool Enabled() const { return enabled_; }
+		Clock::time_point Now() const { return enabled_ ? Clock::now() : Clock::time_point(); }
+		
+		void Record(MetricStage stage, Clock::time_point started);				// from 'started' till now
+		void Record(MetricStage stage, uint64_t us);
+		void Count(MetricCounter counter, uint64_t n = 1);
+		void Gauge(MetricGauge gauge, int64_t delta);
+		
+		uint64_t Total(MetricStage stage) const;								// number of values recorded
+		uint64_t Quantile(MetricStage stage, double q) const;					// upper bound of bucket, us
+		uint64_t Value(MetricCounter counter) const;
+		int64_t Value(MetricGauge gauge) const;
+		
+		void Render(std::string& out) const;									// Prometheus text format 0.0.4
+	
+	private:
+		enum { sub_buckets_ = 8, buckets_ = 8 + 8 * 40, min_shards_ = 16 };
+		
+		static size_t bucket_of(uint64_t us);
+		static uint64_t bucket_ceil(size_t bucket);								// max value of bucket, us
+		
+		using Buckets = std::array<uint64_t, buckets_>;
+		void merge(MetricStage stage, Buckets& buckets, uint64_t& sum_us) const;
+		
+		struct Shard
+		{
+			std::array<std::array<std::atomic<uint64_t>, buckets_>, static_cast<size_t>(MetricStage::count_)> buckets;
+			std::array<std::atomic<uint64_t>, static_cast<size_t>(MetricStage::count_)> sum_us;
+			std::array<std::atomic<uint64_t>, static_cast<size_t>(MetricCounter::count_)> counters;
+			std::array<std::atomic<int64_t>, static_cast<size_t>(MetricGauge::count_)> gauges;
+			char pad[64];														// shards don't share cache lines
+		};
+		
+		Shard& shard();
+	
+	private:
+		bool enabled_;
+		const size_t shards_count_;
+		std::unique_ptr<Shard[]> shards_;
+	};
+}
@@ -0,0 +1,83 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/access_log.h"
+
+#include <fstream>
+
+using namespace net;
+
+
+// Records of several threads end up as JSON lines; overload sheds records and says how many.
+void access_log_records()
+{
+	std::cout << "+++++++++++++ Testing access log records ++++++++++++++++++++++++++++++" << std::endl;
+	
+	uint64_t written = 0;
+	auto path = (fs::temp_directory_path() / fs::unique_path("access-%%%%%%.log")).string();
+	
+	AccessRecord record;
+	record.time_ms = 1700000000123;
+	record.status = 200;
+	record.port = 54321;
+	record.bytes_in = 80;
+	record.bytes_out = 1024;
+	record.duration_us = 350;
+	record.SetAddress(boost::asio::ip::address::from_string("10.1.2.3"));
+	record.SetMethod("GET");
+	record.SetPath("/a\"b");
+	
+	std::string expected;
+	AccessLog::Format(record, expected);
+	PA_ASSERT(expected == "{\"time\":\"2023-11-14T22:13:20.123Z\",\"ip\":\"10.1.2.3\",\"port\":54321,\"tls\":false,"
+	                      "\"method\":\"GET\",\"path\":\"/a\\\"b\",\"status\":200,\"bytes_in\":80,\"bytes_out\":1024,"
+	                      "\"duration_us\":350,\"handler_us\":0}\n");
+	
+	{
+		AccessLog log(path, 1024, 5);
+		log.Start();
+		
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t)
+			threads.emplace_back([&] { for (int i = 0; i < 500; ++i) log.Log(record); });
+		for (auto& t : threads)
+			t.join();
+		
+		log.Stop();
+		PA_ASSERT(log.Written() + log.Dropped() + log.SampledOut() == 2000);
+		written = log.Written();
+	}
+	
+	{
+		AccessLog log(path, 8, 60000);												/// writer sleeps - rings overflow
+		log.Start();
+		
+		for (int i = 0; i < 100; ++i)
+			log.Log(record);
+		
+		PA_ASSERT(log.Dropped() > 0 && log.SampledOut() > 0);
+		PA_ASSERT(log.Dropped() + log.SampledOut() == 100 - 8);
+		
+		log.Stop();
+		PA_ASSERT(log.Written() == 8);
+	}
+	
+	std::ifstream in(path);
+	std::string line;
+	uint64_t records = 0, shed = 0;
+	while (std::getline(in, line))
+	{
+		if (line.find("{\"dropped\":") == 0)
+			++shed;
+		else if (line + "\n" == expected)
+			++records;
+	}
+	
+	PA_ASSERT(shed >= 1 && records == written + 8);
+	
+	fs::remove(path);
+	
+	std::cout << "------------- Finished testing access log records ---------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/access_log_records", access_log_records);
@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include "webserver/stdhdr.h"
+#include "webserver/tests/bench_env.h"
+#include "webserver/mem_socket.h"
+#include "webserver/webserver.h"
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// Helpers shared by benchmarks (tests named "webserver/bench/...") and tests running WebServer in-process, on top
+	// of environment ones of bench_env.h.
+	//------------------------------------------------------------------------------------------------------------------
+	namespace tests
+	{
+		// Self-signed RSA certificate for TLS clients, written where WebServer looks for it
+		inline bool make_certificate(const fs::path& crt, const fs::path& key)
+		{
+			std::unique_ptr<EVP_PKEY, void(*)(EVP_PKEY*)> pkey(EVP_PKEY_new(), EVP_PKEY_free);
+			std::unique_ptr<BIGNUM, void(*)(BIGNUM*)> e(BN_new(), BN_free);
+			RSA* rsa = RSA_new();
+			
+			BN_set_word(e.get(), RSA_F4);
+			if (!RSA_generate_key_ex(rsa, 2048, e.get(), nullptr) || !EVP_PKEY_assign_RSA(pkey.get(), rsa))
+			{
+				RSA_free(rsa);
+				return false;
+			}
+			
+			std::unique_ptr<X509, void(*)(X509*)> x509(X509_new(), X509_free);
+			ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), 1);
+			X509_gmtime_adj(X509_get_notBefore(x509.get()), 0);
+			X509_gmtime_adj(X509_get_notAfter(x509.get()), 86400);
+			X509_set_pubkey(x509.get(), pkey.get());
+			
+			X509_NAME* name = X509_get_subject_name(x509.get());
+			X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+			X509_set_issuer_name(x509.get(), name);
+			
+			if (!X509_sign(x509.get(), pkey.get(), EVP_sha256()))
+				return false;
+			
+			std::unique_ptr<BIO, int(*)(BIO*)> crt_bio(BIO_new_file(crt.string().c_str(), "w"), BIO_free);
+			std::unique_ptr<BIO, int(*)(BIO*)> key_bio(BIO_new_file(key.string().c_str(), "w"), BIO_free);
+			
+			return crt_bio && key_bio && PEM_write_bio_X509(crt_bio.get(), x509.get()) &&
+			       PEM_write_bio_PrivateKey(key_bio.get(), pkey.get(), nullptr, nullptr, 0, nullptr, nullptr);
+		}
+		
+		// Accepts new in-memory client on 'server' and passes WS handshake for 'path'; client end runs on
+		// 'client_service', nullptr is returned unless server answers 101
+		inline std::shared_ptr<MemSocket> ws_connect(WebServer& server, IOService& server_service,
+		                                             IOService& client_service, const std::string& path)
+		{
+			auto server_end = std::make_shared<MemSocket>(server_service);
+			auto client = std::make_shared<MemSocket>(client_service);
+			MemSocket::Connect(*server_end, *client);
+			
+			server.Accept(server_end);
+			
+			boost::asio::write(*client, boost::asio::buffer("GET " + path + " HTTP/1.1\r\n"
+				"Host: 127.0.0.1\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+				"Sec-WebSocket-Version: 13\r\n\r\n"));
+			
+			boost::asio::streambuf buf;
+			boost::asio::read_until(*client, buf, "\r\n\r\n");
+			
+			bool upgraded = buf.size() > 12 && std::string(boost::asio::buffers_begin(buf.data()),
+				boost::asio::buffers_begin(buf.data()) + 12) == "HTTP/1.1 101";
+			
+			return upgraded ? client : nullptr;
+		}
+	}
+}
@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// Environment of benchmarks, free of webserver module, so that standalone bench programs (see micro_bench.cpp)
+	// can use it too.
+	//
+	// Benchmarks take seconds each and load the whole machine, so normal test run skips them: each starts with
+	// 'bench_enabled', which is true only if WEBSERVER_RUN_BENCH is set (and is not "0").
+	//------------------------------------------------------------------------------------------------------------------
+	namespace tests
+	{
+		// Value of environment variable, 'fallback' if it's unset or empty
+		inline std::string env(const char* name, const std::string& fallback)
+		{
+			const char* value = std::getenv(name);
+			return value && *value ? value : fallback;
+		}
+		
+		inline bool bench_enabled(const char* bench)
+		{
+			if (env("WEBSERVER_RUN_BENCH", "0") != "0")
+				return true;
+			
+			std::cout << "~~~~~~~~~~~~~ Skipping " << bench << ", set WEBSERVER_RUN_BENCH=1 to run" << std::endl;
+			return false;
+		}
+	}
+}
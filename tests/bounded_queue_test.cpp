@@ -0,0 +1,223 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/bounded_queue.h"
+
+using namespace net;
+
+
+// Capacity is rounded up, full and empty are reported, FIFO order survives many laps around the ring.
+void bounded_queue_single_thread()
+{
+	std::cout << "+++++++++++++ Testing bounded queue single thread ++++++++++++++++++++" << std::endl;
+	
+	BoundedQueue<std::string> q(5);
+	PA_ASSERT(q.Capacity() == 8);
+	
+	std::string v;
+	PA_ASSERT(!q.Ready() && !q.TryPop(v));
+	
+	for (size_t lap = 0; lap < 100; ++lap)
+	{
+		for (size_t i = 0; i < q.Capacity(); ++i)
+			PA_ASSERT(q.TryPush(std::to_string(lap * 100 + i)));
+		
+		PA_ASSERT(!q.TryPush(std::string("overflow")));
+		PA_ASSERT(q.Size() == q.Capacity() && q.Ready());
+		
+		for (size_t i = 0; i < q.Capacity(); ++i)
+		{
+			PA_ASSERT(q.TryPop(v));
+			PA_ASSERT(v == std::to_string(lap * 100 + i));
+		}
+		
+		PA_ASSERT(!q.TryPop(v) && !q.Ready() && q.Size() == 0);
+		
+		PA_ASSERT(q.TryPush(std::string("half")));									/// shift head and tail off
+		PA_ASSERT(q.TryPop(v) && v == "half");										/// cell boundaries
+	}
+	
+	std::cout << "------------- Finished testing bounded queue single thread -----------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/bounded_queue_single_thread", bounded_queue_single_thread);
+
+
+
+// Several producers and consumers over a small ring, so it's full and empty all the time: every item is popped
+// exactly once, and items of one producer reach each consumer in the order they were pushed.
+void bounded_queue_mpmc_stress()
+{
+	std::cout << "+++++++++++++ Testing bounded queue MPMC stress ++++++++++++++++++++++" << std::endl;
+	
+	const size_t producers = 4;
+	const size_t consumers = 4;
+	const uint64_t items = 200000;													// per producer
+	
+	BoundedQueue<uint64_t> q(8);
+	
+	std::atomic<size_t> producing(producers);
+	std::atomic<uint64_t> full(0), empty(0);
+	std::vector<std::vector<uint64_t>> popped(consumers);
+	
+	std::vector<std::thread> pool;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		pool.emplace_back([&, p]()
+		{
+			for (uint64_t i = 0; i < items; ++i)
+			{
+				while (!q.TryPush((static_cast<uint64_t>(p) << 32) | i))
+				{
+					++full;
+					std::this_thread::yield();
+				}
+			}
+			
+			--producing;
+		});
+	}
+	
+	for (size_t c = 0; c < consumers; ++c)
+	{
+		pool.emplace_back([&, c]()
+		{
+			uint64_t v;
+			for (;;)
+			{
+				if (q.TryPop(v))
+				{
+					popped[c].push_back(v);
+					continue;
+				}
+				
+				++empty;
+				if (producing == 0 && !q.Ready())										/// pushes are all done
+					break;
+				
+				std::this_thread::yield();
+			}
+		});
+	}
+	
+	for (auto& t : pool)
+		t.join();
+	
+	std::vector<uint64_t> seen(producers, 0);										// count per producer
+	std::vector<std::vector<bool>> got(producers, std::vector<bool>(items, false));
+	
+	for (auto& list : popped)
+	{
+		std::vector<int64_t> last(producers, -1);
+		
+		for (uint64_t v : list)
+		{
+			size_t p = static_cast<size_t>(v >> 32);
+			uint64_t i = v & 0xffffffff;
+			
+			PA_ASSERT(p < producers && i < items);
+			PA_ASSERT(!got[p][i]);														/// no duplicates
+			PA_ASSERT(static_cast<int64_t>(i) > last[p]);								/// per-producer order
+			
+			got[p][i] = true;
+			last[p] = static_cast<int64_t>(i);
+			++seen[p];
+		}
+	}
+	
+	for (size_t p = 0; p < producers; ++p)
+		PA_ASSERT(seen[p] == items);													/// nothing lost
+	
+	PA_ASSERT(q.Size() == 0 && !q.Ready());
+	
+	std::cout << "full spins: " << full << ", empty spins: " << empty << std::endl;
+	std::cout << "------------- Finished testing bounded queue MPMC stress -------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/bounded_queue_mpmc_stress", bounded_queue_mpmc_stress);
+
+
+
+// Handoff of WSConnection's writer: producer pushes and schedules writer unless 'writing' is raised; writer drains,
+// lowers 'writing', then re-checks 'Ready' and takes the flag back if a push slipped in between. Producers push
+// one item at a time and wait for it to be written, so an item stranded by a lost wakeup hangs the round instead
+// of being picked up by a later push.
+void bounded_queue_writer_handoff()
+{
+	std::cout << "+++++++++++++ Testing bounded queue writer handoff +++++++++++++++++++" << std::endl;
+	
+	const size_t producers = 3;
+	const uint64_t rounds = 20000;													// per producer
+	
+	IOService strand_service;														// single thread - strand
+	std::unique_ptr<IOService::work> work(new IOService::work(strand_service));
+	std::thread writer_thread([&strand_service] { strand_service.run(); });
+	
+	BoundedQueue<uint64_t> q(4);
+	std::atomic<bool> writing(false);
+	std::atomic<uint64_t> written(0), rechecks(0);
+	
+	std::function<void()> drain = [&]()												/// WSConnection::do_write
+	{
+		for (;;)
+		{
+			uint64_t v;
+			while (q.TryPop(v))
+				++written;
+			
+			std::this_thread::yield();													/// widen the window for a push
+			writing = false;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			
+			if (!q.Ready() || writing.exchange(true))
+				return;
+			
+			++rechecks;
+		}
+	};
+	
+	std::atomic<uint64_t> pushed(0), stuck(0);
+	
+	std::vector<std::thread> pool;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		pool.emplace_back([&]()
+		{
+			for (uint64_t i = 0; i < rounds; ++i)
+			{
+				while (!q.TryPush(i))
+					std::this_thread::yield();
+				
+				uint64_t mine = ++pushed;
+				
+				if (!writing.exchange(true))											/// WSConnection::enqueue
+					strand_service.post(drain);
+				
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+				while (written < mine)
+				{
+					if (std::chrono::steady_clock::now() > deadline)
+					{
+						++stuck;
+						return;
+					}
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	
+	for (auto& t : pool)
+		t.join();
+	
+	work.reset();
+	writer_thread.join();
+	
+	PA_ASSERT(stuck == 0);
+	PA_ASSERT(written == producers * rounds && q.Size() == 0 && !writing);
+	
+	std::cout << "rechecks that found a push: " << rechecks << std::endl;
+	std::cout << "------------- Finished testing bounded queue writer handoff ----------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/bounded_queue_writer_handoff", bounded_queue_writer_handoff);
@@ -0,0 +1,68 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/flight_recorder.h"
+
+using namespace net;
+
+
+// Request moving between threads gets one timeline in time order; fast requests aren't dumped, old events fade out.
+void flight_recorder_timeline()
+{
+	std::cout << "+++++++++++++ Testing flight recorder timeline ++++++++++++++++++++++++++++++" << std::endl;
+	
+	FlightRecorder recorder(8, 5);
+	
+	std::vector<std::string> dumps;
+	recorder.OnSlow([&dumps](uint64_t, const std::string& timeline) { dumps.push_back(timeline); });
+	
+	uint64_t fast = recorder.NewRequest();
+	uint64_t started = recorder.Record(fast, FlightEvent::accept);
+	PA_ASSERT(!recorder.Finish(fast, started));
+	
+	uint64_t slow = recorder.NewRequest();
+	PA_ASSERT(slow != fast);
+	started = recorder.Record(slow, FlightEvent::first_byte, 512);
+	
+	std::thread([&] {																/// bridge runs on another I/O thread
+		recorder.Record(slow, FlightEvent::handler_start);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		recorder.Record(slow, FlightEvent::handler_end);
+	}).join();
+	
+	PA_ASSERT(recorder.Finish(slow, started));
+	recorder.Dump(slow, "GET /slow");
+	
+	PA_ASSERT(dumps.size() == 1 && recorder.Dumped() == 1);
+	
+	const std::string& timeline = dumps[0];
+	auto first_byte = timeline.find("first_byte (512)");
+	auto handler_start = timeline.find("handler_start");
+	auto handler_end = timeline.find("handler_end");
+	auto write_complete = timeline.find("write_complete");
+	
+	PA_ASSERT(timeline.find("GET /slow\n") == 0 && timeline.find("accept") == std::string::npos);
+	PA_ASSERT(first_byte < handler_start && handler_start < handler_end && handler_end < write_complete);
+	PA_ASSERT(write_complete != std::string::npos);
+	
+	recorder.Start();																/// dumped by recorder's thread
+	recorder.Dump(slow, "GET /slow");
+	recorder.Stop();
+	
+	PA_ASSERT(dumps.size() == 2 && dumps[1] == dumps[0] && recorder.Dumped() == 2 && recorder.Skipped() == 0);
+	
+	uint64_t old = recorder.NewRequest();											/// ring keeps last 8 events
+	recorder.Record(old, FlightEvent::accept);
+	for (int i = 0; i < 8; ++i)
+		recorder.Record(slow, FlightEvent::read, 1);
+	
+	PA_ASSERT(recorder.Timeline(old).empty());
+	
+	FlightRecorder disabled(0, 5);
+	PA_ASSERT(disabled.NewRequest() == 0 && disabled.Record(0, FlightEvent::accept) == 0);
+	PA_ASSERT(!disabled.Finish(0, 0));
+	
+	std::cout << "------------- Finished testing flight recorder timeline ---------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/flight_recorder_timeline", flight_recorder_timeline);
@@ -0,0 +1,426 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/webserver.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+#include "webserver/tests/bench_common.h"
+
+#include <fstream>
+#include <regex>
+
+using namespace net;
+using namespace net::tests;
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// HTTP load benchmark: WebServer runs in-process with a trivial handler, built-in load generator drives it over
+// loopback, plain and TLS, and over in-memory MemSocket (no syscalls - cost of the stack itself), in modes
+// - keepalive: one request at a time per connection;
+// - new_connection: connection (and TLS handshake) per request;
+// - pipelined: 'bench_depth' requests written at once, then their responses read;
+// with closed loop (each connection sends next request as soon as previous is answered) and, for keepalive, open loop
+// (requests are due at fixed rate; latency counts from due time, so a stalled server is not hidden by stalled
+// clients).
+//
+// Results (RPS, latency percentiles, errors) go to JSON file, one scenario per line. Given a baseline file from an
+// earlier run, scenario that lost more than tolerance of RPS or p99 fails the test.
+//
+// Environment: WEBSERVER_BENCH_SECONDS (per scenario, 2), WEBSERVER_BENCH_CONNECTIONS (16), WEBSERVER_BENCH_RATE
+// (open loop RPS, 2000), WEBSERVER_BENCH_JSON (output, http_bench.json), WEBSERVER_BENCH_BASELINE (none),
+// WEBSERVER_BENCH_TOLERANCE (0.2), WEBSERVER_BENCH_BODY_BYTES (response size, 2).
+//
+// Scenarios 'https+ktls/...' run against a second server with WebServerParams::ktls on, so the kernel TLS write path
+// can be compared with OpenSSL one of 'https/...'; use large WEBSERVER_BENCH_BODY_BYTES (e.g. 65536), small
+// responses cost the same either way. Where kernel has no 'tls' module, both scenarios take OpenSSL path.
+//----------------------------------------------------------------------------------------------------------------------
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+	
+	enum class BenchMode { keepalive, new_connection, pipelined };
+	
+	const char* mode_names[] = { "keepalive", "new_connection", "pipelined" };
+	const size_t bench_depth = 16;
+	
+	const std::string bench_request = "GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+	
+	struct BenchResult
+	{
+		std::string scenario;
+		size_t connections = 0;
+		double seconds = 0;
+		uint64_t errors = 0;
+		std::vector<uint64_t> latencies_us;
+	};
+	
+	class BenchHandler : public HTTP::HTTPRequestHandler
+	{
+	public:
+		explicit BenchHandler(size_t body_bytes) : body_(body_bytes, 'x') {}
+		
+		void HandleRequest(HTTP::HTTPRequest&, HTTP::HTTPResponse& rep) override
+		{
+			rep.status = HTTP::Schema::StatusCode::ok;
+			rep.content = body_;
+			rep.headers["Content-Type"] = "text/plain";
+			rep.headers["Content-Length"] = std::to_string(body_.size());
+		}
+	
+	private:
+		const std::string body_;
+	};
+	
+	// Reads one response, returns false unless it's 200
+	template<typename TStream>
+	bool read_response(TStream& s, boost::asio::streambuf& buf)
+	{
+		size_t header_size = boost::asio::read_until(s, buf, "\r\n\r\n");
+		
+		std::string header(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + header_size);
+		buf.consume(header_size);
+		
+		size_t content_length = 0;
+		auto pos = header.find("Content-Length: ");
+		if (pos != std::string::npos)
+			content_length = std::stoul(header.substr(pos + 16));
+		
+		if (buf.size() < content_length)
+			boost::asio::read(s, buf, boost::asio::transfer_exactly(content_length - buf.size()));
+		buf.consume(content_length);
+		
+		return header.compare(0, 12, "HTTP/1.1 200") == 0 || header.compare(0, 12, "HTTP/1.0 200") == 0;
+	}
+	
+	template<typename TStream>
+	void closed_loop(const std::function<std::unique_ptr<TStream>()>& connect, BenchMode mode, Clock::time_point until,
+	                 std::vector<uint64_t>& latencies, uint64_t& errors)
+	{
+		std::string pipelined;
+		for (size_t i = 0; i < bench_depth; ++i)
+			pipelined += bench_request;
+		
+		std::unique_ptr<TStream> s;
+		boost::asio::streambuf buf;
+		
+		while (Clock::now() < until)
+		{
+			try
+			{
+				auto started = Clock::now();
+				
+				if (!s || mode == BenchMode::new_connection)
+				{
+					buf.consume(buf.size());
+					s = connect();
+				}
+				
+				size_t n = (mode == BenchMode::pipelined) ? bench_depth : 1;
+				boost::asio::write(*s, boost::asio::buffer(mode == BenchMode::pipelined ? pipelined : bench_request));
+				
+				for (size_t i = 0; i < n; ++i)
+				{
+					if (!read_response(*s, buf))
+						++errors;
+					
+					latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count());
+				}
+				
+				if (mode == BenchMode::new_connection)
+					s.reset();
+			}
+			catch (std::exception&)
+			{
+				++errors;
+				s.reset();
+			}
+		}
+	}
+	
+	template<typename TStream>
+	void open_loop(const std::function<std::unique_ptr<TStream>()>& connect, size_t index, size_t connections,
+	               Clock::duration interval, Clock::time_point start, Clock::time_point until,
+	               std::vector<uint64_t>& latencies, uint64_t& errors)
+	{
+		std::unique_ptr<TStream> s;
+		boost::asio::streambuf buf;
+		
+		for (uint64_t k = 0; ; ++k)
+		{
+			auto due = start + interval * static_cast<Clock::rep>(k * connections + index);
+			if (due >= until)
+				break;
+			
+			std::this_thread::sleep_until(due);
+			
+			try
+			{
+				if (!s)
+				{
+					buf.consume(buf.size());
+					s = connect();
+				}
+				
+				boost::asio::write(*s, boost::asio::buffer(bench_request));
+				if (!read_response(*s, buf))
+					++errors;
+				
+				latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - due).count());
+			}
+			catch (std::exception&)
+			{
+				++errors;
+				s.reset();
+			}
+		}
+	}
+	
+	template<typename TStream>
+	BenchResult run_scenario(const std::string& scenario, const std::function<std::unique_ptr<TStream>()>& connect,
+	                         BenchMode mode, bool open, size_t connections, double seconds, double rate)
+	{
+		std::vector<std::vector<uint64_t>> latencies(connections);
+		std::vector<uint64_t> errors(connections, 0);
+		
+		auto start = Clock::now() + std::chrono::milliseconds(10);
+		auto until = start + std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+		auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+		
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < connections; ++i)
+			threads.emplace_back([&, i]
+			{
+				if (open)
+					open_loop(connect, i, connections, interval, start, until, latencies[i], errors[i]);
+				else
+					closed_loop(connect, mode, until, latencies[i], errors[i]);
+			});
+		
+		for (auto& t : threads)
+			t.join();
+		
+		BenchResult result;
+		result.scenario = scenario;
+		result.connections = connections;
+		result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		
+		for (size_t i = 0; i < connections; ++i)
+		{
+			result.errors += errors[i];
+			result.latencies_us.insert(result.latencies_us.end(), latencies[i].begin(), latencies[i].end());
+		}
+		
+		std::sort(result.latencies_us.begin(), result.latencies_us.end());
+		return result;
+	}
+	
+	uint64_t percentile(const std::vector<uint64_t>& sorted, double q)
+	{
+		if (sorted.empty())
+			return 0;
+		
+		return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+	}
+	
+	std::string to_json(const BenchResult& r)
+	{
+		std::ostringstream ss;
+		ss << "{\"scenario\":\"" << r.scenario << "\",\"connections\":" << r.connections
+		   << ",\"requests\":" << r.latencies_us.size() << ",\"errors\":" << r.errors
+		   << ",\"rps\":" << static_cast<uint64_t>(r.latencies_us.size() / std::max(r.seconds, 1e-9))
+		   << ",\"p50_us\":" << percentile(r.latencies_us, 0.5) << ",\"p90_us\":" << percentile(r.latencies_us, 0.9)
+		   << ",\"p99_us\":" << percentile(r.latencies_us, 0.99) << ",\"p999_us\":" << percentile(r.latencies_us, 0.999)
+		   << ",\"max_us\":" << (r.latencies_us.empty() ? 0 : r.latencies_us.back()) << "}";
+		
+		return ss.str();
+	}
+	
+	// scenario -> (rps, p99_us) of a file written by 'to_json'
+	std::map<std::string, std::pair<double, double>> read_baseline(const std::string& path)
+	{
+		std::map<std::string, std::pair<double, double>> baseline;
+		std::regex re("\"scenario\":\"([^\"]+)\".*\"rps\":([0-9.]+).*\"p99_us\":([0-9.]+)");
+		
+		std::ifstream in(path);
+		std::string line;
+		std::smatch m;
+		
+		while (std::getline(in, line))
+			if (std::regex_search(line, m, re))
+				baseline[m[1]] = { std::stod(m[2]), std::stod(m[3]) };
+		
+		return baseline;
+	}
+}
+
+
+// Throughput and latency of the whole server over loopback; regression gate against baseline, if one is given.
+void http_load_bench()
+{
+	if (!bench_enabled("HTTP load bench"))
+		return;
+	
+	std::cout << "+++++++++++++ Testing HTTP load bench ++++++++++++++++++++++++++++++" << std::endl;
+	
+	const double seconds = std::stod(env("WEBSERVER_BENCH_SECONDS", "2"));
+	const size_t connections = std::stoul(env("WEBSERVER_BENCH_CONNECTIONS", "16"));
+	const double rate = std::stod(env("WEBSERVER_BENCH_RATE", "2000"));
+	const double tolerance = std::stod(env("WEBSERVER_BENCH_TOLERANCE", "0.2"));
+	const std::string output = env("WEBSERVER_BENCH_JSON", "http_bench.json");
+	const std::string baseline_path = env("WEBSERVER_BENCH_BASELINE", "");
+	const size_t body_bytes = std::stoul(env("WEBSERVER_BENCH_BODY_BYTES", "2"));
+	
+	auto root = fs::GetProcessRootDirectory();
+	bool own_certificate = !fs::exists(root / "server.crt") && !fs::exists(root / "server.key");
+	if (own_certificate)
+		PA_ASSERT(make_certificate(root / "server.crt", root / "server.key"));
+	
+	IOService main_service, acceptor_service;
+	std::unique_ptr<IOService::work> main_work(new IOService::work(main_service));
+	std::unique_ptr<IOService::work> acceptor_work(new IOService::work(acceptor_service));
+	
+	WebServerParams params("127.0.0.1", 18080, 18443);
+	params.http_slow_request_ms = 0;
+	params.io_stall_ms = 0;
+	params.metrics = true;															/// gauges show teardown
+	
+	auto handler = [body_bytes] { return std::unique_ptr<HTTP::HTTPRequestHandler>(new BenchHandler(body_bytes)); };
+	
+	std::unique_ptr<WebServer> server(new WebServer(main_service, acceptor_service, params, handler));
+	server->Start();
+	
+	WebServerParams ktls_params("127.0.0.1", 18081, 18444);
+	ktls_params.http_slow_request_ms = 0;
+	ktls_params.io_stall_ms = 0;
+	ktls_params.metrics = true;
+	ktls_params.ktls = true;
+	
+	std::unique_ptr<WebServer> ktls_server(new WebServer(main_service, acceptor_service, ktls_params, handler));
+	ktls_server->Start();
+	
+	std::vector<std::thread> io_threads;
+	for (uint i = 0; i < std::max(std::thread::hardware_concurrency(), 2u); ++i)
+		io_threads.emplace_back([&main_service] { main_service.run(); });
+	io_threads.emplace_back([&acceptor_service] { acceptor_service.run(); });
+	
+	IOService client_service;
+	SSLContext client_context(SSLContext::tlsv12_client);
+	client_context.set_verify_mode(boost::asio::ssl::verify_none);
+	
+	const NetEndpoint http_endpoint(boost::asio::ip::address_v4::loopback(), params.local_http_port);
+	const NetEndpoint https_endpoint(boost::asio::ip::address_v4::loopback(), params.local_https_port);
+	const NetEndpoint ktls_endpoint(boost::asio::ip::address_v4::loopback(), ktls_params.local_https_port);
+	
+	std::function<std::unique_ptr<TCPSocket>()> connect_http = [&]
+	{
+		std::unique_ptr<TCPSocket> s(new TCPSocket(client_service));
+		s->connect(http_endpoint);
+		s->set_option(tcp_flags::no_delay(true));
+		return s;
+	};
+	
+	std::function<std::unique_ptr<SSLSocket>()> connect_https = [&]
+	{
+		std::unique_ptr<SSLSocket> s(new SSLSocket(client_service, client_context));
+		s->lowest_layer().connect(https_endpoint);
+		s->lowest_layer().set_option(tcp_flags::no_delay(true));
+		s->handshake(SSLSocket::client);
+		return s;
+	};
+	
+	std::function<std::unique_ptr<SSLSocket>()> connect_ktls = [&]
+	{
+		std::unique_ptr<SSLSocket> s(new SSLSocket(client_service, client_context));
+		s->lowest_layer().connect(ktls_endpoint);
+		s->lowest_layer().set_option(tcp_flags::no_delay(true));
+		s->handshake(SSLSocket::client);
+		return s;
+	};
+	
+	std::function<std::unique_ptr<MemSocket>()> connect_mem = [&]
+	{
+		auto server_end = std::make_shared<MemSocket>(main_service);
+		std::unique_ptr<MemSocket> s(new MemSocket(client_service));
+		MemSocket::Connect(*server_end, *s);
+		server->Accept(server_end);
+		return s;
+	};
+	
+	std::vector<BenchResult> results;
+	for (auto mode : { BenchMode::keepalive, BenchMode::new_connection, BenchMode::pipelined })
+	{
+		std::string name = std::string("/") + mode_names[static_cast<size_t>(mode)] + "/closed";
+		
+		results.push_back(run_scenario("http" + name, connect_http, mode, false, connections, seconds, rate));
+		results.push_back(run_scenario("https" + name, connect_https, mode, false, connections, seconds, rate));
+		results.push_back(run_scenario("mem" + name, connect_mem, mode, false, connections, seconds, rate));
+	}
+	
+	results.push_back(run_scenario("http/keepalive/open", connect_http, BenchMode::keepalive, true, connections,
+		seconds, rate));
+	results.push_back(run_scenario("https/keepalive/open", connect_https, BenchMode::keepalive, true, connections,
+		seconds, rate));
+	
+	results.push_back(run_scenario("https+ktls/keepalive/closed", connect_ktls, BenchMode::keepalive, false,
+		connections, seconds, rate));
+	results.push_back(run_scenario("https+ktls/keepalive/open", connect_ktls, BenchMode::keepalive, true, connections,
+		seconds, rate));
+	
+	for (int i = 0; i < 200 && server->metrics().Value(MetricGauge::http_connections) +
+	                             ktls_server->metrics().Value(MetricGauge::http_connections) != 0; ++i)	/// let servers
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));											/// see closes
+	
+	server->Stop();
+	ktls_server->Stop();
+	main_service.stop();
+	acceptor_service.stop();
+	for (auto& t : io_threads)
+		t.join();
+	server.reset();
+	ktls_server.reset();
+	
+	if (own_certificate)
+	{
+		fs::remove(root / "server.crt");
+		fs::remove(root / "server.key");
+	}
+	
+	std::ofstream out(output);
+	for (auto& r : results)
+	{
+		std::string json = to_json(r);
+		
+		out << json << "\n";
+		std::cout << json << std::endl;
+		
+		PA_ASSERT(!r.latencies_us.empty());
+		PA_ASSERT(r.errors == 0);
+	}
+	out.close();
+	
+	if (!baseline_path.empty())
+	{
+		auto baseline = read_baseline(baseline_path);
+		auto current = read_baseline(output);
+		
+		for (auto& b : baseline)
+		{
+			auto it = current.find(b.first);
+			if (it == current.end())
+				continue;
+			
+			bool rps_ok = it->second.first >= b.second.first * (1 - tolerance);
+			bool p99_ok = it->second.second <= b.second.second * (1 + tolerance);
+			
+			if (!rps_ok || !p99_ok)
+				std::cout << "REGRESSION " << b.first << ": rps " << b.second.first << " -> " << it->second.first
+				          << ", p99_us " << b.second.second << " -> " << it->second.second << std::endl;
+			
+			PA_ASSERT(rps_ok && p99_ok);
+		}
+	}
+	
+	std::cout << "------------- Finished testing HTTP load bench ---------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/bench/http_load", http_load_bench);
@@ -0,0 +1,94 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/HTTP/http_parser.h"
+#include "webserver/HTTP/http_request.h"
+
+using namespace net;
+
+using Result = HTTP::HTTPParser::Result;
+
+
+static bool zeroed(const char* begin, const char* end)
+{
+	return std::all_of(begin, end, [](char c) { return c == 0; });
+}
+
+
+
+// Pipelined requests in one read: parser stops at the end of each, 'rest' points to the next one, which is left
+// intact, while consumed bytes are zeroouted. Incomplete tail is consumed as 'indeterminate'.
+void http_parser_pipelined()
+{
+	std::cout << "+++++++++++++ Testing HTTP parser on pipelined requests +++++++++++++++++++" << std::endl;
+	
+	const std::string first = "POST /a HTTP/1.1\r\nHost: h\r\nContent-Length: 5\r\n\r\nhello";
+	const std::string second = "GET /b?x=1 HTTP/1.1\r\nHost: h\r\n\r\n";
+	const std::string tail = second.substr(0, 10);
+	
+	std::string stream = first + second + tail;
+	std::vector<char> buffer(stream.begin(), stream.end());
+	char* begin = buffer.data();
+	char* end = begin + buffer.size();
+	char* rest = nullptr;
+	
+	HTTP::HTTPParser parser;
+	HTTP::HTTPRequest request;
+	
+	PA_ASSERT(parser.Parse(request, begin, end, &rest) == Result::good);
+	PA_ASSERT(request.method == "POST" && request.target == "/a" && request.content == "hello");
+	PA_ASSERT(rest == begin + first.size() && zeroed(begin, rest));
+	PA_ASSERT(std::string(rest, end) == second + tail);
+	
+	request = HTTP::HTTPRequest();
+	char* next = rest;
+	PA_ASSERT(parser.Parse(request, next, end, &rest) == Result::good);
+	PA_ASSERT(request.method == "GET" && request.target == "/b?x=1" && request.content.empty());
+	PA_ASSERT(rest == next + second.size() && zeroed(next, rest));
+	PA_ASSERT(std::string(rest, end) == tail);
+	
+	request = HTTP::HTTPRequest();
+	next = rest;
+	PA_ASSERT(parser.Parse(request, next, end, &rest) == Result::indeterminate);
+	PA_ASSERT(rest == end && zeroed(next, end));
+	
+	std::cout << "------------- Finished testing HTTP parser on pipelined requests ---------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/http_parser_pipelined", http_parser_pipelined);
+
+
+
+// Request split at every byte boundary, as it may come in two reads: first part is 'indeterminate', second completes
+// the same request; second part also carries the start of the next request, which stays pending.
+void http_parser_split_at_every_byte()
+{
+	std::cout << "+++++++++++++ Testing HTTP parser on input split at every byte ++++++++++++" << std::endl;
+	
+	const std::string message = "PUT /items/7 HTTP/1.1\r\nHost: h\r\nContent-Length: 11\r\n\r\nhello world";
+	const std::string next = "GET / HTTP/1.1\r\n";
+	
+	for (size_t split = 1; split < message.size(); ++split)
+	{
+		std::string stream = message + next;
+		std::vector<char> buffer(stream.begin(), stream.end());
+		char* begin = buffer.data();
+		char* end = begin + buffer.size();
+		char* rest = nullptr;
+		
+		HTTP::HTTPParser parser;
+		HTTP::HTTPRequest request;
+		
+		PA_ASSERT(parser.Parse(request, begin, begin + split, &rest) == Result::indeterminate);
+		PA_ASSERT(rest == begin + split);
+		
+		PA_ASSERT(parser.Parse(request, begin + split, end, &rest) == Result::good);
+		PA_ASSERT(request.method == "PUT" && request.target == "/items/7" && request.content == "hello world");
+		PA_ASSERT(rest == begin + message.size() && zeroed(begin, rest));
+		PA_ASSERT(std::string(rest, end) == next);
+	}
+	
+	std::cout << "------------- Finished testing HTTP parser on input split at every byte --" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/http_parser_split_at_every_byte", http_parser_split_at_every_byte);
@@ -0,0 +1,207 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/mem_socket.h"
+#include "webserver/webserver.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+
+#include <chrono>
+
+using namespace net;
+
+
+// Reads are cut by script, delayed by it, end with eof after peer's close and with operation_aborted on cancel.
+void mem_socket_scripted_reads()
+{
+	std::cout << "+++++++++++++ Testing mem socket scripted reads ++++++++++++++++++++++" << std::endl;
+	
+	IOService service;
+	MemSocket a(service), b(service);
+	MemSocket::Connect(a, b);
+	
+	a.SetScript(MemScript{ { 3 }, {} });
+	
+	std::array<char, 16> buf;
+	std::vector<size_t> sizes;
+	error_code last;
+	
+	std::function<void()> read = [&]()
+	{
+		a.async_read_some(boost::asio::buffer(buf), [&](const error_code& ec, size_t n)
+		{
+			last = ec;
+			if (!ec)
+			{
+				sizes.push_back(n);
+				read();
+			}
+		});
+	};
+	
+	read();
+	boost::asio::write(b, boost::asio::buffer(std::string("0123456789")));
+	service.poll();
+	
+	PA_ASSERT((sizes == std::vector<size_t>{ 3, 3, 3, 1 }));						/// handlers are posted, not inline
+	
+	error_code ec;
+	b.close(ec);
+	service.reset();
+	service.poll();
+	PA_ASSERT(last == boost::asio::error::eof);
+	
+	boost::asio::write(a, boost::asio::buffer(std::string("x")), ec);				/// peer is gone
+	PA_ASSERT(ec == boost::asio::error::broken_pipe);
+	
+	MemSocket c(service), d(service);
+	MemSocket::Connect(c, d);
+	c.SetScript(MemScript{ {}, { 20000 } });
+	
+	auto started = std::chrono::steady_clock::now();
+	bool delayed_done = false;
+	c.async_read_some(boost::asio::buffer(buf), [&](const error_code& ec, size_t n)
+	{
+		delayed_done = !ec && n == 2;
+	});
+	boost::asio::write(d, boost::asio::buffer(std::string("hi")));
+	
+	service.reset();
+	service.run();
+	PA_ASSERT(delayed_done && std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(20));
+	
+	bool aborted = false;
+	c.async_read_some(boost::asio::buffer(buf), [&](const error_code& ec, size_t)
+	{
+		aborted = (ec == boost::asio::error::operation_aborted);
+	});
+	c.cancel(ec);
+	
+	service.reset();
+	service.poll();
+	PA_ASSERT(aborted);
+	
+	std::cout << "------------- Finished testing mem socket scripted reads -------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/mem_socket_scripted_reads", mem_socket_scripted_reads);
+
+
+
+namespace
+{
+	class PathHandler : public HTTP::HTTPRequestHandler
+	{
+	public:
+		void HandleRequest(HTTP::HTTPRequest& req, HTTP::HTTPResponse& rep) override
+		{
+			rep.status = HTTP::Schema::StatusCode::ok;
+			rep.content = req.uri.path();
+			rep.headers["Content-Length"] = std::to_string(rep.content.size());
+		}
+	};
+}
+
+
+// Whole stack over MemSocket: request cut by server's reads at every offset, then WS handshake and push.
+void mem_socket_full_stack()
+{
+	std::cout << "+++++++++++++ Testing mem socket full stack ++++++++++++++++++++++++++" << std::endl;
+	
+	IOService main_service, acceptor_service, client_service;
+	std::unique_ptr<IOService::work> main_work(new IOService::work(main_service));
+	std::unique_ptr<IOService::work> acceptor_work(new IOService::work(acceptor_service));
+	
+	WebServerParams params("127.0.0.1", 18082, 18446);
+	params.ws_ping_interval_sec = 0;
+	params.metrics = true;															/// gauges show teardown
+	
+	std::unique_ptr<WebServer> server(new WebServer(main_service, acceptor_service, params,
+		[] { return std::unique_ptr<HTTP::HTTPRequestHandler>(new PathHandler()); }));
+	
+	ptl::mutex mx;
+	std::vector<pauuid> opened;
+	server->WSOnEvents(WS::WSEventType::open, [&](const std::vector<WS::WSEvent>& events)
+	{
+		boost::lock_guard<ptl::mutex> lck(mx);
+		for (auto& e : events)
+			opened.push_back(e.id);
+	});
+	server->Start();
+	
+	std::thread main_io([&main_service] { main_service.run(); });
+	std::thread acceptor_io([&acceptor_service] { acceptor_service.run(); });
+	
+	auto connect = [&](MemScript script)
+	{
+		auto server_end = std::make_shared<MemSocket>(main_service);
+		auto client_end = std::make_shared<MemSocket>(client_service);
+		MemSocket::Connect(*server_end, *client_end);
+		server_end->SetScript(std::move(script));
+		
+		server->Accept(server_end);
+		return client_end;
+	};
+	
+	const std::string request = "GET /split HTTP/1.1\r\nHost: 127.0.0.1\r\nAccept: */*\r\n\r\n";
+	
+	for (size_t split = 1; split < request.size(); ++split)
+	{
+		auto client = connect(MemScript{ { split, 0 }, {} });							/// then - no limit
+		boost::asio::write(*client, boost::asio::buffer(request));
+		
+		boost::asio::streambuf buf;
+		boost::asio::read_until(*client, buf, "/split");
+		
+		std::string response(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_end(buf.data()));
+		PA_ASSERT(response.compare(0, 12, "HTTP/1.1 200") == 0);
+	}
+	
+	auto ws = connect(MemScript());
+	boost::asio::write(*ws, boost::asio::buffer(std::string("GET /chat HTTP/1.1\r\n"
+		"Host: 127.0.0.1\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n")));
+	
+	boost::asio::streambuf buf;
+	size_t header_size = boost::asio::read_until(*ws, buf, "\r\n\r\n");
+	std::string header(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + header_size);
+	buf.consume(header_size);
+	PA_ASSERT(header.compare(0, 12, "HTTP/1.1 101") == 0);
+	
+	auto ws_opened = [&]()
+	{
+		boost::lock_guard<ptl::mutex> lck(mx);
+		return opened.size() == 1;
+	};
+	
+	for (int i = 0; i < 500 && !ws_opened(); ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	
+	PA_ASSERT(ws_opened() && server->WSPush(opened[0], "hello"));
+	
+	if (buf.size() < 7)
+		boost::asio::read(*ws, buf, boost::asio::transfer_exactly(7 - buf.size()));
+	std::string frame(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + 7);
+	PA_ASSERT(frame == std::string("\x81\x05hello"));
+	
+	error_code ec;
+	ws->close(ec);
+	
+	for (int i = 0; i < 500 && server->metrics().Value(MetricGauge::ws_connections) != 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	PA_ASSERT(server->metrics().Value(MetricGauge::ws_connections) == 0);
+	
+	server->Stop();
+	main_service.stop();
+	acceptor_service.stop();
+	main_io.join();
+	acceptor_io.join();
+	server.reset();
+	
+	std::cout << "------------- Finished testing mem socket full stack -----------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/mem_socket_full_stack", mem_socket_full_stack);
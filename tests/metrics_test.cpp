@@ -0,0 +1,55 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/metrics.h"
+
+using namespace net;
+
+
+// Quantiles come within bucket precision (12.5%), Prometheus text has cumulative buckets, counters and gauges.
+void metrics_histograms()
+{
+	std::cout << "+++++++++++++ Testing metrics histograms ++++++++++++++++++++++++++++++" << std::endl;
+	
+	Metrics metrics;
+	
+	for (uint64_t us = 1; us <= 1000; ++us)
+		metrics.Record(MetricStage::http_handle, us);
+	
+	PA_ASSERT(metrics.Total(MetricStage::http_handle) == 1000);
+	PA_ASSERT(metrics.Total(MetricStage::http_write) == 0);
+	
+	uint64_t p50 = metrics.Quantile(MetricStage::http_handle, 0.5);
+	uint64_t p99 = metrics.Quantile(MetricStage::http_handle, 0.99);
+	PA_ASSERT(p50 >= 500 && p50 <= 500 * 9 / 8);
+	PA_ASSERT(p99 >= 990 && p99 <= 990 * 9 / 8);
+	PA_ASSERT(metrics.Quantile(MetricStage::http_handle, 0) == 1);
+	
+	std::vector<std::thread> threads;												/// shards are merged on read
+	for (int t = 0; t < 4; ++t)
+		threads.emplace_back([&metrics] { for (int i = 0; i < 1000; ++i) metrics.Count(MetricCounter::http_requests); });
+	for (auto& t : threads)
+		t.join();
+	
+	PA_ASSERT(metrics.Value(MetricCounter::http_requests) == 4000);
+	
+	metrics.Gauge(MetricGauge::ws_connections, 2);
+	metrics.Gauge(MetricGauge::ws_connections, -1);
+	PA_ASSERT(metrics.Value(MetricGauge::ws_connections) == 1);
+	
+	std::string text;
+	metrics.Render(text);
+	PA_ASSERT(text.find("webserver_stage_seconds_bucket{stage=\"http_handle\",le=\"0.000512\"} 511\n") != std::string::npos);
+	PA_ASSERT(text.find("webserver_stage_seconds_count{stage=\"http_handle\"} 1000\n") != std::string::npos);
+	PA_ASSERT(text.find("webserver_http_requests_total 4000\n") != std::string::npos);
+	PA_ASSERT(text.find("webserver_ws_connections 1\n") != std::string::npos);
+	
+	Metrics disabled(false);
+	disabled.Record(MetricStage::http_read, disabled.Now());
+	disabled.Count(MetricCounter::http_requests);
+	PA_ASSERT(disabled.Total(MetricStage::http_read) == 0 && disabled.Value(MetricCounter::http_requests) == 0);
+	
+	std::cout << "------------- Finished testing metrics histograms ---------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/metrics_histograms", metrics_histograms);
@@ -0,0 +1,281 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/HTTP/cookie.h"
+#include "webserver/HTTP/http_parser.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+#include "webserver/WS/ws_proto_impl.h"
+#include "webserver/WS/ws_protocol.h"
+#include "webserver/tests/bench_env.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+
+using namespace net;
+using namespace net::tests;
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// Microbenchmarks of CPU hot paths over fixed corpora: HTTPParser::Parse (whole message and split at every byte
+// boundary), HTTPResponse::to_buffers, Cookie::fromString / toString, WS::fill_text_frame and
+// Schema::MIME::getContentType.
+//
+// Each benchmark is calibrated to run at least WEBSERVER_MICROBENCH_MS (200) milliseconds, best of 3 runs is reported
+// as ns per operation, MB per second of input and heap allocations per operation. Results go to JSON file
+// WEBSERVER_MICROBENCH_JSON (micro_bench.json), one benchmark per line, same way as http_bench.cpp does.
+//
+// Micro bench is a program of its own (tests/micro_bench/micro_bench.vcxproj), not a test of webserver module:
+// allocations are counted by replaced global operator new, which forwards to malloc, counts per thread and costs one
+// increment - in any build, so one run reports both ns/op and allocations. Sources under measurement are compiled
+// into the program instead of being taken from webserver module, so that allocations made inside them go through
+// this operator new too. Replacement is safe only because nothing but the bench runs in this process.
+//----------------------------------------------------------------------------------------------------------------------
+namespace
+{
+	thread_local uint64_t allocations = 0;
+}
+
+void* operator new(size_t size)
+{
+	++allocations;
+	
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+	
+	struct MicroResult
+	{
+		std::string name;
+		uint64_t iterations = 0;
+		double ns_per_op = 0;
+		double mb_per_s = 0;
+		double allocs_per_op = 0;
+	};
+	
+	std::atomic<size_t> sink(0);													/// keeps results alive
+	
+	// 'op(i)' is i-th operation over 'bytes_per_op' bytes of input
+	MicroResult run_micro(const std::string& name, size_t bytes_per_op, const std::function<void(uint64_t)>& op)
+	{
+		const auto min_time = std::chrono::milliseconds(std::stoul(env("WEBSERVER_MICROBENCH_MS", "200")));
+		
+		uint64_t iterations = 1;
+		for (;;)																	/// calibration
+		{
+			auto started = Clock::now();
+			for (uint64_t i = 0; i < iterations; ++i)
+				op(i);
+			
+			if (Clock::now() - started >= min_time / 10 || iterations >= (uint64_t(1) << 40))
+				break;
+			iterations *= 2;
+		}
+		iterations *= 10;
+		
+		MicroResult result;
+		result.name = name;
+		result.iterations = iterations;
+		result.ns_per_op = std::numeric_limits<double>::max();
+		
+		for (int run = 0; run < 3; ++run)
+		{
+			uint64_t allocations_before = allocations;
+			auto started = Clock::now();
+			
+			for (uint64_t i = 0; i < iterations; ++i)
+				op(i);
+			
+			double ns = std::chrono::duration<double, std::nano>(Clock::now() - started).count();
+			
+			result.ns_per_op = std::min(result.ns_per_op, ns / iterations);
+			result.allocs_per_op = double(allocations - allocations_before) / iterations;
+		}
+		
+		result.mb_per_s = bytes_per_op * 1e3 / result.ns_per_op;
+		
+		return result;
+	}
+	
+	std::string to_json(const MicroResult& r)
+	{
+		std::ostringstream ss;
+		ss << "{\"name\":\"" << r.name << "\",\"iterations\":" << r.iterations << ",\"ns_per_op\":" << r.ns_per_op
+		   << ",\"mb_per_s\":" << r.mb_per_s << ",\"allocs_per_op\":" << r.allocs_per_op << "}";
+		
+		return ss.str();
+	}
+	
+	const std::vector<std::pair<std::string, std::string>> request_corpus =
+	{
+		{ "get_minimal",
+			"GET / HTTP/1.1\r\nHost: example.com\r\n\r\n" },
+		{ "get_browser",
+			"GET /api/v1/projects/42/nodes?expand=true&limit=100 HTTP/1.1\r\n"
+			"Host: analytics.example.com\r\n"
+			"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+				"Chrome/120.0.0.0 Safari/537.36\r\n"
+			"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+			"Accept-Language: en-US,en;q=0.9,ru;q=0.8\r\n"
+			"Accept-Encoding: gzip, deflate, br\r\n"
+			"Referer: https://analytics.example.com/projects/42\r\n"
+			"Cookie: pauuid=6f1c2a7e-3b4d-4e5f-8a9b-0c1d2e3f4a5b; theme=dark; GeoIP=RU:MOW:Moscow:55.75:37.62:v4\r\n"
+			"Connection: keep-alive\r\n\r\n" },
+		{ "post_json",
+			"POST /api/v1/projects/42/run HTTP/1.1\r\n"
+			"Host: analytics.example.com\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: 91\r\n"
+			"Cookie: pauuid=6f1c2a7e-3b4d-4e5f-8a9b-0c1d2e3f4a5b\r\n\r\n"
+			"{\"node\":\"c5a1e0d2-7b3f-4c8e-9a6d-1f2e3d4c5b6a\",\"params\":{\"rows\":100000,\"seed\":42,\"x\":true}}" },
+		{ "ws_handshake",
+			"GET /ws HTTP/1.1\r\n"
+			"Host: analytics.example.com\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+			"Origin: https://analytics.example.com\r\n\r\n" },
+	};
+	
+	const std::string cookie_header = "CP=H2; WMF-Last-Access=09-Mar-2018; WMF-Last-Access-Global=09-Mar-2018; "
+		"GeoIP=RU:MOW:Moscow:55.75:37.62:v4; pauuid=6f1c2a7e-3b4d-4e5f-8a9b-0c1d2e3f4a5b; theme=dark";
+	
+	const std::vector<std::string> extensions_corpus =
+	{
+		".html", ".js", ".css", ".json", ".png", ".svg", ".woff2", ".unknown"
+	};
+}
+
+
+// ns/op, MB/s and allocations/op of parser, serializer, cookies, WS framing and MIME lookup.
+void micro_bench()
+{
+	std::cout << "+++++++++++++ Testing micro bench ++++++++++++++++++++++++++++++++++" << std::endl;
+	
+	std::vector<MicroResult> results;
+	
+	for (auto& sample : request_corpus)
+	{
+		const std::string& message = sample.second;
+		std::vector<char> work(message.size());
+		HTTP::HTTPParser parser;
+		HTTP::HTTPRequest request;
+		
+		{																			/// corpus is parsed at all
+			std::copy(message.begin(), message.end(), work.begin());
+			PA_ASSERT(parser.Parse(request, work.data(), work.data() + work.size()) == HTTP::HTTPParser::Result::good);
+		}
+		
+		results.push_back(run_micro("parse/" + sample.first + "/whole", message.size(), [&](uint64_t)
+		{
+			std::copy(message.begin(), message.end(), work.begin());				/// Parse zeroouts its input
+			
+			request = HTTP::HTTPRequest();
+			sink += static_cast<size_t>(parser.Parse(request, work.data(), work.data() + work.size()));
+		}));
+		
+		results.push_back(run_micro("parse/" + sample.first + "/split", message.size(), [&](uint64_t i)
+		{
+			size_t split = 1 + i % (message.size() - 1);							/// every byte boundary in turn
+			std::copy(message.begin(), message.end(), work.begin());
+			
+			request = HTTP::HTTPRequest();
+			sink += static_cast<size_t>(parser.Parse(request, work.data(), work.data() + split));
+			sink += static_cast<size_t>(parser.Parse(request, work.data() + split, work.data() + work.size()));
+		}));
+	}
+	
+	{
+		HTTP::HTTPResponse response;
+		response.status = HTTP::Schema::StatusCode::ok;
+		response.content.assign(1024, 'x');
+		response.headers["Content-Type"] = "application/json; charset=utf-8";
+		response.headers["Content-Length"] = "1024";
+		response.headers["Cache-Control"] = "no-cache, no-store, must-revalidate";
+		response.setCookie(HTTP::Cookie("pauuid", "6f1c2a7e-3b4d-4e5f-8a9b-0c1d2e3f4a5b", "/", "", true, true));
+		
+		size_t bytes = 0;
+		for (auto& b : response.to_buffers())
+			bytes += boost::asio::buffer_size(b);
+		
+		results.push_back(run_micro("response/to_buffers", bytes, [&](uint64_t)
+		{
+			sink += response.to_buffers().size();
+		}));
+	}
+	
+	results.push_back(run_micro("cookie/fromString", cookie_header.size(), [&](uint64_t)
+	{
+		sink += HTTP::Cookie::fromString(cookie_header).size();
+	}));
+	
+	{
+		HTTP::Cookie cookie("pauuid", "6f1c2a7e-3b4d-4e5f-8a9b-0c1d2e3f4a5b", "/", "example.com", true, true, 3600);
+		
+		results.push_back(run_micro("cookie/toString", cookie.name.size() + cookie.value.size(), [&](uint64_t)
+		{
+			sink += cookie.toString().size();
+		}));
+	}
+	
+	for (size_t size : { 16, 1024, 65536 })
+	{
+		const std::string message(size, 'm');
+		std::string frame;
+		
+		results.push_back(run_micro("ws/fill_text_frame/" + std::to_string(size), size, [&](uint64_t)
+		{
+			frame.clear();															/// capacity is kept, as in
+			WS::fill_text_frame(message, WS::Schema::WSFinRsvOpcode::one_fragment_text, frame);	/// send path
+			sink += frame.size();
+		}));
+	}
+	
+	results.push_back(run_micro("mime/getContentType", 0, [&](uint64_t i)
+	{
+		sink += HTTP::Schema::MIME::getContentType(extensions_corpus[i % extensions_corpus.size()]).size();
+	}));
+	
+	std::ofstream out(env("WEBSERVER_MICROBENCH_JSON", "micro_bench.json"));
+	for (auto& r : results)
+	{
+		std::string json = to_json(r);
+		
+		out << json << "\n";
+		std::cout << json << std::endl;
+		
+		PA_ASSERT(r.iterations > 0);
+	}
+	
+	std::cout << "------------- Finished testing micro bench -------------------------" << std::endl;
+}
+
+int main()
+{
+	try
+	{
+		micro_bench();
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "micro bench failed: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,165 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/timer_wheel.h"
+
+#include <chrono>
+
+using namespace net;
+
+
+void timer_wheel_fire_and_cancel()
+{
+	std::cout << "+++++++++++++ Testing timer wheel ++++++++++++++++" << std::endl;
+	
+	IOService service;
+	TimerWheel wheel(service, 10, 8);											// turn of 80 ms - some timers take rounds
+	
+	std::vector<uint> fired;
+	ptl::mutex fired_mx;
+	
+	auto started = std::chrono::steady_clock::now();
+	bool too_early = false;
+	
+	auto record = [&](uint delay_ms)
+	{
+		return [&, delay_ms]()
+		{
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+			
+			boost::lock_guard<ptl::mutex> lck(fired_mx);
+			fired.push_back(delay_ms);
+			too_early = too_early || elapsed.count() < delay_ms;
+		};
+	};
+	
+	for (uint delay_ms : { 250, 30, 170, 10, 90 })
+		wheel.Schedule(delay_ms, record(delay_ms));
+	
+	auto cancelled = wheel.Schedule(60, record(60));
+	PA_ASSERT(wheel.Size() == 6);
+	PA_ASSERT(wheel.Cancel(cancelled) && !wheel.Cancel(cancelled));
+	
+	// timer scheduled from callback fires on a later tick
+	wheel.Schedule(20, [&]() { wheel.Schedule(20, record(40)); });
+	
+	wheel.Start();
+	
+	boost::asio::deadline_timer stopper(service);
+	stopper.expires_from_now(boost::posix_time::milliseconds(400));
+	stopper.async_wait([&](const error_code&) { wheel.Stop(); });
+	
+	service.run();
+	
+	PA_ASSERT(!too_early);
+	PA_ASSERT((fired == std::vector<uint>{ 10, 30, 40, 90, 170, 250 }));
+	PA_ASSERT(wheel.Size() == 0);
+	
+	std::cout << "------------- Finished testing timer wheel -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/timer_wheel_fire_and_cancel", timer_wheel_fire_and_cancel);
+
+
+
+// Timers scheduled while the wheel runs, at moments between its ticks: none fires before its delay is over.
+void timer_wheel_schedule_mid_tick()
+{
+	std::cout << "+++++++++++++ Testing timer wheel schedule mid tick ++++++++++++++++" << std::endl;
+	
+	IOService service;
+	TimerWheel wheel(service, 10, 8);
+	
+	size_t fired = 0;
+	std::vector<long long> early;													// ms short of the delay
+	
+	std::vector<std::unique_ptr<boost::asio::deadline_timer>> schedulers;
+	
+	for (uint offset_ms : { 25, 53, 77, 101, 139 })								/// odd offsets - mid tick
+	{
+		schedulers.emplace_back(new boost::asio::deadline_timer(service));
+		schedulers.back()->expires_from_now(boost::posix_time::milliseconds(offset_ms));
+		schedulers.back()->async_wait([&](const error_code&)
+		{
+			auto scheduled = std::chrono::steady_clock::now();
+			
+			for (uint delay_ms : { 1, 10, 15, 20, 95 })
+			{
+				wheel.Schedule(delay_ms, [&, scheduled, delay_ms]()
+				{
+					auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - scheduled);
+					
+					++fired;
+					if (elapsed.count() < delay_ms)
+						early.push_back(delay_ms - elapsed.count());
+				});
+			}
+		});
+	}
+	
+	wheel.Start();
+	
+	boost::asio::deadline_timer stopper(service);
+	stopper.expires_from_now(boost::posix_time::milliseconds(400));
+	stopper.async_wait([&](const error_code&) { wheel.Stop(); });
+	
+	service.run();
+	
+	PA_ASSERT(early.empty());
+	PA_ASSERT(fired == 25 && wheel.Size() == 0);
+	
+	std::cout << "------------- Finished testing timer wheel schedule mid tick -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/timer_wheel_schedule_mid_tick", timer_wheel_schedule_mid_tick);
+
+
+
+// Wheels destroyed while their io_service keeps running, with ticks due or queued: none of their callbacks runs after
+// destructor returns, and handlers left in the queue don't touch destroyed wheels (run under ASan to see the latter).
+void timer_wheel_destroy_while_running()
+{
+	std::cout << "+++++++++++++ Testing timer wheel destroy while running +++++++++++" << std::endl;
+	
+	IOService service;
+	std::unique_ptr<IOService::work> work(new IOService::work(service));
+	std::vector<std::thread> io;
+	for (int i = 0; i < 2; ++i)
+		io.emplace_back([&service]() { service.run(); });
+	
+	std::atomic<size_t> fired(0), late(0);
+	
+	for (int i = 0; i < 50; ++i)
+	{
+		auto destroyed = std::make_shared<std::atomic<bool>>(false);
+		std::unique_ptr<TimerWheel> wheel(new TimerWheel(service, 1, 8));
+		wheel->Start();
+		
+		for (uint delay_ms = 1; delay_ms <= 8; ++delay_ms)
+		{
+			wheel->Schedule(delay_ms, [&fired, &late, destroyed]()
+			{
+				++fired;
+				if (*destroyed)
+					++late;
+			});
+		}
+		
+		std::this_thread::sleep_for(std::chrono::milliseconds(i % 5));
+		wheel.reset();
+		*destroyed = true;
+	}
+	
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	
+	work.reset();
+	for (auto& th : io)
+		th.join();
+	
+	PA_ASSERT(late == 0);
+	
+	std::cout << fired << " of " << 50 * 8 << " timers fired before their wheels were destroyed" << std::endl;
+	std::cout << "------------- Finished testing timer wheel destroy while running --" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/timer_wheel_destroy_while_running", timer_wheel_destroy_while_running);
@@ -0,0 +1,668 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/webserver.h"
+#include "webserver/traffic_capture.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+#include "webserver/tests/bench_common.h"
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <fstream>
+
+using namespace net;
+using namespace net::tests;
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// Replay of traffic captured by TrafficCapture (WebServerParams::capture_path): each captured connection gets a client
+// connection of its own, its requests are sent in order, each not earlier than its 't_us' since start divided by speed.
+// So both request rate and concurrency of the original load are kept; speed 2 plays it twice as fast. Latency counts
+// from due time, as in open loop of http_bench. Connections are asynchronous (see ReplayConnection) and share a pool of
+// up to 4 client threads, so a capture of thousands of connections doesn't need thousands of threads.
+//
+// Requests are rebuilt from captured heads: redacted headers are left out, body is 'body_bytes' of filler. Requests
+// captured over TLS are sent to HTTPS port.
+//
+// Environment: WEBSERVER_REPLAY_FILE (capture to play; none - self-test: capture of a few requests is made by
+// in-process WebServer and played back to it), WEBSERVER_REPLAY_HOST (127.0.0.1), WEBSERVER_REPLAY_PORT (80),
+// WEBSERVER_REPLAY_HTTPS_PORT (443), WEBSERVER_REPLAY_SPEED (1), WEBSERVER_REPLAY_JSON (output, traffic_replay.json).
+//----------------------------------------------------------------------------------------------------------------------
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+	
+	struct CapturedRequest
+	{
+		uint64_t t_us = 0;
+		uint64_t conn = 0;
+		bool tls = false;
+		std::string method;
+		std::string target;
+		std::string version;
+		std::vector<std::pair<std::string, std::string>> headers;
+		size_t body_bytes = 0;
+	};
+	
+	struct ReplayResult
+	{
+		size_t connections = 0;
+		double seconds = 0;
+		uint64_t errors = 0;														// I/O errors
+		uint64_t not_ok = 0;														// answered, but not 200
+		std::vector<uint64_t> latencies_us;
+	};
+	
+	class ReplayHandler : public HTTP::HTTPRequestHandler
+	{
+	public:
+		void HandleRequest(HTTP::HTTPRequest& req, HTTP::HTTPResponse& rep) override
+		{
+			rep.status = HTTP::Schema::StatusCode::ok;
+			rep.content = std::to_string(req.content.size());
+			rep.headers["Content-Type"] = "text/plain";
+			rep.headers["Content-Length"] = std::to_string(rep.content.size());
+		}
+	};
+	
+	// JSON string at 'pos' (opening quote), as written by TrafficCapture; 'pos' is moved past closing quote
+	bool read_string(const std::string& s, size_t& pos, std::string& out)
+	{
+		out.clear();
+		if (pos >= s.size() || s[pos] != '"')
+			return false;
+		
+		for (++pos; pos < s.size(); ++pos)
+		{
+			char c = s[pos];
+			if (c == '"')
+			{
+				++pos;
+				return true;
+			}
+			
+			if (c != '\\')
+			{
+				out += c;
+				continue;
+			}
+			
+			if (++pos == s.size())
+				return false;
+			
+			if (s[pos] == 'u' && pos + 4 < s.size())
+			{
+				out += static_cast<char>(std::stoul(s.substr(pos + 1, 4), nullptr, 16));
+				pos += 4;
+			}
+			else
+			{
+				out += s[pos];
+			}
+		}
+		
+		return false;
+	}
+	
+	// Scalar value at 'pos' (number, true, false), up to ',' or '}'
+	std::string read_scalar(const std::string& s, size_t& pos)
+	{
+		size_t end = s.find_first_of(",}", pos);
+		std::string value = s.substr(pos, end - pos);
+		pos = end;
+		
+		return value;
+	}
+	
+	// One line of capture; false for {"dropped":..} lines and malformed ones
+	bool parse_line(const std::string& line, CapturedRequest& r)
+	{
+		size_t pos = line.find('{');
+		if (pos == std::string::npos)
+			return false;
+		
+		bool has_method = false;
+		std::string key, value;
+		
+		for (++pos; pos < line.size() && line[pos] != '}'; )
+		{
+			if (line[pos] == ',')
+				++pos;
+			
+			if (!read_string(line, pos, key) || pos >= line.size() || line[pos++] != ':' || pos >= line.size())
+				return false;
+			
+			if (key == "headers")
+			{
+				if (line[pos++] != '{')
+					return false;
+				
+				while (pos < line.size() && line[pos] != '}')
+				{
+					if (line[pos] == ',')
+						++pos;
+					
+					std::string name;
+					if (!read_string(line, pos, name) || pos >= line.size() || line[pos++] != ':' ||
+						!read_string(line, pos, value))
+						return false;
+					
+					r.headers.emplace_back(name, value);
+				}
+				++pos;
+			}
+			else if (line[pos] == '"')
+			{
+				if (!read_string(line, pos, value))
+					return false;
+				
+				if (key == "method")
+				{
+					r.method = value;
+					has_method = true;
+				}
+				else if (key == "target")
+					r.target = value;
+				else if (key == "version")
+					r.version = value;
+			}
+			else
+			{
+				value = read_scalar(line, pos);
+				
+				if (key == "t_us")
+					r.t_us = std::stoull(value);
+				else if (key == "conn")
+					r.conn = std::stoull(value);
+				else if (key == "tls")
+					r.tls = (value == "true");
+				else if (key == "body_bytes")
+					r.body_bytes = std::stoul(value);
+			}
+		}
+		
+		return has_method && !r.target.empty();
+	}
+	
+	// Captured requests grouped by connection, each group in order of time
+	std::map<uint64_t, std::vector<CapturedRequest>> read_capture(const std::string& path, size_t& dropped)
+	{
+		std::map<uint64_t, std::vector<CapturedRequest>> conns;
+		dropped = 0;
+		
+		std::ifstream in(path);
+		std::string line;
+		
+		while (std::getline(in, line))
+		{
+			CapturedRequest r;
+			if (parse_line(line, r))
+				conns[r.conn].push_back(std::move(r));
+			else if (line.compare(0, 11, "{\"dropped\":") == 0)
+				dropped += std::stoul(line.substr(11));
+		}
+		
+		for (auto& c : conns)
+			std::stable_sort(c.second.begin(), c.second.end(), [](const CapturedRequest& a, const CapturedRequest& b)
+			{
+				return a.t_us < b.t_us;
+			});
+		
+		return conns;
+	}
+	
+	std::string build_request(const CapturedRequest& r, const std::string& host)
+	{
+		std::string s = r.method + " " + r.target + " HTTP/" + (r.version.empty() ? "1.1" : r.version) + "\r\n";
+		bool has_host = false;
+		
+		for (auto& h : r.headers)
+		{
+			if (h.second == "<redacted>" || h.first == "content-length" || h.first == "transfer-encoding")
+				continue;
+			
+			has_host = has_host || h.first == "host";
+			s += h.first + ": " + h.second + "\r\n";
+		}
+		
+		if (!has_host)
+			s += "host: " + host + "\r\n";
+		
+		if (r.body_bytes)
+			s += "content-length: " + std::to_string(r.body_bytes) + "\r\n";
+		
+		s += "\r\n";
+		s.append(r.body_bytes, 'x');
+		
+		return s;
+	}
+	
+	// Content length of response head, false unless it's 200
+	bool parse_head(const std::string& header, size_t& content_length)
+	{
+		content_length = 0;
+		auto pos = header.find("Content-Length: ");
+		if (pos != std::string::npos)
+			content_length = std::stoul(header.substr(pos + 16));
+		
+		return header.compare(0, 12, "HTTP/1.1 200") == 0 || header.compare(0, 12, "HTTP/1.0 200") == 0;
+	}
+	
+	// Reads one response, returns false unless it's 200
+	template<typename TStream>
+	bool read_response(TStream& s, boost::asio::streambuf& buf)
+	{
+		size_t header_size = boost::asio::read_until(s, buf, "\r\n\r\n");
+		
+		std::string header(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + header_size);
+		buf.consume(header_size);
+		
+		size_t content_length = 0;
+		bool ok = parse_head(header, content_length);
+		
+		if (buf.size() < content_length)
+			boost::asio::read(s, buf, boost::asio::transfer_exactly(content_length - buf.size()));
+		buf.consume(content_length);
+		
+		return ok;
+	}
+	
+	using OpenHandler = std::function<void(const error_code&)>;
+	
+	void async_open(TCPSocket& s, const NetEndpoint& endpoint, OpenHandler handler)
+	{
+		s.async_connect(endpoint, [&s, handler](const error_code& ec)
+		{
+			error_code ignored;
+			if (!ec)
+				s.set_option(tcp_flags::no_delay(true), ignored);
+			
+			handler(ec);
+		});
+	}
+	
+	void async_open(SSLSocket& s, const NetEndpoint& endpoint, OpenHandler handler)
+	{
+		s.lowest_layer().async_connect(endpoint, [&s, handler](const error_code& ec)
+		{
+			if (ec)
+			{
+				handler(ec);
+				return;
+			}
+			
+			error_code ignored;
+			s.lowest_layer().set_option(tcp_flags::no_delay(true), ignored);
+			s.async_handshake(SSLSocket::client, handler);
+		});
+	}
+	
+	struct ConnectionStats
+	{
+		std::vector<uint64_t> latencies;
+		uint64_t errors = 0;
+		uint64_t not_ok = 0;
+	};
+	
+	// Client of one captured connection, driven by handlers on client pool: waits for due time of the next request
+	// (timer), connects if not connected, writes request and reads response, then goes to the next request. Only one
+	// operation of a connection is in flight at a time, so its requests keep their order and need no strand.
+	// I/O error counts and drops the connection, next request reconnects.
+	template<typename TStream>
+	class ReplayConnection : public std::enable_shared_from_this<ReplayConnection<TStream>>
+	{
+	public:
+		using Factory = std::function<std::unique_ptr<TStream>()>;
+		
+		ReplayConnection(IOService& service, Factory factory, const NetEndpoint& endpoint,
+		                 const std::vector<CapturedRequest>& requests, const std::string& host, double speed,
+		                 Clock::time_point start, ConnectionStats& stats)
+			: factory_(std::move(factory)), endpoint_(endpoint), requests_(requests), host_(host), speed_(speed),
+			  start_(start), stats_(stats), timer_(service) {}
+		
+		void Start()
+		{
+			next();
+		}
+	
+	private:
+		void next()
+		{
+			if (index_ == requests_.size())
+				return;
+			
+			due_ = start_ + std::chrono::microseconds(static_cast<int64_t>(requests_[index_].t_us / speed_));
+			
+			auto self = this->shared_from_this();
+			timer_.expires_at(due_);
+			timer_.async_wait([self](const error_code&) { self->send(); });
+		}
+		
+		void send()
+		{
+			auto self = this->shared_from_this();
+			
+			if (!s_)
+			{
+				buf_.consume(buf_.size());
+				s_ = factory_();
+				async_open(*s_, endpoint_, [self](const error_code& ec)
+				{
+					if (ec)
+						self->failed();
+					else
+						self->send();
+				});
+				return;
+			}
+			
+			request_ = build_request(requests_[index_], host_);
+			boost::asio::async_write(*s_, boost::asio::buffer(request_), [self](const error_code& ec, size_t)
+			{
+				if (ec)
+				{
+					self->failed();
+					return;
+				}
+				
+				boost::asio::async_read_until(*self->s_, self->buf_, "\r\n\r\n",
+					[self](const error_code& ec, size_t header_size) { self->handle_head(ec, header_size); });
+			});
+		}
+		
+		void handle_head(const error_code& ec, size_t header_size)
+		{
+			if (ec)
+			{
+				failed();
+				return;
+			}
+			
+			std::string header(boost::asio::buffers_begin(buf_.data()),
+			                   boost::asio::buffers_begin(buf_.data()) + header_size);
+			buf_.consume(header_size);
+			
+			size_t content_length = 0;
+			bool ok = parse_head(header, content_length);
+			
+			auto self = this->shared_from_this();
+			auto done = [self, ok, content_length](const error_code& ec, size_t)
+			{
+				if (ec)
+				{
+					self->failed();
+					return;
+				}
+				
+				self->buf_.consume(content_length);
+				self->answered(ok);
+			};
+			
+			if (buf_.size() < content_length)
+				boost::asio::async_read(*s_, buf_, boost::asio::transfer_exactly(content_length - buf_.size()), done);
+			else
+				done(error_code(), 0);
+		}
+		
+		void answered(bool ok)
+		{
+			if (!ok)
+				++stats_.not_ok;
+			
+			auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - due_);
+			stats_.latencies.push_back(latency.count());
+			
+			++index_;
+			next();
+		}
+		
+		void failed()
+		{
+			++stats_.errors;
+			s_.reset();																/// next request reconnects
+			
+			++index_;
+			next();
+		}
+	
+	private:
+		Factory factory_;
+		NetEndpoint endpoint_;
+		const std::vector<CapturedRequest>& requests_;
+		std::string host_;
+		double speed_;
+		Clock::time_point start_;
+		ConnectionStats& stats_;
+		
+		boost::asio::steady_timer timer_;
+		std::unique_ptr<TStream> s_;
+		boost::asio::streambuf buf_;
+		std::string request_;
+		size_t index_ = 0;
+		Clock::time_point due_;
+	};
+	
+	ReplayResult replay(const std::map<uint64_t, std::vector<CapturedRequest>>& conns, const std::string& host,
+	                    uint16_t http_port, uint16_t https_port, double speed)
+	{
+		IOService client_service;
+		SSLContext client_context(SSLContext::tlsv12_client);
+		client_context.set_verify_mode(boost::asio::ssl::verify_none);
+		
+		const auto address = boost::asio::ip::address::from_string(host);
+		const NetEndpoint http_endpoint(address, http_port);
+		const NetEndpoint https_endpoint(address, https_port);
+		
+		auto make_http = [&] { return std::unique_ptr<TCPSocket>(new TCPSocket(client_service)); };
+		auto make_https = [&] { return std::unique_ptr<SSLSocket>(new SSLSocket(client_service, client_context)); };
+		
+		const size_t n = conns.size();
+		std::vector<ConnectionStats> stats(n);
+		
+		auto start = Clock::now() + std::chrono::milliseconds(10);
+		
+		size_t i = 0;
+		for (auto& c : conns)														/// each waits for its first request
+		{
+			auto& requests = c.second;
+			if (requests.front().tls)
+				std::make_shared<ReplayConnection<SSLSocket>>(client_service, make_https, https_endpoint, requests,
+					host, speed, start, stats[i])->Start();
+			else
+				std::make_shared<ReplayConnection<TCPSocket>>(client_service, make_http, http_endpoint, requests,
+					host, speed, start, stats[i])->Start();
+			++i;
+		}
+		
+		std::vector<std::thread> pool;												/// till all connections are done
+		for (uint t = 0; t < std::min(std::max(std::thread::hardware_concurrency(), 1u), 4u); ++t)
+			pool.emplace_back([&client_service] { client_service.run(); });
+		
+		for (auto& t : pool)
+			t.join();
+		
+		ReplayResult result;
+		result.connections = n;
+		result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		
+		for (auto& s : stats)
+		{
+			result.errors += s.errors;
+			result.not_ok += s.not_ok;
+			result.latencies_us.insert(result.latencies_us.end(), s.latencies.begin(), s.latencies.end());
+		}
+		
+		std::sort(result.latencies_us.begin(), result.latencies_us.end());
+		return result;
+	}
+	
+	uint64_t percentile(const std::vector<uint64_t>& sorted, double q)
+	{
+		if (sorted.empty())
+			return 0;
+		
+		return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+	}
+	
+	std::string to_json(const ReplayResult& r, double speed, size_t dropped)
+	{
+		std::ostringstream ss;
+		ss << "{\"connections\":" << r.connections << ",\"speed\":" << speed << ",\"requests\":" << r.latencies_us.size()
+		   << ",\"errors\":" << r.errors << ",\"not_ok\":" << r.not_ok << ",\"dropped_in_capture\":" << dropped
+		   << ",\"rps\":" << static_cast<uint64_t>(r.latencies_us.size() / std::max(r.seconds, 1e-9))
+		   << ",\"p50_us\":" << percentile(r.latencies_us, 0.5) << ",\"p90_us\":" << percentile(r.latencies_us, 0.9)
+		   << ",\"p99_us\":" << percentile(r.latencies_us, 0.99)
+		   << ",\"max_us\":" << (r.latencies_us.empty() ? 0 : r.latencies_us.back()) << "}";
+		
+		return ss.str();
+	}
+}
+
+
+// Capture format: sensitive headers are redacted, cookies and query values too, heads and body sizes are kept and read
+// back.
+void traffic_capture_format()
+{
+	std::cout << "+++++++++++++ Testing traffic capture format +++++++++++++++++++++++" << std::endl;
+	
+	HTTP::HTTPRequest req;
+	req.method = "POST";
+	req.target = "/api/v1/\"items\"?q=secret-query&page=2&flag";
+	req.http_version_major = 1;
+	req.http_version_minor = 1;
+	req.headers["host"] = "example.com";
+	req.headers["authorization"] = "Bearer secret-token";
+	req.headers["x-trace"] = "a\\b";
+	req.cookies.insert({ "SID", HTTP::Cookie() });
+	req.content = "12345";
+	
+	PA_ASSERT(TrafficCapture::IsSensitive("authorization") && TrafficCapture::IsSensitive("cookie"));
+	PA_ASSERT(!TrafficCapture::IsSensitive("host"));
+	
+	std::string line;
+	TrafficCapture::Format(42, 7, req, true, line);
+	
+	PA_ASSERT(line.find("secret-token") == std::string::npos && line.find("secret-query") == std::string::npos);
+	PA_ASSERT(line.find("\"cookie\":\"<redacted>\"") != std::string::npos);
+	PA_ASSERT(line.back() == '\n');
+	
+	CapturedRequest r;
+	PA_ASSERT(parse_line(line, r));
+	PA_ASSERT(r.t_us == 42 && r.conn == 7 && r.tls && r.body_bytes == 5);
+	PA_ASSERT(r.method == "POST" && r.target == "/api/v1/\"items\"?q=&page=&flag" && r.version == "1.1");
+	
+	std::string request = build_request(r, "127.0.0.1");
+	PA_ASSERT(request.compare(0, 45, "POST /api/v1/\"items\"?q=&page=&flag HTTP/1.1\r\n") == 0);
+	PA_ASSERT(request.find("authorization") == std::string::npos && request.find("cookie") == std::string::npos);
+	PA_ASSERT(request.find("x-trace: a\\b\r\n") != std::string::npos);
+	PA_ASSERT(request.find("content-length: 5\r\n\r\nxxxxx") != std::string::npos);
+	
+	CapturedRequest dropped;
+	PA_ASSERT(!parse_line("{\"dropped\":3}", dropped));
+	
+	std::cout << "------------- Finished testing traffic capture format --------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/traffic_capture_format", traffic_capture_format);
+
+
+
+// Replays WEBSERVER_REPLAY_FILE against a running server; without it, captures a few requests of in-process server
+// and replays them back.
+void traffic_replay()
+{
+	if (!bench_enabled("traffic replay"))
+		return;
+	
+	std::cout << "+++++++++++++ Testing traffic replay +++++++++++++++++++++++++++++++" << std::endl;
+	
+	const double speed = std::max(std::stod(env("WEBSERVER_REPLAY_SPEED", "1")), 1e-3);
+	const std::string output = env("WEBSERVER_REPLAY_JSON", "traffic_replay.json");
+	std::string file = env("WEBSERVER_REPLAY_FILE", "");
+	
+	size_t dropped = 0;
+	ReplayResult result;
+	
+	if (!file.empty())
+	{
+		auto conns = read_capture(file, dropped);
+		PA_ASSERT(!conns.empty());
+		
+		result = replay(conns, env("WEBSERVER_REPLAY_HOST", "127.0.0.1"),
+			static_cast<uint16_t>(std::stoul(env("WEBSERVER_REPLAY_PORT", "80"))),
+			static_cast<uint16_t>(std::stoul(env("WEBSERVER_REPLAY_HTTPS_PORT", "443"))), speed);
+	}
+	else
+	{
+		file = (fs::GetProcessRootDirectory() / "traffic_replay_capture.jsonl").string();
+		fs::remove(file);
+		
+		IOService main_service, acceptor_service;
+		std::unique_ptr<IOService::work> main_work(new IOService::work(main_service));
+		std::unique_ptr<IOService::work> acceptor_work(new IOService::work(acceptor_service));
+		
+		WebServerParams params("127.0.0.1", 18084, 18447);
+		params.capture_path = file;
+		params.capture_sample_every = 2;												/// 2nd and 4th connections
+		
+		std::unique_ptr<WebServer> server(new WebServer(main_service, acceptor_service, params,
+			[] { return std::unique_ptr<HTTP::HTTPRequestHandler>(new ReplayHandler()); }));
+		server->Start();
+		
+		std::vector<std::thread> io_threads;
+		io_threads.emplace_back([&main_service] { main_service.run(); });
+		io_threads.emplace_back([&acceptor_service] { acceptor_service.run(); });
+		
+		IOService client_service;
+		const NetEndpoint endpoint(boost::asio::ip::address_v4::loopback(), params.local_http_port);
+		
+		const std::string requests =
+			"GET /a HTTP/1.1\r\nHost: 127.0.0.1\r\nCookie: SID=secret-sid\r\n\r\n"
+			"POST /b HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Basic c2VjcmV0\r\nContent-Length: 4\r\n\r\nbody";
+		
+		for (int c = 0; c < 4; ++c)
+		{
+			TCPSocket s(client_service);
+			s.connect(endpoint);
+			boost::asio::write(s, boost::asio::buffer(requests));
+			
+			boost::asio::streambuf buf;
+			PA_ASSERT(read_response(s, buf) && read_response(s, buf));
+		}
+		
+		server->capture().Stop();														/// flushes; replay isn't captured
+		PA_ASSERT(server->capture().Written() == 4 && server->capture().Dropped() == 0);
+		
+		std::ifstream in(file);
+		std::string captured((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		PA_ASSERT(captured.find("secret") == std::string::npos && captured.find("c2VjcmV0") == std::string::npos);
+		
+		auto conns = read_capture(file, dropped);
+		PA_ASSERT(conns.size() == 2);
+		for (auto& c : conns)
+			PA_ASSERT(c.second.size() == 2 && c.second[1].method == "POST" && c.second[1].body_bytes == 4);
+		
+		result = replay(conns, "127.0.0.1", params.local_http_port, params.local_https_port, speed);
+		PA_ASSERT(result.latencies_us.size() == 4 && result.not_ok == 0);
+		
+		server->Stop();
+		main_service.stop();
+		acceptor_service.stop();
+		for (auto& t : io_threads)
+			t.join();
+		server.reset();
+		
+		fs::remove(file);
+	}
+	
+	std::string json = to_json(result, speed, dropped);
+	std::ofstream(output) << json << "\n";
+	std::cout << json << std::endl;
+	
+	PA_ASSERT(result.errors == 0);
+	
+	std::cout << "------------- Finished testing traffic replay ----------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/bench/traffic_replay", traffic_replay);
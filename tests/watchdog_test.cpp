@@ -0,0 +1,55 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/watchdog.h"
+
+using namespace net;
+
+
+void watchdog_blocking_handler(int ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Handler blocking I/O thread is reported once, with context and stack; quick handlers and nested scopes are not.
+void watchdog_stall()
+{
+	std::cout << "+++++++++++++ Testing watchdog stall ++++++++++++++++++++++++++++++" << std::endl;
+	
+	Metrics metrics;
+	Watchdog watchdog(20, metrics, true);
+	
+	std::vector<WatchdogStall> stalls;
+	ptl::mutex mx;
+	watchdog.OnStall([&](const WatchdogStall& stall) { boost::lock_guard<ptl::mutex> lck(mx); stalls.push_back(stall); });
+	watchdog.Start();
+	
+	pauuid conn_id = uuid_generate();
+	
+	std::thread io([&] {
+		for (int i = 0; i < 10; ++i)
+		{
+			Watchdog::Scope watched(watchdog, "WS onmessagein", nullptr, 0, &conn_id);
+		}
+		
+		Watchdog::Scope watched(watchdog, "HTTP handler", nullptr, 7, nullptr);
+		Watchdog::Scope nested(watchdog, "nested", nullptr, 8, nullptr);
+		watchdog_blocking_handler(150);
+	});
+	io.join();
+	
+	watchdog.Stop();
+	
+	PA_ASSERT(stalls.size() == 1 && watchdog.Stalls() == 1);
+	PA_ASSERT(stalls[0].what == "HTTP handler" && stalls[0].request == 7 && stalls[0].ms >= 20);
+#if defined(__linux__)
+	PA_ASSERT(!stalls[0].stack.empty());
+#endif
+	
+	PA_ASSERT(metrics.Total(MetricStage::io_stall) == 1 && metrics.Quantile(MetricStage::io_stall, 1) >= 150000);
+	PA_ASSERT(metrics.Value(MetricCounter::io_stalls) == 1);
+	
+	std::cout << "------------- Finished testing watchdog stall ---------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/watchdog_stall", watchdog_stall);
@@ -0,0 +1,278 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+#include "webserver/tests/bench_common.h"
+
+#include <chrono>
+#include <future>
+
+using namespace net;
+using namespace net::tests;
+
+
+namespace
+{
+	class NoContentHandler : public HTTP::HTTPRequestHandler
+	{
+	public:
+		void HandleRequest(HTTP::HTTPRequest&, HTTP::HTTPResponse& rep) override
+		{
+			rep.status = HTTP::Schema::StatusCode::no_content;
+		}
+	};
+	
+	// WebServer over MemSocket, whose main_service runs in one thread, so that posting a blocking handler there
+	// freezes every connection's writer while test pushes.
+	class Bench
+	{
+	public:
+		Bench()
+			: main_work_(new IOService::work(main_service_)), acceptor_work_(new IOService::work(acceptor_service_))
+		{
+			WebServerParams params("127.0.0.1", 18083, 18447);
+			params.ws_ping_interval_sec = 0;
+			params.ws_send_queue_capacity = 8;
+			
+			server_.reset(new WebServer(main_service_, acceptor_service_, params,
+				[] { return std::unique_ptr<HTTP::HTTPRequestHandler>(new NoContentHandler()); }));
+			
+			server_->WSOnEvents(WS::WSEventType::open, [this](const std::vector<WS::WSEvent>& events)
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				for (auto& e : events)
+					opened_.push_back(e.id);
+			});
+			server_->WSOnEvents(WS::WSEventType::messageout, [this](const std::vector<WS::WSEvent>& events)
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				for (auto& e : events)
+					++messages_out_[e.id];
+			});
+			server_->Start();
+			
+			main_io_ = std::thread([this] { main_service_.run(); });
+			acceptor_io_ = std::thread([this] { acceptor_service_.run(); });
+		}
+		
+		~Bench()
+		{
+			server_->Stop();
+			main_service_.stop();
+			acceptor_service_.stop();
+			main_io_.join();
+			acceptor_io_.join();
+			server_.reset();
+		}
+		
+		WebServer& server() { return *server_; }
+		
+		// handshake of a new WS client, returns its connection id
+		pauuid Connect(std::shared_ptr<MemSocket>& client)
+		{
+			size_t known = opened();
+			client = ws_connect(*server_, main_service_, client_service_, "/chat");
+			PA_ASSERT(client);
+			
+			for (int i = 0; i < 500 && opened() == known; ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			PA_ASSERT(opened_.size() == known + 1);
+			return opened_.back();
+		}
+		
+		// messageout events of connection, once there are 'expected' of them (or 5 s passed) and extra ones had time
+		// to arrive
+		size_t MessagesOut(const pauuid& id, size_t expected)
+		{
+			auto count = [&]()
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				return messages_out_[id];
+			};
+			
+			for (int i = 0; i < 500 && count() < expected; ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			
+			return count();
+		}
+		
+		// blocks main_service until returned promise is set
+		std::promise<void> Freeze()
+		{
+			std::promise<void> release;
+			auto released = release.get_future().share();
+			auto entered = std::make_shared<std::promise<void>>();
+			auto writer_blocked = entered->get_future();
+			
+			main_service_.post([released, entered] { entered->set_value(); released.wait(); });
+			writer_blocked.wait();
+			
+			return release;
+		}
+	
+	private:
+		size_t opened()
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			return opened_.size();
+		}
+	
+	private:
+		IOService main_service_, acceptor_service_, client_service_;
+		std::unique_ptr<IOService::work> main_work_, acceptor_work_;
+		std::unique_ptr<WebServer> server_;
+		std::thread main_io_, acceptor_io_;
+		
+		ptl::mutex mx_;
+		std::vector<pauuid> opened_;
+		std::map<pauuid, size_t> messages_out_;
+	};
+	
+	// next short unmasked frame from server as first byte + payload, empty string at eof
+	std::string read_frame(MemSocket& client)
+	{
+		error_code ec;
+		std::array<uchar, 2> head;
+		boost::asio::read(client, boost::asio::buffer(head), ec);
+		if (ec)
+			return std::string();
+		
+		PA_ASSERT(head[1] < 126);
+		std::string payload(head[1], '\0');
+		boost::asio::read(client, boost::asio::buffer(&payload[0], payload.size()), ec);
+		PA_ASSERT(!ec);
+		
+		return static_cast<char>(head[0]) + payload;
+	}
+	
+	std::string text(const std::string& payload)
+	{
+		return "\x81" + payload;
+	}
+	
+	std::string message(size_t i)														// fixed size, 5 bytes framed
+	{
+		return std::string("m") + static_cast<char>('0' + i / 10) + static_cast<char>('0' + i % 10);
+	}
+}
+
+
+// Each policy over a frozen writer: queue state right after pushes, then what client gets once writer runs.
+void ws_backpressure_policies()
+{
+	std::cout << "+++++++++++++ Testing WS backpressure policies +++++++++++++++++++++++" << std::endl;
+	
+	Bench bench;
+	WebServer& server = bench.server();
+	
+	{
+		std::shared_ptr<MemSocket> client;											/// drop_oldest
+		pauuid id = bench.Connect(client);
+		PA_ASSERT(server.WSSetBackpressure(id, WS::WSBackpressure{ WS::WSOverflowPolicy::drop_oldest, 0 }));
+		
+		auto release = bench.Freeze();
+		for (size_t i = 0; i < 20; ++i)
+			PA_ASSERT(server.WSPush(id, message(i)));
+		
+		WS::WSQueueStats stats;
+		PA_ASSERT(server.WSGetQueueStats(id, stats));
+		PA_ASSERT(stats.depth == 8 && stats.bytes == 8 * 5 && stats.dropped == 12);
+		release.set_value();
+		
+		for (size_t i = 12; i < 20; ++i)
+			PA_ASSERT(read_frame(*client) == text(message(i)));
+		
+		PA_ASSERT(bench.MessagesOut(id, 8) == 8);										/// dropped frames aren't reported
+	}
+	
+	{
+		std::shared_ptr<MemSocket> client;											/// high watermark
+		pauuid id = bench.Connect(client);
+		PA_ASSERT(server.WSSetBackpressure(id, WS::WSBackpressure{ WS::WSOverflowPolicy::drop_oldest, 20 }));
+		
+		auto release = bench.Freeze();
+		for (size_t i = 0; i < 20; ++i)
+			PA_ASSERT(server.WSPush(id, message(i)));
+		
+		WS::WSQueueStats stats;
+		PA_ASSERT(server.WSGetQueueStats(id, stats));
+		PA_ASSERT(stats.depth == 4 && stats.bytes == 20 && stats.dropped == 16);
+		release.set_value();
+		
+		for (size_t i = 16; i < 20; ++i)
+			PA_ASSERT(read_frame(*client) == text(message(i)));
+	}
+	
+	{
+		std::shared_ptr<MemSocket> client;											/// coalesce
+		pauuid id = bench.Connect(client);
+		PA_ASSERT(server.WSSetBackpressure(id, WS::WSBackpressure{ WS::WSOverflowPolicy::coalesce, 0 }));
+		
+		auto release = bench.Freeze();
+		for (size_t i = 0; i < 5; ++i)
+			PA_ASSERT(server.WSPush(id, message(i), "a"));
+		PA_ASSERT(server.WSPush(id, "b", "b"));
+		release.set_value();
+		
+		PA_ASSERT(read_frame(*client) == text(message(4)));
+		PA_ASSERT(read_frame(*client) == text("b"));
+		
+		WS::WSQueueStats stats;
+		PA_ASSERT(server.WSGetQueueStats(id, stats));
+		PA_ASSERT(stats.depth == 0 && stats.coalesced == 4 && stats.dropped == 0);
+		PA_ASSERT(bench.MessagesOut(id, 2) == 2);										/// nor superseded ones
+		
+		for (size_t i = 0; i < 1000; ++i)												/// keys of written frames are pruned
+		{
+			PA_ASSERT(server.WSPush(id, "k", std::to_string(i)));
+			PA_ASSERT(read_frame(*client) == text("k"));
+		}
+	}
+	
+	{
+		std::shared_ptr<MemSocket> client;											/// disconnect
+		pauuid id = bench.Connect(client);
+		
+		auto release = bench.Freeze();
+		for (size_t i = 0; i < 8; ++i)
+			PA_ASSERT(server.WSPush(id, message(i)));
+		server.WSPush(id, message(8));													/// overflow stops connection
+		PA_ASSERT(!server.WSPush(id, message(9)));
+		release.set_value();
+		
+		PA_ASSERT(read_frame(*client).empty());
+	}
+	
+	{
+		std::shared_ptr<MemSocket> client;											/// close frame is never dropped
+		pauuid id = bench.Connect(client);
+		PA_ASSERT(server.WSSetBackpressure(id, WS::WSBackpressure{ WS::WSOverflowPolicy::drop_oldest, 0 }));
+		
+		auto release = bench.Freeze();
+		for (size_t i = 0; i < 8; ++i)
+			PA_ASSERT(server.WSPush(id, message(i)));
+		PA_ASSERT(server.WSClose(id, 1000));
+		for (size_t i = 8; i < 20; ++i)
+			server.WSPush(id, message(i));												/// dropped, close is the last frame
+		
+		WS::WSQueueStats stats;
+		PA_ASSERT(server.WSGetQueueStats(id, stats));
+		PA_ASSERT(stats.depth == 8 && stats.dropped == 1);
+		release.set_value();
+		
+		for (size_t i = 1; i < 8; ++i)
+			PA_ASSERT(read_frame(*client) == text(message(i)));
+		PA_ASSERT(read_frame(*client) == std::string("\x88\x02\x03\xe8", 4));
+		PA_ASSERT(read_frame(*client).empty());
+		
+		PA_ASSERT(bench.MessagesOut(id, 7) == 7);										/// nor close frame
+	}
+	
+	std::cout << "------------- Finished testing WS backpressure policies --------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_backpressure_policies", ws_backpressure_policies);
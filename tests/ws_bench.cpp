@@ -0,0 +1,536 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/webserver.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+#include "webserver/tests/bench_common.h"
+
+#include <atomic>
+#include <fstream>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using namespace net;
+using namespace net::tests;
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// WS fan-out benchmark: WebServer runs in-process, WEBSERVER_WSBENCH_WS plain and WEBSERVER_WSBENCH_WSS secure
+// clients connect over loopback, then WEBSERVER_WSBENCH_PRODUCERS threads call WebServer::WSPush to them round robin
+// at WEBSERVER_WSBENCH_RATE messages per second in total (open loop: pushes are due at fixed times) for
+// WEBSERVER_WSBENCH_SECONDS.
+//
+// Each message carries its due time, so client measures push latency from due time to the frame read, which
+// includes the producer falling behind, WSConnection's send queue and its batched writes. Reported:
+// - push latency percentiles;
+// - server CPU - sum of CPU time I/O threads running main_service spent from the first push till clients drained
+//   (Linux; connection handshakes and teardown are not counted), and process CPU as a whole over the same window;
+// - memory per connection - resident set growth while clients were connecting, client side included (Linux);
+// - pushes failed (connection is gone), frames dropped by backpressure policy (WEBSERVER_WSBENCH_POLICY: disconnect,
+//   drop_oldest) and connections stopped during the run.
+//
+// Results go to JSON file WEBSERVER_WSBENCH_JSON (ws_bench.json), one line. For 10k+ connections raise open files
+// limit: each connection takes two descriptors, both ends are in this process.
+//----------------------------------------------------------------------------------------------------------------------
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+	
+	const std::string fanout_path = "/fanout/";
+	
+	uint64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+	
+	// CPU clock of the calling thread, which others may read while it runs (Linux)
+#if defined(__linux__)
+	using CpuClock = clockid_t;
+	
+	CpuClock this_thread_cpu_clock()
+	{
+		clockid_t clock;
+		pthread_getcpuclockid(pthread_self(), &clock);
+		return clock;
+	}
+	
+	double cpu_seconds(CpuClock clock)
+	{
+		timespec ts;
+		clock_gettime(clock, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+#else
+	using CpuClock = int;
+	
+	CpuClock this_thread_cpu_clock() { return 0; }
+	double cpu_seconds(CpuClock) { return 0; }
+#endif
+	
+	double process_cpu_seconds()
+	{
+#if defined(__linux__)
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+#else
+		return 0;
+#endif
+	}
+	
+	size_t resident_bytes()
+	{
+#if defined(__linux__)
+		size_t pages = 0, resident = 0;
+		std::ifstream statm("/proc/self/statm");
+		statm >> pages >> resident;
+		return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+		return 0;
+#endif
+	}
+	
+	// Counters shared by all clients; latencies are kept per client thread (see 'thread_latencies')
+	struct FanoutStats
+	{
+		std::atomic<uint64_t> received{0};
+		std::atomic<uint64_t> closed{0};											// close frame or read error
+		std::vector<std::vector<uint64_t>> latencies_us;
+	};
+	
+	thread_local std::vector<uint64_t>* thread_latencies = nullptr;
+	
+	// WS client reading unmasked server frames; payload starts with due time of the push in ns
+	template<typename TStream>
+	class FanoutClient : public std::enable_shared_from_this<FanoutClient<TStream>>
+	{
+	public:
+		FanoutClient(IOService& service, std::unique_ptr<TStream> s, FanoutStats& stats)
+			: s_(std::move(s)), stats_(stats), strand_(service)
+		{}
+		
+		// Sends upgrade request to 'path', returns false unless server switched protocols
+		bool Handshake(const std::string& path)
+		{
+			std::string request = "GET " + path + " HTTP/1.1\r\n"
+				"Host: 127.0.0.1\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+				"Sec-WebSocket-Version: 13\r\n\r\n";
+			
+			boost::asio::write(*s_, boost::asio::buffer(request));
+			
+			boost::asio::streambuf buf;
+			size_t header_size = boost::asio::read_until(*s_, buf, "\r\n\r\n");
+			
+			std::string all(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_end(buf.data()));
+			pending_ = all.substr(header_size);										/// frames read with headers
+			
+			return all.compare(0, 12, "HTTP/1.1 101") == 0;
+		}
+		
+		void Start()
+		{
+			consume();
+			do_read();
+		}
+		
+		void Close()
+		{
+			auto self = this->shared_from_this();
+			
+			strand_.post([this, self]()
+			{
+				error_code ec;
+				s_->lowest_layer().close(ec);
+			});
+		}
+	
+	private:
+		void do_read()
+		{
+			auto self = this->shared_from_this();
+			
+			s_->async_read_some(boost::asio::buffer(buffer_), strand_.wrap([this, self](const error_code& ec, size_t bytes)
+			{
+				if (ec)
+				{
+					if (!closed_)
+						++stats_.closed;
+					closed_ = true;
+					return;
+				}
+				
+				pending_.append(buffer_.data(), bytes);
+				consume();
+				
+				if (!closed_)
+					do_read();
+			}));
+		}
+		
+		// Handles complete frames at the front of 'pending_'
+		void consume()
+		{
+			size_t pos = 0;
+			
+			for (;;)
+			{
+				if (pending_.size() - pos < 2)
+					break;
+				
+				uchar opcode = static_cast<uchar>(pending_[pos]) & 0x0f;
+				uint64_t length = static_cast<uchar>(pending_[pos + 1]) & 0x7f;
+				size_t header = 2;
+				
+				if (length >= 126)
+				{
+					size_t n = (length == 126) ? 2 : 8;
+					if (pending_.size() - pos < 2 + n)
+						break;
+					
+					length = 0;
+					for (size_t i = 0; i < n; ++i)
+						length = (length << 8) | static_cast<uchar>(pending_[pos + 2 + i]);
+					header += n;
+				}
+				
+				if (pending_.size() - pos < header + length)
+					break;
+				
+				if (opcode == WS::Schema::WSOpcode::close)
+				{
+					if (!closed_)
+						++stats_.closed;
+					closed_ = true;
+				}
+				else if (opcode == WS::Schema::WSOpcode::text || opcode == WS::Schema::WSOpcode::binary)
+				{
+					uint64_t due = std::strtoull(pending_.c_str() + pos + header, nullptr, 10);
+					uint64_t now = now_ns();
+					
+					if (thread_latencies)
+						thread_latencies->push_back(now > due ? (now - due) / 1000 : 0);
+					++stats_.received;
+				}
+				
+				pos += header + length;
+			}
+			
+			pending_.erase(0, pos);
+		}
+	
+	private:
+		std::unique_ptr<TStream> s_;
+		FanoutStats& stats_;
+		Strand strand_;																// read vs 'Close'
+		
+		std::array<char, 4096> buffer_;
+		std::string pending_;														// bytes of incomplete frame
+		bool closed_ = false;
+	};
+	
+	// Plain HTTP requests are not expected here
+	class FanoutHandler : public HTTP::HTTPRequestHandler
+	{
+	public:
+		void HandleRequest(HTTP::HTTPRequest&, HTTP::HTTPResponse& rep) override
+		{
+			rep = HTTP::HTTPResponse::stock_reply(HTTP::Schema::StatusCode::not_found);
+		}
+	};
+	
+	uint64_t percentile(const std::vector<uint64_t>& sorted, double q)
+	{
+		if (sorted.empty())
+			return 0;
+		
+		return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+	}
+}
+
+
+// Push latency, server CPU, memory per connection and overflow losses of WSPush to many WS and WSS clients.
+void ws_fanout_bench()
+{
+	if (!bench_enabled("WS fan-out bench"))
+		return;
+	
+	std::cout << "+++++++++++++ Testing WS fan-out bench +++++++++++++++++++++++++++++" << std::endl;
+	
+	const size_t ws_clients = std::stoul(env("WEBSERVER_WSBENCH_WS", "500"));
+	const size_t wss_clients = std::stoul(env("WEBSERVER_WSBENCH_WSS", "500"));
+	const size_t producers = std::max<size_t>(std::stoul(env("WEBSERVER_WSBENCH_PRODUCERS", "4")), 1);
+	const double rate = std::stod(env("WEBSERVER_WSBENCH_RATE", "20000"));
+	const double seconds = std::stod(env("WEBSERVER_WSBENCH_SECONDS", "3"));
+	const size_t message_size = std::stoul(env("WEBSERVER_WSBENCH_SIZE", "64"));
+	const std::string policy = env("WEBSERVER_WSBENCH_POLICY", "disconnect");
+	const std::string output = env("WEBSERVER_WSBENCH_JSON", "ws_bench.json");
+	const size_t clients = ws_clients + wss_clients;
+	
+	auto root = fs::GetProcessRootDirectory();
+	bool own_certificate = !fs::exists(root / "server.crt") && !fs::exists(root / "server.key");
+	if (own_certificate)
+		PA_ASSERT(make_certificate(root / "server.crt", root / "server.key"));
+	
+	IOService main_service, acceptor_service;
+	std::unique_ptr<IOService::work> main_work(new IOService::work(main_service));
+	std::unique_ptr<IOService::work> acceptor_work(new IOService::work(acceptor_service));
+	
+	WebServerParams params("127.0.0.1", 18081, 18444);
+	params.ws_ping_interval_sec = 0;													/// clients don't pong
+	params.http_slow_request_ms = 0;
+	params.io_stall_ms = 0;
+	params.metrics = true;															/// gauges show teardown
+	if (policy == "drop_oldest")
+		params.ws_backpressure.policy = WS::WSOverflowPolicy::drop_oldest;
+	
+	std::vector<pauuid> ids(clients);
+	std::atomic<size_t> opened(0);
+	std::atomic<uint64_t> server_closed(0);
+	
+	std::unique_ptr<WebServer> server(new WebServer(main_service, acceptor_service, params,
+		[] { return std::unique_ptr<HTTP::HTTPRequestHandler>(new FanoutHandler()); }));
+	
+	server->WSOnEvents(WS::WSEventType::open, [&](const std::vector<WS::WSEvent>& events)	/// client index is
+	{																						/// in its path
+		for (auto& e : events)
+		{
+			std::string path = e.uri.path();
+			if (path.compare(0, fanout_path.size(), fanout_path) != 0)
+				continue;
+			
+			ids[std::stoul(path.substr(fanout_path.size()))] = e.id;
+			++opened;
+		}
+	});
+	server->WSOnEvents(WS::WSEventType::close, [&](const std::vector<WS::WSEvent>& events)
+	{
+		server_closed += events.size();
+	});
+	server->Start();
+	
+	std::mutex cpu_mx;
+	std::vector<CpuClock> io_clocks;
+	
+	auto io_cpu_seconds = [&]()
+	{
+		std::lock_guard<std::mutex> lock(cpu_mx);
+		
+		double seconds = 0;
+		for (auto clock : io_clocks)
+			seconds += cpu_seconds(clock);
+		return seconds;
+	};
+	
+	std::vector<std::thread> io_threads;
+	for (uint i = 0; i < std::max(std::thread::hardware_concurrency(), 2u); ++i)
+		io_threads.emplace_back([&]
+		{
+			{
+				std::lock_guard<std::mutex> lock(cpu_mx);
+				io_clocks.push_back(this_thread_cpu_clock());
+			}
+			
+			main_service.run();
+		});
+	io_threads.emplace_back([&acceptor_service] { acceptor_service.run(); });
+	
+	IOService client_service;
+	std::unique_ptr<IOService::work> client_work(new IOService::work(client_service));
+	SSLContext client_context(SSLContext::tlsv12_client);
+	client_context.set_verify_mode(boost::asio::ssl::verify_none);
+	
+	const NetEndpoint ws_endpoint(boost::asio::ip::address_v4::loopback(), params.local_http_port);
+	const NetEndpoint wss_endpoint(boost::asio::ip::address_v4::loopback(), params.local_https_port);
+	
+	FanoutStats stats;
+	const size_t client_threads = std::max(std::thread::hardware_concurrency() / 2, 2u);
+	stats.latencies_us.resize(client_threads);
+	
+	std::vector<std::thread> client_io;
+	for (size_t i = 0; i < client_threads; ++i)
+		client_io.emplace_back([&, i]
+		{
+			thread_latencies = &stats.latencies_us[i];
+			client_service.run();
+		});
+	
+	// connecting - by several threads, synchronously
+	size_t rss_before = resident_bytes();
+	
+	std::mutex clients_mx;
+	std::vector<std::function<void()>> closers;
+	std::atomic<size_t> failed(0);
+	
+	std::vector<std::thread> connectors;
+	for (size_t t = 0; t < client_threads; ++t)
+		connectors.emplace_back([&, t]
+		{
+			for (size_t i = t; i < clients; i += client_threads)
+			{
+				try
+				{
+					std::string path = fanout_path + std::to_string(i);
+					
+					if (i < ws_clients)
+					{
+						std::unique_ptr<TCPSocket> s(new TCPSocket(client_service));
+						s->connect(ws_endpoint);
+						
+						auto client = std::make_shared<FanoutClient<TCPSocket>>(client_service, std::move(s), stats);
+						if (!client->Handshake(path))
+							throw std::runtime_error("WS handshake failed");
+						
+						client->Start();
+						std::lock_guard<std::mutex> lock(clients_mx);
+						closers.push_back([client] { client->Close(); });
+					}
+					else
+					{
+						std::unique_ptr<SSLSocket> s(new SSLSocket(client_service, client_context));
+						s->lowest_layer().connect(wss_endpoint);
+						s->handshake(SSLSocket::client);
+						
+						auto client = std::make_shared<FanoutClient<SSLSocket>>(client_service, std::move(s), stats);
+						if (!client->Handshake(path))
+							throw std::runtime_error("WSS handshake failed");
+						
+						client->Start();
+						std::lock_guard<std::mutex> lock(clients_mx);
+						closers.push_back([client] { client->Close(); });
+					}
+				}
+				catch (std::exception&)
+				{
+					++failed;
+				}
+			}
+		});
+	
+	for (auto& t : connectors)
+		t.join();
+	
+	for (int i = 0; i < 1000 && opened < clients - failed; ++i)						/// open events are async
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	
+	size_t rss_after = resident_bytes();
+	
+	// pushing
+	std::atomic<uint64_t> pushed(0), push_failed(0);
+	double cpu_before = process_cpu_seconds();
+	double server_cpu_before = io_cpu_seconds();								/// handshakes are not counted
+	
+	const auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+	const auto start = Clock::now() + std::chrono::milliseconds(10);
+	const auto until = start + std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+	
+	std::vector<std::thread> producer_threads;
+	for (size_t p = 0; p < producers; ++p)
+		producer_threads.emplace_back([&, p]
+		{
+			std::string message;
+			
+			for (uint64_t k = 0; ; ++k)
+			{
+				uint64_t n = k * producers + p;
+				auto due = start + interval * static_cast<Clock::rep>(n);
+				if (due >= until)
+					break;
+				
+				std::this_thread::sleep_until(due);
+				
+				message = std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					due.time_since_epoch()).count());
+				message.resize(std::max(message.size(), message_size), ' ');
+				
+				if (server->WSPush(ids[n % clients], message))
+					++pushed;
+				else
+					++push_failed;
+			}
+		});
+	
+	for (auto& t : producer_threads)
+		t.join();
+	
+	for (uint64_t last = ~uint64_t(0); stats.received < pushed && stats.received != last; )	/// till drained or
+	{																							/// stuck
+		last = stats.received;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	
+	double process_cpu = process_cpu_seconds() - cpu_before;
+	double server_cpu = io_cpu_seconds() - server_cpu_before;
+	
+	uint64_t dropped = 0;
+	for (auto& id : ids)
+	{
+		WS::WSQueueStats qs;
+		if (server->WSGetQueueStats(id, qs))
+			dropped += qs.dropped;
+	}
+	
+	uint64_t disconnects = server_closed;
+	
+	// teardown
+	for (auto& close : closers)
+		close();
+	
+	for (int i = 0; i < 500 && server->metrics().Value(MetricGauge::ws_connections) != 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	
+	client_work.reset();
+	client_service.stop();
+	for (auto& t : client_io)
+		t.join();
+	closers.clear();
+	
+	server->Stop();
+	main_work.reset();
+	main_service.stop();
+	acceptor_service.stop();
+	for (auto& t : io_threads)
+		t.join();
+	server.reset();
+	
+	if (own_certificate)
+	{
+		fs::remove(root / "server.crt");
+		fs::remove(root / "server.key");
+	}
+	
+	std::vector<uint64_t> latencies;
+	for (auto& v : stats.latencies_us)
+		latencies.insert(latencies.end(), v.begin(), v.end());
+	std::sort(latencies.begin(), latencies.end());
+	
+	std::ostringstream json;
+	json << "{\"scenario\":\"ws/fanout/" << policy << "\",\"ws\":" << ws_clients << ",\"wss\":" << wss_clients
+	     << ",\"connect_failed\":" << failed << ",\"producers\":" << producers << ",\"rate\":" << rate
+	     << ",\"pushed\":" << pushed << ",\"push_failed\":" << push_failed << ",\"received\":" << stats.received
+	     << ",\"dropped\":" << dropped << ",\"disconnects\":" << disconnects
+	     << ",\"p50_us\":" << percentile(latencies, 0.5) << ",\"p90_us\":" << percentile(latencies, 0.9)
+	     << ",\"p99_us\":" << percentile(latencies, 0.99) << ",\"p999_us\":" << percentile(latencies, 0.999)
+	     << ",\"max_us\":" << (latencies.empty() ? 0 : latencies.back())
+	     << ",\"server_cpu_s\":" << server_cpu << ",\"process_cpu_s\":" << process_cpu
+	     << ",\"bytes_per_connection\":" << (clients && rss_after > rss_before ? (rss_after - rss_before) / clients : 0)
+	     << "}";
+	
+	std::ofstream(output) << json.str() << "\n";
+	std::cout << json.str() << std::endl;
+	
+	PA_ASSERT(failed == 0 && opened == clients);
+	PA_ASSERT(!latencies.empty());
+	
+	std::cout << "------------- Finished testing WS fan-out bench --------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/bench/ws_fanout", ws_fanout_bench);
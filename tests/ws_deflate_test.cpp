@@ -0,0 +1,195 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_deflate.h"
+#include "webserver/tests/bench_env.h"
+
+#include <chrono>
+#include <fstream>
+
+using namespace net;
+using namespace net::tests;
+
+
+// push message alike the ones webengine sends
+static std::string json_update(size_t i)
+{
+	return "{\"type\":\"update\",\"session\":\"5f0c1a2e-8a77-4b6e-9d1e-3c2b7a9f0e11\",\"seq\":" + std::to_string(i) +
+	       ",\"node\":{\"id\":" + std::to_string(i % 17) + ",\"state\":\"running\",\"progress\":" +
+	       std::to_string(i % 100) + ",\"message\":\"Processing data node, please wait\"}}";
+}
+
+
+
+void ws_deflate_negotiation()
+{
+	std::cout << "+++++++++++++ Testing WS permessage-deflate negotiation ++++++++++++++++" << std::endl;
+	
+	WS::WSDeflateOptions options;
+	options.enabled = true;
+	
+	WS::WSDeflateAgreement agreed;
+	std::string response;
+	
+	PA_ASSERT(WS::negotiate_deflate("permessage-deflate; client_max_window_bits", options, agreed, response));
+	PA_ASSERT(agreed.enabled && !agreed.server_no_context_takeover && response == "permessage-deflate");
+	
+	// first offer is unacceptable (window of 8 bits), second one is taken
+	PA_ASSERT(WS::negotiate_deflate("permessage-deflate; server_max_window_bits=8, "
+	                                "permessage-deflate; server_max_window_bits=10", options, agreed, response));
+	PA_ASSERT(agreed.server_max_window_bits == 10 && response == "permessage-deflate; server_max_window_bits=10");
+	
+	PA_ASSERT(!WS::negotiate_deflate("permessage-deflate; unknown_param", options, agreed, response));
+	PA_ASSERT(!WS::negotiate_deflate("x-webkit-deflate-frame", options, agreed, response));
+	
+	options.no_context_takeover = true;
+	PA_ASSERT(WS::negotiate_deflate("permessage-deflate", options, agreed, response));
+	PA_ASSERT(response == "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+	
+	options.enabled = false;
+	PA_ASSERT(!WS::negotiate_deflate("permessage-deflate", options, agreed, response));
+	
+	std::cout << "------------- Finished testing WS permessage-deflate negotiation -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_deflate_negotiation", ws_deflate_negotiation);
+
+
+
+// Round trip of messages through server's deflater and client's inflater (the same class on both sides), in every
+// context takeover mode and at several compression levels: messages come back intact and take less on the wire.
+void ws_deflate_round_trip()
+{
+	std::cout << "+++++++++++++ Testing WS permessage-deflate round trip ++++++++++++++++" << std::endl;
+	
+	const size_t messages = 200;
+	
+	for (bool no_takeover : { false, true })
+	{
+		for (int level : { 1, 6, 9 })
+		{
+			WS::WSDeflateOptions options;
+			options.enabled = true;
+			options.level = level;
+			
+			WS::WSDeflateAgreement agreed;
+			agreed.enabled = true;
+			agreed.server_no_context_takeover = agreed.client_no_context_takeover = no_takeover;
+			
+			WS::WSDeflate server(options, agreed), client(options, agreed);
+			
+			size_t raw_bytes = 0, wire_bytes = 0;
+			std::string deflated, inflated;
+			
+			for (size_t i = 0; i < messages; ++i)
+			{
+				std::string message = json_update(i);
+				
+				deflated.clear();
+				PA_ASSERT(server.Compress(message.data(), message.size(), deflated));
+				PA_ASSERT(client.Decompress(deflated, 1 << 20, inflated) == 0);
+				PA_ASSERT(inflated == message);
+				
+				raw_bytes += message.size();
+				wire_bytes += deflated.size();
+			}
+			
+			PA_ASSERT(wire_bytes < raw_bytes);
+		}
+	}
+	
+	// inflated size is limited, so that small compressed message can't blow up server memory
+	WS::WSDeflateOptions options;
+	WS::WSDeflateAgreement agreed;
+	WS::WSDeflate server(options, agreed), client(options, agreed);
+	
+	std::string bomb(1 << 20, 'a'), deflated, inflated;
+	PA_ASSERT(server.Compress(bomb.data(), bomb.size(), deflated));
+	PA_ASSERT(client.Decompress(deflated, 1 << 16, inflated) == WS::Schema::WSClosureStatus::message_too_big);
+	
+	PA_ASSERT(client.Decompress("garbage, not deflate", 1 << 16, inflated) == WS::Schema::WSClosureStatus::invalid_payload);
+	
+	std::cout << "------------- Finished testing WS permessage-deflate round trip -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_deflate_round_trip", ws_deflate_round_trip);
+
+
+
+// Bandwidth-vs-CPU trade-off of context takeover modes and compression levels on repetitive JSON: wire/raw ratio and
+// ns per message of deflate and inflate, best of 3 runs. Results go to JSON file WEBSERVER_DEFLATE_BENCH_JSON
+// (ws_deflate_bench.json), one mode per line, same way as micro_bench.cpp does.
+void ws_deflate_bench()
+{
+	if (!bench_enabled("WS permessage-deflate bench"))
+		return;
+	
+	std::cout << "+++++++++++++ Testing WS permessage-deflate bench +++++++++++++++++++++" << std::endl;
+	
+	const size_t messages = 20000;
+	
+	std::vector<std::string> corpus;
+	size_t raw_bytes = 0;
+	for (size_t i = 0; i < messages; ++i)
+	{
+		corpus.push_back(json_update(i));
+		raw_bytes += corpus.back().size();
+	}
+	
+	std::ofstream out(env("WEBSERVER_DEFLATE_BENCH_JSON", "ws_deflate_bench.json"));
+	
+	for (bool no_takeover : { false, true })
+	{
+		for (int level : { 1, 6, 9 })
+		{
+			WS::WSDeflateOptions options;
+			options.enabled = true;
+			options.level = level;
+			
+			WS::WSDeflateAgreement agreed;
+			agreed.enabled = true;
+			agreed.server_no_context_takeover = agreed.client_no_context_takeover = no_takeover;
+			
+			size_t wire_bytes = 0;
+			double deflate_ns = std::numeric_limits<double>::max(), inflate_ns = deflate_ns;
+			
+			for (int run = 0; run < 3; ++run)
+			{
+				WS::WSDeflate server(options, agreed), client(options, agreed);
+				
+				std::vector<std::string> deflated(messages);
+				std::string inflated;
+				
+				auto started = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < messages; ++i)
+					PA_ASSERT(server.Compress(corpus[i].data(), corpus[i].size(), deflated[i]));
+				auto deflated_at = std::chrono::steady_clock::now();
+				
+				for (size_t i = 0; i < messages; ++i)
+					PA_ASSERT(client.Decompress(deflated[i], 1 << 20, inflated) == 0);
+				auto inflated_at = std::chrono::steady_clock::now();
+				
+				using Nanoseconds = std::chrono::duration<double, std::nano>;
+				deflate_ns = std::min(deflate_ns, Nanoseconds(deflated_at - started).count());
+				inflate_ns = std::min(inflate_ns, Nanoseconds(inflated_at - deflated_at).count());
+				
+				wire_bytes = 0;
+				for (auto& d : deflated)
+					wire_bytes += d.size();
+			}
+			
+			std::ostringstream ss;
+			ss << "{\"name\":\"" << (no_takeover ? "no_context_takeover" : "context_takeover") << "/level" << level
+			   << "\",\"messages\":" << messages << ",\"raw_bytes\":" << raw_bytes << ",\"wire_bytes\":" << wire_bytes
+			   << ",\"ratio\":" << double(wire_bytes) / raw_bytes << ",\"deflate_ns_per_msg\":" << deflate_ns / messages
+			   << ",\"inflate_ns_per_msg\":" << inflate_ns / messages << "}";
+			
+			out << ss.str() << "\n";
+			std::cout << ss.str() << std::endl;
+		}
+	}
+	
+	std::cout << "------------- Finished testing WS permessage-deflate bench ------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/bench/ws_deflate", ws_deflate_bench);
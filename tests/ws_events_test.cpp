@@ -0,0 +1,159 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_events.h"
+
+#include <chrono>
+#include <future>
+
+using namespace net;
+
+
+// Events posted from several threads reach subscribed handler in batches, per-producer order is kept.
+// Unsubscribed types are not even posted by WSConnection, here it's only checked they are reported so.
+void ws_event_dispatcher_batches()
+{
+	std::cout << "+++++++++++++ Testing WS event dispatcher batches +++++++++++++++++++" << std::endl;
+	
+	const size_t producers = 4;
+	const size_t events = 50000;												// per producer
+	
+	WS::WSEventDispatcher dispatcher(1 << 12, 256);
+	
+	std::vector<pauuid> ids;
+	for (size_t p = 0; p < producers; ++p)
+		ids.push_back(uuid_generate());
+	
+	std::map<pauuid, size_t> next;												// consumer thread only
+	std::atomic<size_t> delivered(0), batches(0), misordered(0);
+	
+	dispatcher.Subscribe(WS::WSEventType::messageout, [&](const std::vector<WS::WSEvent>& batch)
+	{
+		++batches;
+		
+		for (auto& e : batch)
+		{
+			if (std::stoul(*e.message) != next[e.id]++)
+				++misordered;
+		}
+		
+		delivered += batch.size();
+	});
+	
+	PA_ASSERT(dispatcher.Subscribed(WS::WSEventType::messageout));
+	PA_ASSERT(!dispatcher.Subscribed(WS::WSEventType::open) && !dispatcher.Subscribed(WS::WSEventType::close));
+	
+	dispatcher.Start();
+	
+	std::vector<std::thread> pool;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		pool.emplace_back([&, p]()
+		{
+			for (size_t i = 0; i < events; ++i)
+			{
+				WS::WSEvent e;
+				e.type = WS::WSEventType::messageout;
+				e.id = ids[p];
+				e.message = std::make_shared<const std::string>(std::to_string(i));
+				
+				while (!dispatcher.Post(e))										/// full: let consumer catch up
+					std::this_thread::yield();
+			}
+		});
+	}
+	
+	for (auto& th : pool)
+		th.join();
+	
+	dispatcher.Stop();
+	
+	std::cout << delivered << " events in " << batches << " batches, " << dispatcher.Dropped()
+	          << " posts retried on full queue" << std::endl;
+	
+	PA_ASSERT(delivered == producers * events);
+	PA_ASSERT(misordered == 0);
+	
+	std::cout << "------------- Finished testing WS event dispatcher batches ----------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_event_dispatcher_batches", ws_event_dispatcher_batches);
+
+
+
+// Consumer is stuck while queue overflows: messageout events are dropped, but every open and close is delivered, and
+// open of a connection comes before its close.
+void ws_event_dispatcher_keeps_lifecycle()
+{
+	std::cout << "+++++++++++++ Testing WS event dispatcher keeps lifecycle +++++++++++" << std::endl;
+	
+	const size_t connections = 100;
+	
+	WS::WSEventDispatcher dispatcher(8, 4);
+	
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+	std::atomic<bool> blocked(false);
+	
+	std::map<pauuid, int> state;												// 1 - opened, 2 - closed
+	size_t messages = 0, misordered = 0;
+	
+	dispatcher.Subscribe(WS::WSEventType::open, [&](const std::vector<WS::WSEvent>& batch)
+	{
+		if (!blocked.exchange(true))
+			released.wait();
+		
+		for (auto& e : batch)
+			misordered += (state[e.id]++ != 0) ? 1 : 0;
+	});
+	dispatcher.Subscribe(WS::WSEventType::messageout, [&](const std::vector<WS::WSEvent>& batch)
+	{
+		messages += batch.size();
+	});
+	dispatcher.Subscribe(WS::WSEventType::close, [&](const std::vector<WS::WSEvent>& batch)
+	{
+		for (auto& e : batch)
+			misordered += (state[e.id]++ != 1) ? 1 : 0;
+	});
+	
+	dispatcher.Start();
+	
+	WS::WSEvent first;
+	first.type = WS::WSEventType::open;
+	first.id = uuid_generate();
+	PA_ASSERT(dispatcher.Post(first));
+	
+	while (!blocked)															/// consumer waits in handler
+		std::this_thread::yield();
+	
+	size_t posted_messages = 0;
+	for (size_t c = 0; c < connections; ++c)
+	{
+		WS::WSEvent e;
+		e.id = uuid_generate();
+		
+		e.type = WS::WSEventType::open;
+		PA_ASSERT(dispatcher.Post(e));
+		
+		e.type = WS::WSEventType::messageout;
+		e.message = std::make_shared<const std::string>("m");
+		posted_messages += dispatcher.Post(e) ? 1 : 0;
+		
+		e.type = WS::WSEventType::close;
+		PA_ASSERT(dispatcher.Post(e));
+	}
+	
+	release.set_value();
+	dispatcher.Stop();
+	
+	PA_ASSERT(dispatcher.Dropped() == connections - posted_messages && dispatcher.Dropped() != 0);
+	PA_ASSERT(messages == posted_messages);
+	PA_ASSERT(misordered == 0 && state.size() == connections + 1);
+	
+	for (auto& s : state)
+		PA_ASSERT(s.second == (s.first == first.id ? 1 : 2));
+	
+	std::cout << "------------- Finished testing WS event dispatcher keeps lifecycle --" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_event_dispatcher_keeps_lifecycle", ws_event_dispatcher_keeps_lifecycle);
@@ -0,0 +1,129 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_frame_parser.h"
+
+using namespace net;
+
+
+// client frame: FIN/opcode byte, masked length, mask, masked payload
+static std::string masked_frame(uchar fin_opcode, const std::string& payload)
+{
+	const uchar mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	
+	std::string frame;
+	frame.push_back(fin_opcode);
+	
+	if (payload.size() < 126)
+		frame.push_back(static_cast<char>(0x80 | payload.size()));
+	else
+	{
+		frame.push_back(static_cast<char>(0x80 | 126));
+		frame.push_back(static_cast<char>(payload.size() >> 8));
+		frame.push_back(static_cast<char>(payload.size() & 0xff));
+	}
+	
+	frame.append(reinterpret_cast<const char*>(mask), 4);
+	
+	for (size_t i = 0; i < payload.size(); ++i)
+		frame.push_back(payload[i] ^ mask[i % 4]);
+	
+	return frame;
+}
+
+
+
+void ws_frame_parser_split_at_every_byte()
+{
+	std::cout << "+++++++++++++ Testing WS frame parser on input split at every byte ++++++++++++++++" << std::endl;
+	
+	std::string text(300, 'x');
+	for (size_t i = 0; i < text.size(); ++i)
+		text[i] = static_cast<char>('a' + i % 26);
+	
+	// fragmented text message with ping in the middle, then close
+	std::string stream = masked_frame(0x01, text.substr(0, 100)) +
+	                     masked_frame(0x89, "hb") +
+	                     masked_frame(0x80, text.substr(100)) +
+	                     masked_frame(0x88, std::string("\x03\xe8", 2));
+	
+	for (size_t split = 0; split <= stream.size(); ++split)
+	{
+		WS::WSFrameParser parser(1 << 20);
+		std::vector<std::pair<uchar, std::string>> results;
+		
+		const char* parts[][2] = { { stream.data(), stream.data() + split },
+		                           { stream.data() + split, stream.data() + stream.size() } };
+		
+		for (auto& part : parts)
+		{
+			const char* begin = part[0];
+			
+			for (;;)
+			{
+				auto r = parser.Parse(begin, part[1]);
+				PA_ASSERT(r != WS::WSFrameParser::Result::bad);
+				
+				if (r == WS::WSFrameParser::Result::indeterminate)
+					break;
+				
+				results.emplace_back(parser.opcode(), parser.payload());
+			}
+		}
+		
+		PA_ASSERT(results.size() == 3);
+		PA_ASSERT(results[0].first == WS::Schema::WSOpcode::ping && results[0].second == "hb");
+		PA_ASSERT(results[1].first == WS::Schema::WSOpcode::text && results[1].second == text);
+		PA_ASSERT(results[2].first == WS::Schema::WSOpcode::close && results[2].second == std::string("\x03\xe8", 2));
+	}
+	
+	std::cout << "------------- Finished testing WS frame parser on input split at every byte -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_frame_parser_split_at_every_byte", ws_frame_parser_split_at_every_byte);
+
+
+
+void ws_frame_parser_protocol_errors()
+{
+	std::cout << "+++++++++++++ Testing WS frame parser protocol errors ++++++++++++++++" << std::endl;
+	
+	auto status_of = [](const std::string& stream, size_t max_size = 1 << 20)
+	{
+		WS::WSFrameParser parser(max_size);
+		const char* begin = stream.data();
+		
+		while (begin != stream.data() + stream.size())
+			if (parser.Parse(begin, stream.data() + stream.size()) == WS::WSFrameParser::Result::bad)
+				return parser.close_status();
+		
+		return 0u;
+	};
+	
+	std::string unmasked = masked_frame(0x81, "hi");
+	unmasked[1] &= 0x7f;
+	
+	PA_ASSERT(status_of(unmasked) == WS::Schema::WSClosureStatus::protocol_error);
+	PA_ASSERT(status_of(masked_frame(0x80, "orphan continuation")) == WS::Schema::WSClosureStatus::protocol_error);
+	PA_ASSERT(status_of(masked_frame(0x09, "fragmented ping")) == WS::Schema::WSClosureStatus::protocol_error);
+	PA_ASSERT(status_of(masked_frame(0x81, std::string(200, 'x')), 100) == WS::Schema::WSClosureStatus::message_too_big);
+	PA_ASSERT(status_of(masked_frame(0xc1, "rsv1 without permessage-deflate")) == WS::Schema::WSClosureStatus::protocol_error);
+	PA_ASSERT(status_of(masked_frame(0x81, "ok")) == 0);
+	
+	PA_ASSERT(status_of(masked_frame(0x88, std::string("\x03", 1))) == WS::Schema::WSClosureStatus::protocol_error);
+	for (uint code : { 0u, 999u, 1004u, 1005u, 1006u, 1015u, 2999u, 5000u, 65535u })
+	{
+		const char status[] = { static_cast<char>(code >> 8), static_cast<char>(code & 0xff) };
+		PA_ASSERT(status_of(masked_frame(0x88, std::string(status, 2))) == WS::Schema::WSClosureStatus::protocol_error);
+	}
+	for (uint code : { 1000u, 1001u, 1003u, 1007u, 1011u, 1014u, 3000u, 4999u })
+	{
+		const char status[] = { static_cast<char>(code >> 8), static_cast<char>(code & 0xff) };
+		PA_ASSERT(status_of(masked_frame(0x88, std::string(status, 2) + "bye")) == 0);
+	}
+	PA_ASSERT(status_of(masked_frame(0x88, "")) == 0);
+	
+	std::cout << "------------- Finished testing WS frame parser protocol errors -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_frame_parser_protocol_errors", ws_frame_parser_protocol_errors);
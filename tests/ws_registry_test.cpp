@@ -0,0 +1,221 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_registry.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/HTTP/http_response.h"
+#include "webserver/tests/bench_common.h"
+
+#include <chrono>
+
+using namespace net;
+using namespace net::tests;
+
+
+// Lookup throughput of WSRegistry versus previous storage (std::map under one mutex) from many pushing threads.
+// Handles are empty, so only the registry itself is measured, not the connections' queues.
+void ws_registry_concurrent_lookup()
+{
+	std::cout << "+++++++++++++ Testing WS registry concurrent lookup ++++++++++++++++" << std::endl;
+	
+	const size_t connections = 10000;
+	const size_t lookups = 200000;												// per thread
+	const size_t threads = std::max(2u, std::thread::hardware_concurrency());
+	
+	std::vector<pauuid> ids;
+	for (size_t i = 0; i < connections; ++i)
+		ids.push_back(uuid_generate());
+	
+	WS::WSRegistry registry;
+	std::map<pauuid, WS::WSHandle> baseline;
+	ptl::mutex baseline_mx;
+	
+	for (auto& id : ids)
+	{
+		registry.Add(id, WS::WSHandle());
+		baseline[id] = WS::WSHandle();
+	}
+	
+	PA_ASSERT(registry.Size() == connections);
+	
+	auto measure = [&](const std::function<bool(const pauuid&)>& find)
+	{
+		std::atomic<size_t> found(0);
+		std::vector<std::thread> pool;
+		
+		auto started = std::chrono::steady_clock::now();
+		
+		for (size_t t = 0; t < threads; ++t)
+		{
+			pool.emplace_back([&, t]()
+			{
+				size_t n = 0;
+				for (size_t i = 0; i < lookups; ++i)
+					n += find(ids[(i * 7919 + t) % connections]) ? 1 : 0;
+				
+				found += n;
+			});
+		}
+		
+		for (auto& th : pool)
+			th.join();
+		
+		PA_ASSERT(found == threads * lookups);
+		
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+		return threads * lookups * 1000 / std::max<long long>(elapsed.count(), 1);
+	};
+	
+	auto registry_rate = measure([&](const pauuid& id)
+	{
+		WS::WSHandle handle;
+		return registry.Find(id, handle);
+	});
+	
+	auto baseline_rate = measure([&](const pauuid& id)
+	{
+		boost::lock_guard<ptl::mutex> lck(baseline_mx);
+		return baseline.find(id) != baseline.end();
+	});
+	
+	std::cout << threads << " threads: WSRegistry " << registry_rate << " lookups/s, map+mutex " << baseline_rate
+	          << " lookups/s" << std::endl;
+	
+	for (size_t i = 0; i < connections; i += 2)
+		registry.Remove(ids[i]);
+	
+	WS::WSHandle handle;
+	PA_ASSERT(registry.Size() == connections / 2);
+	PA_ASSERT(!registry.Find(ids[0], handle) && registry.Find(ids[1], handle));
+	
+	size_t visited = 0;
+	registry.ForEach([&](const pauuid&, const WS::WSHandle&) { ++visited; });
+	PA_ASSERT(visited == connections / 2);
+	
+	std::cout << "------------- Finished testing WS registry concurrent lookup -------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_registry_concurrent_lookup", ws_registry_concurrent_lookup);
+
+
+
+namespace
+{
+	class NotFoundHandler : public HTTP::HTTPRequestHandler
+	{
+	public:
+		void HandleRequest(HTTP::HTTPRequest&, HTTP::HTTPResponse& rep) override
+		{
+			rep = HTTP::HTTPResponse::stock_reply(HTTP::Schema::StatusCode::not_found);
+		}
+	};
+}
+
+
+// WebServer::WSPush throughput from many threads to WS connections over MemSocket: registry lookup plus enqueue into
+// connection's send queue, with writers draining queues on I/O threads meanwhile. Clients don't read, their sockets
+// just buffer frames; drop_oldest policy keeps connections alive if writers fall behind.
+void ws_registry_push_throughput()
+{
+	if (!bench_enabled("WS registry push throughput"))
+		return;
+	
+	std::cout << "+++++++++++++ Testing WS registry push throughput +++++++++++++++++" << std::endl;
+	
+	const size_t connections = 1000;
+	const size_t pushes = 50000;													// per thread
+	const size_t threads = std::max(2u, std::thread::hardware_concurrency());
+	
+	IOService main_service, acceptor_service, client_service;
+	std::unique_ptr<IOService::work> main_work(new IOService::work(main_service));
+	std::unique_ptr<IOService::work> acceptor_work(new IOService::work(acceptor_service));
+	
+	WebServerParams params("127.0.0.1", 18084, 18448);
+	params.ws_ping_interval_sec = 0;
+	params.ws_backpressure.policy = WS::WSOverflowPolicy::drop_oldest;
+	params.metrics = true;															/// gauges show teardown
+	
+	std::unique_ptr<WebServer> server(new WebServer(main_service, acceptor_service, params,
+		[] { return std::unique_ptr<HTTP::HTTPRequestHandler>(new NotFoundHandler()); }));
+	
+	ptl::mutex mx;
+	std::vector<pauuid> ids;
+	server->WSOnEvents(WS::WSEventType::open, [&](const std::vector<WS::WSEvent>& events)
+	{
+		boost::lock_guard<ptl::mutex> lck(mx);
+		for (auto& e : events)
+			ids.push_back(e.id);
+	});
+	server->Start();
+	
+	std::vector<std::thread> io_threads;
+	for (uint i = 0; i < std::max(std::thread::hardware_concurrency() / 2, 1u); ++i)
+		io_threads.emplace_back([&main_service] { main_service.run(); });
+	io_threads.emplace_back([&acceptor_service] { acceptor_service.run(); });
+	
+	std::vector<std::shared_ptr<MemSocket>> clients;
+	for (size_t i = 0; i < connections; ++i)
+	{
+		clients.push_back(ws_connect(*server, main_service, client_service, "/push"));
+		PA_ASSERT(clients.back());
+	}
+	
+	auto opened = [&]()
+	{
+		boost::lock_guard<ptl::mutex> lck(mx);
+		return ids.size();
+	};
+	
+	for (int i = 0; i < 500 && opened() < connections; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	PA_ASSERT(opened() == connections);
+	
+	std::atomic<size_t> delivered(0);
+	std::vector<std::thread> pool;
+	
+	auto started = std::chrono::steady_clock::now();
+	
+	for (size_t t = 0; t < threads; ++t)
+	{
+		pool.emplace_back([&, t]()
+		{
+			const std::string message = "update";
+			size_t n = 0;
+			
+			for (size_t i = 0; i < pushes; ++i)
+				n += server->WSPush(ids[(i * 7919 + t) % connections], message) ? 1 : 0;
+			
+			delivered += n;
+		});
+	}
+	
+	for (auto& th : pool)
+		th.join();
+	
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+	
+	PA_ASSERT(delivered == threads * pushes);
+	
+	std::cout << threads << " threads, " << connections << " connections: WSPush "
+	          << threads * pushes * 1000 / std::max<long long>(elapsed.count(), 1) << " pushes/s" << std::endl;
+	
+	for (auto& client : clients)
+	{
+		error_code ec;
+		client->close(ec);
+	}
+	
+	for (int i = 0; i < 500 && server->metrics().Value(MetricGauge::ws_connections) != 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	
+	server->Stop();
+	main_service.stop();
+	acceptor_service.stop();
+	for (auto& th : io_threads)
+		th.join();
+	server.reset();
+	
+	std::cout << "------------- Finished testing WS registry push throughput --------" << std::endl;
+}
+
+REGISTER_TEST("webserver/bench/ws_registry_push", ws_registry_push_throughput);
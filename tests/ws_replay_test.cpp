@@ -0,0 +1,74 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_replay.h"
+
+using namespace net;
+
+
+// Client that has seen N messages of a session gets N+1... on reconnect while ring holds them, full restart otherwise.
+void ws_replay_resume()
+{
+	std::cout << "+++++++++++++ Testing WS replay resume ++++++++++++++++++++++++++++++" << std::endl;
+	
+	uint64_t last_seen = 0;
+	PA_ASSERT(WS::parse_resume_offer("chat, pa-resume.42", last_seen) && last_seen == 42);
+	PA_ASSERT(!WS::parse_resume_offer("chat, pa-resume.", last_seen));
+	PA_ASSERT(!WS::parse_resume_offer("chat, superchat", last_seen));
+	PA_ASSERT(WS::resume_protocol(7) == "pa-resume.7");
+	PA_ASSERT(WS::offers_protocol("pa-resume.3, pa-resume.0", "pa-resume.0"));
+	PA_ASSERT(!WS::offers_protocol("pa-resume.3", "pa-resume.0"));
+	
+	WS::WSReplayStore store(4);
+	pauuid sid = uuid_generate();
+	
+	auto message = [](int i) { return std::make_shared<const std::string>(std::to_string(i)); };
+	
+	WS::WSResumption first;
+	store.Attach(sid, 0, first);
+	PA_ASSERT(first.ring && !first.resumed && first.gap.empty());
+	
+	for (int i = 1; i <= 6; ++i)												// ring keeps 3..6
+		first.ring->Append(first.epoch, message(i), nullptr);
+	
+	store.Detach(first);
+	
+	WS::WSResumption second;
+	store.Attach(sid, 4, second);
+	PA_ASSERT(second.resumed && second.gap.size() == 2);
+	PA_ASSERT(*second.gap[0].frame == "5" && second.gap[0].seq == 5 && *second.gap[1].frame == "6");
+	
+	first.ring->Append(first.epoch, message(100), nullptr);					/// stale connection doesn't record
+	second.ring->Append(second.epoch, message(7), nullptr);
+	
+	WS::WSResumption tab;
+	store.Attach(sid, 4, tab);													/// second tab, 'second' is live
+	PA_ASSERT(!tab.ring && !tab.resumed && tab.gap.empty());
+	
+	second.ring->Append(second.epoch, message(8), nullptr);					/// still owns the ring
+	store.Detach(second);
+	
+	WS::WSResumption third;
+	store.Attach(sid, 1, third);												// 2 is gone already
+	PA_ASSERT(!third.resumed && third.gap.empty());
+	
+	third.ring->Append(third.epoch, message(1), nullptr);
+	third.ring->Append(third.epoch, nullptr, nullptr);							// streamed message
+	third.ring->Append(third.epoch, message(3), nullptr);
+	store.Detach(third);
+	
+	WS::WSResumption fourth;
+	store.Attach(sid, 1, fourth);
+	PA_ASSERT(!fourth.resumed);
+	store.Detach(fourth);
+	
+	store.Expire(sid, third.epoch);												/// session came back after 'third'
+	PA_ASSERT(store.Size() == 1);
+	
+	store.Expire(sid, fourth.epoch);
+	PA_ASSERT(store.Size() == 0);
+	
+	std::cout << "------------- Finished testing WS replay resume ---------------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_replay_resume", ws_replay_resume);
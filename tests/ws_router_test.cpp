@@ -0,0 +1,232 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_router.h"
+
+#include <chrono>
+#include <future>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace net;
+
+
+namespace
+{
+	bool wait_for(const std::function<bool()>& done)
+	{
+		for (int i = 0; i < 500 && !done(); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		
+		return done();
+	}
+	
+	// Node owning single connection 'conn_id', run in a child process: acknowledges each message delivered to it by
+	// pushing "text:<message>" or "binary:<message>" back to connection 'reply' of another node, exits once close
+	// record for 'conn_id' arrives. Returns process exit code: 0 if close status is normal (1000).
+	int run_node(const std::string& dir, const std::string& name, const pauuid& conn_id, const pauuid& reply)
+	{
+		IOService service;
+		std::unique_ptr<IOService::work> work(new IOService::work(service));
+		
+		std::promise<uint> closed;
+		std::atomic<bool> closing(false);
+		std::shared_ptr<WS::WSRouter> router;
+		
+		router = std::make_shared<WS::WSRouter>(service, dir, name,
+			[&](const pauuid& id, WS::WSRouter::Kind kind, std::string& message, const std::string&)
+			{
+				if (id != conn_id)
+					return false;
+				
+				if (kind == WS::WSRouter::Kind::close)
+				{
+					if (!closing.exchange(true))
+						closed.set_value((static_cast<uint8_t>(message[0]) << 8) | static_cast<uint8_t>(message[1]));
+					return true;
+				}
+				
+				router->Push(reply, (kind == WS::WSRouter::Kind::binary ? "binary:" : "text:") + message);
+				return true;
+			},
+			[conn_id]() { return std::vector<pauuid>(1, conn_id); }, 1);
+		router->Start();
+		
+		std::thread io([&service]() { service.run(); });
+		
+		auto status = closed.get_future();
+		bool normal = status.wait_for(std::chrono::seconds(30)) == std::future_status::ready && status.get() == 1000;
+		
+		router->Stop();
+		work.reset();
+		service.stop();
+		io.join();
+		
+		return normal ? 0 : 1;
+	}
+}
+
+
+// Three webserver processes on one host: this one pushes text, coalesced and binary messages and close to
+// connections of two child processes, which acknowledge them by pushing back; a node going away takes its routes.
+void ws_router_cross_process_push()
+{
+	std::cout << "+++++++++++++ Testing WS router cross process push ++++++++++++++++++" << std::endl;
+	
+	auto dir = fs::temp_directory_path() / fs::unique_path();
+	fs::create_directories(dir);
+	
+	pauuid reply = uuid_generate();
+	std::map<std::string, pauuid> children = { { "node-a", uuid_generate() }, { "node-c", uuid_generate() } };
+	std::vector<pid_t> pids;
+	
+	std::cout.flush();
+	for (auto& child : children)													/// before any thread of this test
+	{
+		pid_t pid = fork();
+		PA_ASSERT(pid >= 0);
+		
+		if (pid == 0)
+			_exit(run_node(dir.string(), child.first, child.second, reply));
+		
+		pids.push_back(pid);
+	}
+	
+	IOService service;
+	std::unique_ptr<IOService::work> work(new IOService::work(service));
+	std::thread io([&service]() { service.run(); });
+	
+	ptl::mutex mx;
+	std::vector<std::string> acks;
+	
+	auto router = std::make_shared<WS::WSRouter>(service, dir.string(), "node-b",
+		[&](const pauuid& conn_id, WS::WSRouter::Kind, std::string& message, const std::string&)
+		{
+			if (conn_id != reply)
+				return false;
+			
+			boost::lock_guard<ptl::mutex> lck(mx);
+			acks.push_back(message);
+			return true;
+		},
+		[reply]() { return std::vector<pauuid>(1, reply); }, 1);
+	router->Start();
+	
+	auto acked = [&](const std::string& ack)
+	{
+		return wait_for([&]()
+		{
+			boost::lock_guard<ptl::mutex> lck(mx);
+			return std::find(acks.begin(), acks.end(), ack) != acks.end();
+		});
+	};
+	
+	PA_ASSERT(wait_for([&]() { return router->Routes() == 2 && router->Links() == 2; }));
+	
+	const pauuid& a = children["node-a"];
+	const pauuid& c = children["node-c"];
+	
+	PA_ASSERT(router->Push(a, "hello") && router->Push(c, "world"));
+	PA_ASSERT(!router->Push(uuid_generate(), "nobody"));
+	PA_ASSERT(acked("text:hello") && acked("text:world"));
+	
+	PA_ASSERT(router->PushBinary(c, std::string("\0\xff", 2)));
+	PA_ASSERT(acked(std::string("binary:\0\xff", 9)));
+	
+	for (int i = 0; i < 1000; ++i)												// superseded while link is busy
+		router->Push(a, std::to_string(i), "progress");
+	PA_ASSERT(acked("text:999"));
+	
+	{
+		boost::lock_guard<ptl::mutex> lck(mx);
+		std::cout << "1000 coalesced pushes delivered as " << acks.size() - 3 << " messages" << std::endl;
+	}
+	
+	PA_ASSERT(router->Close(a, 1000));												/// node-a exits
+	PA_ASSERT(wait_for([&]() { return router->Routes() == 1 && router->Links() == 1; }));
+	PA_ASSERT(!router->Push(a, "gone"));
+	
+	PA_ASSERT(router->Close(c, 1000));
+	
+	for (pid_t pid : pids)
+	{
+		int status = 0;
+		PA_ASSERT(waitpid(pid, &status, 0) == pid);
+		PA_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	
+	PA_ASSERT(wait_for([&]() { return router->Routes() == 0 && router->Links() == 0; }));
+	
+	router->Stop();
+	
+	work.reset();
+	io.join();
+	
+	fs::remove_all(dir);
+	
+	std::cout << "------------- Finished testing WS router cross process push ---------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_router_cross_process_push", ws_router_cross_process_push);
+
+
+
+// Peer links but doesn't read: link queue overflows, link is closed with its routes, records are dropped and counted.
+// Router is destroyed while its handlers are still queued.
+void ws_router_link_overflow()
+{
+	std::cout << "+++++++++++++ Testing WS router link overflow ++++++++++++++++++++++++" << std::endl;
+	
+	auto dir = fs::temp_directory_path() / fs::unique_path();
+	fs::create_directories(dir);
+	
+	IOService service;
+	std::unique_ptr<IOService::work> work(new IOService::work(service));
+	std::thread io([&service]() { service.run(); });
+	
+	auto router = std::make_shared<WS::WSRouter>(service, dir.string(), "node",
+		[](const pauuid&, WS::WSRouter::Kind, std::string&, const std::string&) { return false; },
+		[]() { return std::vector<pauuid>(); }, 1);
+	router->Start();
+	
+	IOService peer_service;
+	boost::asio::local::stream_protocol::socket peer(peer_service);
+	peer.connect(boost::asio::local::stream_protocol::endpoint((dir / "node.sock").string()));
+	
+	pauuid conn_id = uuid_generate();
+	std::string id = boost::lexical_cast<std::string>(conn_id);
+	
+	std::string announce(4, '\0');												/// see record format in WSRouter
+	announce += '\x01';
+	announce += static_cast<char>(id.size());
+	announce += id;
+	announce += std::string(2, '\0');
+	announce[0] = static_cast<char>(announce.size() - 4);
+	boost::asio::write(peer, boost::asio::buffer(announce));
+	
+	PA_ASSERT(wait_for([&]() { return router->Routes() == 1; }));
+	
+	const std::string message(1 << 20, 'x');
+	for (int i = 0; i < 100 && router->Links() == 1; ++i)							/// 100 MiB, peer reads nothing
+		PA_ASSERT(router->Push(conn_id, message) || router->Routes() == 0);
+	
+	PA_ASSERT(wait_for([&]() { return router->Links() == 0 && router->Routes() == 0; }));
+	PA_ASSERT(router->Dropped() != 0);
+	PA_ASSERT(!router->Push(conn_id, message));
+	
+	std::cout << router->Dropped() << " records dropped by overflowed link" << std::endl;
+	
+	router->Stop();
+	router.reset();																/// accept & rescan handlers run after it
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	
+	work.reset();
+	io.join();
+	
+	fs::remove_all(dir);
+	
+	std::cout << "------------- Finished testing WS router link overflow ---------------" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_router_link_overflow", ws_router_link_overflow);
@@ -0,0 +1,87 @@
+﻿#include "webserver/stdafx.h"
+
+#include "core/test_engine/test_manager.h"
+#include "webserver/WS/ws_topics.h"
+
+#include <chrono>
+
+using namespace net;
+
+
+// Threads subscribe and unsubscribe their own connections to shared topics while others publish: every snapshot stays
+// consistent (no duplicates, only known ids), and once all connections are gone no topic is left behind.
+void ws_topics_concurrent_membership()
+{
+	std::cout << "+++++++++++++ Testing WS topics concurrent membership ++++++++++++++" << std::endl;
+	
+	const size_t threads = 4;
+	const size_t connections = 2000;												// per thread
+	const std::vector<std::string> topics = { "/a", "/b", "/c" };
+	
+	WS::WSTopicRegistry registry;
+	
+	std::vector<std::vector<pauuid>> ids(threads);
+	for (auto& own : ids)
+		for (size_t i = 0; i < connections; ++i)
+			own.push_back(uuid_generate());
+	
+	std::atomic<bool> done(false);
+	std::atomic<size_t> snapshots(0);
+	
+	std::thread publisher([&]()
+	{
+		while (!done)
+		{
+			for (auto& topic : topics)
+			{
+				auto subscribers = registry.Snapshot(topic);
+				if (!subscribers)
+					continue;
+				
+				std::set<pauuid> unique(subscribers->begin(), subscribers->end());
+				PA_ASSERT(unique.size() == subscribers->size());
+				++snapshots;
+			}
+		}
+	});
+	
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < threads; ++t)
+	{
+		pool.emplace_back([&, t]()
+		{
+			for (size_t i = 0; i < connections; ++i)
+			{
+				registry.Subscribe(topics[i % topics.size()], ids[t][i]);
+				registry.Subscribe(topics[(i + 1) % topics.size()], ids[t][i]);
+				registry.Subscribe(topics[i % topics.size()], ids[t][i]);			/// twice is once
+			}
+			
+			for (size_t i = 0; i < connections; i += 2)
+				registry.Unsubscribe(topics[i % topics.size()], ids[t][i]);
+		});
+	}
+	
+	for (auto& th : pool)
+		th.join();
+	
+	size_t total = 0;
+	for (auto& topic : topics)
+		total += registry.Snapshot(topic)->size();
+	
+	PA_ASSERT(total == threads * (connections * 2 - connections / 2));
+	
+	for (auto& own : ids)															/// connections close
+		for (auto& id : own)
+			registry.UnsubscribeAll(id);
+	
+	done = true;
+	publisher.join();
+	
+	PA_ASSERT(registry.Topics() == 0 && !registry.Snapshot("/a"));
+	
+	std::cout << snapshots << " snapshots published during membership changes" << std::endl;
+	std::cout << "------------- Finished testing WS topics concurrent membership -----" << std::endl;
+}
+
+REGISTER_TEST("webserver/tests/ws_topics_concurrent_membership", ws_topics_concurrent_membership);
@@ -0,0 +1,92 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "templates/mutex.h"
+
+#include <thread>
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// ThreadSlots gives each thread an object of its own ('slot'), so that hot paths write without sharing: a ring of
+	// FlightRecorder, AccessLog, a stall slot of Watchdog.
+	//
+	// Method 'Get' returns slot of the calling thread: a thread_local cache hit (owner id & pointer) normally, a lookup
+	// under mutex on thread's first call, when slot is created by 'make(index)' (index counts slots from 0).
+	// Method 'All' returns pointers to slots created so far; slots live as long as ThreadSlots, so readers use them
+	// without lock.
+	//
+	// Cache is per slot type: a thread switching between two ThreadSlots of one type takes the lock on each switch.
+	//------------------------------------------------------------------------------------------------------------------
+	template<typename T>
+	class ThreadSlots
+	{
+		DECLARE_NONCOPYABLE(ThreadSlots);
+		
+		struct Cached
+		{
+			uint64_t owner = 0;
+			T* slot = nullptr;
+		};
+	
+	public:
+		ThreadSlots() : id_(next_id()) {}
+		
+		template<typename TMake>
+		T& Get(TMake make)
+		{
+			Cached& c = cached();
+			if (c.owner == id_)
+				return *c.slot;
+			
+			boost::lock_guard<ptl::mutex> lck(mx_);									/// first call of thread
+			
+			auto& s = by_thread_[std::this_thread::get_id()];
+			if (!s)
+			{
+				slots_.emplace_back(make(slots_.size()));
+				s = slots_.back().get();
+			}
+			
+			c.owner = id_;
+			c.slot = s;
+			
+			return *s;
+		}
+		
+		std::vector<T*> All() const
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			std::vector<T*> slots;
+			for (auto& s : slots_)
+				slots.push_back(s.get());
+			
+			return slots;
+		}
+	
+	private:
+		static Cached& cached()
+		{
+			static thread_local Cached c;
+			return c;
+		}
+		
+		static uint64_t next_id()
+		{
+			static std::atomic<uint64_t> ids(0);
+			return ++ids;
+		}
+	
+	private:
+		const uint64_t id_;															// tells instances apart in cache
+		
+		std::vector<std::unique_ptr<T>> slots_;
+		std::map<std::thread::id, T*> by_thread_;
+		mutable ptl::mutex mx_;
+	};
+}
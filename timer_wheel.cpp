@@ -0,0 +1,145 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/timer_wheel.h"
+
+
+
+namespace net
+{
+	TimerWheel::TimerWheel(IOService& service, uint tick_ms, size_t slots)
+		: slots_(std::max<size_t>(slots, 1)), timer_(service), tick_ms_(std::max(tick_ms, 1u)),
+		  anchor_(std::make_shared<Anchor>())
+	{
+		anchor_->wheel = this;
+	}
+	
+	TimerWheel::~TimerWheel()
+	{
+		Stop();
+		
+		boost::lock_guard<ptl::mutex> lck(anchor_->mx);								/// tick in progress is over
+		anchor_->wheel = nullptr;
+	}
+	
+	void TimerWheel::Start()
+	{
+		boost::lock_guard<ptl::mutex> lck(mx_);
+		
+		if (running_)
+			return;
+		
+		running_ = true;
+		
+		timer_.expires_from_now(boost::posix_time::milliseconds(tick_ms_));
+		timer_.async_wait(boost::bind(&TimerWheel::on_tick, anchor_, _1));
+	}
+	
+	void TimerWheel::Stop()
+	{
+		boost::lock_guard<ptl::mutex> lck(mx_);
+		
+		running_ = false;
+		
+		error_code ec;
+		timer_.cancel(ec);
+	}
+	
+	TimerWheel::TimerId TimerWheel::Schedule(uint delay_ms, Callback callback)
+	{
+		boost::lock_guard<ptl::mutex> lck(mx_);
+		
+		size_t ticks = std::max<size_t>((delay_ms + tick_ms_ - 1) / tick_ms_, 1);
+		
+		if (running_)																/// cursor's tick is partly over:
+		{																			/// count from the next one
+			int64_t to_next = (timer_.expires_at() - boost::asio::deadline_timer::traits_type::now()).total_milliseconds();
+			int64_t rest = static_cast<int64_t>(delay_ms) - std::max<int64_t>(to_next, 0);
+			
+			ticks = 1 + static_cast<size_t>((std::max<int64_t>(rest, 0) + tick_ms_ - 1) / tick_ms_);
+		}
+		
+		size_t slot = (cursor_ + ticks) % slots_.size();
+		TimerId id = next_id_++;
+		
+		auto it = slots_[slot].insert(slots_[slot].end(), Entry{ id, (ticks - 1) / slots_.size(), std::move(callback) });
+		index_.insert({ id, { slot, it } });
+		
+		return id;
+	}
+	
+	bool TimerWheel::Cancel(TimerId id)
+	{
+		boost::lock_guard<ptl::mutex> lck(mx_);
+		
+		auto it = index_.find(id);
+		if (it == index_.end())
+			return false;
+		
+		slots_[it->second.first].erase(it->second.second);
+		index_.erase(it);
+		
+		return true;
+	}
+	
+	size_t TimerWheel::Size() const
+	{
+		boost::lock_guard<ptl::mutex> lck(mx_);
+		
+		return index_.size();
+	}
+	
+	void TimerWheel::on_tick(const std::shared_ptr<Anchor>& anchor, const error_code& ec)
+	{
+		if (ec == basic_errors::operation_aborted)									/// wheel is stopped or destroyed
+			return;
+		
+		boost::lock_guard<ptl::mutex> lck(anchor->mx);
+		
+		if (anchor->wheel)
+			anchor->wheel->tick();
+	}
+	
+	void TimerWheel::tick()
+	{
+		std::vector<Callback> expired;
+		
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			if (!running_)															/// tick was queued before 'Stop'
+				return;
+			
+			cursor_ = (cursor_ + 1) % slots_.size();
+			auto& slot = slots_[cursor_];
+			
+			for (auto it = slot.begin(); it != slot.end(); )
+			{
+				if (it->rounds != 0)
+				{
+					--it->rounds;
+					++it;
+					continue;
+				}
+				
+				expired.push_back(std::move(it->callback));
+				index_.erase(it->id);
+				it = slot.erase(it);
+			}
+			
+			timer_.expires_at(timer_.expires_at() + boost::posix_time::milliseconds(tick_ms_));	/// no drift
+			timer_.async_wait(boost::bind(&TimerWheel::on_tick, anchor_, _1));
+		}
+		
+		for (auto& callback : expired)
+		{
+			try
+			{
+				callback();
+			}
+			catch (std::exception& e)
+			{
+				IFLOG(P2, "TimerWheel callback failed. Reason follows.", e.what());
+			}
+		}
+	}
+}
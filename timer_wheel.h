@@ -0,0 +1,85 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "templates/mutex.h"
+
+#include <boost/asio/deadline_timer.hpp>
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// TimerWheel is a hashed timing wheel (G. Varghese, T. Lauck): a ring of 'slots' lists advanced by a single
+	// boost::asio timer every 'tick_ms'. It serves lots of coarse timeouts (WS heartbeats, HTTP deadlines) at the cost
+	// of one asio timer per wheel instead of one per connection.
+	//
+	// Method 'Schedule' puts callback into the slot 'delay / tick' positions ahead of the cursor, counting from the
+	// moment the next tick is due (the cursor's tick is partly over); delays longer than a whole turn are kept as a
+	// count of remaining 'rounds'. Methods 'Schedule' and 'Cancel' are O(1). Each tick visits one slot only, firing
+	// entries whose rounds are over and decrementing the others. Precision is one tick: callback fires not earlier
+	// than 'delay' and not later than 'delay + tick_ms'.
+	//
+	// Callbacks are called on the wheel's io_service thread, outside of the wheel's mutex, so they may schedule or
+	// cancel timers themselves. They must be short - a long one delays all timers of the wheel.
+	//
+	// Ticks after 'Stop' are ignored. Tick handler holds 'anchor_' rather than the wheel itself: destructor stops the
+	// wheel and detaches it from the anchor (waiting for a tick in progress), so a handler which is already queued
+	// when the wheel is destroyed does nothing. Callback must not destroy its own wheel.
+	//
+	// WebServer keeps several wheels (see WebServer::timer_wheel) to spread mutex contention between I/O threads.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API TimerWheel
+	{
+		DECLARE_NONCOPYABLE(TimerWheel);
+	
+	public:
+		using Callback = std::function<void()>;
+		using TimerId = uint64_t;												// 0 - no timer
+	
+	public:
+		TimerWheel(IOService& service, uint tick_ms, size_t slots = 512);
+		~TimerWheel();
+		
+		void Start();
+		void Stop();
+		
+		TimerId Schedule(uint delay_ms, Callback callback);
+		bool Cancel(TimerId id);												// false if fired or cancelled already
+		
+		size_t Size() const;
+	
+	private:
+		struct Anchor
+		{
+			ptl::mutex mx;														// held while wheel ticks
+			TimerWheel* wheel;													// nullptr - wheel is destroyed
+		};
+		
+		static void on_tick(const std::shared_ptr<Anchor>& anchor, const error_code& ec);
+		void tick();
+	
+	private:
+		struct Entry
+		{
+			TimerId id;
+			size_t rounds;
+			Callback callback;
+		};
+		
+		using Slot = std::list<Entry>;
+		
+		std::vector<Slot> slots_;
+		std::unordered_map<TimerId, std::pair<size_t, Slot::iterator>> index_;	// for O(1) cancel
+		size_t cursor_ = 0;
+		TimerId next_id_ = 1;
+		mutable ptl::mutex mx_;
+		
+		boost::asio::deadline_timer timer_;
+		uint tick_ms_;
+		bool running_ = false;
+		std::shared_ptr<Anchor> anchor_;
+	};
+}
@@ -0,0 +1,181 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/traffic_capture.h"
+#include "webserver/HTTP/http_request.h"
+#include "webserver/json_string.h"
+
+#include <map>
+
+
+
+namespace net
+{
+	namespace
+	{
+		const char* const redacted = "<redacted>";
+		
+		const char* const sensitive_headers[] =
+		{
+			"authorization", "proxy-authorization", "cookie", "set-cookie", "x-api-key", "x-auth-token",
+			"x-csrf-token", "sec-websocket-key"
+		};
+		
+		// Target with values of query parameters dropped ("/find?q=&page="), names and their order are kept
+		std::string redact_query(const std::string& target)
+		{
+			auto query = target.find('?');
+			if (query == std::string::npos)
+				return target;
+			
+			std::string out = target.substr(0, query + 1);
+			bool value = false;
+			
+			for (size_t i = query + 1; i < target.size(); ++i)
+			{
+				char c = target[i];
+				if (c == '&')
+					value = false;
+				else if (value)
+					continue;
+				else if (c == '=')
+					value = true;
+				
+				out += c;
+			}
+			
+			return out;
+		}
+	}
+	
+	TrafficCapture::TrafficCapture(const std::string& path, uint sample_every, size_t queue_capacity, uint flush_ms)
+		: path_(path), sample_every_(std::max(sample_every, 1u)), flush_ms_(std::max(flush_ms, 1u)),
+		  queue_(std::max<size_t>(queue_capacity, 4)), connections_(0), written_(0), dropped_(0)
+	{
+	}
+	
+	TrafficCapture::~TrafficCapture()
+	{
+		Stop();
+	}
+	
+	void TrafficCapture::Start()
+	{
+		if (!Enabled() || writer_.Running())
+			return;
+		
+		file_ = std::fopen(path_.c_str(), "ab");
+		if (!file_)
+		{
+			IFLOG(P2, "TrafficCapture can't open file, capture is off. Path follows.", path_);
+			return;
+		}
+		
+		started_ = std::chrono::steady_clock::now();
+		writer_.Start([this] { drain(); return false; }, flush_ms_);
+	}
+	
+	void TrafficCapture::Stop()
+	{
+		if (!writer_.Running())
+			return;
+		
+		writer_.Stop();																	/// drains queue
+		
+		std::fclose(file_);
+		file_ = nullptr;
+	}
+	
+	uint64_t TrafficCapture::NewConnection()
+	{
+		if (!writer_.Running())
+			return 0;
+		
+		uint64_t n = ++connections_;
+		return (n % sample_every_ == 0) ? n : 0;
+	}
+	
+	void TrafficCapture::Capture(uint64_t conn, const HTTP::HTTPRequest& req, bool tls)
+	{
+		if (!writer_.Running() || conn == 0)
+			return;
+		
+		auto t_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started_);
+		
+		std::string line;
+		Format(static_cast<uint64_t>(t_us.count()), conn, req, tls, line);
+		
+		if (!queue_.TryPush(std::move(line)))
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+	}
+	
+	bool TrafficCapture::IsSensitive(const std::string& header)
+	{
+		for (auto name : sensitive_headers)
+			if (header == name)
+				return true;
+		
+		return false;
+	}
+	
+	void TrafficCapture::Format(uint64_t t_us, uint64_t conn, const HTTP::HTTPRequest& req, bool tls, std::string& out)
+	{
+		out += "{\"t_us\":" + std::to_string(t_us) + ",\"conn\":" + std::to_string(conn);
+		out += ",\"tls\":";
+		out += tls ? "true" : "false";
+		out += ",\"method\":";
+		AppendJsonString(out, req.method);
+		out += ",\"target\":";
+		AppendJsonString(out, redact_query(req.target));
+		out += ",\"version\":\"" + std::to_string(req.http_version_major) + "." + std::to_string(req.http_version_minor);
+		out += "\",\"headers\":{";
+		
+		std::map<std::string, std::string> headers(req.headers.begin(), req.headers.end());	/// stable order
+		if (!req.cookies.empty())															/// parsed out of headers
+			headers["cookie"] = redacted;
+		
+		bool first = true;
+		for (auto& h : headers)
+		{
+			if (!first)
+				out += ',';
+			first = false;
+			
+			AppendJsonString(out, h.first);
+			out += ':';
+			AppendJsonString(out, IsSensitive(h.first) ? redacted : h.second);
+		}
+		
+		out += "},\"body_bytes\":" + std::to_string(req.content.size()) + "}\n";
+	}
+	
+	size_t TrafficCapture::drain()
+	{
+		buffer_.clear();
+		size_t n = 0;
+		
+		std::string line;
+		while (queue_.TryPop(line))
+		{
+			buffer_ += line;
+			++n;
+		}
+		
+		uint64_t dropped = dropped_;
+		if (dropped != reported_dropped_)
+		{
+			buffer_ += "{\"dropped\":" + std::to_string(dropped - reported_dropped_) + "}\n";
+			reported_dropped_ = dropped;
+		}
+		
+		if (!buffer_.empty())
+		{
+			if (std::fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size())
+				IFLOG(P2, "TrafficCapture write failed. Path follows.", path_);
+			
+			std::fflush(file_);
+		}
+		
+		written_ += n;
+		return n;
+	}
+}
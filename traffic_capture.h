@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+#include "webserver/bounded_queue.h"
+#include "webserver/worker_thread.h"
+
+#include <chrono>
+#include <cstdio>
+
+
+
+namespace net
+{
+	namespace HTTP
+	{
+		struct HTTPRequest;
+	}
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// TrafficCapture writes heads of sampled HTTP requests to file 'path' as JSON lines, so that production load shape
+	// can be replayed locally (see tests/traffic_replay.cpp):
+	//
+	// {"t_us":..,"conn":..,"tls":..,"method":..,"target":..,"version":..,"headers":{..},"body_bytes":..}
+	//
+	// 't_us' is time of request since 'Start', 'conn' numbers HTTP connections, so replay keeps both timing and
+	// concurrency (requests of one connection are sequential, connections overlap as they did). Bodies are not
+	// captured, their sizes are. Values of sensitive headers (see 'IsSensitive') are written as "<redacted>", values of
+	// query parameters are dropped (only path and parameter names of target are written).
+	//
+	// Sampling is by connection: 'NewConnection' returns 0 for all but every 'sample_every'-th one, and HTTPConnection
+	// calls 'Capture' only for non-zero numbers. So unsampled traffic costs a branch. Sampled requests are formatted on
+	// I/O thread and passed to the writer thread via BoundedQueue of 'queue_capacity' lines; a full queue drops them,
+	// numbers of dropped lines are written to the file as {"dropped":..} lines. Writer wakes each 'flush_ms' and
+	// appends the batch with one write.
+	//
+	// Empty 'path' disables capture: no thread is started, 'NewConnection' returns 0.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API TrafficCapture
+	{
+		DECLARE_NONCOPYABLE(TrafficCapture);
+	
+	public:
+		TrafficCapture(const std::string& path, uint sample_every, size_t queue_capacity = 4096, uint flush_ms = 100);
+		~TrafficCapture();
+		
+		bool Enabled() const { return !path_.empty(); }
+		
+		void Start();
+		void Stop();																// drains queue, closes file
+		
+		uint64_t NewConnection();													// 0 - not sampled
+		void Capture(uint64_t conn, const HTTP::HTTPRequest& req, bool tls);		// from I/O threads
+		
+		uint64_t Written() const { return written_; }
+		uint64_t Dropped() const { return dropped_; }
+		
+		static bool IsSensitive(const std::string& header);						// lowercase name
+		static void Format(uint64_t t_us, uint64_t conn, const HTTP::HTTPRequest& req, bool tls, std::string& out);
+	
+	private:
+		size_t drain();
+	
+	private:
+		const std::string path_;
+		const uint sample_every_;
+		const uint flush_ms_;
+		
+		BoundedQueue<std::string> queue_;
+		std::chrono::steady_clock::time_point started_;
+		
+		std::FILE* file_ = nullptr;
+		std::string buffer_;														// writer thread only
+		uint64_t reported_dropped_ = 0;
+		
+		std::atomic<uint64_t> connections_;
+		std::atomic<uint64_t> written_;
+		std::atomic<uint64_t> dropped_;
+		
+		WorkerThread writer_;
+	};
+}
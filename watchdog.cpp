@@ -0,0 +1,260 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/watchdog.h"
+
+#include <chrono>
+#include <mutex>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+
+
+namespace net
+{
+	namespace
+	{
+		const int max_frames = 48;
+
+#if defined(__linux__)
+		// Sample state: 0 - idle, -1 - requested, -2 - being taken by signal handler, > 0 - taken, number of frames
+		void* sample_frames[max_frames];
+		std::atomic<int> sample_size(0);
+		std::atomic<pthread_t> sample_thread;											/// set before request
+		ptl::mutex sampling_mx;															/// one sample at a time
+		
+		struct sigaction previous_action;												/// gets SIGURG not sent by us
+		
+		void on_sample_signal(int sig, siginfo_t* info, void* context)
+		{
+			int requested = -1;
+			if (pthread_equal(pthread_self(), sample_thread.load()) && sample_size.compare_exchange_strong(requested, -2))
+			{
+				int saved_errno = errno;													/// interrupted code may check it
+				sample_size.store(std::max(::backtrace(sample_frames, max_frames), 1));
+				errno = saved_errno;
+				return;
+			}
+			
+			if (previous_action.sa_flags & SA_SIGINFO)
+				previous_action.sa_sigaction(sig, info, context);
+			else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+				previous_action.sa_handler(sig);
+		}
+		
+		void install_sample_handler()
+		{
+			static std::once_flag once;
+			std::call_once(once, []
+			{
+				void* warmup[1];
+				::backtrace(warmup, 1);													/// loads unwinder outside of handler
+				
+				struct sigaction sa = {};
+				sa.sa_sigaction = &on_sample_signal;
+				sa.sa_flags = SA_RESTART | SA_SIGINFO;
+				sigemptyset(&sa.sa_mask);
+				sigaction(SIGURG, &sa, &previous_action);
+			});
+		}
+#endif
+	}
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// Slot of I/O thread. Owner thread fills context and 'entered_ns' under 'mx' on scope entry and clears it on exit;
+	// watchdog thread copies context under 'mx' too, so it never reads a context being destroyed.
+	//------------------------------------------------------------------------------------------------------------------
+	struct Watchdog::Slot
+	{
+		ptl::mutex mx;
+		uint64_t epoch = 0;
+		uint64_t entered_ns = 0;														/// 0 - not in handler
+		const char* what = nullptr;
+		const Uri* uri = nullptr;
+		uint64_t request = 0;
+		const pauuid* conn_id = nullptr;
+		
+		uint64_t reported_epoch = 0;													/// watchdog thread only
+		std::atomic<bool> reported;
+
+#if defined(__linux__)
+		pthread_t thread = pthread_self();
+#endif
+		
+		Slot() : reported(false) {}
+	};
+	
+	Watchdog::Scope::Scope(Watchdog& watchdog, const char* what, const Uri* uri, uint64_t request, const pauuid* conn_id)
+		: watchdog_(watchdog), slot_(nullptr)
+	{
+		if (watchdog.stall_ns_ == 0)
+			return;
+		
+		Slot& s = watchdog.slot();
+		boost::lock_guard<ptl::mutex> lck(s.mx);
+		
+		if (s.entered_ns != 0)															/// nested, outer one is watched
+			return;
+		
+		s.what = what;
+		s.uri = uri;
+		s.request = request;
+		s.conn_id = conn_id;
+		s.entered_ns = now_ns();
+		++s.epoch;
+		
+		slot_ = &s;
+	}
+	
+	Watchdog::Scope::~Scope()
+	{
+		if (!slot_)
+			return;
+		
+		uint64_t entered;
+		{
+			boost::lock_guard<ptl::mutex> lck(slot_->mx);
+			
+			entered = slot_->entered_ns;
+			slot_->entered_ns = 0;
+			slot_->uri = nullptr;
+			slot_->conn_id = nullptr;
+		}
+		
+		if (slot_->reported.exchange(false))
+			watchdog_.metrics_.Record(MetricStage::io_stall, (now_ns() - entered) / 1000);
+	}
+	
+	Watchdog::Watchdog(uint stall_ms, Metrics& metrics, bool sample_stacks)
+		: stall_ns_(uint64_t(stall_ms) * 1000000), sample_stacks_(sample_stacks), metrics_(metrics), stalls_(0)
+	{
+	}
+	
+	Watchdog::~Watchdog()
+	{
+		Stop();
+	}
+	
+	void Watchdog::OnStall(Handler handler)
+	{
+		on_stall_ = std::move(handler);
+	}
+	
+	void Watchdog::Start()
+	{
+		if (stall_ns_ == 0 || thread_.Running())
+			return;
+
+#if defined(__linux__)
+		if (sample_stacks_)
+			install_sample_handler();
+#endif
+		
+		uint period_ms = static_cast<uint>(std::max<uint64_t>(stall_ns_ / 4 / 1000000, 1));
+		thread_.Start([this] { check_all(); return false; }, period_ms);
+	}
+	
+	void Watchdog::Stop()
+	{
+		thread_.Stop();
+	}
+	
+	void Watchdog::check_all()
+	{
+		uint64_t now = now_ns();
+		for (auto s : slots_.All())
+			check(*s, now);
+	}
+	
+	void Watchdog::check(Slot& slot, uint64_t now)
+	{
+		WatchdogStall stall;
+		uint64_t epoch;
+		
+		{
+			boost::lock_guard<ptl::mutex> lck(slot.mx);
+			
+			if (slot.entered_ns == 0 || now - slot.entered_ns < stall_ns_ || slot.reported_epoch == slot.epoch)
+				return;
+			
+			epoch = slot.reported_epoch = slot.epoch;
+			slot.reported = true;
+			
+			stall.ms = (now - slot.entered_ns) / 1000000;
+			stall.what = slot.what ? slot.what : "";
+			if (slot.uri)
+				stall.uri = slot.uri->path();
+			stall.request = slot.request;
+			if (slot.conn_id)
+				stall.conn_id = *slot.conn_id;
+		}
+		
+		if (sample_stacks_)
+			stall.stack = sample_stack(slot);
+		
+		{
+			boost::lock_guard<ptl::mutex> lck(slot.mx);
+			if (slot.epoch != epoch)													/// returned while sampled
+				stall.stack.clear();
+		}
+		
+		++stalls_;
+		metrics_.Count(MetricCounter::io_stalls);
+		
+		if (on_stall_)
+			on_stall_(stall);
+		else
+			IFLOG(P2, "I/O thread stalled in handler. Handler, ms, URI, request, connection and stack follow.",
+				stall.what, stall.ms, stall.uri, stall.request, stall.conn_id, stall.stack);
+	}
+	
+	Watchdog::Slot& Watchdog::slot()
+	{
+		return slots_.Get([](size_t) { return std::unique_ptr<Slot>(new Slot()); });		/// on owner thread
+	}
+	
+	uint64_t Watchdog::now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	
+	std::string Watchdog::sample_stack(Slot& slot)
+	{
+#if defined(__linux__)
+		boost::lock_guard<ptl::mutex> lck(sampling_mx);
+		
+		sample_thread = slot.thread;
+		sample_size = -1;
+		if (pthread_kill(slot.thread, SIGURG) == 0)
+		{
+			for (int i = 0; i < 100 && sample_size.load() == -1; ++i)				/// up to ~100 ms
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		
+		int requested = -1;
+		if (sample_size.compare_exchange_strong(requested, 0))						/// late handler will skip it
+			return std::string();
+		
+		int size;
+		while ((size = sample_size.load()) < 0)										/// handler is taking it right now
+			std::this_thread::yield();
+		
+		sample_size = 0;
+		
+		std::string stack;
+		char** symbols = ::backtrace_symbols(sample_frames, size);
+		for (int i = 0; symbols && i < size; ++i)
+			stack.append(symbols[i]).append("\n");
+		
+		free(symbols);
+		return stack;
+#else
+		return std::string();
+#endif
+	}
+}
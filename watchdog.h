@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/metrics.h"
+#include "webserver/thread_slots.h"
+#include "webserver/worker_thread.h"
+#include "templates/mutex.h"
+
+
+
+namespace net
+{
+	struct WatchdogStall
+	{
+		uint64_t ms = 0;															// in handler so far
+		std::string what;															// kind of handler
+		std::string uri;
+		uint64_t request = 0;														// FlightRecorder id, HTTP only
+		pauuid conn_id;																// WS only
+		std::string stack;															// sampled, empty if unsupported
+	};
+	
+	//------------------------------------------------------------------------------------------------------------------
+	// Watchdog reports I/O threads stuck in a handler: HTTPRequestHandler::HandleRequest and WS callbacks run on
+	// main_service threads, so one blocking call there stalls every connection queued behind it.
+	//
+	// Handlers are wrapped into 'Scope', which marks thread's slot (allocated on its first scope) as busy since now
+	// and bumps its epoch. Watchdog thread wakes each 'stall_ms' / 4 and reports a slot busy for 'stall_ms' or
+	// longer once per epoch: handler kind, connection, URI and a stack sampled from the stuck thread, to 'OnStall'
+	// handler (logged with P2 if none). When a stalled scope ends, its full duration goes to Metrics as
+	// MetricStage::io_stall.
+	//
+	// Stacks are sampled if 'sample_stacks' is set, on Linux only: the stuck thread gets SIGURG and records its own
+	// backtrace. The handler is process-wide; SIGURG which the watchdog didn't send is passed to the handler installed
+	// before. backtrace() is not async-signal-safe: it is warmed up before the handler is installed, yet a thread
+	// interrupted inside the unwinder or malloc may deadlock, so sampling is for diagnostics, not for production
+	// defaults. Otherwise WatchdogStall::stack stays empty.
+	//
+	// 'stall_ms' 0 disables the watchdog: scopes cost a branch, no thread is started.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API Watchdog
+	{
+		DECLARE_NONCOPYABLE(Watchdog);
+		
+		struct Slot;
+	
+	public:
+		using Handler = std::function<void(const WatchdogStall& stall)>;
+		
+		class WEBSERVER_API Scope
+		{
+			DECLARE_NONCOPYABLE(Scope);
+		
+		public:
+			Scope(Watchdog& watchdog, const char* what, const Uri* uri, uint64_t request, const pauuid* conn_id);
+			~Scope();
+		
+		private:
+			Watchdog& watchdog_;
+			Slot* slot_;																// nullptr - disabled or nested
+		};
+	
+	public:
+		Watchdog(uint stall_ms, Metrics& metrics, bool sample_stacks = false);
+		~Watchdog();
+		
+		void OnStall(Handler handler);												// before 'Start'
+		
+		void Start();
+		void Stop();
+		
+		uint64_t Stalls() const { return stalls_; }								// reported so far
+	
+	private:
+		void check_all();
+		void check(Slot& slot, uint64_t now);
+		Slot& slot();
+		
+		static uint64_t now_ns();
+		static std::string sample_stack(Slot& slot);
+	
+	private:
+		const uint64_t stall_ns_;
+		const bool sample_stacks_;
+		Metrics& metrics_;
+		Handler on_stall_;
+		std::atomic<uint64_t> stalls_;
+		
+		ThreadSlots<Slot> slots_;
+		WorkerThread thread_;
+	};
+}
@@ -3,8 +3,11 @@
 #include "webserver/webserver.h"
 #include "webserver/connection.h"
 #include "webserver/HTTP/http_connection.h"
+#include "webserver/WS/ws_proto_impl.h"
 #include "openssl/ssl.h"
 
+#include <boost/lexical_cast.hpp>
+
 
 
 namespace net
@@ -14,20 +17,115 @@ namespace net
 	try : main_service_(main_service), // reuse_addr = true: do not swallow bind/listen error in socket
 		  http_acceptor_(acceptor_service, NetEndpoint(tcp_flags::v4(), params.local_http_port), /* reuse_addr = */ true),
 		  https_acceptor_(acceptor_service, NetEndpoint(tcp_flags::v4(), params.local_https_port), /* reuse_addr = */ true),
-		  http_bridge_creator_(http_bridge_creator), params_(params)
+		  http_bridge_creator_(http_bridge_creator), params_(params),
+		  ssl_reload_timer_(acceptor_service), acceptor_service_(acceptor_service), timer_wheel_next_(0),
+		  ws_replay_(std::min(params.ws_replay_capacity, params.ws_send_queue_capacity)),
+		  http_header_expired_(0), http_body_expired_(0), http_idle_expired_(0), metrics_(params.metrics),
+		  recorder_(params.flight_recorder_events, params.http_slow_request_ms),
+		  watchdog_(params.io_stall_ms, metrics_, params.io_stall_stacks),
+		  access_log_(params.access_log_path, params.access_log_ring),
+		  capture_(params.capture_path, params.capture_sample_every)
 	{
-		context_ = std::make_shared<SSLContext>(acceptor_service, SSLContext::tlsv12);
-		setup_ssl();
+		for (uint i = 0; i < std::max(std::thread::hardware_concurrency(), 1u); ++i)	// a wheel per hardware thread,
+			timer_wheels_.emplace_back(new TimerWheel(main_service, params_.timer_wheel_tick_ms));	// round robin
+		
+		if (!params_.ws_router_dir.empty())
+		{
+			std::string node = params_.ws_router_node;
+			if (node.empty())
+				node = boost::lexical_cast<std::string>(uuid_generate());
+			
+			ws_router_ = std::make_shared<WS::WSRouter>(main_service, params_.ws_router_dir, node,	// delivers to local
+				[this](const pauuid& conn_id, WS::WSRouter::Kind kind, std::string& s, const std::string& key)	// only
+				{
+					switch (kind)
+					{
+						case WS::WSRouter::Kind::binary:
+						{
+							auto payload = std::make_shared<const std::string>(std::move(s));
+							const WS::BinaryFrame frame = WS::make_binary_frame(std::move(payload));
+							return ws_forward(conn_id, frame);
+						}
+						case WS::WSRouter::Kind::close:
+						{
+							uint status_code = (static_cast<uint8_t>(s[0]) << 8) | static_cast<uint8_t>(s[1]);
+							ws_topics_.UnsubscribeAll(conn_id);
+							return ws_forward(conn_id, status_code);
+						}
+						default:
+							break;
+					}
+					
+					if (key.empty())
+						return ws_forward(conn_id, s);
+					
+					const WS::WSKeyedMessage m = { s, key };
+					return ws_forward(conn_id, m);
+				},
+				[this]()
+				{
+					std::vector<pauuid> ids;
+					ws_registry_.ForEach([&ids](const pauuid& conn_id, const WS::WSHandle&) { ids.push_back(conn_id); });
+					
+					return ids;
+				});
+		}
+		
+		auto context = std::make_shared<SSLContext>(acceptor_service, SSLContext::tlsv12);
+		
+		ssl_files_changed(ssl_crt_mtime_, ssl_key_mtime_);	// remember stamps of files the first context is built of
+		setup_ssl(*context);
+		
+		std::atomic_store(&context_, context);
+		params_.context = context;
 	}
 	catch (system_error& e) // reuse_addr option may throw
 	{
 		IFLOG(P1, "Error in boost::asio acceptor creation. Error info (code + message) follows.", e.code());
 	}
 	
+	WebServer::~WebServer()
+	{
+		for (auto& wheel : timer_wheels_)											/// no new ticks while members go
+			wheel->Stop();
+	}
+	
 	void WebServer::Start()
 	{
+		using WS::WSEvent;
+		using WS::WSEventType;
+		
+		// legacy callbacks go via queue too, except open and close ones, which WSConnection calls synchronously
+		if (!ws_events_.Subscribed(WSEventType::messageout) && ws_onmessageout)
+			ws_events_.Subscribe(WSEventType::messageout, [](const std::vector<WSEvent>& events)
+			{
+				for (auto& e : events)
+					ws_onmessageout(e.id, *e.message);
+			});
+		
+		if (!ws_events_.Subscribed(WSEventType::error) && ws_onerror)
+			ws_events_.Subscribe(WSEventType::error, [](const std::vector<WSEvent>& events)
+			{
+				for (auto& e : events)
+					ws_onerror(e.id, e.ec);
+			});
+		
+		ws_events_.Start();
+		watchdog_.Start();
+		recorder_.Start();
+		access_log_.Start();
+		capture_.Start();
+		
+		if (ws_router_)
+			ws_router_->Start();
+		
 		do_accept_http();
 		do_accept_https();
+		
+		watch_ssl_files();
+		
+		for (auto& wheel : timer_wheels_)
+			wheel->Start();
 	}
 	
 	void WebServer::Stop()
@@ -37,24 +135,156 @@ namespace net
 		http_acceptor_.close(ec);
 		https_acceptor_.close(ec);
 		
+		ssl_reload_timer_.cancel(ec);
+		
+		if (ws_router_)
+			ws_router_->Stop();
+		
 		if (ec)
 			IFLOG(P2, "Exception happened while closing http(s) acceptor. Error info (code+message) follows.", ec);
 	}
 	
 	bool WebServer::WSPush(const pauuid& conn_id, std::string const& s)
 	{
-		boost::lock_guard<ptl::mutex> lck(ws_conns_mx_);
+		return ws_forward(conn_id, s) || (ws_router_ && ws_router_->Push(conn_id, s));
+	}
+	
+	bool WebServer::WSPush(const pauuid& conn_id, std::string const& s, std::string const& coalesce_key)
+	{
+		const WS::WSKeyedMessage m = { s, coalesce_key };
 		
-		return (ws_forward(conn_id, ws_conns_, s) ||
-		        ws_forward(conn_id, ws_secure_conns_, s));
+		return ws_forward(conn_id, m) || (ws_router_ && ws_router_->Push(conn_id, s, coalesce_key));
+	}
+	
+	bool WebServer::WSPushBinary(const pauuid& conn_id, WS::PayloadPtr payload)
+	{
+		if (!payload)
+			return false;
+		
+		const WS::BinaryFrame frame = WS::make_binary_frame(payload);
+		
+		return ws_forward(conn_id, frame) || (ws_router_ && ws_router_->PushBinary(conn_id, *payload));
+	}
+	
+	bool WebServer::WSPushStream(const pauuid& conn_id, WS::WSStreamSource source, bool binary)
+	{
+		WS::WSStream stream;
+		stream.source = std::move(source);
+		stream.binary = binary;
+		
+		const WS::WSStream& s = stream;
+		
+		return ws_forward(conn_id, s);	// not routed to other processes: source is a callback of this one
+	}
+	
+	size_t WebServer::WSBroadcast(const std::vector<pauuid>& conn_ids, std::string const& s)
+	{
+		const WS::FramePtr frame = WS::make_frame(s, WS::Schema::WSFinRsvOpcode::one_fragment_text);	// encode once
+		size_t n = 0;
+		
+		for (auto& conn_id : conn_ids)
+		{
+			if (ws_forward(conn_id, frame))
+				++n;
+		}
+		
+		return n;
+	}
+	
+	size_t WebServer::WSBroadcast(const std::function<bool(const pauuid&)>& pred, std::string const& s)
+	{
+		const WS::FramePtr frame = WS::make_frame(s, WS::Schema::WSFinRsvOpcode::one_fragment_text);	// encode once
+		
+		return ws_forward_if(pred, frame);
+	}
+	
+	bool WebServer::WSSubscribe(const std::string& topic, const pauuid& conn_id)
+	{
+		ws_topics_.Subscribe(topic, conn_id);
+		
+		WS::WSHandle handle;
+		if (ws_registry_.Find(conn_id, handle))	// checked after subscribing: WSRemoveSession removes from registry,
+			return true;						// then from topics, so either it sees this subscription or we see removal
+		
+		ws_topics_.Unsubscribe(topic, conn_id);
+		return false;
+	}
+	
+	void WebServer::WSUnsubscribe(const std::string& topic, const pauuid& conn_id)
+	{
+		ws_topics_.Unsubscribe(topic, conn_id);
+	}
+	
+	size_t WebServer::WSPublish(const std::string& topic, std::string const& s)
+	{
+		auto subscribers = ws_topics_.Snapshot(topic);	// immutable, no lock is held while iterating
+		
+		if (!subscribers)
+			return 0;
+		
+		return WSBroadcast(*subscribers, s);
 	}
 	
 	bool WebServer::WSClose(const pauuid& conn_id, uint status_code)
 	{
-		boost::lock_guard<ptl::mutex> lck(ws_conns_mx_);
+		ws_topics_.UnsubscribeAll(conn_id);
 		
-		return (ws_forward(conn_id, ws_conns_, status_code) ||         // first try to forward closure status into WS connection by id
-		        ws_forward(conn_id, ws_secure_conns_, status_code));   // if failure, try to forward into WSS connection by id
+		return ws_forward(conn_id, status_code) ||   // forward closure status into WS or WSS connection by id
+		       (ws_router_ && ws_router_->Close(conn_id, status_code));
+	}
+	
+	
+	
+	bool WebServer::WSSetBackpressure(const pauuid& conn_id, const WS::WSBackpressure& bp)
+	{
+		return ws_forward(conn_id, bp);
+	}
+	
+	bool WebServer::WSGetQueueStats(const pauuid& conn_id, WS::WSQueueStats& stats)
+	{
+		return ws_forward(conn_id, stats);
+	}
+	
+	TimerWheel& WebServer::timer_wheel()
+	{
+		return *timer_wheels_[timer_wheel_next_++ % timer_wheels_.size()];
+	}
+	
+	void WebServer::WSOnEvents(WS::WSEventType type, WS::WSEventDispatcher::BatchHandler handler)
+	{
+		ws_events_.Subscribe(type, std::move(handler));
+	}
+	
+	HTTP::HTTPDeadlineStats WebServer::GetHTTPDeadlineStats() const
+	{
+		HTTP::HTTPDeadlineStats stats;
+		stats.header = http_header_expired_;
+		stats.body = http_body_expired_;
+		stats.idle = http_idle_expired_;
+		
+		return stats;
+	}
+	
+	void WebServer::count_http_deadline(HTTP::HTTPDeadline deadline)
+	{
+		switch (deadline)
+		{
+			case HTTP::HTTPDeadline::handshake:
+			case HTTP::HTTPDeadline::header:
+				++http_header_expired_;
+				metrics_.Count(MetricCounter::http_timeouts_header);
+				break;
+			case HTTP::HTTPDeadline::body:
+				++http_body_expired_;
+				metrics_.Count(MetricCounter::http_timeouts_body);
+				break;
+			case HTTP::HTTPDeadline::idle:
+				++http_idle_expired_;
+				metrics_.Count(MetricCounter::http_timeouts_idle);
+				break;
+			default:
+				break;
+		}
 	}
 	
 	
@@ -62,9 +292,10 @@ namespace net
 	// Forming of secure context
 	// server.key - server private key (searched for beside pa7 configuration files)
 	// server.crt - server certificate
-	void WebServer::setup_ssl()
+	// Returns false if certificate and/or key are absent or broken.
+	bool WebServer::setup_ssl(SSLContext& context)
 	{
-		context_->set_options(
+		context.set_options(
 			SSLContext::default_workarounds
 			| SSLContext::no_sslv2
 			| SSLContext::no_sslv3
@@ -72,25 +303,32 @@ namespace net
 			| SSL_OP_SINGLE_ECDH_USE
 		);
 		
+#ifdef SSL_OP_NO_RENEGOTIATION
+		if (params_.ktls)	// OpenSSL must not write records by itself after kernel took over write key
+			SSL_CTX_set_options(context.native_handle(), SSL_OP_NO_RENEGOTIATION);
+#endif
+		
 		auto fpath = fs::GetProcessRootDirectory();
 		
 		if (fs::exists(fpath / "server.crt") && fs::exists(fpath / "server.key"))
 		{
 			try
 			{
-				context_->use_certificate_chain_file((fpath / "server.crt").string());
-				context_->use_private_key_file((fpath / "server.key").string(), SSLContext::pem);
-			
+				context.use_certificate_chain_file((fpath / "server.crt").string());
+				context.use_private_key_file((fpath / "server.key").string(), SSLContext::pem);
+				
 				std::unique_ptr<EC_KEY, void(*)(EC_KEY*)> ecdh(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1), EC_KEY_free);
 				
-				SSL_CTX_set_tmp_ecdh(context_->native_handle(), ecdh.get());
+				SSL_CTX_set_tmp_ecdh(context.native_handle(), ecdh.get());
 				
 				char* cipher_list = TLS1_TXT_ECDHE_RSA_WITH_AES_256_GCM_SHA384 " "
 				                    TLS1_TXT_ECDHE_RSA_WITH_AES_128_GCM_SHA256 " "
 				                    TLS1_TXT_RSA_WITH_AES_256_GCM_SHA384       " "
 				                    TLS1_TXT_RSA_WITH_AES_128_GCM_SHA256;
 				
-				SSL_CTX_set_cipher_list(context_->native_handle(), cipher_list);
+				SSL_CTX_set_cipher_list(context.native_handle(), cipher_list);
+				
+				return true;
 			}
 			catch (std::exception &e)
 			{
@@ -100,30 +338,109 @@ namespace net
 		else
 			IFLOG(P1, "SSL certificate and/or private key absent. SSL disabled. Security broken.");
 		
-		params_.context = context_;
+		return false;
 	}
 	
-	template<typename TMap, typename TArg>
-	bool WebServer::ws_forward(const pauuid& conn_id, TMap& ws_map, TArg& a)
+	// Certificate rotation without restart: a new context is built on acceptor_service thread and swapped in only if
+	// it's complete. Failed attempt (e.g. new .crt is written, but .key is not yet) is retried on the next check.
+	void WebServer::watch_ssl_files()
 	{
-		bool ok = false;
+		if (params_.ssl_reload_interval_sec == 0)
+			return;
 		
-		auto ws_conn = ws_map.find(conn_id);
-		if (ws_conn != ws_map.end())
-		{
-			if (auto conn_lck = ws_conn->second.lock())
+		ssl_reload_timer_.expires_from_now(boost::posix_time::seconds(params_.ssl_reload_interval_sec));
+		ssl_reload_timer_.async_wait(
+			[this](error_code ec)
 			{
-				conn_lck->Forward(a);
-				ok = true;
+				if (ec == boost::asio::error::operation_aborted || !https_acceptor_.is_open())
+					return;
+				
+				std::time_t crt_mtime = ssl_crt_mtime_, key_mtime = ssl_key_mtime_;
+				
+				if (ssl_files_changed(crt_mtime, key_mtime))
+				{
+					auto context = std::make_shared<SSLContext>(acceptor_service_, SSLContext::tlsv12);
+					
+					if (setup_ssl(*context))
+					{
+						std::atomic_store(&context_, context);
+						
+						ssl_crt_mtime_ = crt_mtime;
+						ssl_key_mtime_ = key_mtime;
+						
+						IFLOG(P3, "SSL certificate and private key reloaded.");
+					}
+					else
+						IFLOG(P2, "SSL certificate and/or private key changed but can't be loaded. Old ones kept.");
+				}
+				
+				watch_ssl_files();
 			}
+		);
+	}
+	
+	bool WebServer::ssl_files_changed(std::time_t& crt_mtime, std::time_t& key_mtime)
+	{
+		auto fpath = fs::GetProcessRootDirectory();
+		
+		try
+		{
+			std::time_t crt = fs::last_write_time(fpath / "server.crt");
+			std::time_t key = fs::last_write_time(fpath / "server.key");
+			
+			bool changed = (crt != crt_mtime || key != key_mtime);
+			
+			crt_mtime = crt;
+			key_mtime = key;
+			
+			return changed;
+		}
+		catch (std::exception&)	// files are absent or being replaced right now
+		{
+			return false;
+		}
+	}
+	
+	template<typename TArg>
+	bool WebServer::ws_forward(const pauuid& conn_id, TArg& a)
+	{
+		WS::WSHandle handle;
+		if (!ws_registry_.Find(conn_id, handle))
+			return false;
+		
+		if (handle.Forward(a))
+			return true;
+		
+		IFLOG(P4, "WS message push error. Connection handle dead. Erasing connnection with following id.", conn_id);
+		WSRemoveSession(conn_id);	// normally done by stopping connection, this one died without stop
+		
+		return false;
+	}
+	
+	template<typename TArg>
+	size_t WebServer::ws_forward_if(const std::function<bool(const pauuid&)>& pred, TArg& a)
+	{
+		size_t n = 0;
+		std::vector<pauuid> dead;
+		
+		ws_registry_.ForEach([&](const pauuid& conn_id, const WS::WSHandle& handle)	// over snapshot, no lock held
+		{
+			if (!pred(conn_id))
+				return;
+			
+			if (handle.Forward(a))
+				++n;
 			else
-			{
-				IFLOG(P4, "WS message push error. Connection handle dead. Erasing connnection with following id.", conn_id);
-				ws_map.erase(ws_conn);
-			}
+				dead.push_back(conn_id);
+		});
+		
+		for (auto& conn_id : dead)
+		{
+			IFLOG(P4, "WS message broadcast error. Connection handle dead. Erasing connnection with following id.", conn_id);
+			WSRemoveSession(conn_id);
 		}
 		
-		return ok;
+		return n;
 	}
 	
 	
@@ -138,16 +455,16 @@ namespace net
 				{
 					return;
 				}
-
+				
 				if (!ec)
 				{
 					params_.remote_ip = sock->remote_endpoint().address();
 					params_.remote_port = sock->remote_endpoint().port();
-
+					
 					auto conn = std::make_shared<HTTP::HTTPConnection<TCPSocket>>(*this, sock, params_, http_bridge_creator_());
 					conn->Start();
 				}
-
+				
 				do_accept_http();  // process next http connection
 			}
 		);
@@ -155,45 +472,80 @@ namespace net
 	
 	void WebServer::do_accept_https()
 	{
-		auto ssl_sock = std::make_shared<SSLSocket>(main_service_, *context_.get());
+		auto context = std::atomic_load(&context_);	// connection keeps this context till the end, even after reload
+		
+		auto ssl_sock = std::make_shared<SSLSocket>(main_service_, *context.get());
 		https_acceptor_.async_accept(ssl_sock->lowest_layer(),
-			[this, ssl_sock](boost::system::error_code ec)
+			[this, ssl_sock, context](boost::system::error_code ec)
 			{
 				if (!https_acceptor_.is_open())
 				{
 					return;
 				}
-
+				
 				if (!ec)
 				{
 					params_.remote_ip = ssl_sock->lowest_layer().remote_endpoint().address();
 					params_.remote_port = ssl_sock->lowest_layer().remote_endpoint().port();
-
+					params_.context = context;
+					
 					auto conn = std::make_shared<HTTP::HTTPConnection<SSLSocket>>(*this, ssl_sock, params_, http_bridge_creator_());
 					conn->Start();
 				}
-
+				
 				do_accept_https(); // process next https connection
 			}
 		);
 	}
 	
+	void WebServer::Accept(std::shared_ptr<MemSocket> sock)
+	{
+		acceptor_service_.post([this, sock]()												/// 'params_' are written there
+		{
+			params_.remote_ip = sock->remote_endpoint().address();
+			params_.remote_port = sock->remote_endpoint().port();
+			
+			auto conn = std::make_shared<HTTP::HTTPConnection<MemSocket>>(*this, sock, params_, http_bridge_creator_());
+			conn->Start();
+		});
+	}
+	
 	
 	
 	template<>
 	void WebServer::WSAddSession<TCPSocket>(const pauuid& id, std::weak_ptr<WS::WSConnection<TCPSocket>> wp)
 	{
-		boost::lock_guard<ptl::mutex> lck(ws_conns_mx_);
+		ws_registry_.Add(id, WS::WSHandle(std::move(wp)));
 		
-		ws_conns_.insert( { id, wp } );
+		if (ws_router_)
+			ws_router_->Announce(id);
 	}
 	
 	template<>
 	void WebServer::WSAddSession<SSLSocket>(const pauuid& id, std::weak_ptr<WS::WSConnection<SSLSocket>> wp)
 	{
-		boost::lock_guard<ptl::mutex> lck(ws_conns_mx_);
+		ws_registry_.Add(id, WS::WSHandle(std::move(wp)));
+		
+		if (ws_router_)
+			ws_router_->Announce(id);
+	}
+	
+	template<>
+	void WebServer::WSAddSession<MemSocket>(const pauuid& id, std::weak_ptr<WS::WSConnection<MemSocket>> wp)
+	{
+		ws_registry_.Add(id, WS::WSHandle(std::move(wp)));
+		
+		if (ws_router_)
+			ws_router_->Announce(id);
+	}
+	
+	void WebServer::WSRemoveSession(const pauuid& id)
+	{
+		ws_registry_.Remove(id);
+		ws_topics_.UnsubscribeAll(id);
 		
-		ws_secure_conns_.insert( { id, wp } );
+		if (ws_router_)
+			ws_router_->Withdraw(id);
 	}
 	
 	
@@ -8,6 +8,16 @@
 #include "webserver/HTTP/http_request_handler.h"
 #include "webserver/WS/ws_connection.h"
 #include "webserver/WS/ws_protocol.h"
+#include "webserver/WS/ws_topics.h"
+#include "webserver/WS/ws_registry.h"
+#include "webserver/WS/ws_events.h"
+#include "webserver/WS/ws_router.h"
+#include "webserver/timer_wheel.h"
+#include "webserver/metrics.h"
+#include "webserver/flight_recorder.h"
+#include "webserver/watchdog.h"
+#include "webserver/access_log.h"
+#include "webserver/traffic_capture.h"
 
 
 
@@ -16,7 +26,7 @@ namespace net
 	//------------------------------------------------------------------------------------------------------------------
 	// WebServer is a one-instance web service which
 	// 1) handles bidirectional HTTP(S) connections in half-duplex mode (write and read can't happen simultaneously
-	// 2) stores push-only WS connections.
+	// 2) stores bidirectional WS connections (messages from clients come via 'ws_onmessagein').
 	//
 	// WebServer is multithreaded equally as ThreadPool of it's io_server.
 	//
@@ -25,13 +35,59 @@ namespace net
 	// HTTPConnection<TCPSocket> object is created.
 	//
 	// Methods 'Start' and 'Stop' methods manage whether acceptors are open. They are called from webengine module.
-	// Method 'WSPush' passes websocket message to client.
-	// Method 'WSClose' stops single WS channel.
-	// Method 'setup_ssl' creates cyphered context to get a secure socket.
+	// Method 'WSPush' passes websocket message to client. If client is connected to another webserver process on this
+	//   host and WebServerParams::ws_router_dir is set, message is forwarded there (see WSRouter).
+	// Methods 'WSBroadcast' pass the same message to many clients - chosen by list of ids or by predicate over ids. The
+	//   frame is encoded once and shared (not copied) by all target connections' queues.
+	// Methods 'WSSubscribe', 'WSUnsubscribe', 'WSPublish' maintain topics (channels) of WS connections and broadcast to
+	//   all subscribers of a topic (see WSTopicRegistry). Only live connections of this process can subscribe. If
+	//   WebServerParams::ws_subscribe_by_path is set, connection is subscribed to the topic named by its URI path at
+	//   handshake time.
+	// Method 'WSPushBinary' passes binary message to client without copying it: payload is shared with caller and
+	//   written right after a small separately encoded frame header. Null payload is rejected (returns false).
+	// Method 'WSPushStream' passes a message of any size to client in fragments, pulling them lazily from the source
+	//   (see WS::WSStream), so the message is never held whole in memory. Unlike other push methods and 'WSClose',
+	//   which are routed like 'WSPush', it reaches only connections of this process.
+	// Method 'WSPush' with coalescing key lets newer message supersede queued ones with the same key (see
+	//   WS::WSBackpressure).
+	// Methods 'WSSetBackpressure' and 'WSGetQueueStats' change policy and read counters of single WS channel's queue.
+	// Method 'WSClose' sends close frame with given status into single WS channel and stops it.
+	// Method 'setup_ssl' fills cyphered context to get a secure socket.
+	// Method 'watch_ssl_files' periodically checks certificate & key files and, if they changed, builds a new context
+	//   and atomically swaps 'context_'. New HTTPS connections get the new context, existing ones keep the context
+	//   they started with (it's held by shared_ptr in their WebServerParams).
 	// Method 'ws_forward' passes a single argument to a particular connection, if it exists. This argument is either a
 	//   message for client or unsigned int closure code (standard code is used by default).
+	// Method 'timer_wheel' returns one of 'timer_wheels_' (round robin), which serve coarse per-connection timeouts:
+	//   WS heartbeats and HTTP deadlines. Wheels run on main_service and keep running after 'Stop', as connections do;
+	//   destructor stops them.
+	// Method 'WSOnEvents' subscribes a handler to batches of WS lifecycle events of one type (see WSEventDispatcher).
+	//   Events are queued by I/O threads and handled on a separate thread; types without handlers cost nothing.
+	//   Static callbacks 'ws_onmessageout', 'ws_onerror', if set before 'Start' and not overridden by 'WSOnEvents',
+	//   are delivered the same way, one call per event. Static 'ws_onopen' and 'ws_onclose', unless overridden, are
+	//   called synchronously by the connection's I/O thread, so 'ws_onopen' always precedes the connection's first
+	//   'ws_onmessagein'; 'WSOnEvents' handlers of open and close run asynchronously to 'ws_onmessagein'.
+	// If WebServerParams::ws_replay_capacity is set, WS sessions (SID cookie) are resumable: a reconnecting client
+	//   gets messages it missed instead of the full state (see WSReplayStore).
+	// Method 'metrics' gives connections the shared Metrics (stage histograms, counters, gauges), which are served at
+	//   WebServerParams::metrics_path by HTTPConnection itself.
+	// Method 'recorder' gives connections the shared FlightRecorder; HTTP requests slower than
+	//   WebServerParams::http_slow_request_ms get their timelines logged (or passed to 'recorder().OnSlow' handler) by
+	//   recorder's thread, which is started by 'Start' and stopped with WebServer.
+	// Method 'watchdog' gives connections the Watchdog, which reports I/O threads stuck in HTTPRequestHandler or
+	//   'ws_onmessagein' for WebServerParams::io_stall_ms; it's started by 'Start' and stopped with WebServer.
+	// Method 'access_log' gives connections the AccessLog (WebServerParams::access_log_path), same lifetime as watchdog.
+	// Method 'capture' gives connections the TrafficCapture (WebServerParams::capture_path): heads of sampled requests
+	//   are written for replay by tests/traffic_replay.cpp.
+	// Method 'GetHTTPDeadlineStats' returns numbers of HTTP connections cut by header, body and keep-alive idle
+	//   deadlines (see HTTPConnection::arm_deadline).
 	// Methods 'do_accept_...' create HTTPConnection objects above socket.
-	// Method 'WSAddSession' allows to manage all WSConnections from WebServer.
+	// Method 'Accept' does the same for in-memory socket, which caller has connected to its own peer MemSocket: the
+	//   whole HTTP & WS stack then runs without syscalls (benchmarks, deterministic tests). Like real accepts, it
+	//   goes through acceptor_service.
+	// Methods 'WSAddSession' and 'WSRemoveSession' keep registry of all WS and WSS connections (see WSRegistry):
+	//   connection is added after handshake and removed when it stops, so no dead handles pile up. Registry is
+	//   sharded, so pushes from many threads don't serialize on a global mutex.
 	//
 	// There are two underlying io_services:
 	// 1) main_service - a queue of requests deployed over thread pool.
@@ -48,22 +104,60 @@ namespace net
 		
 		template<typename TSocket>
 		friend void HTTP::HTTPConnection<TSocket>::_create_ws_connection(std::shared_ptr<HTTP::HTTPConnection<TSocket>> self);
+		
+		template<typename TSocket>
+		friend class WS::WSConnection;
+		
+		template<typename TSocket>
+		friend class HTTP::HTTPConnection;
 	
 	public:
 		explicit WebServer(IOService& main_service, IOService& acceptor_service, WebServerParams params,
 		                   HTTP::HTTPRequestHandler::CreatorType http_bridge_creator);
+		~WebServer();
 		
 		void Start();
 		void Stop();	// does not stop existing HTTP and WS connections
 		
+		void Accept(std::shared_ptr<MemSocket> sock);
+		
 		bool WSPush(const pauuid& conn_id, std::string const& s);
+		bool WSPush(const pauuid& conn_id, std::string const& s, std::string const& coalesce_key);
+		bool WSPushBinary(const pauuid& conn_id, WS::PayloadPtr payload);
+		bool WSPushStream(const pauuid& conn_id, WS::WSStreamSource source, bool binary = false);
+		size_t WSBroadcast(const std::vector<pauuid>& conn_ids, std::string const& s);				// returns number of
+		size_t WSBroadcast(const std::function<bool(const pauuid&)>& pred, std::string const& s);	// clients reached
+		
+		bool WSSubscribe(const std::string& topic, const pauuid& conn_id);								// false - not live
+		void WSUnsubscribe(const std::string& topic, const pauuid& conn_id);
+		size_t WSPublish(const std::string& topic, std::string const& s);
 		bool WSClose(const pauuid& conn_id, uint status_code = WS::Schema::WSClosureStatus::normal);
+		
+		bool WSSetBackpressure(const pauuid& conn_id, const WS::WSBackpressure& bp);
+		bool WSGetQueueStats(const pauuid& conn_id, WS::WSQueueStats& stats);
+		
+		TimerWheel& timer_wheel();
+		
+		HTTP::HTTPDeadlineStats GetHTTPDeadlineStats() const;
+		
+		Metrics& metrics() { return metrics_; }
+		FlightRecorder& recorder() { return recorder_; }
+		Watchdog& watchdog() { return watchdog_; }
+		AccessLog& access_log() { return access_log_; }
+		TrafficCapture& capture() { return capture_; }
+		
+		void WSOnEvents(WS::WSEventType type, WS::WSEventDispatcher::BatchHandler handler);	// before 'Start'
 	
 	private:
-		void setup_ssl();
+		bool setup_ssl(SSLContext& context);
+		void watch_ssl_files();
+		bool ssl_files_changed(std::time_t& crt_mtime, std::time_t& key_mtime);
 		
-		template<typename TMap, typename TArg>
-		bool ws_forward(const pauuid& conn_id, TMap& ws_map, TArg& a);
+		template<typename TArg>
+		bool ws_forward(const pauuid& conn_id, TArg& a);
+		
+		template<typename TArg>
+		size_t ws_forward_if(const std::function<bool(const pauuid&)>& pred, TArg& a);
 		
 		void do_accept_http();
 		
@@ -71,9 +165,13 @@ namespace net
 		
 		template<typename TSocket>
 		void WSAddSession(const pauuid& id, std::weak_ptr<WS::WSConnection<TSocket>> wp);
+		void WSRemoveSession(const pauuid& id);
+		
+		void count_http_deadline(HTTP::HTTPDeadline deadline);
 	
 	public:
-		// callbacks for WSConnection lifecycle, which are filled-in in webengine module, on "WS bridge"
+		// callbacks for WSConnection lifecycle, which are filled-in in webengine module, on "WS bridge"; all but
+		// 'ws_onmessagein' are called on 'ws_events_' consumer thread, not on I/O threads (see 'Start')
 		static std::function<void(const pauuid&, const pauuid&, const Uri&)> ws_onopen;
 		static std::function<void(const pauuid&, const std::string&)> ws_onmessagein;
 		static std::function<void(const pauuid&, const std::string&)> ws_onmessageout;
@@ -81,14 +179,40 @@ namespace net
 		static std::function<void(const pauuid&, const Uri&)> ws_onclose;
 	
 	private:
-		// storage and synchronization for WS and WSS connections
-		std::map<pauuid, std::weak_ptr<WS::WSConnection<TCPSocket>>> ws_conns_;
-		std::map<pauuid, std::weak_ptr<WS::WSConnection<SSLSocket>>> ws_secure_conns_;
-		ptl::mutex ws_conns_mx_;
+		// storage of WS and WSS connections
+		WS::WSRegistry ws_registry_;
+		
+		WS::WSTopicRegistry ws_topics_;
+		
+		WS::WSEventDispatcher ws_events_;
+		
+		WS::WSReplayStore ws_replay_;
+		
+		std::shared_ptr<WS::WSRouter> ws_router_;										// nullptr - single process
 		
 		TCPAcceptor http_acceptor_;
 		TCPAcceptor https_acceptor_;
-		std::shared_ptr<SSLContext> context_;
+		std::shared_ptr<SSLContext> context_;											// accessed via std::atomic_load/store only
+		
+		// certificate hot reload (timer runs on acceptor_service)
+		boost::asio::deadline_timer ssl_reload_timer_;
+		std::time_t ssl_crt_mtime_ = 0;
+		std::time_t ssl_key_mtime_ = 0;
+		
+		IOService& acceptor_service_;
+		
+		std::vector<std::unique_ptr<TimerWheel>> timer_wheels_;
+		std::atomic<size_t> timer_wheel_next_;
+		
+		std::atomic<uint64_t> http_header_expired_;
+		std::atomic<uint64_t> http_body_expired_;
+		std::atomic<uint64_t> http_idle_expired_;
+		
+		Metrics metrics_;
+		FlightRecorder recorder_;
+		Watchdog watchdog_;
+		AccessLog access_log_;
+		TrafficCapture capture_;
 		
 		// Factory method pattern impl, which passes an instance of HTTPRequestHandler to each HTTPConnection
 		HTTP::HTTPRequestHandler::CreatorType http_bridge_creator_;
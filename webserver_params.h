@@ -2,6 +2,8 @@
 
 #include "webserver/expimp.h"
 #include "webserver/stdhdr.h"
+#include "webserver/WS/ws_backpressure.h"
+#include "webserver/WS/ws_deflate.h"
 
 
 
@@ -24,5 +26,38 @@ namespace net
 		uint16_t remote_port;        // filled but unused currently
 		
 		std::shared_ptr<SSLContext> context;
+		uint ssl_reload_interval_sec = 60;  // period of server.crt / server.key change checks, 0 - no hot reload
+		
+		uint http_header_timeout_sec = 10;  // request line + headers must arrive in this time, else 408; 0 - no limit
+		uint http_body_timeout_sec = 30;    // body must arrive in this time after headers, else 408; 0 - no limit
+		uint http_idle_timeout_sec = 60;    // keep-alive connection waiting for next request is closed; 0 - no limit
+		
+		size_t ws_max_message_size = 4 << 20;  // incoming WS message limit, bigger ones close connection with 1009
+		bool ws_subscribe_by_path = false;     // subscribe WS connection to topic named by its URI path at handshake
+		size_t ws_send_queue_capacity = 128;   // frames queued per WS connection, see WS::WSBackpressure on overflow
+		WS::WSBackpressure ws_backpressure;    // default policy for new WS connections
+		WS::WSDeflateOptions ws_deflate;       // opt-in permessage-deflate compression (RFC 7692)
+		size_t ws_stream_fragment_size = 64 << 10; // payload of one frame of streamed WS message (see WSPushStream)
+		uint ws_ping_interval_sec = 30;        // WS heartbeat period, 0 - no heartbeat
+		uint ws_pong_timeout_sec = 10;         // silent WS connection is closed with 4020 this long after ping
+		size_t ws_replay_capacity = 0;         // messages kept per session for resumption, 0 - off (see WSReplayStore)
+		uint ws_replay_ttl_sec = 60;           // session's messages are kept this long after its connection stops
+		std::string ws_router_dir;             // pushes to other local webserver processes via sockets here (see WSRouter)
+		std::string ws_router_node;            // this process' name among them, random if empty
+		
+		uint timer_wheel_tick_ms = 100;        // precision of heartbeats and deadlines (see TimerWheel)
+		
+		bool metrics = false;                  // stage latency histograms & counters (see Metrics)
+		std::string metrics_path;              // they are served here in Prometheus text format, empty - not served
+		size_t flight_recorder_events = 4096;  // last request events kept per I/O thread, 0 - off (see FlightRecorder)
+		uint http_slow_request_ms = 1000;      // timeline of HTTP request this slow is logged, 0 - never
+		uint io_stall_ms = 500;                // I/O thread this long in one handler is reported (see Watchdog), 0 - off
+		bool io_stall_stacks = false;          // ... with its stack, sampled by SIGURG handler (Linux, see Watchdog)
+		std::string access_log_path;           // JSON line per HTTP request is appended here, empty - off (see AccessLog)
+		size_t access_log_ring = 4096;         // access records buffered per I/O thread, more are sampled or dropped
+		std::string capture_path;              // sampled request heads appended here for replay, empty - off (see TrafficCapture)
+		uint capture_sample_every = 1;         // every n-th HTTP connection is captured
+		
+		bool ktls = false;           // opt-in kernel TLS offload of HTTPS/WSS writes (Linux only, see ktls.h)
 	};
 }
\ No newline at end of file
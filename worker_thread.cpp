@@ -0,0 +1,82 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/worker_thread.h"
+
+#include <chrono>
+
+
+
+namespace net
+{
+	WorkerThread::WorkerThread()
+		: running_(false), sleeping_(false)
+	{
+	}
+	
+	WorkerThread::~WorkerThread()
+	{
+		Stop();
+	}
+	
+	void WorkerThread::Start(Work work, uint period_ms)
+	{
+		if (running_.exchange(true))
+			return;
+		
+		work_ = std::move(work);
+		period_ms_ = std::max(period_ms, 1u);
+		thread_ = std::thread(&WorkerThread::run, this);
+	}
+	
+	void WorkerThread::Stop()
+	{
+		if (!running_.exchange(false))
+			return;
+		
+		{
+			boost::lock_guard<ptl::mutex> lck(sleep_mx_);
+			wakeup_.notify_one();
+		}
+		
+		thread_.join();
+	}
+	
+	void WorkerThread::Wake()
+	{
+		if (sleeping_)																/// rare: thread ran out of work
+		{
+			boost::lock_guard<ptl::mutex> lck(sleep_mx_);
+			woken_ = true;
+			wakeup_.notify_one();
+		}
+	}
+	
+	void WorkerThread::run()
+	{
+		while (running_)
+		{
+			if (work_())
+				continue;
+			
+			sleeping_ = true;
+			
+			if (work_())															/// recheck: producer may have missed 'sleeping_'
+			{
+				sleeping_ = false;
+				continue;
+			}
+			
+			{
+				std::unique_lock<ptl::mutex> lck(sleep_mx_);
+				if (running_ && !woken_)
+					wakeup_.wait_for(lck, std::chrono::milliseconds(period_ms_));
+				woken_ = false;
+			}
+			
+			sleeping_ = false;
+		}
+		
+		while (work_())																/// leftovers
+			;
+	}
+}
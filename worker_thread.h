@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "templates/mutex.h"
+
+#include <condition_variable>
+#include <thread>
+
+
+
+namespace net
+{
+	//------------------------------------------------------------------------------------------------------------------
+	// WorkerThread is the background thread of AccessLog, TrafficCapture, Watchdog, FlightRecorder and
+	// WSEventDispatcher: it calls 'work' in a loop, sleeping 'period_ms' (or until 'Wake') whenever 'work' returns
+	// false, i.e. found nothing more to do right now.
+	//
+	// Method 'Wake' is cheap for producers: it takes the mutex only if the thread is asleep. Before sleeping, thread
+	// calls 'work' once more after raising 'sleeping_', so a producer which missed the flag can't leave its item
+	// unnoticed for a whole period.
+	// Method 'Stop' joins the thread; 'work' is called until it returns false once more after stop is requested, so
+	// that leftovers are handled.
+	//------------------------------------------------------------------------------------------------------------------
+	class WEBSERVER_API WorkerThread
+	{
+		DECLARE_NONCOPYABLE(WorkerThread);
+	
+	public:
+		using Work = std::function<bool()>;										// true - call again right away
+	
+	public:
+		WorkerThread();
+		~WorkerThread();
+		
+		void Start(Work work, uint period_ms);
+		void Stop();
+		void Wake();
+		
+		bool Running() const { return running_; }
+	
+	private:
+		void run();
+	
+	private:
+		Work work_;
+		uint period_ms_ = 0;
+		
+		std::thread thread_;
+		std::atomic<bool> running_;
+		std::atomic<bool> sleeping_;
+		bool woken_ = false;														// under 'sleep_mx_'
+		ptl::mutex sleep_mx_;
+		std::condition_variable_any wakeup_;
+	};
+}
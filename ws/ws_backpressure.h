@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		//--------------------------------------------------------------------------------------------------------------
+		// Backpressure policy of WSConnection's sending queue - what happens when client reads slower than server pushes.
+		//
+		// Queue is over limit when it holds 'capacity' frames (WebServerParams::ws_send_queue_capacity; streamed message
+		// waiting to start counts as a frame) or, if 'high_watermark_bytes' is not 0, when queued frames take more bytes
+		// than that. Then, depending on 'policy':
+		//
+		// 1) disconnect   -- connection is stopped (legacy behaviour, default)
+		// 2) drop_oldest  -- oldest queued frames are dropped until new one fits; close frame is never dropped
+		// 3) coalesce     -- message pushed with a coalescing key supersedes all queued messages with the same key, so
+		//                    only the newest update per key is written; if queue is still over limit, oldest frames
+		//                    are dropped as in 2)
+		//
+		// Policy is set for all connections in WebServerParams::ws_backpressure and may be changed for a single
+		// connection via WebServer::WSSetBackpressure.
+		//--------------------------------------------------------------------------------------------------------------
+		enum class WSOverflowPolicy
+		{
+			disconnect,
+			drop_oldest,
+			coalesce
+		};
+		
+		struct WSBackpressure
+		{
+			WSOverflowPolicy policy = WSOverflowPolicy::disconnect;
+			size_t high_watermark_bytes = 0;										// 0 - limit by frames count only
+		};
+		
+		// Snapshot of WSConnection's sending queue counters (see WebServer::WSGetQueueStats)
+		struct WSQueueStats
+		{
+			size_t depth = 0;														// frames and streams queued
+			size_t bytes = 0;														// bytes queued
+			uint64_t dropped = 0;													// frames dropped by policy
+			uint64_t coalesced = 0;													// frames superseded by newer ones
+		};
+		
+		// Message with coalescing key, see WSOverflowPolicy::coalesce
+		struct WSKeyedMessage
+		{
+			const std::string& message;
+			const std::string& key;
+		};
+	} // namespace WS
+} // namespace net
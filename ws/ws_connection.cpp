@@ -3,6 +3,7 @@
 #include "webserver/WS/ws_connection.h"
 #include "webserver/webserver.h"
 #include "webserver/WS/ws_proto_impl.h"
+#include "webserver/ktls.h"
 
 
 
@@ -11,14 +12,31 @@ namespace net
 	namespace WS
 	{
 		template<typename TSocket>
-		WSConnection<TSocket>::WSConnection(std::shared_ptr<TSocket> sock, WebServerParams params, const Uri& uri, const pauuid& sid,
-											const pauuid& id)
-			: Connection<TSocket>(sock, params), uri_(uri), closed_(false), session_id_(sid), id_(id)
-		{}
+		WSConnection<TSocket>::WSConnection(WebServer& webserver, std::shared_ptr<TSocket> sock, WebServerParams params,
+											const Uri& uri, const pauuid& sid, const pauuid& id, bool ktls_tx,
+											const WSDeflateAgreement& deflate_agreed)
+			: Connection<TSocket>(sock, params, ktls_tx), webserver_(webserver), uri_(uri), closed_(false), closing_(false),
+			  heartbeat_timer_(0), pong_pending_(false), session_id_(sid), id_(id),
+			  send_q_(params.ws_send_queue_capacity), writing_(false), control_q_(control_queue_capacity_), streams_pending_(0),
+			  policy_(params.ws_backpressure.policy), high_watermark_bytes_(params.ws_backpressure.high_watermark_bytes),
+			  queued_bytes_(0), dropped_(0), coalesced_(0),
+			  frame_parser_(params.ws_max_message_size, deflate_agreed.enabled), metrics_(webserver.metrics()),
+			  strand_(sock->get_io_service())
+		{
+			metrics_.Gauge(MetricGauge::ws_connections, 1);
+			
+			if (deflate_agreed.enabled)
+				deflate_.reset(new WSDeflate(params.ws_deflate, deflate_agreed));
+			
+			batch_.reserve(2 * max_batch_frames_);
+			batch_buffers_.reserve(2 * max_batch_frames_);
+		}
 		
 		template<typename TSocket>
 		WSConnection<TSocket>::~WSConnection()
 		{
+			metrics_.Gauge(MetricGauge::ws_connections, -1);
+			
 			if (!closed_)
 			{
 				IFLOG(P5, "INFO: ~WSConnection - connection not closed in DTOR occurred.");
@@ -30,45 +48,158 @@ namespace net
 		template<typename TSocket>
 		void WSConnection<TSocket>::Start()
 		{
-			WebServer::ws_onopen(id_, session_id_, uri_);
+			if (webserver_.ws_events_.Subscribed(WSEventType::open))
+			{
+				WSEvent e;
+				e.type = WSEventType::open;
+				e.id = id_;
+				e.session_id = session_id_;
+				e.uri = uri_;
+				e.resumed = replay_.resumed;
+				
+				webserver_.ws_events_.Post(std::move(e));
+			}
+			else if (WebServer::ws_onopen)												/// legacy callback is synchronous,
+			{																			/// so it precedes ws_onmessagein
+				Watchdog::Scope watched(webserver_.watchdog(), "WS onopen", &uri_, 0, &id_);
+				WebServer::ws_onopen(id_, session_id_, uri_);
+			}
 			
-			auto buf = std::make_shared<NetStreambuf>(2);
+			if (params.ws_ping_interval_sec != 0)
+			{
+				wheel_ = &webserver_.timer_wheel();
+				schedule_heartbeat(params.ws_ping_interval_sec * 1000, &WSConnection<TSocket>::ping);
+			}
 			
-			async_read(*sock_.get(), *buf, transfer_exactly(2),						/// expect frame from client
-				boost::bind(&WSConnection<TSocket>::handle_read, this, this->shared_from_this(), buf, _1, _2)
-			);
+			do_read();
 		}
 		
-		template<typename TSocket>													/// get opcode, check mask, log, stop
-		void WSConnection<TSocket>::handle_read(TSelf, std::shared_ptr<NetStreambuf> buf, const error_code& ec, size_t bytes)
+		template<typename TSocket>
+		void WSConnection<TSocket>::Resume(WSResumption resumption)
 		{
-			if (ec && ec != basic_errors::operation_aborted)
-				WebServer::ws_onerror(id_, ec);
+			replay_ = std::move(resumption);
 			
-			if (bytes != 2)
+			for (auto& entry : replay_.gap)
 			{
-				IFLOG(P5, "INFO: WS read, follows bytes expected vs. bytes transferred.", 2, bytes);
+				OutFrame out;
+				out.frame = std::move(entry.frame);
+				out.payload = std::move(entry.payload);
+				out.replayed = true;
+				
+				enqueue(std::move(out));
 			}
-			else
+			
+			if (!replay_.gap.empty())
+				IFLOG(P4, "WS session resumed. Connection id and replayed messages follow.", id_, replay_.gap.size());
+			
+			replay_.gap.clear();
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::do_read()
+		{
+			sock_->async_read_some(boost::asio::buffer(buffer_),					/// expect frames from client
+				strand_.wrap(boost::bind(&WSConnection<TSocket>::handle_read, this, this->shared_from_this(), _1, _2))
+			);
+		}
+		
+		template<typename TSocket>													/// parse frames, dispatch, read further
+		void WSConnection<TSocket>::handle_read(TSelf, const error_code& ec, size_t bytes)
+		{
+			if (ec)
 			{
-				std::istream is(buf.get());
-				uchar opcode = is.get();
-				uchar mask = is.get();
-				
-				if (mask < 128) {                                                              /// unmasked frame = proto error
-					IFLOG(P5, "INFO: WS unmasked frame from client. Protocol error.");
-				}
-				else if (8 == opcode & 0x0f) {                                                 /// close frame opcode
-					IFLOG(P5, "INFO: WS close frame from client - connection closure is expected.")
+				if (ec != basic_errors::operation_aborted)
+				{
+					post_error(ec);
+					stop();
 				}
-				else {
-					IFLOG(P5, "INFO: WS not-closing masked frame from client.");
+				return;
+			}
+			
+			pong_pending_ = false;														/// any data proves peer is alive
+			
+			const char* begin = buffer_.data();
+			const char* end = begin + bytes;
+			
+			for (;;)
+			{
+				auto result = frame_parser_.Parse(begin, end);
+				
+				if (result == WSFrameParser::Result::indeterminate)
+					break;
+				
+				if (result == WSFrameParser::Result::bad)
+				{
+					IFLOG(P5, "INFO: WS bad frame from client. Closing connection with following id and status.", id_,
+						frame_parser_.close_status());
+					
+					close(frame_parser_.close_status());
+					return;
 				}
+				
+				handle_frame();
+				
+				if (closing_)
+					return;
 			}
 			
-			IFLOG(P5, "INFO: WS frame from client on oneway proto impl. Stopping connection with following id.", id_);
+			do_read();
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::handle_frame()
+		{
+			const std::string& payload = frame_parser_.payload();
 			
-			stop();
+			switch (frame_parser_.opcode())
+			{
+				case Schema::WSOpcode::text:
+				case Schema::WSOpcode::binary:
+					metrics_.Count(MetricCounter::ws_messages_in);
+					
+					if (frame_parser_.compressed())
+					{
+						uint status = deflate_->Decompress(payload, params.ws_max_message_size, inflated_);
+						if (status != 0)
+						{
+							IFLOG(P5, "INFO: WS compressed message can't be inflated. Closing connection with following id "
+								"and status.", id_, status);
+							
+							close(status);
+							break;
+						}
+						
+						if (WebServer::ws_onmessagein)
+						{
+							Watchdog::Scope watched(webserver_.watchdog(), "WS onmessagein", &uri_, 0, &id_);
+							WebServer::ws_onmessagein(id_, inflated_);
+						}
+					}
+					else if (WebServer::ws_onmessagein)
+					{
+						Watchdog::Scope watched(webserver_.watchdog(), "WS onmessagein", &uri_, 0, &id_);
+						WebServer::ws_onmessagein(id_, payload);
+					}
+					break;
+				case Schema::WSOpcode::ping:
+					write(payload, Schema::WSFinRsvOpcode::pong_frame);				/// pong echoes ping's payload
+					break;
+				case Schema::WSOpcode::pong:
+					break;															/// unsolicited pong is allowed
+				case Schema::WSOpcode::close:
+				{
+					uint status = Schema::WSClosureStatus::normal;					/// echo client's status, which
+					if (payload.size() >= 2)										/// parser has validated
+						status = (static_cast<uchar>(payload[0]) << 8) | static_cast<uchar>(payload[1]);
+					
+					IFLOG(P5, "INFO: WS close frame from client. Closing connection with following id.", id_);
+					
+					close(status);
+					break;
+				}
+				default:
+					break;
+			}
 		}
 		
 		
@@ -76,63 +207,461 @@ namespace net
 		template<typename TSocket>
 		void WSConnection<TSocket>::write(const std::string& message, uchar opcode)
 		{
-			std::string result;
-			fill_text_frame(message, opcode, result);
+			write(make_frame(message, opcode), opcode == Schema::WSFinRsvOpcode::close_connection);
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::write(FramePtr frame, bool is_close)
+		{
+			OutFrame out;
+			out.frame = std::move(frame);
+			out.close = is_close;
 			
-			if (WebServer::ws_onmessageout)
-				WebServer::ws_onmessageout(id_, result);
+			enqueue(std::move(out));
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::write(const BinaryFrame& frame)
+		{
+			OutFrame out;
+			out.frame = frame.header;
+			out.payload = frame.payload;
 			
+			enqueue(std::move(out));
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::write(const WSKeyedMessage& message)
+		{
+			if (policy_ != WSOverflowPolicy::coalesce)
 			{
-				boost::lock_guard<ptl::mutex> lck(send_q_mx_);
+				write(message.message);
+				return;
+			}
+			
+			OutFrame out;
+			out.frame = make_frame(message.message, opcode_one);
+			
+			{
+				boost::lock_guard<ptl::mutex> lck(coalesce_mx_);
+				
+				if (coalesce_keys_.size() >= coalesce_prune_at_)						/// forget keys with no frames queued:
+				{																		/// copies are made under the mutex only
+					for (auto it = coalesce_keys_.begin(); it != coalesce_keys_.end(); )
+						it = (it->second.use_count() == 1) ? coalesce_keys_.erase(it) : std::next(it);
+					
+					coalesce_prune_at_ = std::max<size_t>(2 * coalesce_keys_.size(), min_coalesce_prune_at_);
+				}
 				
-				send_q_.push_back(std::move(result));
+				auto& g = coalesce_keys_[message.key];
+				if (!g)
+					g = std::make_shared<std::atomic<uint64_t>>(0);
 				
-				size_t qsz = send_q_.size();
+				out.key_gen = g;
+				out.gen = ++(*g);														/// queued frames with this key are stale now
+			}
+			
+			enqueue(std::move(out));
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::write(const WSStream& stream)
+		{
+			if (closed_ || closing_ || !stream.source)
+				return;
+			
+			bool overflow = false;
+			
+			{
+				boost::lock_guard<ptl::mutex> lck(streams_mx_);
 				
-				if (qsz > 100)
+				while (streams_.size() + send_q_.Size() >= send_q_.Capacity())			/// waiting stream takes a slot
 				{
-					IFLOG(P2, "WS send_q overflow. Size follows.", qsz);
-					stop();
+					if (policy_ == WSOverflowPolicy::disconnect)
+					{
+						overflow = true;
+						break;
+					}
+					
+					if (!streams_.empty())												/// oldest stream goes first,
+					{
+						streams_.pop_front();
+						--streams_pending_;
+						++dropped_;
+					}
+					else if (!drop_oldest())											/// then oldest frame
+						break;
 				}
 				
-				if (send_q_.size() == 1) {
-					async_write(*sock_.get(), boost::asio::const_buffers_1(send_q_.front().data(), send_q_.front().size()),
-						boost::bind(&WSConnection<TSocket>::handle_write, this, this->shared_from_this(), _1, _2)
-					);
+				if (!overflow)
+				{
+					streams_.push_back(stream);
+					++streams_pending_;
 				}
 			}
+			
+			if (overflow)
+			{
+				IFLOG(P2, "WS send_q overflow by stream. Frames and streams queued follow.",
+					  send_q_.Size(), streams_pending_.load());
+				
+				stop();
+				return;
+			}
+			
+			if (!writing_.exchange(true))
+				strand_.post(boost::bind(&WSConnection<TSocket>::do_write, this, this->shared_from_this()));
 		}
 		
 		template<typename TSocket>
-		void WSConnection<TSocket>::handle_write(TSelf, const error_code &ec, size_t)
+		void WSConnection<TSocket>::enqueue(OutFrame out)
 		{
-			if (ec)
+			if (closed_ || closing_)													/// nothing is written after close frame
+				return;
+			
+			bool is_close = out.close;
+			if (is_close && closing_.exchange(true))
+				return;
+			
+			if (!is_close && (static_cast<uchar>((*out.frame)[0]) & 0x08))				/// ping or pong
 			{
-				if (ec != basic_errors::operation_aborted)
-					WebServer::ws_onerror(id_, ec);
+				enqueue_control(std::move(out));
+				return;
+			}
+			
+			size_t size = out.size();
+			out.queued = metrics_.Now();
+			
+			queued_bytes_ += size;
+			
+			for (;;)
+			{
+				if (closing_ && !is_close)												/// raced with close - not written anyway
+				{
+					queued_bytes_ -= size;
+					return;
+				}
 				
-				boost::lock_guard<ptl::mutex> lck(send_q_mx_);
+				size_t watermark = high_watermark_bytes_;
+				bool over_watermark = (watermark != 0 && queued_bytes_ > watermark && !is_close);
 				
-				send_q_.clear();
+				if (!over_watermark && send_q_.TryPush(std::move(out)))					/// moved from only on success
+					break;
 				
-				stop();
-				return;
+				if (policy_ == WSOverflowPolicy::disconnect)
+				{
+					IFLOG(P2, "WS send_q overflow. Frames and bytes queued follow.", send_q_.Size(), queued_bytes_.load());
+					
+					queued_bytes_ -= size;
+					stop();
+					return;
+				}
+				
+				if (!drop_oldest() && over_watermark)									/// single frame above watermark
+				{
+					if (send_q_.TryPush(std::move(out)))
+						break;
+				}
+			}
+			
+			if (!writing_.exchange(true))												/// write is initiated inside strand only
+				strand_.post(boost::bind(&WSConnection<TSocket>::do_write, this, this->shared_from_this()));
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::enqueue_control(OutFrame out)
+		{
+			while (!control_q_.TryPush(std::move(out)))									/// client floods with pings -
+			{
+				OutFrame stale;															/// answer the latest ones
+				control_q_.TryPop(stale);
 			}
 			
+			if (!writing_.exchange(true))
+				strand_.post(boost::bind(&WSConnection<TSocket>::do_write, this, this->shared_from_this()));
+		}
+		
+		template<typename TSocket>
+		bool WSConnection<TSocket>::drop_oldest()
+		{
+			OutFrame victim;
+			
+			if (!send_q_.TryPop(victim))												/// writer took everything
+				return false;
+			
+			if (victim.close)															/// close frame is never dropped: it goes
+			{																			/// back behind frames which raced with it
+				OutFrame other;
+				while (!send_q_.TryPush(std::move(victim)))
+				{
+					if (send_q_.TryPop(other))
+					{
+						queued_bytes_ -= other.size();
+						++dropped_;
+					}
+				}
+				return true;
+			}
+			
+			queued_bytes_ -= victim.size();
+			++dropped_;
+			
+			return true;
+		}
+		
+		template<typename TSocket>
+		WSQueueStats WSConnection<TSocket>::queue_stats() const
+		{
+			WSQueueStats stats;
+			
+			stats.depth = send_q_.Size() + streams_pending_;
+			stats.bytes = queued_bytes_;
+			stats.dropped = dropped_;
+			stats.coalesced = coalesced_;
+			
+			return stats;
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::do_write(TSelf)
+		{
+			for (;;)
 			{
-				boost::lock_guard<ptl::mutex> lck(send_q_mx_);
+				OutFrame out;
 				
-				send_q_.erase(send_q_.begin());
+				while (batch_.size() < max_batch_frames_ && control_q_.TryPop(out))		/// may go between fragments
+					add_to_batch(out);
 				
-				if (send_q_.size() > 0)
+				if (!stream_)															/// no message is half-sent
 				{
-					IFLOG(P5, "WSConnection - internal queue size follows.", send_q_.size());
+					bool drained = false;
+					
+					while (batch_.size() < max_batch_frames_ && !batch_closes_)
+					{
+						if (!send_q_.TryPop(out))
+						{
+							drained = true;
+							break;
+						}
+						
+						queued_bytes_ -= out.size();
+						
+						if (out.key_gen && out.key_gen->load() != out.gen)				/// newer frame with same key queued
+						{
+							++coalesced_;
+							continue;
+						}
+						
+						metrics_.Record(MetricStage::ws_queue, out.queued);
+						metrics_.Count(MetricCounter::ws_frames_out);
+						
+						if (replay_.ring && !out.close && !out.replayed)				/// numbered in wire order
+							replay_.ring->Append(replay_.epoch, out.frame, out.payload);
+						
+						if (!out.close)
+							post_messageout(out);										/// before compression
+						
+						if (deflate_ && !out.close)
+							compress(out);
+						
+						add_to_batch(out);
+					}
+					
+					if (!batch_closes_ && streams_pending_ != 0 &&						/// stream yields to queued frames,
+					    (drained || ++stream_waited_ >= max_stream_wait_batches_))		/// but not forever
+					{
+						boost::lock_guard<ptl::mutex> lck(streams_mx_);
+						
+						stream_.reset(new WSStream(std::move(streams_.front())));
+						stream_started_ = false;
+						stream_waited_ = 0;
+						
+						streams_.pop_front();
+						--streams_pending_;
+					}
+				}
 				
-					async_write(*sock_.get(), boost::asio::const_buffers_1(send_q_.front().data(), send_q_.front().size()),
-						boost::bind(&WSConnection<TSocket>::handle_write, this, this->shared_from_this(), _1, _2)
-					);
+				if (stream_ && !batch_closes_)
+				{
+					add_fragment();
+					
+					if (closed_)														/// source failed
+						return;
 				}
+				
+				if (!batch_.empty())
+					break;
+				
+				writing_ = false;														/// queues are empty - writer goes idle,
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				
+				if (!(send_q_.Ready() || control_q_.Ready() || streams_pending_ != 0) ||	/// unless producer pushed
+				    writing_.exchange(true))											/// meanwhile
+					return;
 			}
+			
+			if (batch_.size() > 1)
+				IFLOG(P5, "WSConnection - frames in gathered write follow.", batch_.size());
+			
+			write_started_ = metrics_.Now();
+			async_write_layer(*sock_.get(), ktls_tx, batch_buffers_,
+				strand_.wrap(boost::bind(&WSConnection<TSocket>::handle_write, this, this->shared_from_this(), _1, _2))
+			);
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::post_messageout(const OutFrame& out)
+		{
+			if (!webserver_.ws_events_.Subscribed(WSEventType::messageout))
+				return;
+			
+			WSEvent e;
+			e.type = WSEventType::messageout;
+			e.id = id_;
+			e.message = out.frame;														/// shares the frame, no copy
+			
+			if (out.payload)															/// binary is encoded frame too, so
+			{																			/// it's glued for subscribers only
+				auto whole = std::make_shared<std::string>(*out.frame);
+				whole->append(*out.payload);
+				e.message = std::move(whole);
+			}
+			
+			webserver_.ws_events_.Post(std::move(e));
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::add_to_batch(OutFrame& out)
+		{
+			batch_buffers_.push_back(boost::asio::buffer(*out.frame));
+			batch_.push_back(std::move(out.frame));
+			
+			if (out.payload)															/// header & payload - no copy
+			{
+				batch_buffers_.push_back(boost::asio::buffer(*out.payload));
+				batch_.push_back(std::move(out.payload));
+			}
+			
+			batch_closes_ = batch_closes_ || out.close;									/// close frame is the last one
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::add_fragment()
+		{
+			auto chunk = std::make_shared<std::string>();
+			bool more;
+			
+			try
+			{
+				chunk->reserve(params.ws_stream_fragment_size);
+				more = stream_->source(*chunk, params.ws_stream_fragment_size);
+			}
+			catch (std::exception& e)
+			{
+				IFLOG(P3, "WSConnection - stream source failed, connection is stopped. Id and reason follow.", id_, e.what());
+				
+				stream_.reset();
+				stop();
+				return;
+			}
+			
+			uchar opcode = Schema::WSOpcode::continuation;
+			if (!stream_started_)
+			{
+				opcode = stream_->binary ? Schema::WSOpcode::binary : Schema::WSOpcode::text;
+				
+				if (replay_.ring)														/// counted, but can't be replayed
+					replay_.ring->Append(replay_.epoch, nullptr, nullptr);
+			}
+			
+			if (!more)
+				opcode |= 0x80;															/// FIN - the last fragment
+			
+			OutFrame out;
+			out.payload = std::move(chunk);
+			
+			auto header = std::make_shared<std::string>();
+			fill_frame_header(out.payload->size(), opcode, *header);
+			out.frame = std::move(header);
+			
+			add_to_batch(out);
+			
+			stream_started_ = true;
+			if (!more)
+				stream_.reset();
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::compress(OutFrame& out)
+		{
+			const std::string& f = *out.frame;
+			
+			uchar fin_rsv_opcode = static_cast<uchar>(f[0]);
+			uchar opcode = fin_rsv_opcode & 0x0f;
+			
+			if (!(fin_rsv_opcode & 0x80) || (opcode != Schema::WSOpcode::text && opcode != Schema::WSOpcode::binary))
+				return;																	/// control frames are never compressed
+			
+			uchar length = static_cast<uchar>(f[1]) & 0x7f;
+			size_t header = 2 + (length == 126 ? 2 : (length == 127 ? 8 : 0));
+			
+			const char* payload = out.payload ? out.payload->data() : f.data() + header;
+			size_t payload_size = out.payload ? out.payload->size() : f.size() - header;
+			
+			if (payload_size < deflate_->min_size())
+				return;
+			
+			deflated_.clear();
+			if (!deflate_->Compress(payload, payload_size, deflated_))
+			{
+				IFLOG(P3, "WSConnection - deflate failed, frame is sent uncompressed. Connection id follows.", id_);
+				return;
+			}
+			
+			auto result = std::make_shared<std::string>();
+			result->reserve(deflated_.size() + 10);
+			
+			fill_text_frame(deflated_, fin_rsv_opcode | Schema::WSRsvBits::compressed, *result);
+			
+			out.frame = std::move(result);
+			out.payload.reset();
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::handle_write(TSelf self, const error_code &ec, size_t)
+		{
+			metrics_.Record(MetricStage::ws_write, write_started_);
+			
+			batch_.clear();
+			batch_buffers_.clear();
+			
+			if (ec)
+			{
+				if (ec != basic_errors::operation_aborted)
+					post_error(ec);
+				
+				stop();																	/// 'writing_' stays raised
+				return;
+			}
+			
+			if (batch_closes_)															/// close frame is written
+			{
+				stop();
+				return;
+			}
+			
+			do_write(self);
+		}
+		
+		
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::close(uint status)
+		{
+			std::string payload;
+			fill_closing_frame(status, "", payload);
+			
+			write(payload, Schema::WSFinRsvOpcode::close_connection);
 		}
 		
 		
@@ -145,7 +674,34 @@ namespace net
 			if (!exchanged)															/// close only once
 				return;
 
-			WebServer::ws_onclose(id_, uri_);
+			if (webserver_.ws_events_.Subscribed(WSEventType::close))
+			{
+				WSEvent e;
+				e.type = WSEventType::close;
+				e.id = id_;
+				e.uri = uri_;
+				
+				webserver_.ws_events_.Post(std::move(e));
+			}
+			else if (WebServer::ws_onclose)
+			{
+				Watchdog::Scope watched(webserver_.watchdog(), "WS onclose", &uri_, 0, &id_);
+				WebServer::ws_onclose(id_, uri_);
+			}
+			
+			webserver_.WSRemoveSession(id_);
+			
+			if (wheel_)
+				wheel_->Cancel(heartbeat_timer_);
+			
+			if (replay_.ring)															/// ring waits for reconnect
+			{
+				auto& store = webserver_.ws_replay_;
+				store.Detach(replay_);
+				
+				webserver_.timer_wheel().Schedule(params.ws_replay_ttl_sec * 1000,
+					[&store, sid = replay_.session_id, epoch = replay_.epoch]() { store.Expire(sid, epoch); });
+			}
 			
 			_cancel();		/// Cancel all asynchronous operations associated with the socket. Expect operation_aborted.
 			_shutdown();	/// Disable sends or receives on the socket. Preparation for _close call.
@@ -154,13 +710,82 @@ namespace net
 		
 		
 		
+		template<typename TSocket>
+		void WSConnection<TSocket>::post_error(const error_code& ec)
+		{
+			if (!webserver_.ws_events_.Subscribed(WSEventType::error))
+				return;
+			
+			WSEvent e;
+			e.type = WSEventType::error;
+			e.id = id_;
+			e.ec = ec;
+			
+			webserver_.ws_events_.Post(std::move(e));
+		}
+		
+		
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::schedule_heartbeat(uint delay_ms, void (WSConnection<TSocket>::*stage)())
+		{
+			std::weak_ptr<WSConnection<TSocket>> weak = this->shared_from_this();	/// wheel doesn't prolong life
+			
+			heartbeat_timer_ = wheel_->Schedule(delay_ms, [weak, stage]()
+			{
+				if (auto self = weak.lock())
+					((*self).*stage)();
+			});
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::ping()
+		{
+			if (closed_ || closing_)
+				return;
+			
+			pong_pending_ = true;
+			write(std::string(), Schema::WSFinRsvOpcode::ping_frame);
+			
+			schedule_heartbeat(params.ws_pong_timeout_sec * 1000, &WSConnection<TSocket>::check_pong);
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::check_pong()
+		{
+			if (closed_)
+				return;
+			
+			if (pong_pending_)
+			{
+				IFLOG(P4, "WS heartbeat timeout. Closing connection with following id.", id_);
+				
+				close(Schema::WSClosureStatus::timeout);
+				schedule_heartbeat(params.ws_pong_timeout_sec * 1000, &WSConnection<TSocket>::expire);
+				return;
+			}
+			
+			uint interval = params.ws_ping_interval_sec, timeout = params.ws_pong_timeout_sec;
+			schedule_heartbeat((interval > timeout ? interval - timeout : interval) * 1000, &WSConnection<TSocket>::ping);
+		}
+		
+		template<typename TSocket>
+		void WSConnection<TSocket>::expire()
+		{
+			if (!closed_)																/// close frame is stuck in socket
+				stop();
+		}
+		
+		
+		
 		template class WSConnection<SSLSocket>;
 		template class WSConnection<TCPSocket>;
+		template class WSConnection<MemSocket>;
 		
 		template<> template<>
 		void WSConnection<TCPSocket>::Forward(uint& a)
 		{
-			stop();
+			close(a);
 		}
 		
 		template<> template<>
@@ -169,10 +794,47 @@ namespace net
 			write(a);
 		}
 		
+		template<> template<>
+		void WSConnection<TCPSocket>::Forward(const FramePtr& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<TCPSocket>::Forward(const BinaryFrame& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<TCPSocket>::Forward(const WSStream& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<TCPSocket>::Forward(const WSKeyedMessage& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<TCPSocket>::Forward(const WSBackpressure& a)
+		{
+			policy_ = a.policy;
+			high_watermark_bytes_ = a.high_watermark_bytes;
+		}
+		
+		template<> template<>
+		void WSConnection<TCPSocket>::Forward(WSQueueStats& a)
+		{
+			a = queue_stats();
+		}
+		
 		template<> template<>
         void WSConnection<SSLSocket>::Forward(uint& a)
 		{
-			stop();
+			close(a);
 		}
 		
 		template<> template<>
@@ -180,5 +842,91 @@ namespace net
 		{
 			write(a);
 		}
+		
+		template<> template<>
+		void WSConnection<SSLSocket>::Forward(const FramePtr& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<SSLSocket>::Forward(const BinaryFrame& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<SSLSocket>::Forward(const WSStream& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<SSLSocket>::Forward(const WSKeyedMessage& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<SSLSocket>::Forward(const WSBackpressure& a)
+		{
+			policy_ = a.policy;
+			high_watermark_bytes_ = a.high_watermark_bytes;
+		}
+		
+		template<> template<>
+		void WSConnection<SSLSocket>::Forward(WSQueueStats& a)
+		{
+			a = queue_stats();
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(uint& a)
+		{
+			close(a);
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(const std::string& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(const FramePtr& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(const BinaryFrame& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(const WSStream& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(const WSKeyedMessage& a)
+		{
+			write(a);
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(const WSBackpressure& a)
+		{
+			policy_ = a.policy;
+			high_watermark_bytes_ = a.high_watermark_bytes;
+		}
+		
+		template<> template<>
+		void WSConnection<MemSocket>::Forward(WSQueueStats& a)
+		{
+			a = queue_stats();
+		}
 	} // namespace WS
 } // namespace net
\ No newline at end of file
@@ -4,13 +4,26 @@
 #include "webserver/stdhdr.h"
 
 #include "webserver/connection.h"
+#include "webserver/bounded_queue.h"
 #include "webserver/WS/ws_protocol.h"
+#include "webserver/WS/ws_frame_parser.h"
+#include "webserver/WS/ws_proto_impl.h"
+#include "webserver/WS/ws_backpressure.h"
+#include "webserver/WS/ws_deflate.h"
+#include "webserver/WS/ws_stream.h"
+#include "webserver/WS/ws_replay.h"
+#include "webserver/timer_wheel.h"
+#include "webserver/metrics.h"
 #include "templates/mutex.h"
 
+#include <deque>
+
 
 
 namespace net
 {
+	class WebServer;
+	
 	namespace  WS
 	{
 		//--------------------------------------------------------------------------------------------------------------
@@ -22,25 +35,60 @@ namespace net
 		// -> https://phabricator.megaputer.ru/w/pa7/arch/webserver/overview/
 		// -> https://phabricator.megaputer.ru/w/pa7/arch/webserver/ws_impl/
 		//
-		// This WebSocket implementation is one-way only: after connection is established via WS handshake server pushes
-		// messages to client. Any attempt of client to send message through this channel leads to WSConnection stop and
-		// destruction.
+		// This WebSocket implementation is bidirectional: after connection is established via WS handshake server pushes
+		// messages to client and client may send messages to server through the same channel. Incoming bytes are
+		// assembled into messages by incremental WSFrameParser and delivered via WebServer::ws_onmessagein. Pings are
+		// answered with pongs, client's close frame is answered with close frame, protocol violation closes connection
+		// with corresponding status.
+		//
+		// All socket operations are serialized via 'strand_': reads are chained by 'do_read' - 'handle_read', writes are
+		// initiated by 'do_write' posted into strand by 'write'.
+		//
+		// Internally, WSConnection instance consists of a lock-free bounded sending queue 'send_q_' (see BoundedQueue)
+		// and a single writer running inside 'strand_'. Queue stores encoded frames by shared pointer, so that a frame
+		// broadcast to many connections is encoded and stored only once. Binary frames (see BinaryFrame) are stored as
+		// separate header and caller's payload buffers and written as two elements of the gather list, so that large
+		// binary payload is never copied.
+		//
+		// Method 'write' is called by producers (webengine threads, broadcasts, read handler for pongs) and never blocks:
+		// it pushes frame into 'send_q_' and, if no write is in progress ('writing_' flag is raised by this producer),
+		// posts 'do_write' into strand. If 'send_q_' is filled too fast and writer doesn't push at this pace, queue
+		// gets over limit and backpressure policy applies (see WSBackpressure): connection stops, or oldest frames are
+		// dropped, or superseded frames with the same coalescing key are skipped by writer.
+		// Method 'do_write' drains everything queued (up to 'max_batch_frames_' frames) into a single gathered
+		// async_write ("scatter-gather I/O"), so a busy connection pays one syscall per batch instead of one per frame.
+		// Method 'handle_write' releases written frames and calls 'do_write' again; the cycle ends when 'send_q_' is
+		// emptied and 'writing_' flag is lowered.
 		//
-		// Internally, WSConnection instance consists of a sending queue 'send_q_' guarded by a mutex and a series of
-		// write handlers on boost::asio io_service's conveyor.
+		// If permessage-deflate is negotiated at handshake, writer compresses data frames of at least
+		// WSDeflateOptions::min_size bytes right before writing them - after drop and coalesce decisions, so that
+		// discarded frames cost no compression and shared broadcast frames stay uncompressed in the queue. Reader
+		// inflates incoming messages with RSV1 set. See WSDeflate.
 		//
-		// There are 3 cases of enqueuing string (S) and write handler (H):
+		// Large messages may be streamed (see WSStream): writer pulls them lazily from the source, one fragment of
+		// WebServerParams::ws_stream_fragment_size bytes per batch, so a message is never held whole in memory. Streams
+		// wait in 'streams_', each taking a slot of 'send_q_' capacity (overflow policy applies to them as to frames),
+		// and start when 'send_q_' is empty or after 'max_stream_wait_batches_' batches, so that steady pushes can't
+		// starve them. While a stream is in progress, data frames stay in 'send_q_' (RFC 6455, 5.4 forbids
+		// interleaving fragments of different messages), but pings and pongs, which are kept in a separate small
+		// 'control_q_', go out between fragments. Fragments are neither compressed nor reported as messageout events.
 		//
-		// 1) 1S + 1H -- if send_q_ is empty in 'write'
-		// 2) 1S + 0H -- if send_q_ is not empty in 'write'; H is added via case 3)
-		// 3) 0S + 1H -- if send_q_ is not empty in 'handle_write'
+		// Heartbeat: every WebServerParams::ws_ping_interval_sec connection sends ping and expects any frame from client
+		// (pong, normally) within ws_pong_timeout_sec. Otherwise peer is considered dead (half-open TCP connection),
+		// connection is closed with 4020 status and stopped if even close frame can't be written in time. Heartbeat
+		// stages are driven by a shared TimerWheel instead of an asio timer per connection.
 		//
-		// Method 'write' serves as both filler of queue and initiator of actual writing ("push"). If 'send_q_' is
-		// filled too fast and write handlers don't push at this pace, queue overflow happens and WSConnection stops.
-		// Method 'handle_write' serves as both dequeuer and a cycle of actual writing ("pushes") which ends when
-		// 'send_q_' is emptied.
+		// Resumable sessions (see WSReplayStore): method 'Resume' queues messages client missed before anything else,
+		// writer numbers data messages as it batches them and keeps them in session's ring.
 		//
-		// Method 'stop' closes boost::asio socket gracefully.
+		// Lifecycle events (open, outgoing message, error, close) are posted to WebServer's WSEventDispatcher and only
+		// if somebody subscribed to them. Outgoing message event is posted by writer for data frame joining a batch, so
+		// pings, pongs, close frames and frames dropped or coalesced by backpressure raise none. It shares the frame
+		// instead of copying it (binary frame, which is queued as separate header and payload, is copied into the
+		// event whole).
+		//
+		// Method 'close' enqueues close frame with given status; connection is stopped when it's written.
+		// Method 'stop' closes boost::asio socket gracefully and removes connection from WebServer's registry.
 		//
 		// Through callbacks - ws_open_handler, ws_close_handler, ws_messagein_handler, ws_messageout_handler,
 		// ws_error_handler WSConnection is able to give feedback to WebServer.
@@ -55,6 +103,7 @@ namespace net
 		{
 			using Connection<TSocket>::sock_;
 			using Connection<TSocket>::params;
+			using Connection<TSocket>::ktls_tx;
 			
 			using Connection<TSocket>::_cancel;
 			using Connection<TSocket>::_shutdown;
@@ -68,35 +117,134 @@ namespace net
 			static const uchar opcode_one = Schema::WSFinRsvOpcode::one_fragment_text;
 		
 		public:
-			WSConnection(std::shared_ptr<TSocket> sock, WebServerParams params, const Uri& uri, const pauuid& sid,
-						 const pauuid& id);
+			WSConnection(WebServer& webserver, std::shared_ptr<TSocket> sock, WebServerParams params, const Uri& uri,
+						 const pauuid& sid, const pauuid& id, bool ktls_tx, const WSDeflateAgreement& deflate_agreed);
 			~WSConnection();
 			
 			virtual void Start() override final;
 			
+			void Resume(WSResumption resumption);									// before registration & 'Start'
+			
 			template<typename TArg>	void Forward(TArg& a);
 		
 		private:
-			void handle_read(TSelf, std::shared_ptr<NetStreambuf> buf, const error_code& ec, size_t bytes);
+			struct OutFrame
+			{
+				FramePtr frame;														// header only if 'payload' is set
+				PayloadPtr payload;
+				bool close = false;
+				bool replayed = false;												// numbered in previous connection
+				Metrics::Clock::time_point queued;									// zero if metrics are disabled
+				
+				std::shared_ptr<std::atomic<uint64_t>> key_gen;						// latest generation of coalescing key
+				uint64_t gen = 0;													// frame is superseded if gen < *key_gen
+				
+				size_t size() const { return frame->size() + (payload ? payload->size() : 0); }
+			};
+			
+			void do_read();
+			void handle_read(TSelf, const error_code& ec, size_t bytes);
+			void handle_frame();
 			
-			// enqueue message & write if queue consists of single message
+			// enqueue message & start writer if it's idle
 			void write(const std::string& message, uchar opcode = opcode_one);
+			void write(FramePtr frame, bool is_close = false);
+			void write(const WSKeyedMessage& message);
+			void write(const BinaryFrame& frame);
+			void write(const WSStream& stream);
+			void enqueue(OutFrame out);
+			void enqueue_control(OutFrame out);
+			bool drop_oldest();
 			
-			// dequeue message & write next message if queue not empty
+			WSQueueStats queue_stats() const;
+			
+			// dequeue batch of messages & write them at once
+			void do_write(TSelf);
+			void add_to_batch(OutFrame& out);
+			void add_fragment();
+			void post_messageout(const OutFrame& out);
+			
+			// permessage-deflate: replace frame with one with compressed payload and RSV1, unless it's not worth it
+			void compress(OutFrame& out);
+			
+			// release written batch & write next one if queue not empty
 			void handle_write(TSelf, const error_code &ec, size_t);
 			
+			void close(uint status);
 			void stop();
 			
+			void post_error(const error_code& ec);
+			
+			// heartbeat stages, called by TimerWheel
+			void schedule_heartbeat(uint delay_ms, void (WSConnection<TSocket>::*stage)());
+			void ping();
+			void check_pong();
+			void expire();
+			
 		private:
+			WebServer& webserver_;													// backlink for registry cleanup
+			
 			Uri uri_;
 			pauuid id_;
 			
 			pauuid session_id_;
 			
 			std::atomic<bool> closed_;
+			std::atomic<bool> closing_;												// close frame enqueued, nothing else is sent
+			
+			TimerWheel* wheel_ = nullptr;											// nullptr - no heartbeat
+			std::atomic<TimerWheel::TimerId> heartbeat_timer_;
+			std::atomic<bool> pong_pending_;										// ping sent, nothing received since
+			
+			BoundedQueue<OutFrame> send_q_;
+			std::atomic<bool> writing_;												// writer is scheduled or in progress
+			
+			enum { control_queue_capacity_ = 16 };
+			BoundedQueue<OutFrame> control_q_;										// pings & pongs, overtake data frames
+			
+			// streamed messages, waiting ones are guarded by 'streams_mx_', current one is accessed by writer only
+			enum { max_stream_wait_batches_ = 4 };
+			std::deque<WSStream> streams_;											// take slots of 'send_q_'
+			std::atomic<size_t> streams_pending_;
+			ptl::mutex streams_mx_;
+			
+			std::unique_ptr<WSStream> stream_;										// nullptr - no message is streamed
+			bool stream_started_ = false;
+			size_t stream_waited_ = 0;												// batches written while stream waits
+			
+			// backpressure
+			std::atomic<WSOverflowPolicy> policy_;
+			std::atomic<size_t> high_watermark_bytes_;
+			std::atomic<size_t> queued_bytes_;
+			std::atomic<uint64_t> dropped_;
+			std::atomic<uint64_t> coalesced_;
+			
+			// generation per coalescing key; keys whose frames are all written are pruned when map doubles
+			enum { min_coalesce_prune_at_ = 64 };
+			std::map<std::string, std::shared_ptr<std::atomic<uint64_t>>> coalesce_keys_;
+			size_t coalesce_prune_at_ = min_coalesce_prune_at_;
+			ptl::mutex coalesce_mx_;
+			
+			// batch being written, accessed by writer only (inside strand)
+			enum { max_batch_frames_ = 64 };
+			std::vector<FramePtr> batch_;											// frames, headers and payloads
+			std::vector<NetCBuffer> batch_buffers_;
+			bool batch_closes_ = false;
+			
+			WSFrameParser frame_parser_;
+			
+			std::unique_ptr<WSDeflate> deflate_;									// nullptr - not negotiated
+			
+			WSResumption replay_;													// ring is nullptr - not resumable
+			
+			Metrics& metrics_;
+			Metrics::Clock::time_point write_started_;								// of batch, writer only
+			std::string inflated_;													// incoming message, reused
+			std::string deflated_;													// outgoing payload, reused
 			
-			std::list<std::string> send_q_;
-			ptl::mutex send_q_mx_;
+			enum { max_buffer_length_ = 8192 };
+			std::array<char, max_buffer_length_> buffer_;							// read buffer for socket
+			Strand strand_;
 		};
 	} // namespace WS
 } // namespace net
\ No newline at end of file
@@ -0,0 +1,251 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_deflate.h"
+
+#include <boost/algorithm/string.hpp>
+
+#include <set>
+
+#include <zlib.h>
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		static const char deflate_token[] = "permessage-deflate";
+		static const char deflate_tail[4] = { 0x00, 0x00, '\xff', '\xff' };	/// empty stored block of Z_SYNC_FLUSH
+		
+		// check parameters of one offer, e.g. "permessage-deflate; client_max_window_bits; server_no_context_takeover"
+		static bool accept_offer(const std::string& offer, const WSDeflateOptions& options, WSDeflateAgreement& agreed)
+		{
+			std::vector<std::string> params;
+			boost::split(params, offer, boost::is_any_of(";"));
+			
+			for (auto& param : params)
+				boost::trim(param);
+			
+			if (!boost::iequals(params[0], deflate_token))
+				return false;
+			
+			WSDeflateAgreement result;
+			result.enabled = true;
+			
+			std::set<std::string> seen;
+			
+			for (size_t i = 1; i < params.size(); ++i)
+			{
+				std::string name = params[i], value;
+				
+				auto eq = name.find('=');
+				if (eq != std::string::npos)
+				{
+					value = boost::trim_copy_if(name.substr(eq + 1), boost::is_any_of(" \t\""));
+					name = boost::trim_copy(name.substr(0, eq));
+				}
+				
+				if (!seen.insert(name).second)										/// duplicate parameter
+					return false;
+				
+				int bits = value.empty() ? 0 : std::atoi(value.c_str());
+				
+				if (name == "server_no_context_takeover" && value.empty())
+					result.server_no_context_takeover = true;
+				else if (name == "client_no_context_takeover" && value.empty())
+					result.client_no_context_takeover = true;
+				else if (name == "server_max_window_bits" && bits >= 9 && bits <= 15)	/// zlib can't deflate with 8
+					result.server_max_window_bits = bits;
+				else if (name == "client_max_window_bits" && (value.empty() || (bits >= 8 && bits <= 15)))
+					;																/// inflater accepts any window
+				else
+					return false;
+			}
+			
+			if (options.no_context_takeover)
+			{
+				result.server_no_context_takeover = true;
+				result.client_no_context_takeover = true;						/// client must support it (RFC 7692, 7.1.1.2)
+			}
+			
+			agreed = result;
+			return true;
+		}
+		
+		bool negotiate_deflate(const std::string& offers, const WSDeflateOptions& options, WSDeflateAgreement& agreed,
+		                       std::string& response)
+		{
+			if (!options.enabled || offers.empty())
+				return false;
+			
+			std::vector<std::string> list;
+			boost::split(list, offers, boost::is_any_of(","));
+			
+			for (auto& offer : list)
+			{
+				if (!accept_offer(offer, options, agreed))
+					continue;
+				
+				response = deflate_token;
+				
+				if (agreed.server_no_context_takeover)
+					response += "; server_no_context_takeover";
+				if (agreed.client_no_context_takeover)
+					response += "; client_no_context_takeover";
+				if (agreed.server_max_window_bits != 15)
+					response += "; server_max_window_bits=" + std::to_string(agreed.server_max_window_bits);
+				
+				return true;
+			}
+			
+			return false;
+		}
+		
+		
+		
+		WSDeflate::WSDeflate(const WSDeflateOptions& options, const WSDeflateAgreement& agreed)
+			: options_(options), agreed_(agreed)
+		{
+		}
+		
+		WSDeflate::~WSDeflate()
+		{
+			release_deflater();
+			release_inflater();
+		}
+		
+		bool WSDeflate::Compress(const char* data, size_t length, std::string& result)
+		{
+			if (!deflater_)															/// lazy - connection may never send
+			{
+				std::unique_ptr<z_stream> stream(new z_stream());
+				
+				if (deflateInit2(stream.get(), options_.level, Z_DEFLATED, -agreed_.server_max_window_bits, 8,
+				                 Z_DEFAULT_STRATEGY) != Z_OK)
+					return false;
+				
+				deflater_ = std::move(stream);
+			}
+			
+			deflater_->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+			deflater_->avail_in = static_cast<uInt>(length);
+			
+			size_t offset = result.size();
+			size_t chunk = deflateBound(deflater_.get(), static_cast<uLong>(length)) + sizeof(deflate_tail);
+			
+			for (;;)
+			{
+				size_t have = result.size();
+				result.resize(have + chunk);
+				
+				deflater_->next_out = reinterpret_cast<Bytef*>(&result[have]);
+				deflater_->avail_out = static_cast<uInt>(chunk);
+				
+				int rc = deflate(deflater_.get(), Z_SYNC_FLUSH);
+				result.resize(result.size() - deflater_->avail_out);
+				
+				if (rc != Z_OK && rc != Z_BUF_ERROR)
+				{
+					release_deflater();
+					result.resize(offset);
+					return false;
+				}
+				
+				if (deflater_->avail_out != 0)										/// flush is complete
+					break;
+			}
+			
+			if (result.size() - offset >= sizeof(deflate_tail))						/// RFC 7692, 7.2.1: strip the tail
+				result.resize(result.size() - sizeof(deflate_tail));
+			
+			if (agreed_.server_no_context_takeover)
+				release_deflater();
+			
+			return true;
+		}
+		
+		uint WSDeflate::Decompress(const std::string& data, size_t max_size, std::string& result)
+		{
+			result.clear();
+			
+			if (!inflater_)
+			{
+				std::unique_ptr<z_stream> stream(new z_stream());
+				
+				if (inflateInit2(stream.get(), -15) != Z_OK)
+					return Schema::WSClosureStatus::internal_error;
+				
+				inflater_ = std::move(stream);
+			}
+			
+			const std::pair<const char*, size_t> inputs[] = { { data.data(), data.size() },
+			                                                  { deflate_tail, sizeof(deflate_tail) } };
+			
+			for (auto& input : inputs)
+			{
+				inflater_->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.first));
+				inflater_->avail_in = static_cast<uInt>(input.second);
+				
+				do
+				{
+					size_t have = result.size();
+					size_t chunk = std::max<size_t>(input.second * 2, 4096);
+					
+					if (have + chunk > max_size + 1)									/// one byte more tells overflow
+						chunk = max_size + 1 - have;
+					
+					result.resize(have + chunk);
+					
+					inflater_->next_out = reinterpret_cast<Bytef*>(&result[have]);
+					inflater_->avail_out = static_cast<uInt>(chunk);
+					
+					int rc = inflate(inflater_.get(), Z_SYNC_FLUSH);
+					result.resize(result.size() - inflater_->avail_out);
+					
+					if (result.size() > max_size)
+					{
+						release_inflater();
+						return Schema::WSClosureStatus::message_too_big;
+					}
+					
+					if (rc == Z_STREAM_END)											/// client closed deflate stream
+					{
+						inflateReset(inflater_.get());
+						break;
+					}
+					
+					if (rc == Z_BUF_ERROR)											/// no progress - input consumed
+						break;
+					
+					if (rc != Z_OK)
+					{
+						release_inflater();
+						return Schema::WSClosureStatus::invalid_payload;
+					}
+				}
+				while (inflater_->avail_in != 0 || inflater_->avail_out == 0);
+			}
+			
+			if (agreed_.client_no_context_takeover)
+				release_inflater();
+			
+			return 0;
+		}
+		
+		void WSDeflate::release_deflater()
+		{
+			if (deflater_)
+				deflateEnd(deflater_.get());
+			
+			deflater_.reset();
+		}
+		
+		void WSDeflate::release_inflater()
+		{
+			if (inflater_)
+				inflateEnd(inflater_.get());
+			
+			inflater_.reset();
+		}
+	} // namespace WS
+} // namespace net
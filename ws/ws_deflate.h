@@ -0,0 +1,79 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/WS/ws_protocol.h"
+
+typedef struct z_stream_s z_stream;
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		// permessage-deflate settings of the server (WebServerParams::ws_deflate)
+		struct WSDeflateOptions
+		{
+			bool enabled = false;
+			bool no_context_takeover = false;									// compress each message from scratch
+			int level = 6;														// zlib compression level, 1..9
+			size_t min_size = 256;												// smaller payloads are sent as is
+		};
+		
+		// permessage-deflate parameters agreed at WS handshake, passed by HTTPConnection to WSConnection it creates
+		struct WSDeflateAgreement
+		{
+			bool enabled = false;
+			bool server_no_context_takeover = false;
+			bool client_no_context_takeover = false;
+			int server_max_window_bits = 15;
+		};
+		
+		// Picks the first acceptable permessage-deflate offer from Sec-WebSocket-Extensions request header value and
+		// fills value of the response header. Returns false if nothing is offered or acceptable.
+		bool negotiate_deflate(const std::string& offers, const WSDeflateOptions& options, WSDeflateAgreement& agreed,
+		                       std::string& response);
+		
+		//--------------------------------------------------------------------------------------------------------------
+		// WSDeflate is a per-connection compression context of permessage-deflate extension (RFC 7692).
+		//
+		// Method 'Compress' deflates one message payload and appends it to 'result' without trailing 00 00 FF FF.
+		// Method 'Decompress' inflates one message payload (RSV1 set on its first frame) into 'result', returning 0 or
+		// WS closure status to close connection with: message_too_big when inflated payload exceeds 'max_size' or
+		// invalid_payload on corrupted data.
+		//
+		// With context takeover (default) zlib streams keep sliding window between messages, which is where repetitive
+		// JSON gains most, at the price of ~300KB per connection. With no_context_takeover streams are created for each
+		// message and released right after it, so idle connections hold no compression memory.
+		//
+		// Not thread-safe: compression is called by WSConnection's writer, decompression by its reader, both inside
+		// WSConnection's strand.
+		//--------------------------------------------------------------------------------------------------------------
+		class WSDeflate
+		{
+			DECLARE_NONCOPYABLE(WSDeflate);
+		
+		public:
+			WSDeflate(const WSDeflateOptions& options, const WSDeflateAgreement& agreed);
+			~WSDeflate();
+			
+			bool Compress(const char* data, size_t length, std::string& result);
+			uint Decompress(const std::string& data, size_t max_size, std::string& result);
+			
+			size_t min_size() const { return options_.min_size; }
+		
+		private:
+			void release_deflater();
+			void release_inflater();
+		
+		private:
+			WSDeflateOptions options_;
+			WSDeflateAgreement agreed_;
+			
+			std::unique_ptr<z_stream> deflater_;								// nullptr - not initialized
+			std::unique_ptr<z_stream> inflater_;
+		};
+	} // namespace WS
+} // namespace net
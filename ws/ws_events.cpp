@@ -0,0 +1,122 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_events.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		WSEventDispatcher::WSEventDispatcher(size_t capacity, size_t max_batch)
+			: queue_(capacity), max_batch_(std::max<size_t>(max_batch, 1)), overflow_size_(0), dropped_(0)
+		{
+		}
+		
+		WSEventDispatcher::~WSEventDispatcher()
+		{
+			Stop();
+		}
+		
+		void WSEventDispatcher::Subscribe(WSEventType type, BatchHandler handler)
+		{
+			if (consumer_.Running())
+			{
+				IFLOG(P2, "WSEventDispatcher::Subscribe after Start is ignored. Event type follows.", int(type));
+				return;
+			}
+			
+			handlers_[static_cast<size_t>(type)] = std::move(handler);
+			
+			if (handlers_[static_cast<size_t>(type)])
+				mask_ |= 1u << static_cast<uint>(type);
+			else
+				mask_ &= ~(1u << static_cast<uint>(type));
+		}
+		
+		bool WSEventDispatcher::Post(WSEvent event)
+		{
+			bool lifecycle = (event.type == WSEventType::open || event.type == WSEventType::close);
+			
+			if ((!lifecycle || overflow_size_ == 0) && queue_.TryPush(std::move(event)))	/// moved from on success only
+			{
+				consumer_.Wake();
+				return true;
+			}
+			
+			if (!lifecycle)
+			{
+				++dropped_;
+				return false;
+			}
+			
+			{
+				boost::lock_guard<ptl::mutex> lck(overflow_mx_);						/// after queued ones, in order
+				
+				overflow_.push_back(std::move(event));
+				++overflow_size_;
+			}
+			
+			consumer_.Wake();
+			return true;
+		}
+		
+		void WSEventDispatcher::Start()
+		{
+			if (mask_ == 0)																/// nobody listens - no thread
+				return;
+			
+			consumer_.Start([this] { return dispatch() != 0; }, 10);
+		}
+		
+		void WSEventDispatcher::Stop()
+		{
+			consumer_.Stop();															/// delivers leftovers
+		}
+		
+		size_t WSEventDispatcher::dispatch()
+		{
+			size_t n = 0;
+			WSEvent event;
+			
+			while (n < max_batch_ && queue_.TryPop(event))
+			{
+				batches_[static_cast<size_t>(event.type)].push_back(std::move(event));
+				++n;
+			}
+			
+			if (n < max_batch_ && overflow_size_ != 0)									/// queue is drained - events posted
+			{																			/// before overflowed ones are taken
+				boost::lock_guard<ptl::mutex> lck(overflow_mx_);
+				
+				for (auto& e : overflow_)
+					batches_[static_cast<size_t>(e.type)].push_back(std::move(e));
+				
+				n += overflow_.size();
+				overflow_.clear();
+				overflow_size_ = 0;
+			}
+			
+			for (size_t type = 0; type < batches_.size(); ++type)
+			{
+				auto& batch = batches_[type];
+				if (batch.empty())
+					continue;
+				
+				try
+				{
+					if (handlers_[type])
+						handlers_[type](batch);
+				}
+				catch (std::exception& e)
+				{
+					IFLOG(P2, "WS event handler failed. Reason follows.", e.what());
+				}
+				
+				batch.clear();
+			}
+			
+			return n;
+		}
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/bounded_queue.h"
+#include "webserver/worker_thread.h"
+#include "webserver/WS/ws_proto_impl.h"
+#include "templates/mutex.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		enum class WSEventType { open, messageout, error, close, count_ };
+		
+		// Lifecycle event of WS connection; fields not relevant to the type are empty
+		struct WSEvent
+		{
+			WSEventType type = WSEventType::open;
+			pauuid id;
+			pauuid session_id;															// open
+			Uri uri;																	// open, close
+			PayloadPtr message;															// messageout: encoded frame
+			error_code ec;																// error
+			bool resumed = false;														// open: missed messages replayed
+		};
+		
+		//--------------------------------------------------------------------------------------------------------------
+		// WSEventDispatcher delivers WS lifecycle events (see WSEventType) from I/O threads to a consumer thread of its
+		// own, in batches.
+		//
+		// Method 'Subscribe' registers a handler of batches for one event type; it's called before 'Start' only.
+		// Method 'Subscribed' is the producer's check before building an event: it's a load of a plain mask, so event
+		//   types nobody subscribed to cost nothing - no allocation, no copy, no queue traffic.
+		// Method 'Post' puts event into lock-free BoundedQueue and never blocks; if the queue is full (consumer is
+		//   stuck), messageout and error events are dropped and counted ('Dropped'), I/O threads are never slowed
+		//   down by handlers. Open and close events are never dropped: they go to 'overflow_' list under a mutex
+		//   (and so do all following ones until consumer empties it), which is delivered after the queued events.
+		//
+		// Consumer thread pops up to 'max_batch' events, splits them by type and calls each handler once per batch,
+		// so handlers may amortize their own costs (DB transaction, lock, syscall) over the batch. Events of one type
+		// keep their order; handlers of a batch are called in WSEventType order, which is lifecycle order, so 'open' of
+		// a connection is never delivered after its 'close'. When queue is empty, consumer sleeps (see WorkerThread);
+		// producers notify it only if it's asleep.
+		//
+		// Handlers run on consumer thread only and must not throw (exceptions are logged and swallowed).
+		//--------------------------------------------------------------------------------------------------------------
+		class WEBSERVER_API WSEventDispatcher
+		{
+			DECLARE_NONCOPYABLE(WSEventDispatcher);
+		
+		public:
+			using BatchHandler = std::function<void(const std::vector<WSEvent>& events)>;
+		
+		public:
+			explicit WSEventDispatcher(size_t capacity = 1 << 16, size_t max_batch = 256);
+			~WSEventDispatcher();
+			
+			void Subscribe(WSEventType type, BatchHandler handler);
+			
+			bool Subscribed(WSEventType type) const
+			{
+				return (mask_ & (1u << static_cast<uint>(type))) != 0;
+			}
+			
+			bool Post(WSEvent event);													// false if dropped
+			
+			void Start();
+			void Stop();																// delivers events queued so far
+			
+			uint64_t Dropped() const { return dropped_; }
+		
+		private:
+			size_t dispatch();
+		
+		private:
+			BoundedQueue<WSEvent> queue_;
+			size_t max_batch_;
+			
+			std::vector<WSEvent> overflow_;												// open & close, queue was full
+			std::atomic<size_t> overflow_size_;
+			ptl::mutex overflow_mx_;
+			
+			uint mask_ = 0;																// written before 'Start' only
+			std::array<BatchHandler, static_cast<size_t>(WSEventType::count_)> handlers_;
+			std::array<std::vector<WSEvent>, static_cast<size_t>(WSEventType::count_)> batches_;
+			
+			std::atomic<uint64_t> dropped_;
+			
+			WorkerThread consumer_;
+		};
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,247 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_frame_parser.h"
+
+#include <cstring>
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		namespace
+		{
+			// status which may be sent in close frame (RFC 6455, 7.4): 1004-1006 and 1015 are reserved or must not be
+			// sent, 1016-2999 are unassigned, 3000-4999 belong to libraries and applications
+			bool valid_close_status(uint status)
+			{
+				return (status >= 1000 && status <= 1003) || (status >= 1007 && status <= 1014) ||
+				       (status >= 3000 && status <= 4999);
+			}
+		}
+		
+		WSFrameParser::WSFrameParser(size_t max_message_size, bool allow_compressed)
+			: max_message_size_(max_message_size), allow_compressed_(allow_compressed)
+		{
+		}
+		
+		void WSFrameParser::Reset()
+		{
+			state_ = State::fin_rsv_opcode;
+			
+			message_opcode_ = 0;
+			message_compressed_ = false;
+			message_.clear();
+			control_.clear();
+			
+			ready_opcode_ = 0;
+			close_status_ = Schema::WSClosureStatus::normal;
+		}
+		
+		const std::string& WSFrameParser::payload() const
+		{
+			return (ready_opcode_ & 0x08) ? control_ : message_;
+		}
+		
+		WSFrameParser::Result WSFrameParser::Parse(const char*& begin, const char* end)
+		{
+			if (ready_opcode_ != 0)												/// previous result is consumed by caller
+			{
+				if (ready_opcode_ & 0x08)
+					control_.clear();
+				else
+					message_.clear();
+				
+				ready_opcode_ = 0;
+			}
+			
+			while (begin != end)
+			{
+				uchar input = static_cast<uchar>(*begin);
+				
+				switch (state_)
+				{
+					case State::fin_rsv_opcode:
+						fin_ = (input & 0x80) != 0;
+						opcode_ = input & 0x0f;
+						
+						if ((input & Schema::WSRsvBits::rsv_mask) & ~(allow_compressed_ ? Schema::WSRsvBits::compressed : 0))
+							return fail(Schema::WSClosureStatus::protocol_error);		/// no such extension negotiated
+						
+						if ((input & Schema::WSRsvBits::compressed) && !(opcode_ == Schema::WSOpcode::text ||
+						                                                 opcode_ == Schema::WSOpcode::binary))
+							return fail(Schema::WSClosureStatus::protocol_error);		/// RSV1 on first frame only
+						
+						if (opcode_ & 0x08)											/// control frame
+						{
+							if (!fin_ || (opcode_ != Schema::WSOpcode::close && opcode_ != Schema::WSOpcode::ping &&
+							              opcode_ != Schema::WSOpcode::pong))
+								return fail(Schema::WSClosureStatus::protocol_error);
+						}
+						else if (opcode_ == Schema::WSOpcode::continuation)
+						{
+							if (message_opcode_ == 0)								/// nothing to continue
+								return fail(Schema::WSClosureStatus::protocol_error);
+						}
+						else if (opcode_ == Schema::WSOpcode::text || opcode_ == Schema::WSOpcode::binary)
+						{
+							if (message_opcode_ != 0)								/// previous message is not finished
+								return fail(Schema::WSClosureStatus::protocol_error);
+							
+							message_opcode_ = opcode_;
+							message_compressed_ = (input & Schema::WSRsvBits::compressed) != 0;
+						}
+						else
+							return fail(Schema::WSClosureStatus::protocol_error);
+						
+						state_ = State::mask_length;
+						++begin;
+						break;
+					case State::mask_length:
+						if (input < 128)												/// unmasked frame from client
+							return fail(Schema::WSClosureStatus::protocol_error);
+						
+						length_ = input & 0x7f;
+						header_bytes_ = 0;
+						
+						if (length_ == 126 || length_ == 127)
+						{
+							extended_bytes_ = (length_ == 126 ? 2 : 8);
+							length_ = 0;
+							state_ = State::extended_length;
+						}
+						else
+							state_ = State::masking_key;
+						
+						++begin;
+						break;
+					case State::extended_length:
+						length_ = (length_ << 8) | input;								/// network byte order
+						++begin;
+						
+						if (++header_bytes_ == extended_bytes_)
+						{
+							if (length_ >> 63)											/// most significant bit must be 0
+								return fail(Schema::WSClosureStatus::protocol_error);
+							
+							header_bytes_ = 0;
+							state_ = State::masking_key;
+						}
+						break;
+					case State::masking_key:
+						mask_[header_bytes_] = input;
+						++begin;
+						
+						if (++header_bytes_ == 4)
+						{
+							auto result = frame_header_done();
+							if (result != Result::indeterminate)
+								return result;
+						}
+						break;
+					case State::payload:
+					{
+						std::string& target = (opcode_ & 0x08) ? control_ : message_;
+						
+						size_t chunk = static_cast<size_t>(std::min<uint64_t>(length_ - received_, end - begin));
+						size_t offset = target.size();
+						
+						target.append(begin, chunk);
+						unmask(&target[offset], chunk, mask_, static_cast<size_t>(received_));
+						
+						begin += chunk;
+						received_ += chunk;
+						
+						if (received_ == length_)
+						{
+							auto result = frame_done();
+							if (result != Result::indeterminate)
+								return result;
+						}
+						break;
+					}
+					default:
+						return fail(Schema::WSClosureStatus::protocol_error);
+				}
+			}
+			
+			return Result::indeterminate;
+		}
+		
+		WSFrameParser::Result WSFrameParser::frame_header_done()
+		{
+			if (opcode_ & 0x08)
+			{
+				if (length_ > 125 || (opcode_ == Schema::WSOpcode::close && length_ == 1))
+					return fail(Schema::WSClosureStatus::protocol_error);
+			}
+			else if (message_.size() + length_ > max_message_size_)
+				return fail(Schema::WSClosureStatus::message_too_big);
+			
+			received_ = 0;
+			state_ = State::payload;
+			
+			if (length_ == 0)
+				return frame_done();
+			
+			std::string& target = (opcode_ & 0x08) ? control_ : message_;
+			target.reserve(target.size() + static_cast<size_t>(length_));
+			
+			return Result::indeterminate;
+		}
+		
+		WSFrameParser::Result WSFrameParser::frame_done()
+		{
+			state_ = State::fin_rsv_opcode;
+			
+			if (opcode_ & 0x08)
+			{
+				if (opcode_ == Schema::WSOpcode::close && control_.size() >= 2 &&
+				    !valid_close_status((static_cast<uchar>(control_[0]) << 8) | static_cast<uchar>(control_[1])))
+					return fail(Schema::WSClosureStatus::protocol_error);
+				
+				ready_opcode_ = opcode_;
+				return Result::good;
+			}
+			
+			if (!fin_)																/// wait for continuation frames
+				return Result::indeterminate;
+			
+			ready_opcode_ = message_opcode_;
+			message_opcode_ = 0;
+			
+			return Result::good;
+		}
+		
+		WSFrameParser::Result WSFrameParser::fail(uint status)
+		{
+			close_status_ = status;
+			return Result::bad;
+		}
+		
+		// XOR payload with 4-byte mask. 'offset' is the position of 'data' inside frame payload, so that chunk of payload
+		// which came in a separate read is unmasked with correctly rotated mask.
+		void WSFrameParser::unmask(char* data, size_t length, const uchar (&mask)[4], size_t offset)
+		{
+			uchar m[8];
+			for (size_t i = 0; i < 8; ++i)
+				m[i] = mask[(offset + i) % 4];
+			
+			uint64_t m8;
+			std::memcpy(&m8, m, sizeof(m8));										/// byte order agnostic
+			
+			size_t i = 0;
+			for (; i + 8 <= length; i += 8)
+			{
+				uint64_t w;
+				std::memcpy(&w, data + i, sizeof(w));								/// no alignment requirements
+				w ^= m8;
+				std::memcpy(data + i, &w, sizeof(w));
+			}
+			
+			for (; i < length; ++i)
+				data[i] ^= m[i % 8];
+		}
+	} // namespace WS
+} // namespace net
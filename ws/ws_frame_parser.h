@@ -0,0 +1,87 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/WS/ws_protocol.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		//--------------------------------------------------------------------------------------------------------------
+		// WSFrameParser gets byte array of client-to-server stream and returns
+		// 1 either result code 'good' plus complete message or control frame (see 'opcode' and 'payload')
+		// 2 or result code 'bad' plus WS closure status to close connection with (see 'close_status')
+		// 3 or result code 'indeterminate' which means that byte array contained just a part of a frame
+		//
+		// Method 'Parse' consumes bytes from [begin; end) and stops right after the first complete message or control
+		// frame, so 'begin' is moved to the first unconsumed byte. Parser is incremental: frame may be split at any
+		// byte, state is kept between calls. Results 'opcode' and 'payload' stay valid till the next 'Parse' call.
+		// Method 'Reset' drops all state (e.g. after 'bad' result).
+		//
+		// Frames are parsed by RFC 6455, 5.2: 7/16/64-bit payload lengths, mandatory client masking, fragmentation
+		// (text/binary frame + continuation frames) and control frames (close, ping, pong). Close frame with 1-byte
+		// payload or with status that must not be sent (RFC 6455, 7.4) is 'bad' with 'protocol_error'. Control frames may come
+		// between fragments of a data message, so their payload is stored separately from message being assembled.
+		// Both storages are reused from message to message, so that steady-state parsing does not allocate.
+		//
+		// Payload is unmasked in place, 8 bytes at a time (see 'unmask').
+		//
+		// RSV bits are rejected unless permessage-deflate is negotiated ('allow_compressed'): then RSV1 is allowed on
+		// the first frame of a data message, and 'compressed' tells the caller to inflate the payload.
+		//--------------------------------------------------------------------------------------------------------------
+		class WSFrameParser
+		{
+		public:
+			enum class Result { good, bad, indeterminate };
+		
+		public:
+			explicit WSFrameParser(size_t max_message_size, bool allow_compressed = false);
+			
+			void Reset();
+			
+			Result Parse(const char*& begin, const char* end);
+			
+			uchar opcode() const { return ready_opcode_; }						// Schema::WSOpcode value
+			const std::string& payload() const;
+			bool compressed() const { return !(ready_opcode_ & 0x08) && message_compressed_; }
+			uint close_status() const { return close_status_; }
+			
+			static void unmask(char* data, size_t length, const uchar (&mask)[4], size_t offset);
+		
+		private:
+			enum class State { fin_rsv_opcode, mask_length, extended_length, masking_key, payload };
+			
+			Result frame_header_done();
+			Result frame_done();
+			Result fail(uint status);
+		
+		private:
+			State state_ = State::fin_rsv_opcode;
+			
+			// current frame
+			bool fin_ = false;
+			uchar opcode_ = 0;
+			uchar mask_[4] = {};
+			uint64_t length_ = 0;
+			uint64_t received_ = 0;
+			uint header_bytes_ = 0;												// bytes of extended length or mask read so far
+			uint extended_bytes_ = 0;
+			
+			// current message (possibly fragmented) and current control frame
+			uchar message_opcode_ = 0;											// 0 - no data message in progress
+			bool message_compressed_ = false;
+			std::string message_;
+			std::string control_;
+			
+			uchar ready_opcode_ = 0;											// 0 - nothing ready
+			uint close_status_ = Schema::WSClosureStatus::normal;
+			
+			size_t max_message_size_;
+			bool allow_compressed_;
+		};
+	} // namespace WS
+} // namespace net
@@ -1,6 +1,7 @@
 ﻿#include "webserver/stdafx.h"
 
 #include "webserver/WS/ws_proto_impl.h"
+#include "webserver/WS/ws_protocol.h"
 
 
 
@@ -35,10 +36,8 @@ namespace net
 {
 	namespace WS
 	{
-		void fill_text_frame(const std::string& message, uchar opcode, std::string & result)
+		void fill_frame_header(size_t length, uchar opcode, std::string & result)
 		{
-			size_t length = message.length();
-			
 			result.push_back(opcode);
 			
 			if (length >= 126)													/// unmasked (first length byte < 128)
@@ -63,7 +62,12 @@ namespace net
 			}
 			else
 				result.push_back(static_cast<uchar>(length));					/// 1B length
-				
+		}
+		
+		void fill_text_frame(const std::string& message, uchar opcode, std::string & result)
+		{
+			fill_frame_header(message.length(), opcode, result);
+			
 			result.append(message);                                             // TODO: check that message need not be
 		}                                                                       // TODO: masked & does not start early in lowlevel frame map
 		
@@ -73,5 +77,23 @@ namespace net
 			result.push_back(status % 256);
 			result.append(reason);
 		}
+		
+		FramePtr make_frame(const std::string& message, uchar opcode)
+		{
+			auto frame = std::make_shared<std::string>();
+			frame->reserve(message.size() + 10);								/// max header length
+			
+			fill_text_frame(message, opcode, *frame);
+			
+			return frame;
+		}
+		
+		BinaryFrame make_binary_frame(PayloadPtr payload)
+		{
+			auto header = std::make_shared<std::string>();
+			fill_frame_header(payload->size(), Schema::WSFinRsvOpcode::one_fragment_binary, *header);
+			
+			return { header, std::move(payload) };
+		}
 	} // namespace WS
 } // namespace net
\ No newline at end of file
@@ -9,8 +9,25 @@ namespace net
 {
 	namespace WS
 	{
+		// encoded frame, immutable and shared between all connections it's sent to (see WebServer::WSBroadcast)
+		using FramePtr = std::shared_ptr<const std::string>;
+		
+		// payload of binary message, shared with caller and written to socket without copying (see WebServer::WSPushBinary)
+		using PayloadPtr = std::shared_ptr<const std::string>;
+		
+		// binary frame kept in two buffers: 2-10 bytes of encoded header and untouched payload
+		struct BinaryFrame
+		{
+			FramePtr header;
+			PayloadPtr payload;
+		};
+		
 		// encode string message or closure code+reason into WS bit format, using lowlevel bitwise operations
+		void fill_frame_header(size_t length, uchar opcode, std::string& result);
 		void fill_text_frame(const std::string& message, uchar opcode, std::string& result);
 		void fill_closing_frame(uint status, const std::string& reason, std::string& result);
+		
+		FramePtr make_frame(const std::string& message, uchar opcode);
+		BinaryFrame make_binary_frame(PayloadPtr payload);
 	} // namespace WS
 } // namespace net
\ No newline at end of file
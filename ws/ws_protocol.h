@@ -16,7 +16,12 @@ namespace net
 			enum WSClosureStatus							/// See http://tools.ietf.org/html/rfc6455
 			{
 				normal			= 1000,
+				going_away		= 1001,
 				protocol_error	= 1002,
+				unsupported		= 1003,
+				invalid_payload	= 1007,
+				message_too_big	= 1009,
+				internal_error	= 1011,
 				timeout			= 4020						/// custom code
 			};
 			
@@ -24,7 +29,25 @@ namespace net
 			{
 				one_fragment_text	= 129,
 				one_fragment_binary	= 130,
-				close_connection	= 136
+				close_connection	= 136,
+				ping_frame			= 137,
+				pong_frame			= 138
+			};
+			
+			enum WSOpcode									/// 4 low bits of the first frame byte
+			{
+				continuation	= 0,
+				text			= 1,
+				binary			= 2,
+				close			= 8,
+				ping			= 9,
+				pong			= 10
+			};
+			
+			enum WSRsvBits									/// See http://tools.ietf.org/html/rfc7692#section-6
+			{
+				rsv_mask		= 0x70,
+				compressed		= 0x40						/// RSV1 of the first frame of compressed message
 			};
 		} // namespace Schema
 	} // namespace WS
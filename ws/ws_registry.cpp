@@ -0,0 +1,54 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_registry.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		void WSRegistry::Add(const pauuid& id, WSHandle handle)
+		{
+			auto& shard = shard_of(id);
+			
+			boost::lock_guard<ptl::mutex> lck(shard.mx);
+			shard.map[id] = std::move(handle);
+		}
+		
+		void WSRegistry::Remove(const pauuid& id)
+		{
+			auto& shard = shard_of(id);
+			
+			boost::lock_guard<ptl::mutex> lck(shard.mx);
+			shard.map.erase(id);
+		}
+		
+		bool WSRegistry::Find(const pauuid& id, WSHandle& handle) const
+		{
+			auto& shard = shard_of(id);
+			
+			boost::lock_guard<ptl::mutex> lck(shard.mx);
+			
+			auto it = shard.map.find(id);
+			if (it == shard.map.end())
+				return false;
+			
+			handle = it->second;
+			return true;
+		}
+		
+		size_t WSRegistry::Size() const
+		{
+			size_t n = 0;
+			
+			for (auto& shard : shards_)
+			{
+				boost::lock_guard<ptl::mutex> lck(shard.mx);
+				n += shard.map.size();
+			}
+			
+			return n;
+		}
+	} // namespace WS
+} // namespace net
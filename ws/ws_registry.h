@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/WS/ws_connection.h"
+#include "templates/mutex.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		// Unified handle of WS, WSS or in-memory (see MemSocket) connection - the registry stores all kinds side by side.
+		// Method 'Forward' passes argument to connection (see WSConnection::Forward) and returns false if it's dead.
+		class WSHandle
+		{
+		public:
+			WSHandle() = default;
+			WSHandle(std::weak_ptr<WSConnection<TCPSocket>> ws) : ws_(std::move(ws)) {}
+			WSHandle(std::weak_ptr<WSConnection<SSLSocket>> wss) : wss_(std::move(wss)) {}
+			WSHandle(std::weak_ptr<WSConnection<MemSocket>> mem) : mem_(std::move(mem)) {}
+			
+			template<typename TArg>
+			bool Forward(TArg& a) const
+			{
+				if (auto conn = ws_.lock())
+				{
+					conn->Forward(a);
+					return true;
+				}
+				
+				if (auto conn = wss_.lock())
+				{
+					conn->Forward(a);
+					return true;
+				}
+				
+				if (auto conn = mem_.lock())
+				{
+					conn->Forward(a);
+					return true;
+				}
+				
+				return false;
+			}
+		
+		private:
+			std::weak_ptr<WSConnection<TCPSocket>> ws_;
+			std::weak_ptr<WSConnection<SSLSocket>> wss_;
+			std::weak_ptr<WSConnection<MemSocket>> mem_;
+		};
+		
+		// Hash of connection id: ids are random, so folding their bytes into a word is enough
+		struct WSIdHash
+		{
+			size_t operator()(const pauuid& id) const
+			{
+				static_assert(std::is_trivially_copyable<pauuid>::value, "pauuid is hashed by its bytes");
+				
+				size_t h = 0, word;
+				const char* bytes = reinterpret_cast<const char*>(&id);
+				
+				for (size_t i = 0; i + sizeof(word) <= sizeof(id); i += sizeof(word))
+				{
+					std::memcpy(&word, bytes + i, sizeof(word));
+					h ^= word;
+				}
+				
+				return h;
+			}
+		};
+		
+		//--------------------------------------------------------------------------------------------------------------
+		// WSRegistry maps connection ids to WSHandles of all WS and WSS connections (see WebServer::WSPush & co).
+		//
+		// Ids are spread over 'shards_count_' shards by their hash. Each shard is a hash map under its own mutex, held
+		// only for a single lookup, insert or erase, so pushes from many threads contend only when they hit the same
+		// shard at the same moment, and connect / disconnect block only pushes to that shard.
+		//
+		// Connection is added right after WS handshake and removed by WSConnection::stop, so the registry holds only
+		// live connections (plus those being stopped right now).
+		//--------------------------------------------------------------------------------------------------------------
+		class WSRegistry
+		{
+			DECLARE_NONCOPYABLE(WSRegistry);
+			
+			using Map = std::unordered_map<pauuid, WSHandle, WSIdHash>;
+		
+		public:
+			WSRegistry() = default;
+			
+			void Add(const pauuid& id, WSHandle handle);
+			void Remove(const pauuid& id);
+			
+			bool Find(const pauuid& id, WSHandle& handle) const;
+			size_t Size() const;
+			
+			// calls f(id, handle) for each connection; shard is copied under its mutex and f is called without it, so
+			// f may add or remove connections
+			template<typename TFunc>
+			void ForEach(TFunc f) const
+			{
+				std::vector<std::pair<pauuid, WSHandle>> snapshot;
+				
+				for (auto& shard : shards_)
+				{
+					{
+						boost::lock_guard<ptl::mutex> lck(shard.mx);
+						snapshot.assign(shard.map.begin(), shard.map.end());
+					}
+					
+					for (auto& entry : snapshot)
+						f(entry.first, entry.second);
+				}
+			}
+		
+		private:
+			enum { shards_count_ = 64 };
+			
+			struct Shard
+			{
+				Map map;
+				mutable ptl::mutex mx;
+				char pad[64];														// shards' mutexes live on different lines
+			};
+			
+			Shard& shard_of(const pauuid& id) { return shards_[WSIdHash()(id) % shards_count_]; }
+			const Shard& shard_of(const pauuid& id) const { return shards_[WSIdHash()(id) % shards_count_]; }
+		
+		private:
+			std::array<Shard, shards_count_> shards_;
+		};
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,182 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_replay.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		namespace
+		{
+			const char resume_prefix[] = "pa-resume.";
+		}
+		
+		void WSReplayRing::Append(uint64_t epoch, FramePtr frame, PayloadPtr payload)
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			if (epoch != epoch_)														/// session reconnected elsewhere
+				return;
+			
+			if (entries_.size() == capacity_)
+				entries_.pop_front();
+			
+			entries_.push_back(WSReplayEntry{ next_seq_++, std::move(frame), std::move(payload) });
+		}
+		
+		
+		
+		void WSReplayStore::Attach(const pauuid& session_id, uint64_t last_seen, WSResumption& resumption)
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);											/// 'Expire' can't drop ring meanwhile
+			
+			auto& ring = rings_[session_id];
+			if (!ring)
+				ring = std::make_shared<WSReplayRing>(capacity_);
+			
+			boost::lock_guard<ptl::mutex> ring_lck(ring->mx_);
+			
+			resumption.session_id = session_id;
+			resumption.ring = nullptr;
+			resumption.epoch = 0;
+			resumption.resumed = false;
+			resumption.gap.clear();
+			
+			if (ring->attached_)														/// another tab of the session: ring
+				return;																	/// holds its messages, not ours
+			
+			resumption.ring = ring;
+			resumption.epoch = ++ring->epoch_;
+			
+			ring->attached_ = true;
+			
+			auto& entries = ring->entries_;
+			
+			bool covered = (last_seen != 0 && last_seen < ring->next_seq_ &&
+			                (entries.empty() ? last_seen + 1 == ring->next_seq_ : last_seen + 1 >= entries.front().seq));
+			
+			if (covered)
+			{
+				for (auto& entry : entries)
+				{
+					if (entry.seq <= last_seen)
+						continue;
+					
+					if (!entry.frame)													/// streamed message can't be replayed
+					{
+						covered = false;
+						break;
+					}
+					
+					resumption.gap.push_back(entry);
+				}
+			}
+			
+			if (covered)
+			{
+				resumption.resumed = true;
+				return;
+			}
+			
+			resumption.gap.clear();														/// new numbering
+			entries.clear();
+			ring->next_seq_ = 1;
+		}
+		
+		void WSReplayStore::Detach(const WSResumption& resumption)
+		{
+			if (!resumption.ring)
+				return;
+			
+			boost::lock_guard<ptl::mutex> lck(resumption.ring->mx_);
+			
+			if (resumption.ring->epoch_ == resumption.epoch)
+				resumption.ring->attached_ = false;
+		}
+		
+		void WSReplayStore::Expire(const pauuid& session_id, uint64_t epoch)
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			auto it = rings_.find(session_id);
+			if (it == rings_.end())
+				return;
+			
+			{
+				boost::lock_guard<ptl::mutex> ring_lck(it->second->mx_);
+				
+				if (it->second->epoch_ != epoch || it->second->attached_)				/// session is back
+					return;
+			}
+			
+			rings_.erase(it);
+		}
+		
+		size_t WSReplayStore::Size() const
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			return rings_.size();
+		}
+		
+		
+		
+		namespace
+		{
+			// calls f(token) for each comma separated token of the offer list until f returns true
+			template<typename TFunc>
+			bool find_offer(const std::string& offers, TFunc f)
+			{
+				std::string::size_type begin = 0;
+				
+				while (begin < offers.size())
+				{
+					auto end = offers.find(',', begin);
+					if (end == std::string::npos)
+						end = offers.size();
+					
+					auto token = offers.substr(begin, end - begin);
+					
+					token.erase(0, token.find_first_not_of(' '));
+					token.erase(token.find_last_not_of(' ') + 1);
+					
+					if (f(token))
+						return true;
+					
+					begin = end + 1;
+				}
+				
+				return false;
+			}
+		}
+		
+		bool parse_resume_offer(const std::string& offers, uint64_t& last_seen)
+		{
+			return find_offer(offers, [&last_seen](const std::string& token)
+			{
+				if (token.compare(0, sizeof(resume_prefix) - 1, resume_prefix) != 0)
+					return false;
+				
+				auto digits = token.substr(sizeof(resume_prefix) - 1);
+				
+				if (digits.empty() || digits.size() >= 20 || digits.find_first_not_of("0123456789") != std::string::npos)
+					return false;
+				
+				last_seen = std::stoull(digits);
+				return true;
+			});
+		}
+		
+		bool offers_protocol(const std::string& offers, const std::string& protocol)
+		{
+			return find_offer(offers, [&protocol](const std::string& token) { return token == protocol; });
+		}
+		
+		std::string resume_protocol(uint64_t last_seen)
+		{
+			return resume_prefix + std::to_string(last_seen);
+		}
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/WS/ws_proto_impl.h"
+#include "templates/mutex.h"
+
+#include <deque>
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		// Data message written to a resumable session; 'frame' is the uncompressed frame (or frame header if 'payload'
+		// is set), both shared with the queue. Streamed messages are counted but not kept ('frame' is nullptr).
+		struct WSReplayEntry
+		{
+			uint64_t seq;
+			FramePtr frame;
+			PayloadPtr payload;
+		};
+		
+		class WSReplayRing;
+		
+		// Outcome of WSReplayStore::Attach, handed from HTTP handshake to WSConnection
+		struct WSResumption
+		{
+			pauuid session_id;
+			std::shared_ptr<WSReplayRing> ring;											// nullptr - connection isn't resumable
+			uint64_t epoch = 0;															// tells current owner of the ring
+			bool resumed = false;
+			std::vector<WSReplayEntry> gap;												// messages client missed
+		};
+		
+		// Bounded ring of the latest data messages of one session
+		class WSReplayRing
+		{
+			DECLARE_NONCOPYABLE(WSReplayRing);
+			
+			friend class WSReplayStore;
+		
+		public:
+			explicit WSReplayRing(size_t capacity) : capacity_(capacity) {}
+			
+			void Append(uint64_t epoch, FramePtr frame, PayloadPtr payload);			// ignored unless 'epoch' owns ring
+		
+		private:
+			std::deque<WSReplayEntry> entries_;
+			size_t capacity_;
+			uint64_t next_seq_ = 1;
+			uint64_t epoch_ = 0;
+			bool attached_ = false;
+			ptl::mutex mx_;
+		};
+		
+		//--------------------------------------------------------------------------------------------------------------
+		// WSReplayStore keeps a WSReplayRing per session (SID cookie), so that a client reconnecting after network blip
+		// or server-side stop gets only messages it missed instead of the full session state.
+		//
+		// Protocol is opt-in via WS subprotocol: client offers "pa-resume.<N>", where N is the number of data messages
+		// (text and binary, not control frames) it has received in this session so far, 0 for a new session. Numbers
+		// are implicit: n-th data message written to the session is number n, so frames stay unchanged and broadcast
+		// frames stay shared. Server answers "pa-resume.<N>" and writes messages N+1, N+2... first, if the ring still
+		// holds all of them. Otherwise numbering restarts and webengine has to resend the state (WSEvent::resumed tells
+		// webengine which case it is); server then answers "pa-resume.0", if client offered it too, so clients should
+		// offer "pa-resume.<N>, pa-resume.0". Server never selects a subprotocol that wasn't offered: if it selects
+		// none, client counts from 0 and offers "pa-resume.0" on its next reconnect.
+		//
+		// Method 'Attach' is called at handshake: it makes the connection the ring's owner (new 'epoch') and collects
+		// the gap. While another connection of the session is attached (second browser tab shares the SID cookie),
+		// ring holds that connection's messages, so the new one is refused: it's not resumable and gets no
+		// subprotocol. The same happens when client reconnects before server noticed the old connection is dead -
+		// client gets the full state then.
+		// Method 'Detach' is called when connection stops; ring survives it for WebServerParams::ws_replay_ttl_sec and
+		// method 'Expire' then drops it unless the session reconnected meanwhile.
+		//
+		// Messages are numbered when writer puts them into a batch - after drop and coalesce decisions, in wire order.
+		// Ring capacity is WebServerParams::ws_replay_capacity messages, at most ws_send_queue_capacity, so the gap
+		// always fits into the queue of the new connection.
+		//--------------------------------------------------------------------------------------------------------------
+		class WSReplayStore
+		{
+			DECLARE_NONCOPYABLE(WSReplayStore);
+		
+		public:
+			explicit WSReplayStore(size_t capacity) : capacity_(capacity) {}
+			
+			void Attach(const pauuid& session_id, uint64_t last_seen, WSResumption& resumption);
+			void Detach(const WSResumption& resumption);
+			void Expire(const pauuid& session_id, uint64_t epoch);
+			
+			size_t Size() const;
+		
+		private:
+			std::map<pauuid, std::shared_ptr<WSReplayRing>> rings_;
+			size_t capacity_;
+			mutable ptl::mutex mx_;
+		};
+		
+		// parses "pa-resume.<N>" out of Sec-WebSocket-Protocol offer list, false if it's absent
+		bool parse_resume_offer(const std::string& offers, uint64_t& last_seen);
+		bool offers_protocol(const std::string& offers, const std::string& protocol);
+		std::string resume_protocol(uint64_t last_seen);
+	} // namespace WS
+} // namespace net
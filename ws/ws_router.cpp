@@ -0,0 +1,611 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_router.h"
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		namespace
+		{
+			enum RecordType : uint8_t { announce = 1, withdraw = 2, push = 3, push_binary = 4, close = 5 };
+			
+			const uint32_t max_record_size = 64 << 20;
+			const size_t max_pending_bytes = 64 << 20;									// per link, peer is stuck beyond
+			
+			std::string encode(uint8_t type, const std::string& id, const std::string& key, const std::string& payload)
+			{
+				std::string record(4, '\0');											/// length, filled below
+				record.reserve(4 + 1 + 1 + id.size() + 2 + key.size() + payload.size());
+				
+				record.push_back(static_cast<char>(type));
+				record.push_back(static_cast<char>(id.size()));
+				record += id;
+				record.push_back(static_cast<char>(key.size() & 0xff));
+				record.push_back(static_cast<char>((key.size() >> 8) & 0xff));
+				record += key;
+				record += payload;
+				
+				uint32_t length = static_cast<uint32_t>(record.size() - 4);
+				for (int i = 0; i < 4; ++i)
+					record[i] = static_cast<char>((length >> (8 * i)) & 0xff);
+				
+				return record;
+			}
+		}
+		
+		
+		
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		using LocalProtocol = boost::asio::local::stream_protocol;
+		
+		// Single connection between two nodes: reader of records and batching writer. Socket is touched inside 'strand_'
+		// only, queue of records ('pending_') is guarded by 'mx_' and handed to writer in strand.
+		class WSRouter::Link : public std::enable_shared_from_this<WSRouter::Link>
+		{
+		public:
+			Link(const std::shared_ptr<WSRouter>& router, const std::string& node)
+				: router_(router), node_(node), service_(router->service_), sock_(service_), strand_(service_) {}
+			
+			LocalProtocol::socket& socket() { return sock_; }						// for acceptor, before 'Start'
+			const std::string& node() const { return node_; }						// empty for accepted links
+			
+			void Connect(const LocalProtocol::endpoint& peer, std::function<void(const error_code&)> handler)
+			{
+				auto self = shared_from_this();
+				strand_.post([this, self, peer, handler]() { sock_.async_connect(peer, strand_.wrap(handler)); });
+			}
+			
+			void Start()
+			{
+				strand_.post(boost::bind(&Link::do_read_header, shared_from_this()));
+			}
+			
+			// false if record is dropped: link overflowed and is being closed
+			bool Send(std::string record, const std::string& coalesce_id = std::string())
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				
+				if (overflowed_)
+					return false;
+				
+				if (!coalesce_id.empty())
+				{
+					auto it = pending_keys_.find(coalesce_id);
+					if (it != pending_keys_.end())										/// supersede queued push
+					{
+						pending_bytes_ += record.size() - pending_[it->second].size();
+						pending_[it->second] = std::move(record);
+						return true;
+					}
+				}
+				
+				if (!pending_.empty() && pending_bytes_ + record.size() > max_pending_bytes)
+				{
+					IFLOG(P2, "WSRouter - peer doesn't read, link is closed. Node and queued bytes follow.", node_,
+					      pending_bytes_);
+					
+					overflowed_ = true;													/// not here: caller may hold router's lock
+					strand_.post(boost::bind(&Link::closed, shared_from_this(),
+						error_code(basic_errors::no_buffer_space)));
+					return false;
+				}
+				
+				if (!coalesce_id.empty())
+					pending_keys_[coalesce_id] = pending_.size();
+				
+				pending_bytes_ += record.size();
+				pending_.push_back(std::move(record));
+				
+				if (!writing_)
+				{
+					writing_ = true;
+					strand_.post(boost::bind(&Link::do_write, shared_from_this()));
+				}
+				
+				return true;
+			}
+			
+			void Close()
+			{
+				strand_.post(boost::bind(&Link::do_close, shared_from_this()));
+			}
+		
+		private:
+			void do_write()																// in strand
+			{
+				{
+					boost::lock_guard<ptl::mutex> lck(mx_);
+					
+					if (pending_.empty())
+					{
+						writing_ = false;
+						return;
+					}
+					
+					batch_.swap(pending_);
+					pending_.clear();
+					pending_keys_.clear();
+					pending_bytes_ = 0;
+				}
+				
+				buffers_.clear();
+				for (auto& record : batch_)
+					buffers_.push_back(boost::asio::buffer(record));
+				
+				async_write(sock_, buffers_, strand_.wrap(boost::bind(&Link::handle_write, shared_from_this(), _1)));
+			}
+			
+			void handle_write(const error_code& ec)
+			{
+				batch_.clear();
+				
+				if (!ec)
+				{
+					do_write();
+					return;
+				}
+				
+				{
+					boost::lock_guard<ptl::mutex> lck(mx_);
+					writing_ = false;
+				}
+				
+				closed(ec);
+			}
+			
+			void do_close()
+			{
+				error_code ec;
+				sock_.close(ec);
+			}
+			
+			void do_read_header()
+			{
+				async_read(sock_, boost::asio::buffer(header_),
+					strand_.wrap(boost::bind(&Link::handle_header, shared_from_this(), _1)));
+			}
+			
+			void handle_header(const error_code& ec)
+			{
+				if (ec)
+				{
+					closed(ec);
+					return;
+				}
+				
+				uint32_t length = 0;
+				for (int i = 0; i < 4; ++i)
+					length |= static_cast<uint32_t>(header_[i]) << (8 * i);
+				
+				if (length < 4 || length > max_record_size)
+				{
+					IFLOG(P2, "WSRouter - malformed record, link is closed. Length follows.", length);
+					
+					closed(basic_errors::invalid_argument);
+					return;
+				}
+				
+				body_.resize(length);
+				async_read(sock_, boost::asio::buffer(&body_[0], length),
+					strand_.wrap(boost::bind(&Link::handle_body, shared_from_this(), _1)));
+			}
+			
+			void handle_body(const error_code& ec)
+			{
+				if (ec)
+				{
+					closed(ec);
+					return;
+				}
+				
+				uint8_t type = static_cast<uint8_t>(body_[0]);
+				size_t id_length = static_cast<uint8_t>(body_[1]);
+				size_t key_offset = 2 + id_length + 2;
+				
+				if (key_offset > body_.size())
+				{
+					closed(basic_errors::invalid_argument);
+					return;
+				}
+				
+				size_t key_length = static_cast<uint8_t>(body_[2 + id_length]) |
+				                    (static_cast<size_t>(static_cast<uint8_t>(body_[3 + id_length])) << 8);
+				
+				if (key_offset + key_length > body_.size())
+				{
+					closed(basic_errors::invalid_argument);
+					return;
+				}
+				
+				try
+				{
+					pauuid conn_id(body_.substr(2, id_length));
+					std::string key = body_.substr(key_offset, key_length);
+					std::string payload = body_.substr(key_offset + key_length);
+					
+					auto router = router_.lock();
+					if (!router)														/// router is destroyed
+						return;
+					
+					router->on_record(shared_from_this(), type, conn_id, key, payload);
+				}
+				catch (std::exception& e)
+				{
+					IFLOG(P2, "WSRouter - bad record, link is closed. Reason follows.", e.what());
+					
+					closed(basic_errors::invalid_argument);
+					return;
+				}
+				
+				do_read_header();
+			}
+			
+			void closed(const error_code& ec)
+			{
+				if (ec == basic_errors::operation_aborted)								/// stopped by router
+					return;
+				
+				if (auto router = router_.lock())
+					router->on_link_closed(shared_from_this());
+			}
+		
+		private:
+			std::weak_ptr<WSRouter> router_;
+			std::string node_;
+			IOService& service_;
+			LocalProtocol::socket sock_;
+			Strand strand_;
+			
+			std::array<uint8_t, 4> header_;
+			std::string body_;
+			
+			std::vector<std::string> pending_;											// records waiting for writer
+			std::map<std::string, size_t> pending_keys_;								// coalescing: id & key -> index
+			size_t pending_bytes_ = 0;
+			bool overflowed_ = false;													// closing, records are dropped
+			bool writing_ = false;														// do_write is posted or running
+			ptl::mutex mx_;
+			
+			std::vector<std::string> batch_;											// records being written, in strand
+			std::vector<NetCBuffer> buffers_;
+		};
+#else
+		class WSRouter::Link
+		{
+		public:
+			bool Send(std::string, const std::string& = std::string()) { return true; }
+			void Close() {}
+			const std::string& node() const { return node_; }
+		
+		private:
+			std::string node_;
+		};
+#endif
+		
+		
+		
+		WSRouter::WSRouter(IOService& service, const std::string& dir, const std::string& node, Deliver deliver,
+		                   Snapshot snapshot, uint rescan_sec)
+			: service_(service), dir_(dir), node_(node), deliver_(std::move(deliver)), snapshot_(std::move(snapshot)),
+			  rescan_sec_(std::max(rescan_sec, 1u)),
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+			  acceptor_(service),
+#endif
+			  rescan_timer_(service), running_(false), dropped_(0)
+		{
+		}
+		
+		WSRouter::~WSRouter()
+		{
+			Stop();
+		}
+		
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		void WSRouter::Start()
+		{
+			if (running_.exchange(true))
+				return;
+			
+			std::string path = (fs::path(dir_) / (node_ + ".sock")).string();
+			
+			error_code ec;
+			fs::remove(path, ec);														/// left by crashed predecessor
+			
+			acceptor_.open(LocalProtocol(), ec);
+			if (!ec)
+				acceptor_.bind(LocalProtocol::endpoint(path), ec);
+			if (!ec)
+				acceptor_.listen(boost::asio::socket_base::max_connections, ec);
+			
+			if (ec)
+			{
+				IFLOG(P2, "WSRouter can't listen on Unix-domain socket. Path and error follow.", path, ec);
+				
+				running_ = false;
+				return;
+			}
+			
+			do_accept();
+			rescan();
+		}
+		
+		void WSRouter::do_accept()
+		{
+			auto link = std::make_shared<Link>(shared_from_this(), std::string());
+			std::weak_ptr<WSRouter> weak = shared_from_this();
+			
+			acceptor_.async_accept(link->socket(),
+				[weak, link](error_code ec)
+				{
+					auto self = weak.lock();
+					if (!self || !self->running_ || ec == basic_errors::operation_aborted)
+						return;
+					
+					if (!ec)
+						self->add_link(link);
+					
+					self->do_accept();
+				});
+		}
+		
+		void WSRouter::rescan()
+		{
+			std::weak_ptr<WSRouter> weak = shared_from_this();
+			error_code ec;
+			
+			for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec))
+			{
+				auto path = it->path();
+				if (path.extension() != ".sock")
+					continue;
+				
+				std::string node = path.stem().string();
+				if (node <= node_)														/// that node links to this one
+					continue;
+				
+				{
+					boost::lock_guard<ptl::mutex> lck(mx_);
+					
+					if (!linked_nodes_.insert(node).second)
+						continue;
+				}
+				
+				auto link = std::make_shared<Link>(shared_from_this(), node);
+				
+				link->Connect(LocalProtocol::endpoint(path.string()),
+					[weak, link](const error_code& ec)
+					{
+						auto self = weak.lock();
+						if (!self || !self->running_)
+							return;
+						
+						if (ec)															/// stale socket file, retry later
+						{
+							boost::lock_guard<ptl::mutex> lck(self->mx_);
+							self->linked_nodes_.erase(link->node());
+							return;
+						}
+						
+						self->add_link(link);
+					});
+			}
+			
+			rescan_timer_.expires_from_now(boost::posix_time::seconds(rescan_sec_));
+			rescan_timer_.async_wait(
+				[weak](error_code ec)
+				{
+					auto self = weak.lock();
+					if (self && ec != basic_errors::operation_aborted && self->running_)
+						self->rescan();
+				});
+		}
+		
+		void WSRouter::add_link(std::shared_ptr<Link> link)
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);										/// announces & withdraws wait
+			
+			links_.push_back(link);
+			
+			for (auto& conn_id : snapshot_())
+			{
+				if (!link->Send(encode(announce, boost::lexical_cast<std::string>(conn_id), std::string(), std::string())))
+					++dropped_;
+			}
+			
+			link->Start();
+		}
+#else
+		void WSRouter::Start()
+		{
+			IFLOG(P2, "WSRouter needs Unix-domain sockets, which are not available on this platform.");
+		}
+#endif
+		
+		void WSRouter::Stop()
+		{
+			if (!running_.exchange(false))
+				return;
+			
+			error_code ec;
+			rescan_timer_.cancel(ec);
+			
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+			acceptor_.close(ec);
+			fs::remove(fs::path(dir_) / (node_ + ".sock"), ec);
+#endif
+			
+			std::vector<std::shared_ptr<Link>> links;
+			
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				
+				links.swap(links_);
+				linked_nodes_.clear();
+				routes_.clear();
+			}
+			
+			for (auto& link : links)
+				link->Close();
+		}
+		
+		void WSRouter::Announce(const pauuid& conn_id)
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			if (links_.empty())
+				return;
+			
+			auto record = encode(announce, boost::lexical_cast<std::string>(conn_id), std::string(), std::string());
+			
+			for (auto& link : links_)
+			{
+				if (!link->Send(record))
+					++dropped_;
+			}
+		}
+		
+		void WSRouter::Withdraw(const pauuid& conn_id)
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			if (links_.empty())
+				return;
+			
+			auto record = encode(withdraw, boost::lexical_cast<std::string>(conn_id), std::string(), std::string());
+			
+			for (auto& link : links_)
+			{
+				if (!link->Send(record))
+					++dropped_;
+			}
+		}
+		
+		bool WSRouter::Push(const pauuid& conn_id, const std::string& message, const std::string& key)
+		{
+			return route(conn_id, push, key, message);
+		}
+		
+		bool WSRouter::PushBinary(const pauuid& conn_id, const std::string& message)
+		{
+			return route(conn_id, push_binary, std::string(), message);
+		}
+		
+		bool WSRouter::Close(const pauuid& conn_id, uint status_code)
+		{
+			const char status[] = { static_cast<char>((status_code >> 8) & 0xff), static_cast<char>(status_code & 0xff) };
+			
+			return route(conn_id, close, std::string(), std::string(status, 2));
+		}
+		
+		bool WSRouter::route(const pauuid& conn_id, uint8_t type, const std::string& key, const std::string& payload)
+		{
+			std::shared_ptr<Link> link;
+			
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				
+				auto it = routes_.find(conn_id);
+				if (it == routes_.end())
+					return false;
+				
+				link = it->second;
+			}
+			
+			auto id = boost::lexical_cast<std::string>(conn_id);
+			
+			if (!link->Send(encode(type, id, key, payload), key.empty() ? std::string() : id + '\n' + key))
+				++dropped_;
+			
+			return true;
+		}
+		
+		size_t WSRouter::Routes() const
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			return routes_.size();
+		}
+		
+		size_t WSRouter::Links() const
+		{
+			boost::lock_guard<ptl::mutex> lck(mx_);
+			
+			return links_.size();
+		}
+		
+		uint64_t WSRouter::Dropped() const
+		{
+			return dropped_;
+		}
+		
+		void WSRouter::on_record(const std::shared_ptr<Link>& link, uint8_t type, const pauuid& conn_id,
+		                         std::string& key, std::string& payload)
+		{
+			switch (type)
+			{
+				case announce:
+				{
+					boost::lock_guard<ptl::mutex> lck(mx_);
+					routes_[conn_id] = link;
+					break;
+				}
+				case withdraw:
+				{
+					boost::lock_guard<ptl::mutex> lck(mx_);
+					
+					auto it = routes_.find(conn_id);
+					if (it != routes_.end() && it->second == link)
+						routes_.erase(it);
+					break;
+				}
+				case push:
+					deliver_(conn_id, Kind::text, payload, key);						/// connection may be gone meanwhile
+					break;
+				case push_binary:
+					deliver_(conn_id, Kind::binary, payload, key);
+					break;
+				case close:
+					if (payload.size() == 2)
+						deliver_(conn_id, Kind::close, payload, key);
+					else
+						IFLOG(P2, "WSRouter - close record without status ignored. Size follows.", payload.size());
+					break;
+				default:
+					IFLOG(P2, "WSRouter - unknown record type ignored. Type follows.", int(type));
+					break;
+			}
+		}
+		
+		void WSRouter::on_link_closed(const std::shared_ptr<Link>& link)
+		{
+			{
+				boost::lock_guard<ptl::mutex> lck(mx_);
+				
+				auto it = std::find(links_.begin(), links_.end(), link);
+				if (it == links_.end())													/// closed already
+					return;
+				
+				links_.erase(it);
+				
+				if (!link->node().empty())
+					linked_nodes_.erase(link->node());									/// rescan links it again
+				
+				for (auto route = routes_.begin(); route != routes_.end(); )
+				{
+					if (route->second == link)
+						route = routes_.erase(route);
+					else
+						++route;
+				}
+			}
+			
+			link->Close();
+		}
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,120 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "templates/mutex.h"
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <set>
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		//--------------------------------------------------------------------------------------------------------------
+		// WSRouter lets several webserver processes on one host push to each other's WS connections, so that any of
+		// them (behind a load balancer) can push to any client.
+		//
+		// Each node listens on Unix-domain socket '<dir>/<node>.sock' and links to every other node found in 'dir'
+		// (rescanned each 'rescan_sec'); a pair of nodes gets a single link, opened by the node with the lower name.
+		// Over a link nodes exchange records:
+		// - announce / withdraw (conn_id) - connection appeared / disappeared on sender. A new link starts with
+		//   announces of all local connections (see 'Snapshot');
+		// - push (conn_id, coalescing key, message) - text message for receiver's connection, delivered via 'Deliver';
+		// - push_binary (conn_id, message) - binary message, delivered the same way;
+		// - close (conn_id, status) - close frame with u16 status (big endian), delivered the same way.
+		// Routing table 'routes_' maps foreign conn_ids to the links of their owners; it's fed by announces and
+		// cleaned by withdraws and link failures.
+		//
+		// Methods 'Push', 'PushBinary' and 'Close' are called for conn_id unknown locally and return false if no node
+		// announced it either. Delivery to remote connection is not confirmed, as it is not for a local one. Streams
+		// (WSStream) are not routed: their source is a callback of the pushing process.
+		//
+		// Records are batched: link's writer takes all records queued while previous write was in flight and sends
+		// them with one gathered write. Queued push with non-empty coalescing key is replaced by a newer one with the
+		// same conn_id and key, as WSBackpressure coalescing does in connection's own queue.
+		//
+		// Link's queue is bounded by 'max_pending_bytes': peer which doesn't read that much is considered stuck, link is
+		// closed (its routes are removed, so pushes to connections behind it fail) and records sent meanwhile are
+		// dropped and counted (see 'Dropped'). Nodes which link again re-announce their connections.
+		//
+		// Record: u32 length (little endian) of the rest | u8 type | u8 id length | id | u16 key length | key | payload.
+		//
+		// Unix-domain sockets are not available on every platform (see BOOST_ASIO_HAS_LOCAL_SOCKETS); there 'Start'
+		// logs an error and router stays empty.
+		//
+		// Link's socket operations (connect, reads, writes and close) all run in link's strand, so 'Send' and 'Stop'
+		// may be called from any thread.
+		//
+		// Router must be owned by std::shared_ptr: asynchronous handlers and links hold it weakly, so that a handler
+		// completing after router is destroyed does nothing.
+		//--------------------------------------------------------------------------------------------------------------
+		class WSRouter : public std::enable_shared_from_this<WSRouter>
+		{
+			DECLARE_NONCOPYABLE(WSRouter);
+			
+			class Link;
+			friend class Link;
+		
+		public:
+			enum class Kind : uint8_t { text, binary, close };
+			
+			// 'message' of close is its status
+			using Deliver = std::function<bool(const pauuid& conn_id, Kind kind, std::string& message,
+			                                   const std::string& key)>;
+			using Snapshot = std::function<std::vector<pauuid>()>;
+		
+		public:
+			WSRouter(IOService& service, const std::string& dir, const std::string& node, Deliver deliver,
+			         Snapshot snapshot, uint rescan_sec = 2);
+			~WSRouter();
+			
+			void Start();
+			void Stop();
+			
+			void Announce(const pauuid& conn_id);
+			void Withdraw(const pauuid& conn_id);
+			bool Push(const pauuid& conn_id, const std::string& message, const std::string& key = std::string());
+			bool PushBinary(const pauuid& conn_id, const std::string& message);
+			bool Close(const pauuid& conn_id, uint status_code);
+			
+			size_t Routes() const;
+			size_t Links() const;
+			uint64_t Dropped() const;													// records, by overflowed links
+		
+		private:
+			void do_accept();
+			void rescan();
+			void add_link(std::shared_ptr<Link> link);
+			void on_record(const std::shared_ptr<Link>& link, uint8_t type, const pauuid& conn_id, std::string& key,
+			               std::string& payload);
+			void on_link_closed(const std::shared_ptr<Link>& link);
+			bool route(const pauuid& conn_id, uint8_t type, const std::string& key, const std::string& payload);
+		
+		private:
+			IOService& service_;
+			std::string dir_;
+			std::string node_;
+			Deliver deliver_;
+			Snapshot snapshot_;
+			uint rescan_sec_;
+			
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+			boost::asio::local::stream_protocol::acceptor acceptor_;
+#endif
+			boost::asio::deadline_timer rescan_timer_;
+			std::atomic<bool> running_;
+			std::atomic<uint64_t> dropped_;
+			
+			std::vector<std::shared_ptr<Link>> links_;
+			std::set<std::string> linked_nodes_;										// links opened by this node
+			std::map<pauuid, std::shared_ptr<Link>> routes_;
+			mutable ptl::mutex mx_;
+		};
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,26 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		// Lazy data source of streamed WS message (see WebServer::WSPushStream). It's called by connection's writer once
+		// per fragment, right before the fragment is written: it appends at most 'max_size' bytes of the next piece to
+		// 'chunk' and returns true if more data follows, false after the last piece. Exception thrown by source stops
+		// the connection, as a message already begun can't be finished otherwise.
+		// Streamed messages are not compressed by permessage-deflate and raise no messageout events (the message isn't
+		// known whole before it's written); they are not kept for session resumption either.
+		using WSStreamSource = std::function<bool(std::string& chunk, size_t max_size)>;
+		
+		struct WSStream
+		{
+			WSStreamSource source;
+			bool binary = false;
+		};
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,127 @@
+﻿#include "webserver/stdafx.h"
+
+#include "webserver/WS/ws_topics.h"
+
+#include <algorithm>
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		void WSTopicRegistry::Subscribe(const std::string& topic, const pauuid& conn_id)
+		{
+			auto& conn = shard_of(conn_id);
+			boost::lock_guard<ptl::mutex> conn_lck(conn.mx);
+			
+			auto& conn_topics = conn.topics[conn_id];
+			if (std::find(conn_topics.begin(), conn_topics.end(), topic) != conn_topics.end())
+				return;																/// already subscribed
+			
+			conn_topics.push_back(topic);
+			
+			auto& shard = shard_of(topic);
+			boost::lock_guard<ptl::mutex> lck(shard.mx);
+			
+			auto& t = shard.topics[topic];
+			t.positions.emplace(conn_id, t.subscribers.size());
+			t.subscribers.push_back(conn_id);
+			t.snapshot.reset();
+		}
+		
+		void WSTopicRegistry::Unsubscribe(const std::string& topic, const pauuid& conn_id)
+		{
+			auto& conn = shard_of(conn_id);
+			boost::lock_guard<ptl::mutex> conn_lck(conn.mx);
+			
+			auto ct = conn.topics.find(conn_id);
+			if (ct == conn.topics.end())
+				return;
+			
+			auto it = std::find(ct->second.begin(), ct->second.end(), topic);
+			if (it == ct->second.end())
+				return;
+			
+			ct->second.erase(it);
+			if (ct->second.empty())
+				conn.topics.erase(ct);
+			
+			remove(topic, conn_id);
+		}
+		
+		void WSTopicRegistry::UnsubscribeAll(const pauuid& conn_id)
+		{
+			auto& conn = shard_of(conn_id);
+			boost::lock_guard<ptl::mutex> conn_lck(conn.mx);
+			
+			auto ct = conn.topics.find(conn_id);
+			if (ct == conn.topics.end())
+				return;
+			
+			for (auto& topic : ct->second)
+				remove(topic, conn_id);
+			
+			conn.topics.erase(ct);
+		}
+		
+		WSTopicRegistry::SubscribersPtr WSTopicRegistry::Snapshot(const std::string& topic) const
+		{
+			auto& shard = shard_of(topic);
+			boost::lock_guard<ptl::mutex> lck(shard.mx);
+			
+			auto it = shard.topics.find(topic);
+			if (it == shard.topics.end())
+				return nullptr;
+			
+			auto& t = it->second;
+			if (!t.snapshot)														/// membership changed
+				t.snapshot = std::make_shared<const Subscribers>(t.subscribers);
+			
+			return t.snapshot;
+		}
+		
+		size_t WSTopicRegistry::Topics() const
+		{
+			size_t n = 0;
+			
+			for (auto& shard : topics_)
+			{
+				boost::lock_guard<ptl::mutex> lck(shard.mx);
+				n += shard.topics.size();
+			}
+			
+			return n;
+		}
+		
+		void WSTopicRegistry::remove(const std::string& topic, const pauuid& conn_id)
+		{
+			auto& shard = shard_of(topic);
+			boost::lock_guard<ptl::mutex> lck(shard.mx);
+			
+			auto it = shard.topics.find(topic);
+			if (it == shard.topics.end())
+				return;
+			
+			auto& t = it->second;
+			auto pos = t.positions.find(conn_id);
+			if (pos == t.positions.end())
+				return;
+			
+			size_t i = pos->second;
+			t.positions.erase(pos);
+			
+			if (i + 1 != t.subscribers.size())										/// last one takes the place
+			{
+				t.subscribers[i] = t.subscribers.back();
+				t.positions[t.subscribers[i]] = i;
+			}
+			t.subscribers.pop_back();
+			
+			if (t.subscribers.empty())												/// last subscriber - drop topic
+				shard.topics.erase(it);
+			else
+				t.snapshot.reset();
+		}
+	} // namespace WS
+} // namespace net
@@ -0,0 +1,92 @@
+﻿#pragma once
+
+#include "webserver/expimp.h"
+#include "webserver/stdhdr.h"
+
+#include "webserver/WS/ws_registry.h"
+#include "templates/mutex.h"
+
+
+
+namespace net
+{
+	namespace WS
+	{
+		//--------------------------------------------------------------------------------------------------------------
+		// WSTopicRegistry maps topic (channel) names to WS connection ids subscribed to them. It's the storage behind
+		// WebServer::WSSubscribe / WSUnsubscribe / WSPublish.
+		//
+		// Topics are spread over 'shards_count_' shards by hash of their names, each shard under its own mutex, so
+		// publishers and subscribers of different topics rarely meet. Topic keeps its subscribers in a vector with an
+		// index of positions: subscribe appends, unsubscribe moves the last subscriber into the freed place, both O(1).
+		//
+		// Method 'Snapshot' returns immutable vector of subscribers for publish to iterate without any lock. Snapshot
+		// is cached by topic and rebuilt (under shard's mutex) by the first 'Snapshot' after membership changed, so
+		// its O(N) copy is paid at most once per publish, while N connections joining a topic cost O(N) in total.
+		//
+		// Reverse index 'conns_' (sharded by connection id) allows to drop closed connection from all its topics at
+		// once. Connection's shard is always locked before topic's shard.
+		//--------------------------------------------------------------------------------------------------------------
+		class WSTopicRegistry
+		{
+			DECLARE_NONCOPYABLE(WSTopicRegistry);
+		
+		public:
+			using Subscribers = std::vector<pauuid>;
+			using SubscribersPtr = std::shared_ptr<const Subscribers>;
+		
+		public:
+			WSTopicRegistry() = default;
+			
+			void Subscribe(const std::string& topic, const pauuid& conn_id);
+			void Unsubscribe(const std::string& topic, const pauuid& conn_id);
+			void UnsubscribeAll(const pauuid& conn_id);
+			
+			SubscribersPtr Snapshot(const std::string& topic) const;				// nullptr if no subscribers
+			size_t Topics() const;													// with subscribers
+		
+		private:
+			void remove(const std::string& topic, const pauuid& conn_id);			// under connection's shard mutex
+		
+		private:
+			enum { shards_count_ = 64 };
+			
+			struct Topic
+			{
+				Subscribers subscribers;											// unordered
+				std::unordered_map<pauuid, size_t, WSIdHash> positions;				// in 'subscribers'
+				mutable SubscribersPtr snapshot;									// nullptr - to be rebuilt
+			};
+			
+			struct TopicShard
+			{
+				std::unordered_map<std::string, Topic> topics;
+				mutable ptl::mutex mx;
+				char pad[64];														// shards' mutexes live on different lines
+			};
+			
+			struct ConnShard
+			{
+				std::unordered_map<pauuid, std::vector<std::string>, WSIdHash> topics;	// by connection
+				ptl::mutex mx;
+				char pad[64];
+			};
+			
+			TopicShard& shard_of(const std::string& topic)
+			{
+				return topics_[std::hash<std::string>()(topic) % shards_count_];
+			}
+			
+			const TopicShard& shard_of(const std::string& topic) const
+			{
+				return topics_[std::hash<std::string>()(topic) % shards_count_];
+			}
+			
+			ConnShard& shard_of(const pauuid& conn_id) { return conns_[WSIdHash()(conn_id) % shards_count_]; }
+		
+		private:
+			std::array<TopicShard, shards_count_> topics_;
+			std::array<ConnShard, shards_count_> conns_;
+		};
+	} // namespace WS
+} // namespace net